@@ -5,14 +5,19 @@
 #include <pthread.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
 #include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <string.h>
 
 #include "util.h"
 #include "bios.h"
@@ -28,6 +33,17 @@
 	- The PIC thread receives all signals and dispatches them to
 	the right core thread by raising SIGUSR1.
 
+	Interrupts are disabled by a per-core (thread-local) flag, not by the
+	signal mask. A signal arriving while the flag is set leaves the
+	interrupt pending, and cpu_enable_interrupts() dispatches it.
+
+	With the doorbell transport, raising an interrupt sets a bit in the
+	core's pending mask. A running core is sent SIGUSR1 only if no signal 
+	is already on its way to it, and the signal handler dispatches all the 
+	pending interrupts. A halted core sleeps on a futex and dispatches its 
+	pending interrupts when woken up, without a signal. The PIC thread is 
+	woken up by an eventfd, instead of SIGUSR1.
+
  */
 
 
@@ -51,6 +67,13 @@ typedef struct core
 	volatile uint32_t int_pending;
 	interrupt_handler* intvec[maximum_interrupt_no];
 
+	/* The serial ports that raised each interrupt, one bit per port */
+	volatile uint32_t serial_pending[maximum_interrupt_no];
+
+	/* Doorbell transport */
+	volatile uint32_t kicked;	/* a SIGUSR1 was sent and not yet handled */
+	volatile uint32_t doorbell;	/* futex word for halting */
+
 	sig_atomic_t halted;
 	rlnode halted_node;
 	pthread_cond_t halt_cond;
@@ -101,23 +124,21 @@ static rlnode halted_list;
 /* PIC thread id */
 static pthread_t PIC_thread;
 
+/* The interrupt transport, for the next or the running VM */
+static interrupt_transport vm_transport = INTERRUPT_SIGNAL;
+
+/* Used to wake up the PIC thread with the doorbell transport */
+static int PIC_eventfd = -1;
+
+/* The epoll set of the PIC thread. Cores re-arm devices in it. */
+static int PIC_epfd = -1;
+
 /* Save the sigaction for SIGUSR1 */
 static struct sigaction USR1_saved_sigaction;
 
 /* The sigaction for SIGUSR1 (core interrupts) */
 static struct sigaction USR1_sigaction;
 
-/* A simulated coarse clock measuring time with a res. of 0.1 sec,
-   since "boot". Used for serial device timeouts. */
-typedef unsigned long coarse_clock_t;
-static volatile coarse_clock_t  system_clock;
-
-/* This is how fast the coarse clock is updated (in usec) */
-#define SLOW_HZ 10000
-
-/* This gives a rough serial port timeout of 300 msec */
-#define SERIAL_TIMEOUT 300
-
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
 
 
@@ -165,16 +186,31 @@ static void PIC_daemon();  /* forward def */
 	Static func to access the thread-local Core.
 */
 _Thread_local uint cpu_core_id;
+
 static inline Core* curr_core() {
 	return CORE+cpu_core_id;
 }
 
+/* 
+	The interrupt-disable flag of the core. It is only accessed by 
+	single instructions, so that an interrupt handler that moves the 
+	running context to another core is never observed half-way.
+ */
+static _Thread_local volatile sig_atomic_t irq_disabled;
+
 
 /*
 	Cause PIC daemon to loop.
  */
 static inline void interrupt_pic_thread()
 {
+	if(vm_transport == INTERRUPT_DOORBELL) {
+		uint64_t one = 1;
+		while(write(PIC_eventfd, &one, sizeof(one))==-1 && errno==EINTR);
+		__atomic_fetch_add(&PIC_usr1_queued,1,__ATOMIC_RELAXED);
+		return;
+	}
+
 	union sigval coreval;
 	coreval.sival_ptr = NULL; /* This is silly, but silences valgrind */
 	coreval.sival_int = -1;
@@ -193,6 +229,10 @@ static void* bootfunc_wrapper(void* _core)
 
 	/* Clear pending bitvec */
 	core->int_pending = 0;
+	for(int i=0; i<maximum_interrupt_no; i++)
+		core->serial_pending[i] = 0;
+	core->kicked = 0;
+	core->doorbell = 0;
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
@@ -209,7 +249,7 @@ static void* bootfunc_wrapper(void* _core)
 	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
 	core->timer_sigevent.sigev_signo = SIGALRM;
 	core->timer_sigevent.sigev_value.sival_int = core->id;
-	CHECK(timer_create(CLOCK_REALTIME, & core->timer_sigevent, & core->timer_id));
+	CHECK(timer_create(CLOCK_MONOTONIC, & core->timer_sigevent, & core->timer_id));
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
@@ -260,14 +300,49 @@ static inline int interrupt_clear(Core* core, Interrupt intno)
 }
 
 
-/* Cause the given core to be interrupted in the future */
-static inline void interrupt_core(Core* core)
+/* Futex helpers for the doorbell transport */
+static inline void futex_wait(volatile uint32_t* addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(volatile uint32_t* addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Send SIGUSR1 to a core */
+static inline void signal_core(Core* core)
 {
 	union sigval coreval;
 	coreval.sival_ptr = NULL; /* This is to silence valgrind */
 	coreval.sival_int = core->id;	
 
 	CHECKRC(pthread_sigqueue(core->thread, SIGUSR1, coreval));
+}
+
+/* 
+	Ring the doorbell of a core: wake it up if it is halted, 
+	or else signal it, unless a signal is already on its way.
+ */
+static inline void doorbell_ring(Core* core)
+{
+	__atomic_fetch_add(& core->doorbell, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(& core->halted, __ATOMIC_SEQ_CST))
+		futex_wake(& core->doorbell);
+	else if(! __atomic_exchange_n(& core->kicked, 1, __ATOMIC_ACQ_REL))
+		signal_core(core);
+}
+
+/* Cause the given core to be interrupted in the future */
+static inline void interrupt_core(Core* core)
+{
+	if(vm_transport == INTERRUPT_DOORBELL) {
+		doorbell_ring(core);
+		return;
+	}
+
+	signal_core(core);
 	cpu_core_restart(core->id);
 }
 
@@ -286,6 +361,16 @@ static inline void raise_interrupt(Core* core, Interrupt intno)
 }
 
 
+/*
+	Raise a serial device interrupt to a core, recording the port.
+ */
+static inline void raise_serial_interrupt(Core* core, Interrupt intno, uint serial)
+{
+	__atomic_fetch_or(& core->serial_pending[intno], 1u << serial, __ATOMIC_ACQ_REL);
+	raise_interrupt(core, intno);
+}
+
+
 /*
 	Dispatch the pending iterrupts for the given core.
  */
@@ -311,22 +396,33 @@ static int try_dispatch(Core* core)
 	return 0;
 }
 
-static inline void dispatch_interrupts(Core* core)
+/*
+	Dispatch all the pending interrupts of the current core. 
+	This must be called with interrupts enabled.
+
+	One signal (or wakeup) may stand for many interrupts, and also 
+	interrupts raised while interrupts were disabled are dispatched here.
+ */
+static void dispatch_interrupts()
 {
-	assert(cpu_core_id==core->id);
-	try_dispatch(core);
-	return;
+	while(1) {
+		Core* core = curr_core();
+		if(core->int_pending == 0) break;
+
+		/* Handlers are executed with interrupts disabled */
+		irq_disabled = 1;
+		int dispatched = try_dispatch(core);
+		irq_disabled = 0;
+		if(! dispatched) break;
 
-	while( try_dispatch(core) ) {
 		/* 
 			Note: after the successful dispatch, we may not
 			be running on the core any more (!), if the
-			dispatch action has been scheduled...
+			dispatch action has been scheduled. The core's
+			new owner must see the rest.
 		*/
-		if(cpu_core_id != core->id) {
-			//if(core->int_pending) interrupt_core(core);
-			break;
-		}
+		if(curr_core() != core && core->int_pending)
+			interrupt_core(core);
 	}
 }
 
@@ -342,7 +438,13 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	core->irq_count++;
 #endif
 
-	dispatch_interrupts(core);
+	/* Interrupts raised from now on need a new signal */
+	if(vm_transport == INTERRUPT_DOORBELL)
+		__atomic_store_n(& core->kicked, 0, __ATOMIC_RELEASE);
+
+	/* If interrupts are disabled, cpu_enable_interrupts() will dispatch */
+	if(! irq_disabled)
+		dispatch_interrupts();
 }
 
 
@@ -351,16 +453,6 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
  */
 
 
-/* Coarse clock */
-static coarse_clock_t get_coarse_time()
-{
-	struct timespec curtime;
-	CHECK(clock_gettime(CLOCK_REALTIME, &curtime));
-	return curtime.tv_nsec / 1000000 + curtime.tv_sec*1000;
-}
-
-
-
 /*
 	An io_device handles a file descriptor that is connected to some
 	'peripheral' in stream (byte-oriented) mode. The file descriptor must be
@@ -375,15 +467,32 @@ static coarse_clock_t get_coarse_time()
 	by this program (bidirectional fds, such as sockets, can be handled by a pair of
 	io_device objects).  
 
-	An io_device is ready if I/O operations may succeed (as reported by select()).
+	An io_device is ready if I/O operations may succeed (as reported by epoll).
 
-	A not-ready device is made ready when select() returns it as such.
+	A not-ready device is made ready when epoll returns it as such. The fd of
+	every device is in the epoll set of the PIC in one-shot mode: it is armed
+	only while the device is not ready, so that the PIC is never woken up
+	by a device that the cores have not drained yet.
 
-	A ready device is made not-ready on each failed attempt to do an I/O transfer.
+	A ready device is made not-ready (and re-armed) on each failed attempt 
+	to do an I/O transfer.
 
 	When a not-ready device becomes ready, an interrupt is raised.
+
+	When the other end of a device hangs up, the device is made ready (the
+	cores will see EOF or EPIPE), and it is not re-armed, since epoll would
+	report the hang-up for as long as it lasts. Instead, the PIC watches the
+	FIFO for opens (with inotify), and when the peer has re-connected, the 
+	device is made ready again, to be re-armed as usual.
+
+	Transfers are done in bulk. An RX device reads from its fd into a buffer, 
+	and serves the cores from it, so that a host system call brings many 
+	bytes. A TX device writes the bytes given by a core with one system call.
  */
 
+/* The size of the buffer of an RX device */
+#define SERIAL_BUFFER_SIZE 4096
+
 typedef enum io_direction
 {
 	IODIR_RX,
@@ -400,7 +509,13 @@ typedef struct io_device
 
 	volatile Core* int_core;		/* core to receive interrupts */
 	volatile int ready;  		/* ready flag */
-	coarse_clock_t last_int;	/* used for timeouts */
+	volatile int hungup;		/* the peer has hung up */
+	int hupwd;					/* the inotify watch while hung up, or -1 */
+	uint64_t tag;				/* the epoll tag of the device */
+
+	volatile int lock;			/* spinlock for the buffer */
+	uint head, tail;			/* the unread bytes of the buffer */
+	char buffer[SERIAL_BUFFER_SIZE];
 } io_device;
 
 
@@ -413,50 +528,130 @@ static int io_ready(int fd, io_direction dir) {
 	return (pfd.revents & evt) ? 1 : 0;
 }
 
-static void io_device_init(io_device* this, int fd, io_direction iodir)
+static int io_hungup(int fd) {
+	struct pollfd pfd = { .fd=fd, .events=0 };
+	int rc;
+	do {
+		rc = poll(&pfd, 1, 0);
+	} while(rc == -1 && errno==EINTR);
+	CHECK(rc);
+	return (pfd.revents & (POLLHUP|POLLERR)) ? 1 : 0;
+}
+
+static void io_device_init(io_device* this, int fd, io_direction iodir, uint64_t tag)
 {
 	this->fd = fd;
 	this->iodir = iodir;
 	this->int_core = &CORE[0];
 	this->ready = io_ready(fd, iodir);
-	this->last_int = system_clock;
+	this->hungup = 0;
+	this->hupwd = -1;
+	this->tag = tag;
+	this->lock = 0;
+	this->head = this->tail = 0;
 
 	/* Set file descriptor to non-blocking */
 	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
 }
 
 
-static int io_device_read(io_device* this, char* ptr)
+/*
+	Add the device to the epoll set of the PIC, armed if it is not ready.
+ */
+static void io_device_watch(io_device* this)
+{
+	struct epoll_event evt;
+	evt.events = EPOLLONESHOT;
+	if(! this->ready)
+		evt.events |= (this->iodir==IODIR_RX) ? EPOLLIN : EPOLLOUT;
+	evt.data.u64 = this->tag;
+	CHECK(epoll_ctl(PIC_epfd, EPOLL_CTL_ADD, this->fd, &evt));
+}
+
+/*
+	Arm a not-ready device, so that the PIC is notified when it becomes ready.
+ */
+static void io_device_arm(io_device* this)
+{
+	struct epoll_event evt;
+	evt.events = EPOLLONESHOT | ((this->iodir==IODIR_RX) ? EPOLLIN : EPOLLOUT);
+	evt.data.u64 = this->tag;
+	CHECK(epoll_ctl(PIC_epfd, EPOLL_CTL_MOD, this->fd, &evt));
+}
+
+
+static inline void io_device_lock(io_device* this)
+{
+	while(__atomic_exchange_n(& this->lock, 1, __ATOMIC_ACQUIRE)) {
+#if defined(__x86__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#endif
+	}
+}
+
+static inline void io_device_unlock(io_device* this)
+{
+	__atomic_store_n(& this->lock, 0, __ATOMIC_RELEASE);
+}
+
+
+static uint io_device_read(io_device* this, char* buf, uint size)
 {
 	assert(this->iodir == IODIR_RX);
-	int rc;
-	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
-	assert(rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)));
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
+	/* The buffer is shared by the cores */
+	int enabled = cpu_disable_interrupts();
+	io_device_lock(this);
+
+	uint count = 0;
+	while(count < size) {
+		if(this->head == this->tail) {
+			/* Refill the buffer */
+			int rc;
+			while((rc=read(this->fd, this->buffer, SERIAL_BUFFER_SIZE))==-1 && errno == EINTR);
+			assert(rc>=0 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)));
+
+			if(rc<=0) {
+				if(this->ready) {
+					this->ready = 0;
+					if(! this->hungup) io_device_arm(this);
+				}
+				break;
+			}
+			this->head = 0;
+			this->tail = rc;
+		}
+
+		uint n = this->tail - this->head;
+		if(n > size-count) n = size-count;
+		memcpy(buf+count, this->buffer+this->head, n);
+		this->head += n;
+		count += n;
 	}
-	return rc==1;
+
+	io_device_unlock(this);
+	if(enabled) cpu_enable_interrupts();
+	return count;
 }
 
 
-static int io_device_write(io_device* this, char value)
+static uint io_device_write(io_device* this, const char* buf, uint size)
 {
 	assert(this->iodir == IODIR_TX);
 
 	/* Try to write */
 	int rc;
-	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
+	while((rc = write(this->fd, buf, size))==-1 && errno == EINTR);
 
-	assert(rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE))); 
+	assert(rc>=0 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE))); 
 
-	if(rc!=1 && this->ready) {
+	/* A short write means that the fifo is full */
+	if(rc<(int)size && this->ready) {
 		this->ready = 0;
-		interrupt_pic_thread();
+		if(! this->hungup) io_device_arm(this);
 	} 
 
-	return rc==1;
+	return (rc>0) ? rc : 0;
 }
 
 
@@ -485,12 +680,12 @@ static int terminal_init(terminal* this, int no)
 	sprintf(fname, "con%d", no);
 	fd = open(fname, O_WRONLY);
 	if(fd==-1) return -1;
-	io_device_init(& this->con, fd, IODIR_TX);
+	io_device_init(& this->con, fd, IODIR_TX, 2*no+1);
 
 	sprintf(fname, "kbd%d", no);
 	fd = open(fname, O_RDONLY);
 	if(fd==-1) return -1;
-	io_device_init(& this->kbd, fd, IODIR_RX);
+	io_device_init(& this->kbd, fd, IODIR_RX, 2*no);
 
 	return 0;
 }
@@ -520,21 +715,140 @@ static void close_terminal(terminal* term)
 {
 	CHECK(terminal_destroy(term));
 }
-static inline void fdset_add(fd_set* set, int fd, int* nfds)
+
+
+/*
+	A disk is a host file, served by a host thread (the 'engine' of the 
+	disk), which plays the role of the disk controller and its DMA. 
+
+	Cores append requests to the submission queue of the disk. The engine 
+	takes all the queued requests as a batch, transfers each with one 
+	preadv/pwritev, pushes it to the completion stack, and finally raises
+	one DISK interrupt on each core named in the batch.
+ */
+typedef struct disk_unit
 {
-	FD_SET(fd, set);
-	if(fd >= *nfds) *nfds = fd+1;
+	int fd;						/* the host file */
+	uint64_t sectors;			/* the size of the disk */
+
+	pthread_t engine;			/* the thread serving the requests */
+	pthread_mutex_t lock;		/* protects the submission queue */
+	pthread_cond_t submitted;	/* signalled on submission and on shutdown */
+	int active;					/* cleared at shutdown */
+	disk_request *head, *tail;	/* the submission queue */
+
+	disk_request* done;			/* the completed requests, a lock-free stack */
+} disk_unit;
+
+/* The disk table */
+static disk_unit DISKS[MAX_DISKS];
+
+/* Current number of disks */
+static uint ndisks = 0;
+
+
+static int disk_transfer(disk_unit* disk, disk_request* req)
+{
+	struct iovec iov[DISK_MAX_SEGMENTS];
+	size_t remaining = 0;
+	for(uint i=0; i<req->nsegs; i++) {
+		iov[i].iov_base = req->segs[i].buf;
+		iov[i].iov_len = req->segs[i].size;
+		remaining += req->segs[i].size;
+	}
+
+	struct iovec* vec = iov;
+	int veclen = req->nsegs;
+	off_t pos = req->sector * DISK_SECTOR_SIZE;
+	while(remaining > 0) {
+		ssize_t rc = req->write ? pwritev(disk->fd, vec, veclen, pos)
+								: preadv(disk->fd, vec, veclen, pos);
+		if(rc==-1 && errno==EINTR) continue;
+		if(rc<=0) return -1;
+
+		/* Skip what was transferred */
+		remaining -= rc;
+		pos += rc;
+		while(veclen > 0 && (size_t)rc >= vec->iov_len) {
+			rc -= vec->iov_len;
+			vec++; veclen--;
+		}
+		if(veclen > 0) {
+			vec->iov_base = (char*)vec->iov_base + rc;
+			vec->iov_len -= rc;
+		}
+	}
+	return 0;
 }
 
 
-static int check_terminal(terminal* term)
+static void* disk_engine(void* _disk)
 {
-	/* poll the read side */
-	struct pollfd fds = { .fd=term->kbd.fd, .events=POLLIN };
-	int rc;
-	while( (rc=poll(&fds, 1, 0)) == -1 && errno==EINTR );
-	CHECK(rc);
-	return (fds.revents & (POLLHUP|POLLERR))==0;
+	disk_unit* disk = (disk_unit*) _disk;
+
+	pthread_mutex_lock(& disk->lock);
+	while(1) {
+		while(disk->head == NULL && disk->active)
+			pthread_cond_wait(& disk->submitted, & disk->lock);
+
+		disk_request* batch = disk->head;
+		if(batch == NULL) break;
+		disk->head = disk->tail = NULL;
+		pthread_mutex_unlock(& disk->lock);
+
+		uint cores = 0;
+		while(batch != NULL) {
+			disk_request* req = batch;
+			batch = req->next;
+
+			req->status = disk_transfer(disk, req);
+			cores |= 1u << req->core;
+
+			/* After this, req belongs to the cores */
+			req->next = __atomic_load_n(& disk->done, __ATOMIC_RELAXED);
+			while(! __atomic_compare_exchange_n(& disk->done, & req->next, req, 
+				1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		}
+
+		for(; cores; cores &= cores-1)
+			raise_interrupt(& CORE[__builtin_ctz(cores)], DISK);
+
+		pthread_mutex_lock(& disk->lock);
+	}
+	pthread_mutex_unlock(& disk->lock);
+	return NULL;
+}
+
+static void start_disks()
+{
+	/* The engines must not take any signals of the VM */
+	sigset_t all, saved;
+	CHECK(sigfillset(&all));
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &all, &saved));
+
+	for(uint d=0; d<ndisks; d++) {
+		disk_unit* disk = & DISKS[d];
+		disk->active = 1;
+		disk->head = disk->tail = disk->done = NULL;
+		CHECKRC(pthread_create(& disk->engine, NULL, disk_engine, disk));
+		char thread_name[16];
+		CHECK(snprintf(thread_name,16,"disk-%d",d));
+		CHECKRC(pthread_setname_np(disk->engine, thread_name));
+	}
+
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved, NULL));
+}
+
+static void stop_disks()
+{
+	for(uint d=0; d<ndisks; d++) {
+		disk_unit* disk = & DISKS[d];
+		pthread_mutex_lock(& disk->lock);
+		disk->active = 0;
+		pthread_cond_signal(& disk->submitted);
+		pthread_mutex_unlock(& disk->lock);
+		CHECKRC(pthread_join(disk->engine, NULL));
+	}
 }
 
 
@@ -555,6 +869,78 @@ static void pic_drain_sigusr1(int sigusr1fd)
 }
 
 
+/* Epoll tags of the PIC, besides the devices (tagged by 2*serial+iodir) */
+#define PIC_TAG_ALARM (2*MAX_TERMINALS)
+#define PIC_TAG_WAKE (2*MAX_TERMINALS+1)
+#define PIC_TAG_OPEN (2*MAX_TERMINALS+2)
+
+/* The inotify fd of the PIC, watching the FIFOs of the hung-up devices */
+static int PIC_inotify = -1;
+
+static void pic_watch(int fd, uint64_t tag)
+{
+	struct epoll_event evt = { .events = EPOLLIN, .data.u64 = tag };
+	CHECK(epoll_ctl(PIC_epfd, EPOLL_CTL_ADD, fd, &evt));
+}
+
+/* Helper for PIC_daemon: a device has become ready */
+static void pic_device_ready(io_device* dev, uint serial)
+{
+	dev->ready = 1;
+	Core* core = (Core*) dev->int_core;
+	raise_serial_interrupt(core, 
+		(dev->iodir==IODIR_RX) ? SERIAL_RX_READY : SERIAL_TX_READY, serial);
+}
+
+/* Helper for PIC_daemon: the peer of a hung-up device re-connected */
+static void pic_device_reconnect(io_device* dev)
+{
+	CHECK(inotify_rm_watch(PIC_inotify, dev->hupwd));
+	dev->hupwd = -1;
+	dev->hungup = 0;
+}
+
+/* 
+	Helper for PIC_daemon: the peer of a device hung up. Until it re-opens 
+	the FIFO, the device is not re-armed.
+ */
+static void pic_device_hangup(io_device* dev, uint serial)
+{
+	dev->hungup = 1;
+	if(dev->hupwd != -1) return;
+
+	char fname[32];
+	sprintf(fname, "%s%d", (dev->iodir==IODIR_TX) ? "con" : "kbd", serial);
+	dev->hupwd = inotify_add_watch(PIC_inotify, fname, IN_OPEN);
+	CHECK(dev->hupwd);
+
+	/* The peer may have re-opened the FIFO before the watch */
+	if(! io_hungup(dev->fd))
+		pic_device_reconnect(dev);
+}
+
+/* Helper for PIC_daemon: some watched FIFOs were opened */
+static void pic_device_opened()
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int rc;
+	while((rc = read(PIC_inotify, buf, sizeof(buf))) > 0) {
+		for(char* p = buf; p < buf+rc; ) {
+			struct inotify_event* evt = (struct inotify_event*) p;
+			p += sizeof(struct inotify_event) + evt->len;
+			for(uint i=0; i<2*nterm; i++) {
+				io_device* dev = (i & 1) ? &TERM[i/2].con : &TERM[i/2].kbd;
+				if(dev->hupwd == evt->wd && ! io_hungup(dev->fd)) {
+					pic_device_reconnect(dev);
+					pic_device_ready(dev, i/2);
+				}
+			}
+		}
+	}
+	assert(rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR));
+}
+
+
 /*
 	The PIC daemon dispatches interrupts to core threads,
 	by calling raise_interrupt().
@@ -563,6 +949,11 @@ static void pic_drain_sigusr1(int sigusr1fd)
 	(a) ALARM, when the core timer expires
 	(b) SERIAL_RX_READY  &  SERIAL_TX_READY, when some 
 		io_device becomes ready.
+
+	The daemon sleeps in epoll_wait() on a persistent set of fds: the 
+	terminal FIFOs, the signalfds of ALARM and of the wake-up signal, and 
+	an inotify fd for the FIFOs of hung-up terminals. Thus, it only wakes 
+	up when there is something to do.
  */
 static void PIC_daemon(uint serialno)
 {
@@ -576,16 +967,34 @@ static void PIC_daemon(uint serialno)
 	CHECKRC(pthread_getname_np(pthread_self(), oldname, 16));
 	CHECKRC(pthread_setname_np(pthread_self(), "tinyos_vm"));
 
-	for(uint i=0; i<nterm; i++)
+	PIC_epfd = epoll_create1(0);
+	CHECK(PIC_epfd);
+
+	for(uint i=0; i<nterm; i++) {
 		open_terminal(& TERM[i], i);
+		io_device_watch(& TERM[i].kbd);
+		io_device_watch(& TERM[i].con);
+	}
 
 	sigset_t saved_mask;
 
 	int sigusr1fd = signalfd(-1, &sigusr1_set, SFD_NONBLOCK);
 	CHECK(sigusr1fd);
+	if(vm_transport == INTERRUPT_DOORBELL) {
+		PIC_eventfd = eventfd(0, EFD_NONBLOCK);
+		CHECK(PIC_eventfd);
+	}
 	int sigalrmfd = signalfd(-1, &sigalrm_set, SFD_NONBLOCK);
 	CHECK(sigalrmfd);
 
+	PIC_inotify = inotify_init1(IN_NONBLOCK);
+	CHECK(PIC_inotify);
+
+	pic_watch(sigalrmfd, PIC_TAG_ALARM);
+	pic_watch(sigusr1fd, PIC_TAG_WAKE);
+	if(PIC_eventfd != -1) pic_watch(PIC_eventfd, PIC_TAG_WAKE);
+	pic_watch(PIC_inotify, PIC_TAG_OPEN);
+
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
 		
 	/* sync with all cores */
@@ -593,36 +1002,16 @@ static void PIC_daemon(uint serialno)
 	
 	/* The PIC multiplexing loop */
 	while(__atomic_load_n(&PIC_active, __ATOMIC_ACQUIRE)) {
-		int maxfd = 0;
-		fd_set readfds, writefds;
-
-		/* Prepare to select */
-		FD_ZERO(&readfds);
-		FD_ZERO(&writefds);
-
-		for(uint i=0; i<nterm; i++) {
-			terminal* term = & TERM[i];
-			if(!check_terminal(term)) continue;
-			if(! term->kbd.ready) fdset_add(&readfds, term->kbd.fd, &maxfd);
-			if(! term->con.ready) fdset_add(&writefds, term->con.fd, &maxfd);
-		}
-
-		fdset_add(&readfds, sigalrmfd, &maxfd);
-		fdset_add(&readfds, sigusr1fd, &maxfd);
-
-		/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
-		struct timeval sleeptime = { .tv_sec=0, .tv_usec = SLOW_HZ };
-		int selcode = select(maxfd, &readfds, &writefds, NULL, &sleeptime);
-
-		/* update system clock */
-		system_clock = get_coarse_time();
+		struct epoll_event events[2*MAX_TERMINALS+3];
+		int nevents = epoll_wait(PIC_epfd, events, 2*MAX_TERMINALS+3, -1);
 
 		/* process */
-		if(selcode<0) continue;
+		if(nevents<0) { assert(errno==EINTR); continue; }
 		__atomic_fetch_add(&PIC_loops,1,__ATOMIC_RELAXED);
 
 		/* First raise ALRM as needed (timers have priority :-) */
-		if( FD_ISSET(sigalrmfd, &readfds) ) {
+		for(int e=0; e<nevents; e++) {
+			if(events[e].data.u64 != PIC_TAG_ALARM) continue;
 			struct signalfd_siginfo sfdinfo;
 
 			while(1) {
@@ -638,35 +1027,28 @@ static void PIC_daemon(uint serialno)
 			}
 		}
 
-		/* Discard any USR1 signals to PIC (their purpose was to unblock PIC 
-		   from select) */
-		if( FD_ISSET(sigusr1fd, &readfds) ) {
-			pic_drain_sigusr1(sigusr1fd);
-		}
-
-		/* Handle the devices */
-		for(uint i=0; i<nterm; i++) {
-
-			terminal* term = & TERM[i];
-			if( FD_ISSET(term->con.fd, &writefds) 
-				|| (system_clock-term->con.last_int)>SERIAL_TIMEOUT
-				) 
-			{
-				term->con.ready = 1;
-				term->con.last_int = system_clock;
-				Core* core = (Core*) term->con.int_core;
-				raise_interrupt(core, SERIAL_TX_READY);
+		for(int e=0; e<nevents; e++) {
+			uint64_t tag = events[e].data.u64;
+
+			if(tag < 2*MAX_TERMINALS) {
+				/* A device is ready, or its peer hung up */
+				terminal* term = & TERM[tag/2];
+				io_device* dev = (tag & 1) ? &term->con : &term->kbd;
+				if(events[e].events & (EPOLLHUP|EPOLLERR))
+					pic_device_hangup(dev, tag/2);
+				pic_device_ready(dev, tag/2);
+			} 
+			else if(tag == PIC_TAG_WAKE) {
+				/* Discard any wake-ups of the PIC (their purpose was to 
+				   unblock it from epoll_wait) */
+				pic_drain_sigusr1(sigusr1fd);
+				uint64_t count;
+				if(PIC_eventfd != -1 && read(PIC_eventfd, &count, sizeof(count))==sizeof(count))
+					__atomic_fetch_add(&PIC_usr1_drained,count,__ATOMIC_RELAXED);
 			}
-
-
-			if( FD_ISSET(term->kbd.fd, &readfds) 
-				|| (system_clock-term->kbd.last_int)>SERIAL_TIMEOUT
-				) 
-			{
-				term->kbd.ready = 1;
-				term->kbd.last_int = system_clock;
-				Core* core = (Core*) term->kbd.int_core;
-				raise_interrupt(core, SERIAL_RX_READY);
+			else if(tag == PIC_TAG_OPEN) {
+				/* Re-connect the hung-up devices whose peer is back */
+				pic_device_opened();
 			}
 		}
 	}
@@ -677,7 +1059,13 @@ static void PIC_daemon(uint serialno)
 	/* Close signal fds */
 	pic_drain_sigusr1(sigusr1fd);
 	CHECK(close(sigalrmfd));
+	CHECK(close(PIC_inotify));
+	PIC_inotify = -1;
 	CHECK(close(sigusr1fd));
+	if(PIC_eventfd != -1) {
+		CHECK(close(PIC_eventfd));
+		PIC_eventfd = -1;
+	}
 
 	/* Restore sigmask */
 	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
@@ -686,6 +1074,8 @@ static void PIC_daemon(uint serialno)
 	for(uint i=0; i<nterm; i++)
 		close_terminal(& TERM[i]);
 	nterm = 0;
+	CHECK(close(PIC_epfd));
+	PIC_epfd = -1;
 
 	/* Reset name */
 	CHECKRC(pthread_setname_np(pthread_self(), oldname));
@@ -719,9 +1109,6 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	PIC_thread = pthread_self();
 	PIC_active = 1;	
 
-	/* Initialize system_clock */
-	system_clock = get_coarse_time();
-
 	/* Initialize the barriers */
 	pthread_barrier_init(& system_barrier, NULL, cores+1);
 	pthread_barrier_init(& core_barrier, NULL, cores);
@@ -756,6 +1143,9 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 		CHECKRC(pthread_setname_np(CORE[c].thread, thread_name));
 	}
 
+	/* Start the disks */
+	start_disks();
+
 	/* Initialize PIC statistics */
 	PIC_loops = 0; PIC_usr1_queued = PIC_usr1_drained = 0;
 
@@ -767,6 +1157,9 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 		CHECKRC(pthread_join(CORE[c].thread, NULL));
 	}
 
+	/* Serve any remaining disk requests and stop the disks */
+	stop_disks();
+
 	/* Destroy the core barrier */
 	pthread_barrier_destroy(& system_barrier);
 	pthread_barrier_destroy(& core_barrier);
@@ -792,6 +1185,43 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 }
 
 
+int vm_attach_disk(const char* path)
+{
+	CHECK_CONDITION(ncores==0);
+	if(ndisks == MAX_DISKS) return -1;
+
+	int fd = open(path, O_RDWR);
+	if(fd==-1) return -1;
+	struct stat st;
+	CHECK(fstat(fd, &st));
+
+	disk_unit* disk = & DISKS[ndisks];
+	disk->fd = fd;
+	disk->sectors = st.st_size / DISK_SECTOR_SIZE;
+	CHECKRC(pthread_mutex_init(& disk->lock, NULL));
+	CHECKRC(pthread_cond_init(& disk->submitted, NULL));
+	return ndisks++;
+}
+
+void vm_detach_disks()
+{
+	CHECK_CONDITION(ncores==0);
+	for(uint d=0; d<ndisks; d++) {
+		CHECK(close(DISKS[d].fd));
+		CHECKRC(pthread_mutex_destroy(& DISKS[d].lock));
+		CHECKRC(pthread_cond_destroy(& DISKS[d].submitted));
+	}
+	ndisks = 0;
+}
+
+
+void vm_set_interrupt_transport(interrupt_transport transport)
+{
+	CHECK_CONDITION(ncores==0);
+	vm_transport = transport;
+}
+
+
 uint cpu_cores()
 {
 	return ncores;
@@ -811,17 +1241,41 @@ static inline void core_restart(Core* core)
 }
 
 
+/*
+	Halt with the doorbell transport. The pending interrupts are dispatched
+	by cpu_core_halt(), as no signal was sent.
+ */
+static void doorbell_halt(Core* core)
+{
+	__atomic_store_n(& core->halted, 1, __ATOMIC_SEQ_CST);
+	uint32_t seq = __atomic_load_n(& core->doorbell, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(& core->int_pending, __ATOMIC_SEQ_CST) == 0)
+		futex_wait(& core->doorbell, seq);
+	__atomic_store_n(& core->halted, 0, __ATOMIC_SEQ_CST);
+}
+
 void cpu_core_halt()
 {
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 
 	Core* core = curr_core();
 
+	if(vm_transport == INTERRUPT_DOORBELL) {
+		doorbell_halt(core);
+		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+		if(! irq_disabled)
+			dispatch_interrupts();
+		return;
+	}
+
 	pthread_mutex_lock(& core_halt_mutex);
-	core->halted = 1;
-	rlist_push_front(&halted_list, & core->halted_node);
-	while(core->halted)
-		pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
+	/* An interrupt raised before we got here must not be slept through */
+	if(core->int_pending == 0) {
+		core->halted = 1;
+		rlist_push_front(&halted_list, & core->halted_node);
+		while(core->halted)
+			pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
+	}
 	assert(! core->halted);
 	pthread_mutex_unlock(& core_halt_mutex);
 
@@ -830,6 +1284,14 @@ void cpu_core_halt()
 
 void cpu_core_restart(uint c)
 {
+	if(vm_transport == INTERRUPT_DOORBELL) {
+		if(__atomic_load_n(& CORE[c].halted, __ATOMIC_SEQ_CST)) {
+			__atomic_fetch_add(& CORE[c].doorbell, 1, __ATOMIC_SEQ_CST);
+			futex_wake(& CORE[c].doorbell);
+		}
+		return;
+	}
+
 	pthread_mutex_lock(& core_halt_mutex);
 	core_restart(CORE+c);
 	pthread_mutex_unlock(& core_halt_mutex);	
@@ -837,6 +1299,15 @@ void cpu_core_restart(uint c)
 
 void cpu_core_restart_one()
 {
+	if(vm_transport == INTERRUPT_DOORBELL) {
+		for(uint c=0; c<ncores; c++)
+			if(__atomic_load_n(& CORE[c].halted, __ATOMIC_SEQ_CST)) {
+				cpu_core_restart(c);
+				return;
+			}
+		return;
+	}
+
 	pthread_mutex_lock(& core_halt_mutex);
 	if(! is_rlist_empty(&halted_list)) {
 		core_restart((Core*) rlist_pop_front(&halted_list)->obj);
@@ -846,6 +1317,12 @@ void cpu_core_restart_one()
 
 void cpu_core_restart_all()
 {
+	if(vm_transport == INTERRUPT_DOORBELL) {
+		for(uint c=0; c<ncores; c++)
+			cpu_core_restart(c);
+		return;
+	}
+
 	pthread_mutex_lock(& core_halt_mutex);
 	for(uint c=0; c<ncores; c++)
 		core_restart(CORE+c);
@@ -865,29 +1342,34 @@ void cpu_ici(uint core)
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	int enabled = cpu_disable_interrupts();
 	curr_core()->intvec[interrupt] = handler;
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	if(enabled) cpu_enable_interrupts();
 }
 
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return ! irq_disabled;
 }
 
 int cpu_disable_interrupts()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	/* 
+		A signal between the two accesses is handled with interrupts
+		enabled and returns with them enabled, maybe on another core.
+	 */
+	int enabled = ! irq_disabled;
+	irq_disabled = 1;
+	return enabled;
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	irq_disabled = 0;
+
+	/* Dispatch the interrupts that arrived while disabled */
+	if(curr_core()->int_pending)
+		dispatch_interrupts();
 }
 
 
@@ -902,8 +1384,8 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
   ctx->uc_stack.ss_size = ss_size;
   ctx->uc_stack.ss_flags = 0;
 
-  //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
+  /* Interrupts are masked by the core's flag, not by the signal mask */
+  ctx->uc_sigmask = core_signal_set;
   makecontext(ctx, (void*) ctx_func, 0);
 }
 
@@ -931,14 +1413,13 @@ TimerDuration bios_set_timer(TimerDuration usec)
 	};
 
 	struct itimerspec oldtime;
-	sigset_t curss;
 
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));	
+	int enabled = cpu_disable_interrupts();
 	
 	timer_settime(curr_core()->timer_id, 0, &newtime, &oldtime);
 	interrupt_clear(curr_core(), ALARM);
 	
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	if(enabled) cpu_enable_interrupts();
 
 	assert(oldtime.it_interval.tv_sec ==0 && oldtime.it_interval.tv_nsec==0);
 	return 1000000*oldtime.it_value.tv_sec + oldtime.it_value.tv_nsec/1000ull;
@@ -952,7 +1433,9 @@ TimerDuration bios_cancel_timer()
 
 TimerDuration bios_clock()
 {
-	return system_clock * 1000ul;
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_sec*1000000ul + curtime.tv_nsec/1000ul;
 }	
 
 
@@ -982,13 +1465,29 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
 }
 
 
+/*
+	Return and clear the set of serial ports that raised 'intno' to the 
+	current core.
+ */
+uint bios_serial_pending(Interrupt intno)
+{
+	if(!(intno==SERIAL_RX_READY || intno==SERIAL_TX_READY)) return 0;
+	return __atomic_exchange_n(& curr_core()->serial_pending[intno], 0, __ATOMIC_ACQ_REL);
+}
+
+
 /*
 	Try to read a byte from serial port 'serial' and store it into the location
 	pointed by 'ptr'.  If the operation succeds, 1 is returned. If not, 0 is returned.
  */
 int bios_read_serial(uint serial, char* ptr)
 {
-	return io_device_read(& TERM[serial].kbd, ptr);
+	return io_device_read(& TERM[serial].kbd, ptr, 1);
+}
+
+uint bios_read_serial_buf(uint serial, char* buf, uint size)
+{
+	return io_device_read(& TERM[serial].kbd, buf, size);
 }
 
 
@@ -998,7 +1497,66 @@ int bios_read_serial(uint serial, char* ptr)
  */
 int bios_write_serial(uint serial, char value)
 {
-	return io_device_write(& TERM[serial].con, value);
+	return io_device_write(& TERM[serial].con, &value, 1);
+}
+
+uint bios_write_serial_buf(uint serial, const char* buf, uint size)
+{
+	return io_device_write(& TERM[serial].con, buf, size);
+}
+
+int bios_serial_hungup(uint serial)
+{
+	return TERM[serial].con.hungup;
+}
+
+
+uint bios_disks()
+{
+	return ndisks;
+}
+
+
+uint64_t bios_disk_sectors(uint disk)
+{
+	return (disk < ndisks) ? DISKS[disk].sectors : 0;
 }
 
 
+int bios_disk_submit(uint disk, disk_request* req)
+{
+	if(!(disk < ndisks)) return -1;
+	if(!(req->core < ncores)) return -1;
+	if(req->nsegs == 0 || req->nsegs > DISK_MAX_SEGMENTS) return -1;
+
+	uint64_t count = 0;
+	for(uint i=0; i<req->nsegs; i++) {
+		if(req->segs[i].size % DISK_SECTOR_SIZE) return -1;
+		count += req->segs[i].size / DISK_SECTOR_SIZE;
+	}
+	disk_unit* unit = & DISKS[disk];
+	if(req->sector > unit->sectors || count > unit->sectors - req->sector) return -1;
+
+	req->next = NULL;
+
+	/* The queue lock must not be held by an interrupted core */
+	int enabled = cpu_disable_interrupts();
+	pthread_mutex_lock(& unit->lock);
+	if(unit->tail) 
+		unit->tail->next = req;
+	else
+		unit->head = req;
+	unit->tail = req;
+	pthread_cond_signal(& unit->submitted);
+	pthread_mutex_unlock(& unit->lock);
+	if(enabled) cpu_enable_interrupts();
+
+	return 0;
+}
+
+
+disk_request* bios_disk_completed(uint disk)
+{
+	if(!(disk < ndisks)) return NULL;
+	return __atomic_exchange_n(& DISKS[disk].done, NULL, __ATOMIC_ACQUIRE);
+}
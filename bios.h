@@ -51,8 +51,8 @@
 
 	The peripherals are managed via the 'bios_...' functions. 
 
-	There are two types of simulated peripherals:  _timers_ and _serial ports_ 
-	(connected to terminals). Each type of peripheral is documented below.
+	There are three types of simulated peripherals:  _timers_, _serial ports_ 
+	(connected to terminals) and _disks_. Each type of peripheral is documented below.
 
 	Timers
 	-------
@@ -95,8 +95,24 @@
 	which is ready, the write will succeed. When a non-ready device becomes ready,
 	a @c SERIAL_TX_READY interrupt is raised.
 
-	Also, each interrupt is sent if the serial device timeouts (is inactive for
-	about 300 msec).
+	An interrupt is raised only when a device becomes ready. When the terminal
+	hangs up, the device becomes ready (reads and writes fail), and it becomes
+	ready again when the terminal re-connects.
+
+	Disks
+	-----
+
+	A disk is an array of sectors of @c DISK_SECTOR_SIZE bytes, stored in a host 
+	file. Disks are attached to the virtual machine by @c vm_attach_disk before
+	it boots, and are numbered from 0, up to @c MAX_DISKS-1. 
+
+	A disk transfers data asynchronously, like a DMA controller. A core submits
+	a @c disk_request, which reads or writes a range of consecutive sectors from
+	or to a list of memory segments, and continues running. The requests of a 
+	disk are served in the order of submission. When a request completes, 
+	a @c DISK interrupt is raised on the core named in the request, and the 
+	request can be collected by @c bios_disk_completed. The completions of 
+	requests served together are reported by one interrupt per core.
 
  */
 
@@ -123,6 +139,7 @@ typedef enum Interrupt
 						   from a serial port */
 	SERIAL_TX_READY,	/**< Raised when a serial port is ready to accept 
 						   data */
+	DISK,				/**< Raised when disk requests have completed */
 
 	maximum_interrupt_no 
 } Interrupt;
@@ -134,6 +151,9 @@ typedef enum Interrupt
 /** @brief Maximum number of terminals for a virtual machine. */
 #define MAX_TERMINALS 4
 
+/** @brief Maximum number of disks for a virtual machine. */
+#define MAX_DISKS 4
+
 /**
 	@brief Boot a CPU with the given number of cores and boot function.
 
@@ -161,6 +181,51 @@ typedef enum Interrupt
 void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno);
 
 
+/** @brief The ways interrupts can be delivered to the simulated cores */
+typedef enum interrupt_transport
+{
+	INTERRUPT_SIGNAL,	/**< Each interrupt raised is sent to the core thread as a signal (the default) */
+	INTERRUPT_DOORBELL	/**< Interrupts are posted to the core's pending mask. A running core
+						   is sent at most one signal for a batch of them, and a halted core 
+						   is woken up by a futex, without a signal. */
+} interrupt_transport;
+
+/**
+	@brief Select how interrupts are delivered to the simulated cores.
+
+	The transport is a property of the simulator, and does not change the
+	semantics of interrupts. It takes effect at the next call of @c vm_boot,
+	and must not be changed while a VM is running.
+
+	@param transport the transport to use
+ */
+void vm_set_interrupt_transport(interrupt_transport transport);
+
+
+/**
+	@brief Attach a disk to the virtual machine.
+
+	The host file at @c path is opened for reading and writing, and becomes
+	the next disk of the virtual machines booted from now on. Its size in 
+	sectors is the size of the file, divided by @c DISK_SECTOR_SIZE. The file
+	can be removed after this call.
+
+	This must not be called while a VM is running.
+
+	@param path the host file of the disk
+	@return the number of the disk, or -1 if the file cannot be opened or
+		@c MAX_DISKS disks are attached
+ */
+int vm_attach_disk(const char* path);
+
+/**
+	@brief Detach all disks from the virtual machine.
+
+	This must not be called while a VM is running.
+ */
+void vm_detach_disks();
+
+
 /**
 	@brief Contains the id of the current core.
  */
@@ -213,7 +278,8 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler);
 	If an interrupt arrives while interrupts are disabled, it will be
 	marked as _pending_ and will be raised when interrupts are re-enabled.
 
-	
+	Disabling and enabling interrupts only sets a per-core flag, and is
+	cheap: no host system call is made.
 
 	@returns 1 if interrupts were enabled before the call, else 0.
 	@see cpu_enable_interrupts
@@ -342,13 +408,13 @@ TimerDuration bios_cancel_timer();
 /**
 	@brief Get the current time from the hardware clock.
 
-	This function returns a real-time clock value, in usec.
-	The value of the clock is 10 times the number of seconds since
-	the epoch. 
+	This function returns a monotonic clock value, in usec. 
+	The clock is not affected by changes to the wall-clock time, and 
+	its origin is arbitrary (but fixed while the host is up), so only
+	differences of its values are meaningful.
 
-	The resolution of the clock is very low, currently 
-	around 100 msec. Therefore, it is inappropriate for any type of
-	precise timing.
+	The resolution of the clock is 1 usec, and the core timers 
+	(@c bios_set_timer) count time on the same clock.
  */
 TimerDuration bios_clock();
 
@@ -381,6 +447,23 @@ uint bios_serial_ports();
 void bios_serial_interrupt_core(uint serial, Interrupt intno, uint core);
 
 
+/**
+	@brief Get the serial ports that raised an interrupt.
+
+	Return the set of serial ports that raised @c intno (one of 
+	@c SERIAL_RX_READY and @c SERIAL_TX_READY) to the current core, since
+	the last call, as a bit mask: port @f$ N @f$ is in the set if bit @f$ N @f$
+	is set. The set is cleared.
+
+	This is typically called by the interrupt handler, to find which
+	devices became ready.
+
+	@param intno the interrupt
+	@return the bit mask of the serial ports
+ */
+uint bios_serial_pending(Interrupt intno);
+
+
 /**
 	@brief Read a byte from a serial port.
 
@@ -415,4 +498,123 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Read many bytes from a serial port.
+
+	Read up to @c size bytes that are available from serial port @c serial 
+	into @c buf, and return their number. This is equivalent to 
+	calling @c bios_read_serial until it fails, or @c size bytes are read, 
+	but the bytes are transferred in bulk.
+
+	If this operation returns less than @c size, a @c SERIAL_RX_READY interrupt 
+	will be raised when data is ready to be received.
+
+	@param serial the serial device to read from
+	@param buf the location in which to store the bytes read
+	@param size the maximum number of bytes to read
+	@return the number of bytes read
+ */
+uint bios_read_serial_buf(uint serial, char* buf, uint size);
+
+
+/**
+	@brief Write many bytes to a serial port.
+
+	Write up to @c size bytes from @c buf to serial port @c serial, and 
+	return the number of bytes written. This is equivalent to 
+	calling @c bios_write_serial until it fails, or @c size bytes are written, 
+	but the bytes are transferred in bulk.
+
+	If this operation returns less than @c size, a @c SERIAL_TX_READY interrupt 
+	will be raised when the device is ready to accept data.
+
+	@param serial the serial device to write to
+	@param buf the bytes to write
+	@param size the number of bytes to write
+	@return the number of bytes written
+ */
+uint bios_write_serial_buf(uint serial, const char* buf, uint size);
+
+
+/**
+	@brief Check if the terminal of a serial port has hung up its console.
+
+	While the console is hung up, writes to the serial port fail. When the 
+	terminal re-connects, a @c SERIAL_TX_READY interrupt is raised.
+
+	@param serial the serial device to check
+	@return non-zero if the console is hung up, else zero
+ */
+int bios_serial_hungup(uint serial);
+
+
+/** @brief The size of a disk sector in bytes */
+#define DISK_SECTOR_SIZE 512
+
+/** @brief The maximum number of memory segments of a disk request */
+#define DISK_MAX_SEGMENTS 64
+
+/** @brief A memory segment of a disk transfer */
+typedef struct disk_segment
+{
+	void* buf;		/**< @brief The memory of the segment */
+	uint size;		/**< @brief The size in bytes, a multiple of @c DISK_SECTOR_SIZE */
+} disk_segment;
+
+/** 
+	@brief A disk request. 
+
+	The request transfers consecutive sectors, starting at @c sector,
+	from or to the memory segments, in order. The memory of the request
+	must remain valid until it completes.
+ */
+typedef struct disk_request
+{
+	int write;				/**< @brief Non-zero for a write, zero for a read */
+	uint64_t sector;		/**< @brief The first sector of the transfer */
+	disk_segment* segs;		/**< @brief The memory segments */
+	uint nsegs;				/**< @brief The number of segments, up to @c DISK_MAX_SEGMENTS */
+	uint core;				/**< @brief The core to interrupt on completion */
+	int status;				/**< @brief Set on completion: 0 on success, -1 on error */
+	struct disk_request* next;	/**< @brief Used by the BIOS */
+} disk_request;
+
+
+/**
+	@brief Return the number of disks.
+ */
+uint bios_disks();
+
+/**
+	@brief Return the size of a disk in sectors, or 0 if there is no such disk.
+ */
+uint64_t bios_disk_sectors(uint disk);
+
+/**
+	@brief Submit a request to a disk.
+
+	The request is queued to the disk, and this call returns immediately. 
+	When the request completes, its @c status is set and a @c DISK interrupt
+	is raised on core @c req->core.
+
+	@param disk the disk
+	@param req the request
+	@return 0 if the request was submitted, or -1 if it is invalid (no such disk 
+		or core, bad segments, or sectors beyond the end of the disk)
+ */
+int bios_disk_submit(uint disk, disk_request* req);
+
+/**
+	@brief Collect the completed requests of a disk.
+
+	Return the requests of the disk that completed since the last call, as a
+	list linked by their @c next field, in no particular order, or NULL.
+	This is typically called by the @c DISK interrupt handler.
+
+	@param disk the disk
+	@return the list of completed requests
+ */
+disk_request* bios_disk_completed(uint disk);
+
+
 #endif
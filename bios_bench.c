@@ -0,0 +1,260 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "bios.h"
+
+/*
+	A benchmark of the interrupt transports of the VM.
+
+	For each transport, it measures
+	- the rate of ICIs between two cores, when the receiver is halted
+	  (ping-pong) and when it is busy running,
+	- the jitter of the ALARM interrupt, i.e., how late the handler
+	  runs after the timer was due,
+	- the round-trip latency of a byte over serial port 0, when the 
+	  terminal program echoes the console back to the keyboard.
+
+	Usage: bios_bench [seconds]
+ */
+
+static double duration = 1.0;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1E-9;
+}
+
+
+/*
+	ICI ping-pong: core 0 sends an ICI to core 1, which answers with an
+	ICI to core 0. Each core halts while waiting.
+ */
+static volatile unsigned long pings, pongs;
+static volatile int stop;
+
+static void ping_handler() { pongs++; }
+static void pong_handler() { pings++; cpu_ici(0); }
+
+static double ici_halted_rate;
+
+static void ici_halted_boot()
+{
+	if(cpu_core_id == 0) {
+		cpu_interrupt_handler(ICI, ping_handler);
+		pings = pongs = 0;
+		stop = 0;
+	} else
+		cpu_interrupt_handler(ICI, pong_handler);
+	cpu_core_barrier_sync();
+
+	if(cpu_core_id == 0) {
+		double t0 = now(), t;
+		do {
+			unsigned long sent = pongs;
+			cpu_ici(1);
+			while(pongs == sent)
+				cpu_core_halt();
+		} while((t = now()) - t0 < duration);
+		ici_halted_rate = 2*pongs / (t-t0);
+		stop = 1;
+		cpu_ici(1);
+	} else {
+		while(! stop)
+			cpu_core_halt();
+	}
+
+	cpu_interrupt_handler(ICI, NULL);
+	cpu_core_barrier_sync();
+}
+
+
+/*
+	ICIs to a busy core: as above, but core 1 spins with interrupts 
+	enabled, instead of halting.
+ */
+static double ici_busy_rate;
+
+static void ici_busy_boot()
+{
+	if(cpu_core_id == 0) {
+		cpu_interrupt_handler(ICI, ping_handler);
+		pings = pongs = 0;
+		stop = 0;
+	} else
+		cpu_interrupt_handler(ICI, pong_handler);
+	cpu_core_barrier_sync();
+
+	if(cpu_core_id == 0) {
+		double t0 = now(), t;
+		do {
+			unsigned long sent = pongs;
+			cpu_ici(1);
+			while(pongs == sent)
+				cpu_core_halt();
+		} while((t = now()) - t0 < duration);
+		ici_busy_rate = 2*pongs / (t-t0);
+		stop = 1;
+	} else {
+		while(! stop);
+	}
+
+	cpu_interrupt_handler(ICI, NULL);
+	cpu_core_barrier_sync();
+}
+
+
+/*
+	ALARM jitter: core 0 sets its timer and halts until the ALARM handler
+	runs, many times.
+ */
+#define ALARM_USEC 1000
+#define ALARM_SAMPLES 1000
+
+static double lateness[ALARM_SAMPLES];
+static volatile double fired;
+
+static void alarm_handler() { fired = now(); }
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static void alarm_boot()
+{
+	if(cpu_core_id != 0) return;
+
+	cpu_interrupt_handler(ALARM, alarm_handler);
+	for(int i=0; i<ALARM_SAMPLES; i++) {
+		fired = 0.0;
+		double due = now() + ALARM_USEC*1E-6;
+		bios_set_timer(ALARM_USEC);
+		while(fired == 0.0)
+			cpu_core_halt();
+		lateness[i] = (fired - due)*1E6;
+	}
+	cpu_interrupt_handler(ALARM, NULL);
+
+	qsort(lateness, ALARM_SAMPLES, sizeof(double), compare_double);
+}
+
+
+/*
+	Serial latency: core 0 writes a byte to serial port 0 and halts until it
+	comes back. The peer is a terminal program whose stdout is piped to its
+	stdin.
+ */
+#define ECHO_SAMPLES 1000
+
+static volatile int rx_ready;
+
+static void rx_handler() { rx_ready = 1; }
+
+static char echo_read()
+{
+	char c;
+	while(1) {
+		rx_ready = 0;
+		if(bios_read_serial(0, &c)) return c;
+		cpu_disable_interrupts();
+		if(! rx_ready) cpu_core_halt();
+		cpu_enable_interrupts();
+	}
+}
+
+static void echo_boot()
+{
+	cpu_interrupt_handler(SERIAL_RX_READY, rx_handler);
+
+	/* Skip the banners of the terminal */
+	while(! bios_write_serial(0, '#'));
+	while(echo_read() != '#');
+
+	for(int i=0; i<ECHO_SAMPLES; i++) {
+		double t0 = now();
+		while(! bios_write_serial(0, 'x'));
+		echo_read();
+		lateness[i] = (now() - t0)*1E6;
+	}
+	cpu_interrupt_handler(SERIAL_RX_READY, NULL);
+
+	qsort(lateness, ECHO_SAMPLES, sizeof(double), compare_double);
+}
+
+static pid_t start_echo_terminal()
+{
+	if(access("./terminal", X_OK) || access("con0", F_OK) || access("kbd0", F_OK))
+		return -1;
+
+	int fd[2];
+	if(pipe(fd)) return -1;
+	pid_t pid = fork();
+	if(pid == 0) {
+		dup2(fd[0], 0);
+		dup2(fd[1], 1);
+		close(fd[0]); close(fd[1]);
+		execl("./terminal", "terminal", "0", NULL);
+		_exit(1);
+	}
+	close(fd[0]); close(fd[1]);
+	return pid;
+}
+
+
+int main(int argc, char** argv)
+{
+	if(argc > 1) duration = atof(argv[1]);
+
+	const char* name[] = { "signal", "doorbell" };
+	interrupt_transport transport[] = { INTERRUPT_SIGNAL, INTERRUPT_DOORBELL };
+
+	printf("%-10s %14s %14s %30s\n", "transport", "ICI/s halted", "ICI/s busy",
+		"ALARM lateness usec avg/p50/p99/max");
+	for(int t=0; t<2; t++) {
+		vm_set_interrupt_transport(transport[t]);
+		vm_boot(ici_halted_boot, 2, 0);
+		vm_boot(ici_busy_boot, 2, 0);
+		vm_boot(alarm_boot, 1, 0);
+
+		double avg = 0.0;
+		for(int i=0; i<ALARM_SAMPLES; i++) avg += lateness[i];
+		avg /= ALARM_SAMPLES;
+
+		printf("%-10s %14.0f %14.0f %9.1f/%6.1f/%6.1f/%7.1f\n", name[t],
+			ici_halted_rate, ici_busy_rate, avg,
+			lateness[ALARM_SAMPLES/2], lateness[ALARM_SAMPLES*99/100],
+			lateness[ALARM_SAMPLES-1]);
+	}
+
+	printf("\n%-10s %30s\n", "transport", "serial echo usec avg/p50/p99/max");
+	for(int t=0; t<2; t++) {
+		pid_t peer = start_echo_terminal();
+		if(peer == -1) {
+			printf("%-10s %30s\n", name[t], "(no ./terminal or FIFOs)");
+			continue;
+		}
+		vm_set_interrupt_transport(transport[t]);
+		vm_boot(echo_boot, 1, 1);
+		kill(peer, SIGKILL);
+		waitpid(peer, NULL, 0);
+
+		double avg = 0.0;
+		for(int i=0; i<ECHO_SAMPLES; i++) avg += lateness[i];
+		avg /= ECHO_SAMPLES;
+
+		printf("%-10s %9.1f/%6.1f/%6.1f/%7.1f\n", name[t], avg,
+			lateness[ECHO_SAMPLES/2], lateness[ECHO_SAMPLES*99/100],
+			lateness[ECHO_SAMPLES-1]);
+	}
+	vm_set_interrupt_transport(INTERRUPT_SIGNAL);
+
+	return 0;
+}
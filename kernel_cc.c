@@ -31,14 +31,22 @@
 
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
+
+ 	The mutex byte holds two flags: MUTEX_LOCKED is the lock proper, and
+ 	MUTEX_MORPHED is set when @c Cond_Broadcast has requeued waiters on the
+ 	mutex (see wait-morphing below). When the latter is set, unlocking the 
+ 	mutex wakes up one of these waiters.
  */
+#define MUTEX_LOCKED  1
+#define MUTEX_MORPHED 2
+
 void Mutex_Lock(Mutex* lock)
 {
 #define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
+  while(__atomic_fetch_or(lock, MUTEX_LOCKED, __ATOMIC_ACQUIRE) & MUTEX_LOCKED) {
     int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+    while(__atomic_load_n(lock, __ATOMIC_RELAXED) & MUTEX_LOCKED) {
 #if defined(__x86__) || defined(__x86_64__)
       __builtin_ia32_pause();
 #endif
@@ -46,8 +54,10 @@ void Mutex_Lock(Mutex* lock)
       	spin--; 
       else { 
       	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
+      	if(cpu_interrupts_enabled()) {
+      		SCHED_STAT_INC(mutex_yields);
       		yield(SCHED_MUTEX); 
+      	}
       }
     }
   }
@@ -55,9 +65,16 @@ void Mutex_Lock(Mutex* lock)
 }
 
 
+int mutex_release(Mutex* lock)
+{
+  return __atomic_fetch_and(lock, ~MUTEX_LOCKED, __ATOMIC_RELEASE) & MUTEX_MORPHED;
+}
+
+
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  if(mutex_release(lock))
+    mutex_handoff(lock);
 }
 
 
@@ -73,24 +90,141 @@ typedef struct __cv_waiter {
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	Mutex* mutex;				/* the mutex the thread will re-lock */
+	sig_atomic_t morphed;		/* this is set while the waiter is queued 
+								   on its mutex by Cond_Broadcast */
+	int arg;					/* RWLock waiters: set for writers,
+								   PIMutex waiters: the priority level */
 } __cv_waiter;
 /** \endcond */
 
 /**
    @internal
-   A helper routine to remove a condition waiter from the CondVar ring.
+   A helper routine to add a waiter to the back of a waiter ring,
+   such as the waitset of a CondVar.
  */
-static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
+static inline void push_to_ring(void** waitset, __cv_waiter* w)
 {
-	if(cv->waitset == w) {
-		/* Make cv->waitset safe */
+	if(*waitset) {
+		__cv_waiter* wset = *waitset;
+		rlist_push_back(& wset->node, & w->node);
+	} else {
+		*waitset = w;
+	}
+}
+
+/**
+   @internal
+   A helper routine to remove a waiter from a waiter ring.
+ */
+static inline void remove_from_ring(void** waitset, __cv_waiter* w)
+{
+	if(*waitset == w) {
+		/* Make the waitset safe */
 		__cv_waiter * nextw = w->node.next->obj;
-		cv->waitset =  (nextw == w) ? NULL : nextw;
+		*waitset =  (nextw == w) ? NULL : nextw;
 	}
 	rlist_remove(& w->node);
 }
 
 
+/*
+	Wait-morphing.
+	--------------
+
+	When @c Cond_Broadcast wakes up many threads, all but one of them would
+	immediately block again on the mutex they have to re-lock. Instead, we
+	wake up only the first waiter and move the rest to a queue associated
+	with their mutex, marking the mutex with MUTEX_MORPHED. Each time such
+	a mutex is unlocked, one more of these waiters is woken up. Thus, only
+	one thread becomes runnable per unlock.
+
+	The waiter queues are kept in a small hash table, indexed by the
+	mutex address. Waiters of different mutexes may share a bucket.
+ */
+
+#define MORPH_BUCKETS 64
+
+/** \cond HELPER */
+typedef struct __morph_bucket {
+	Mutex lock;			/* protects the bucket */
+	void* waitset;		/* ring of morphed waiters, or NULL */
+} __morph_bucket;
+/** \endcond */
+
+static __morph_bucket MORPH_TABLE[MORPH_BUCKETS];
+
+static inline __morph_bucket* morph_bucket(Mutex* mx)
+{
+	uintptr_t h = (uintptr_t) mx;
+	return & MORPH_TABLE[(h ^ (h>>6) ^ (h>>12)) % MORPH_BUCKETS];
+}
+
+/*
+	Requeue a (sleeping) waiter on its mutex.
+	Returns 1 if the mutex was unlocked at the time.
+ */
+static int morph_requeue(__cv_waiter* w)
+{
+	__morph_bucket* b = morph_bucket(w->mutex);
+
+	Mutex_Lock(& b->lock);
+	w->morphed = 1;
+	push_to_ring(& b->waitset, w);
+	int oldmx = __atomic_fetch_or(w->mutex, MUTEX_MORPHED, __ATOMIC_RELAXED);
+	Mutex_Unlock(& b->lock);
+
+	return ! (oldmx & MUTEX_LOCKED);
+}
+
+/*
+	Called by a waiter that woke up (e.g., by timeout) while still queued
+	on its mutex.
+ */
+static void morph_cancel(__cv_waiter* w)
+{
+	__morph_bucket* b = morph_bucket(w->mutex);
+
+	Mutex_Lock(& b->lock);
+	if(w->morphed) {
+		remove_from_ring(& b->waitset, w);
+		w->morphed = 0;
+	}
+	Mutex_Unlock(& b->lock);
+}
+
+
+void mutex_handoff(Mutex* mx)
+{
+	__morph_bucket* b = morph_bucket(mx);
+
+	Mutex_Lock(& b->lock);
+	for(;;) {
+		/* Find the first waiter for mx */
+		__cv_waiter* w = b->waitset;
+		while(w && w->mutex != mx) {
+			w = w->node.next->obj;
+			if(w == b->waitset) w = NULL;
+		}
+
+		if(w == NULL) {
+			/* No more waiters for mx */
+			__atomic_fetch_and(mx, ~MUTEX_MORPHED, __ATOMIC_RELAXED);
+			break;
+		}
+
+		remove_from_ring(& b->waitset, w);
+		int woken = wakeup(w->thread);
+		/* We must not touch w after this */
+		__atomic_store_n(& w->morphed, 0, __ATOMIC_RELEASE);
+
+		/* If w was not woken, it has timed out and is running already */
+		if(woken) break;
+	}
+	Mutex_Unlock(& b->lock);
+}
+
+
 /** 
    @internal
    @brief Wait on a condition variable, specifying the cause. 
@@ -121,17 +255,13 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 static int cv_wait(Mutex* mutex, CondVar* cv, 
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0,
+		.mutex = mutex, .morphed = 0 };
 	rlnode_init(& waiter.node, &waiter);
 
 	Mutex_Lock(&(cv->waitset_lock));
 	/* We just push the current thread to the back of the list */
-	if(cv->waitset) {
-		__cv_waiter* wset = cv->waitset;
-		rlist_push_back(& wset->node, & waiter.node);
-	} else {
-		cv->waitset = &waiter;
-	}
+	push_to_ring(& cv->waitset, &waiter);
 
 	/* Now atomically release mutex and sleep */
 	Mutex_Unlock(mutex);
@@ -143,10 +273,15 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 		assert(! waiter.signalled);
 
 		/* We must remove ourselves from the ring! */
-		remove_from_ring(cv, &waiter);
+		remove_from_ring(& cv->waitset, &waiter);
 	}
 	Mutex_Unlock(&(cv->waitset_lock));
 
+	/* If we were woken by a timeout after a broadcast, we may still be
+	   queued on the mutex. */
+	if(__atomic_load_n(& waiter.morphed, __ATOMIC_ACQUIRE))
+		morph_cancel(&waiter);
+
 	Mutex_Lock(mutex);
 	return waiter.signalled;
 }
@@ -163,7 +298,7 @@ static inline void cv_signal(CondVar* cv)
 	/* Wakeup first process in the waiters' queue, if it exists. */
 	while(cv->waitset) {
 		__cv_waiter* waiter = cv->waitset;
-		remove_from_ring(cv, waiter);
+		remove_from_ring(& cv->waitset, waiter);
 		waiter->removed = 1;
 		if(wakeup(waiter->thread)) {
 			waiter->signalled = 1;
@@ -197,12 +332,417 @@ void Cond_Signal(CondVar* cv)
 void Cond_Broadcast(CondVar* cv)
 {
   Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
+  SCHED_STAT_INC(broadcasts);
+
+  /* Wake up the first waiter, as in Cond_Signal. Its thread will 
+     eventually unlock the mutex, waking up the next one. */
+  cv_signal(cv);
+
+  /* Morph the rest into waiters of their mutex */
+  while(cv->waitset) {
+    __cv_waiter* waiter = cv->waitset;
+    remove_from_ring(& cv->waitset, waiter);
+    waiter->removed = 1;
+    waiter->signalled = 1;
+    SCHED_STAT_INC(morphed);
+    /* An unlocked mutex may have been unlocked before it was marked,
+       even the first waiter's when the caller does not hold it, so 
+       nobody else will hand it off. A spurious handoff is harmless. */
+    if(morph_requeue(waiter))
+      mutex_handoff(waiter->mutex);
+  }
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
 
 
+/*
+	Semaphores and reader-writer locks.
+	-----------------------------------
+
+	These are implemented directly on waiter rings, as condition variables. 
+	A thread that cannot proceed pushes itself on the ring and sleeps,
+	releasing the lock of the primitive. A releasing thread grants the
+	semaphore unit (or the lock) directly to the first waiter(s), by 
+	marking them as signalled before waking them up. Therefore, waiters
+	are served in FIFO order and a woken thread never has to retry.
+ */
+
+/*
+	Wait on a ring, atomically releasing lock. On return, lock is held 
+	again and the result tells whether the waiter was granted. A waiter that
+	timed out has been removed from the ring.
+ */
+static int ring_wait(Mutex* lock, void** waitset, int arg, TimerDuration timeout)
+{
+	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0,
+		.mutex = NULL, .morphed = 0, .arg = arg };
+	rlnode_init(& waiter.node, &waiter);
+
+	push_to_ring(waitset, &waiter);
+	sleep_releasing(STOPPED, lock, SCHED_USER, timeout);
+
+	Mutex_Lock(lock);
+	if(! waiter.removed) {
+		assert(! waiter.signalled);
+		remove_from_ring(waitset, &waiter);
+	}
+	return waiter.signalled;
+}
+
+/*
+	Grant the first waiter of the ring. 
+	If the waiter has already timed out, it will find out it was granted
+	as soon as it gets the lock.
+ */
+static inline void ring_grant(void** waitset)
+{
+	__cv_waiter* waiter = *waitset;
+	remove_from_ring(waitset, waiter);
+	waiter->removed = 1;
+	waiter->signalled = 1;
+	wakeup(waiter->thread);
+}
+
+
+static int sem_wait(Semaphore* sem, TimerDuration timeout)
+{
+	int ret = 1;
+	Mutex_Lock(& sem->lock);
+	if(sem->count > 0 && sem->waitset == NULL)
+		sem->count--;
+	else
+		ret = ring_wait(& sem->lock, & sem->waitset, 0, timeout);
+	Mutex_Unlock(& sem->lock);
+	return ret;
+}
+
+void Sem_Wait(Semaphore* sem)
+{
+	sem_wait(sem, NO_TIMEOUT);
+}
+
+int Sem_TimedWait(Semaphore* sem, timeout_t timeout)
+{
+	return sem_wait(sem, timeout*1000ul);
+}
+
+int Sem_TryWait(Semaphore* sem)
+{
+	int ret = 0;
+	Mutex_Lock(& sem->lock);
+	if(sem->count > 0 && sem->waitset == NULL) {
+		sem->count--;
+		ret = 1;
+	}
+	Mutex_Unlock(& sem->lock);
+	return ret;
+}
+
+void Sem_Post(Semaphore* sem)
+{
+	Mutex_Lock(& sem->lock);
+	if(sem->waitset)
+		ring_grant(& sem->waitset);
+	else
+		sem->count++;
+	Mutex_Unlock(& sem->lock);
+}
+
+
+/* 
+	Grant the lock to as many waiters as possible, in FIFO order. 
+ */
+static void rwlock_grant(RWLock* rw)
+{
+	while(rw->waitset) {
+		__cv_waiter* first = rw->waitset;
+		if(first->arg) {
+			if(rw->state != 0) break;
+			rw->state = -1;
+		} else {
+			if(rw->state < 0) break;
+			rw->state++;
+		}
+		ring_grant(& rw->waitset);
+	}
+}
+
+static int rwlock_lock(RWLock* rw, int writer, TimerDuration timeout)
+{
+	int ret = 1;
+	Mutex_Lock(& rw->lock);
+
+	/* Do not overtake waiting threads */
+	if(rw->waitset == NULL && (writer ? rw->state == 0 : rw->state >= 0))
+		rw->state = writer ? -1 : rw->state+1;
+	else if(timeout == 0)
+		ret = 0;
+	else {
+		ret = ring_wait(& rw->lock, & rw->waitset, writer, timeout);
+		/* A writer that left the head of the ring may unblock readers */
+		if(! ret) rwlock_grant(rw);
+	}
+
+	Mutex_Unlock(& rw->lock);
+	return ret;
+}
+
+void RWLock_ReadLock(RWLock* rw) { rwlock_lock(rw, 0, NO_TIMEOUT); }
+
+int RWLock_TimedReadLock(RWLock* rw, timeout_t timeout) 
+{ 
+	return rwlock_lock(rw, 0, timeout*1000ul); 
+}
+
+int RWLock_TryReadLock(RWLock* rw) { return rwlock_lock(rw, 0, 0); }
+
+void RWLock_WriteLock(RWLock* rw) { rwlock_lock(rw, 1, NO_TIMEOUT); }
+
+int RWLock_TimedWriteLock(RWLock* rw, timeout_t timeout) 
+{ 
+	return rwlock_lock(rw, 1, timeout*1000ul); 
+}
+
+int RWLock_TryWriteLock(RWLock* rw) { return rwlock_lock(rw, 1, 0); }
+
+void RWLock_ReadUnlock(RWLock* rw)
+{
+	Mutex_Lock(& rw->lock);
+	assert(rw->state > 0);
+	if(--rw->state == 0)
+		rwlock_grant(rw);
+	Mutex_Unlock(& rw->lock);
+}
+
+void RWLock_WriteUnlock(RWLock* rw)
+{
+	Mutex_Lock(& rw->lock);
+	assert(rw->state == -1);
+	rw->state = 0;
+	rwlock_grant(rw);
+	Mutex_Unlock(& rw->lock);
+}
+
+
+
+/*
+	Priority-inheritance mutexes.
+	-----------------------------
+
+	A thread blocking on a locked PIMutex sleeps on the waiter ring of the
+	mutex, and raises the owner to its own priority level, if that is
+	higher. The owner keeps the inherited level until it releases all the
+	PIMutexes it holds. On unlock, the mutex is passed directly to the
+	waiter with the highest priority, which inherits from the rest.
+
+	Inheritance is not transitive: if the owner is itself blocked on 
+	another PIMutex, the owner of that one is not raised.
+
+	The internal lock is held with preemption off. Otherwise, a waiter
+	spinning on it would yield with SCHED_MUTEX and lose its priority.
+ */
+
+/* Find the waiter with the highest priority (i.e., lowest level) */
+static __cv_waiter* pimutex_top_waiter(PIMutex* pm)
+{
+	__cv_waiter* top = pm->waitset;
+	if(top == NULL) return NULL;
+	for(rlnode* n = top->node.next; n != & ((__cv_waiter*)pm->waitset)->node; n = n->next) {
+		__cv_waiter* w = n->obj;
+		if(w->arg < top->arg) top = w;
+	}
+	return top;
+}
+
+void PIMutex_Lock(PIMutex* pm)
+{
+	TCB* self = cur_thread();
+
+	int preempt = preempt_off;
+	Mutex_Lock(& pm->lock);
+	if(pm->owner == NULL)
+		pm->owner = self;
+	else {
+		int level = sched_effective_priority(self);
+		TCB* owner = pm->owner;
+		if(level < sched_effective_priority(owner))
+			sched_set_inherited_priority(owner, level);
+
+		/* We are woken up as the new owner */
+		int granted = ring_wait(& pm->lock, & pm->waitset, level, NO_TIMEOUT);
+		assert(granted && pm->owner == self);
+	}
+	Mutex_Unlock(& pm->lock);
+	if(preempt) preempt_on;
+
+	self->pi_held++;
+}
+
+int PIMutex_TryLock(PIMutex* pm)
+{
+	TCB* self = cur_thread();
+	int ret = 0;
+
+	int preempt = preempt_off;
+	Mutex_Lock(& pm->lock);
+	if(pm->owner == NULL) {
+		pm->owner = self;
+		ret = 1;
+	}
+	Mutex_Unlock(& pm->lock);
+	if(preempt) preempt_on;
+
+	if(ret) self->pi_held++;
+	return ret;
+}
+
+void PIMutex_Unlock(PIMutex* pm)
+{
+	TCB* self = cur_thread();
+
+	int preempt = preempt_off;
+	Mutex_Lock(& pm->lock);
+	assert(pm->owner == self);
+
+	/* Drop any inherited priority, once we hold no PIMutex */
+	if(--self->pi_held == 0 && self->inherited_level >= 0)
+		sched_set_inherited_priority(self, -1);
+
+	__cv_waiter* top = pimutex_top_waiter(pm);
+	if(top) {
+		TCB* owner = top->thread;
+		remove_from_ring(& pm->waitset, top);
+		top->removed = 1;
+		top->signalled = 1;
+		pm->owner = owner;
+
+		__cv_waiter* next = pimutex_top_waiter(pm);
+		if(next && next->arg < sched_effective_priority(owner))
+			sched_set_inherited_priority(owner, next->arg);
+
+		wakeup(owner);
+	} else
+		pm->owner = NULL;
+
+	Mutex_Unlock(& pm->lock);
+	if(preempt) preempt_on;
+}
+
+
+
+/*
+	Barriers.
+	---------
+
+	A combining tree of nodes with fan-in BARRIER_FANIN. Each arriving 
+	thread takes a ticket, which determines its leaf and the round.
+	The last thread to arrive at a node goes on to the parent, while
+	the others wait at the node. When the last thread arrives at the 
+	root, it descends the same path, releasing the nodes it passed.
+
+	For up to BARRIER_FLAT threads, the tree is a single node: the 
+	release then costs one broadcast instead of a cascade, which on 
+	bench_barrier was no slower than the tree at these sizes.
+
+	The ticket is 64 bits wide, so that it never wraps; a wrapping 
+	ticket would jump to another leaf and round whenever n does not 
+	divide the range of the ticket.
+ */
+
+#define BARRIER_FANIN 8
+#define BARRIER_FLAT 32
+
+/** \cond HELPER */
+typedef struct __barrier_node {
+	struct __barrier_node* parent;
+	unsigned int size;		/* number of arrivals to expect */
+	unsigned int count;		/* arrivals in this round */
+	unsigned int round;		/* the current round */
+	Mutex mx;
+	CondVar cv;
+} __barrier_node;
+/** \endcond */
+
+int Barrier_Init(Barrier* bar, unsigned int n)
+{
+	if(n==0) return -1;
+	unsigned int fanin = (n <= BARRIER_FLAT) ? n : BARRIER_FANIN;
+
+	/* Count the nodes of the tree */
+	unsigned int nodes = 0;
+	for(unsigned int w = n; ; w = (w+fanin-1)/fanin) {
+		nodes += (w+fanin-1)/fanin;
+		if(w <= fanin) break;
+	}
+
+	/* Lay out the tree level by level, leaves first */
+	__barrier_node* tree = xmalloc(nodes*sizeof(__barrier_node));
+	__barrier_node* level = tree;
+	for(unsigned int w = n; ; ) {
+		unsigned int width = (w+fanin-1)/fanin;
+		__barrier_node* next = level + width;
+		for(unsigned int i=0; i<width; i++) {
+			level[i] = (__barrier_node) {
+				.parent = (w <= fanin) ? NULL : &next[i/fanin],
+				.size = (i+1 < width) ? fanin : w - i*fanin,
+				.count = 0, .round = 0,
+				.mx = MUTEX_INIT, .cv = COND_INIT
+			};
+		}
+		if(w <= fanin) break;
+		w = width;
+		level = next;
+	}
+
+	bar->n = n;
+	bar->fanin = fanin;
+	bar->ticket = 0;
+	bar->tree = tree;
+	return 0;
+}
+
+static void barrier_arrive(__barrier_node* node, unsigned int round)
+{
+	Mutex_Lock(& node->mx);
+	if(++ node->count < node->size) {
+		/* A node may be entered for the next round before it is released 
+		   from the current one, so we wait for node->round to go past ours. */
+		while((int)(node->round - round) <= 0)
+			Cond_Wait(& node->mx, & node->cv);
+		Mutex_Unlock(& node->mx);
+		return;
+	}
+	node->count = 0;
+	Mutex_Unlock(& node->mx);
+
+	/* We are the last to arrive here */
+	if(node->parent)
+		barrier_arrive(node->parent, round);
+
+	/* Release this node */
+	Mutex_Lock(& node->mx);
+	node->round = round+1;
+	Cond_Broadcast(& node->cv);
+	Mutex_Unlock(& node->mx);
+}
+
+void Barrier_Sync(Barrier* bar)
+{
+	/* All tickets of a round are taken before the round ends */
+	unsigned long long ticket = __atomic_fetch_add(& bar->ticket, 1, __ATOMIC_RELAXED);
+	__barrier_node* tree = bar->tree;
+	barrier_arrive(& tree[(ticket % bar->n)/bar->fanin], (unsigned int)(ticket / bar->n));
+}
+
+void Barrier_Destroy(Barrier* bar)
+{
+	free(bar->tree);
+	bar->tree = NULL;
+}
+
+
+
 
 
 /*
@@ -72,6 +72,25 @@ void kernel_signal(CondVar* cv);
 void kernel_broadcast(CondVar* cv);
 
 
+/**
+	@brief Unlock a mutex, without waking up morphed waiters.
+
+	This is the first half of @c Mutex_Unlock. It returns non-zero if
+	@c Cond_Broadcast has queued waiters on the mutex, in which case
+	the caller must later call @c mutex_handoff(). It is used by 
+	@c sleep_releasing, which cannot wake up threads while holding
+	the scheduler lock.
+
+	@see mutex_handoff
+  */
+int mutex_release(Mutex* mx);
+
+/**
+	@brief Wake up one of the threads queued on a mutex by @c Cond_Broadcast.
+  */
+void mutex_handoff(Mutex* mx);
+
+
 /**
 	@brief Put thread to sleep, unlocking the kernel.
 
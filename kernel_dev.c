@@ -65,11 +65,20 @@ static file_ops nulldev_fops = {
 /* forward */
 void serial_rx_handler();
 void serial_tx_handler();
+void disk_handler();
+
+/* The size of the transmit ring of a serial device */
+#define SERIAL_TX_RING 4096
 
 typedef struct serial_device_control_block {
   uint devno;
-  Mutex spinlock;
+  uint int_core;    /* the core handling the interrupts of the device */
+  Mutex spinlock;   /* protects the transmit ring */
   CondVar rx_ready;
+  CondVar tx_space; /* signalled when the transmit ring is drained */
+
+  char tx_ring[SERIAL_TX_RING];  /* bytes written, not yet sent to the device */
+  uint tx_head, tx_count;
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -84,90 +93,181 @@ void serial_rx_handler()
 {
   int pre = preempt_off;
 
-  /* 
-    We do not know which terminal is
-    ready, so we must signal them all !
-   */
-  for(int i=0;i<bios_serial_ports();i++) {
-    serial_dcb_t* dcb = &serial_dcb[i];
+  /* Signal the terminals that became ready */
+  for(uint ports = bios_serial_pending(SERIAL_RX_READY); ports; ports &= ports-1) {
+    serial_dcb_t* dcb = &serial_dcb[__builtin_ctz(ports)];
+    Mutex_Lock(&dcb->spinlock);
     Cond_Broadcast(&dcb->rx_ready);
+    Mutex_Unlock(&dcb->spinlock);
   }
   if(pre) preempt_on;
 }
 
 /*
   Read from the device, sleeping if needed.
+
+  The device raises SERIAL_RX_READY only once, when it becomes ready, so the 
+  reader waits on rx_ready with the spinlock, like a writer on tx_space.
  */
 int serial_read(void* dev, char *buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
-  preempt_off;            /* Stop preemption */
-
-  uint count =  0;
+  kernel_unlock();
+  int pre = preempt_off;
 
-  while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
-    
-    if (valid) {
-      count++;
-    }
-    else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
-    }
-    else
-      break;
-  }
+  uint count = 0;
 
-  preempt_on;           /* Restart preemption */
+  /* Read what is available, or wait for something to read */
+  Mutex_Lock(&dcb->spinlock);
+  while(size > 0 && (count = bios_read_serial_buf(dcb->devno, buf, size)) == 0)
+    Cond_Wait(&dcb->spinlock, &dcb->rx_ready);
+  Mutex_Unlock(&dcb->spinlock);
 
+  if(pre) preempt_on;
+  kernel_lock();
   return count;
 }
 
 
 /*
-  A polling driver for serial writes
+  Interrupt-driven driver for serial writes.
+
+  Written bytes are queued in the transmit ring of the device, which is 
+  drained into the device by the writers and by the SERIAL_TX_READY 
+  interrupt. A writer only waits while the ring is full.
   */
 
-/* Interrupt driver */
+/*
+  Send as much of the transmit ring to the device as it accepts. 
+  If the ring is not drained, the device will raise SERIAL_TX_READY.
+
+  *** MUST BE CALLED WITH dcb->spinlock HELD ***
+ */
+static void serial_tx_drain(serial_dcb_t* dcb)
+{
+  uint drained = 0;
+  while(dcb->tx_count > 0) {
+    uint n = SERIAL_TX_RING - dcb->tx_head;
+    if(n > dcb->tx_count) n = dcb->tx_count;
+    n = bios_write_serial_buf(dcb->devno, dcb->tx_ring + dcb->tx_head, n);
+    if(n == 0) {
+      /* A hung-up terminal will never take the bytes, so they are discarded */
+      if(bios_serial_hungup(dcb->devno)) {
+        drained += dcb->tx_count;
+        dcb->tx_head = dcb->tx_count = 0;
+      }
+      break;
+    }
+    dcb->tx_head = (dcb->tx_head + n) % SERIAL_TX_RING;
+    dcb->tx_count -= n;
+    drained += n;
+  }
+  if(drained) Cond_Broadcast(&dcb->tx_space);
+}
+
 void serial_tx_handler()
 {
-  /* There is nothing to do */
+  int pre = preempt_off;
+
+  /* Drain the terminals that became ready */
+  for(uint ports = bios_serial_pending(SERIAL_TX_READY); ports; ports &= ports-1) {
+    serial_dcb_t* dcb = &serial_dcb[__builtin_ctz(ports)];
+    Mutex_Lock(&dcb->spinlock);
+    serial_tx_drain(dcb);
+    Mutex_Unlock(&dcb->spinlock);
+  }
+  if(pre) preempt_on;
 }
 
 /* 
-  Write call 
-  This is currently a polling driver.
+  Write call. 
+
+  The writer waits on tx_space with the spinlock, so that a drain by the 
+  interrupt handler cannot be missed. The kernel lock is released first, 
+  since the handler may have interrupted its holder.
 */
 int serial_write(void* dev, const char* buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
+  kernel_unlock();
+  int pre = preempt_off;
+
   unsigned int count = 0;
-  while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
-
-    if(success) {
-      count++;
-    } 
-    else if(count==0)
-    {
-      yield(SCHED_IO);
+  while(size > 0 && count == 0) {
+    Mutex_Lock(&dcb->spinlock);
+
+    /* A full ring is discarded, if the terminal hung up */
+    if(dcb->tx_count == SERIAL_TX_RING)
+      serial_tx_drain(dcb);
+
+    /* When the ring is empty, try the device first */
+    if(dcb->tx_count == 0)
+      count = bios_write_serial_buf(dcb->devno, buf, size);
+
+    /* Queue as much of the rest as fits */
+    while(count < size && dcb->tx_count < SERIAL_TX_RING) {
+      uint tail = (dcb->tx_head + dcb->tx_count) % SERIAL_TX_RING;
+      uint n = (tail >= dcb->tx_head) ? SERIAL_TX_RING - tail : dcb->tx_head - tail;
+      if(n > size - count) n = size - count;
+      memcpy(dcb->tx_ring + tail, buf + count, n);
+      dcb->tx_count += n;
+      count += n;
     }
-    else
-      break;
+
+    if(count == 0)
+      Cond_Wait(&dcb->spinlock, &dcb->tx_space);
+    Mutex_Unlock(&dcb->spinlock);
   }
 
+  if(pre) preempt_on;
+  kernel_lock();
   return count;  
 }
 
 
+/*
+  Closing waits until the written bytes have been sent to the device, or 
+  discarded because the terminal hung up.
+ */
 int serial_close(void* dev) 
 {
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  kernel_unlock();
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+  while(serial_tx_drain(dcb), dcb->tx_count > 0)
+    Cond_Wait(&dcb->spinlock, &dcb->tx_space);
+  Mutex_Unlock(&dcb->spinlock);
+  if(pre) preempt_on;
+  kernel_lock();
+
+  return 0;
+}
+
+
+int sys_SetTerminalCore(unsigned int termno, unsigned int core)
+{
+  if(termno >= bios_serial_ports() || core >= cpu_cores())
+    return -1;
+
+  bios_serial_interrupt_core(termno, SERIAL_RX_READY, core);
+  bios_serial_interrupt_core(termno, SERIAL_TX_READY, core);
+  serial_dcb[termno].int_core = core;
   return 0;
 }
 
 
+int sys_GetTerminalCore(unsigned int termno)
+{
+  if(termno >= bios_serial_ports())
+    return -1;
+  return serial_dcb[termno].int_core;
+}
+
+
 void* serial_open(uint term)
 {
   assert(term<bios_serial_ports());
@@ -185,6 +285,216 @@ file_ops serial_fops = {
 
 
 
+/*============================================
+
+  The block device driver
+
+ ============================================*/
+
+/*
+  A thread transfers sectors to or from a disk by a blk_io. Each blk_io is 
+  queued to its disk as a blk_request, or is merged into a queued request for 
+  adjacent sectors, as another memory segment. At most BLK_DEPTH requests of
+  each disk are in flight (submitted to the disk), so that requests wait in the
+  queue, and can be merged, when the disk is busy.
+
+  The DISK interrupt handler completes the requests, wakes up the threads 
+  of their blk_ios, and submits more requests from the queue. The completion 
+  interrupt of a request is raised on the core that submitted it.
+ */
+
+/* The number of requests in flight to a disk */
+#define BLK_DEPTH 8
+
+/* The largest request made by merging */
+#define BLK_MAX_SECTORS 256
+
+typedef struct blk_io {
+  uint64_t sector;
+  uint count;
+  void* buf;
+  int status;
+  int done;
+  CondVar done_cv;      /* signalled when done */
+  struct blk_io* next;  /* the next blk_io of the same request */
+} blk_io;
+
+typedef struct blk_request {
+  disk_request req;     /* must be first */
+  disk_segment segs[DISK_MAX_SEGMENTS];
+  uint count;           /* the number of sectors */
+  blk_io* ios;          /* the transfers merged in this request */
+  rlnode node;          /* in the queue of the disk */
+} blk_request;
+
+typedef struct block_device_control_block {
+  uint devno;
+  Mutex spinlock;       /* protects the queue */
+  rlnode queue;         /* requests not submitted yet */
+  uint inflight;        /* requests submitted to the disk */
+} block_dcb_t;
+
+block_dcb_t block_dcb[MAX_DISKS];
+
+
+/*
+  Try to merge io into a queued request of the same direction, for 
+  adjacent sectors. The requests queued after the one merged into must 
+  not overlap with io, since merging moves io ahead of them.
+
+  *** MUST BE CALLED WITH dcb->spinlock HELD ***
+ */
+static int blk_merge(block_dcb_t* dcb, int write, blk_io* io)
+{
+  for(rlnode* n = dcb->queue.prev; n != &dcb->queue; n = n->prev) {
+    blk_request* br = n->obj;
+    uint64_t start = br->req.sector, end = start + br->count;
+
+    if(br->req.write == write && br->req.nsegs < DISK_MAX_SEGMENTS 
+        && br->count + io->count <= BLK_MAX_SECTORS
+        && (end == io->sector || io->sector + io->count == start)) {
+      disk_segment seg = { io->buf, io->count * DISK_SECTOR_SIZE };
+      if(end == io->sector)
+        br->segs[br->req.nsegs] = seg;
+      else {
+        memmove(br->segs+1, br->segs, br->req.nsegs * sizeof(disk_segment));
+        br->segs[0] = seg;
+        br->req.sector = io->sector;
+      }
+      br->req.nsegs++;
+      br->count += io->count;
+      io->next = br->ios;
+      br->ios = io;
+      return 1;
+    }
+
+    /* Do not merge past an overlapping request */
+    if(io->sector < end && start < io->sector + io->count)
+      return 0;
+  }
+  return 0;
+}
+
+/*
+  Report the end of a request to the threads of its blk_ios.
+
+  *** MUST BE CALLED WITH dcb->spinlock HELD ***
+ */
+static void blk_complete(blk_request* br, int status)
+{
+  for(blk_io* io = br->ios; io != NULL; ) {
+    blk_io* next = io->next;
+    io->status = status;
+    io->done = 1;
+    Cond_Signal(&io->done_cv);
+    io = next;
+  }
+  free(br);
+}
+
+/*
+  Submit queued requests to the disk, up to BLK_DEPTH in flight.
+
+  *** MUST BE CALLED WITH dcb->spinlock HELD ***
+ */
+static void blk_dispatch(block_dcb_t* dcb)
+{
+  while(dcb->inflight < BLK_DEPTH && ! is_rlist_empty(&dcb->queue)) {
+    blk_request* br = rlist_pop_front(&dcb->queue)->obj;
+    br->req.core = cpu_core_id;
+    if(bios_disk_submit(dcb->devno, &br->req) == 0)
+      dcb->inflight++;
+    else
+      blk_complete(br, -1);
+  }
+}
+
+void disk_handler()
+{
+  int pre = preempt_off;
+
+  for(uint d=0; d<bios_disks(); d++) {
+    disk_request* done = bios_disk_completed(d);
+    if(done == NULL) continue;
+
+    block_dcb_t* dcb = &block_dcb[d];
+    Mutex_Lock(&dcb->spinlock);
+    while(done != NULL) {
+      disk_request* req = done;
+      done = req->next;
+      dcb->inflight--;
+      blk_complete((blk_request*) req, req->status);
+    }
+    blk_dispatch(dcb);
+    Mutex_Unlock(&dcb->spinlock);
+  }
+  if(pre) preempt_on;
+}
+
+
+int blk_transfer(uint disk, int write, uint64_t sector, uint count, void* buf)
+{
+  if(disk >= bios_disks() || count == 0 || count > bios_disk_sectors(disk) 
+      || sector > bios_disk_sectors(disk) - count)
+    return -1;
+
+  block_dcb_t* dcb = &block_dcb[disk];
+  blk_io io = { .sector = sector, .count = count, .buf = buf, 
+    .status = 0, .done = 0, .done_cv = COND_INIT, .next = NULL };
+
+  /* The kernel lock is released first, since the DISK handler may have
+     interrupted its holder, and spin on dcb->spinlock */
+  kernel_unlock();
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+
+  if(! blk_merge(dcb, write, &io)) {
+    blk_request* br = xmalloc(sizeof(blk_request));
+    br->req.write = write;
+    br->req.sector = sector;
+    br->req.segs = br->segs;
+    br->req.nsegs = 1;
+    br->segs[0] = (disk_segment){ buf, count * DISK_SECTOR_SIZE };
+    br->count = count;
+    br->ios = &io;
+    rlnode_init(&br->node, br);
+    rlist_push_back(&dcb->queue, &br->node);
+  }
+  blk_dispatch(dcb);
+
+  /* Wait on the spinlock, so that the completion cannot be missed */
+  while(! io.done)
+    Cond_Wait(&dcb->spinlock, &io.done_cv);
+  Mutex_Unlock(&dcb->spinlock);
+
+  if(pre) preempt_on;
+  kernel_lock();
+  return io.status;
+}
+
+
+unsigned int sys_GetDiskDevices()
+{
+  return bios_disks();
+}
+
+unsigned long sys_GetDiskSectors(unsigned int diskno)
+{
+  return bios_disk_sectors(diskno);
+}
+
+int sys_ReadSectors(unsigned int diskno, unsigned long sector, unsigned int count, void* buf)
+{
+  return blk_transfer(diskno, 0, sector, count, buf);
+}
+
+int sys_WriteSectors(unsigned int diskno, unsigned long sector, unsigned int count, const void* buf)
+{
+  return blk_transfer(diskno, 1, sector, count, (void*) buf);
+}
+
+
+
 /***********************************
 
   The device table
@@ -209,12 +519,28 @@ void initialize_devices()
   /* Initialize the serial devices */
   for(int i=0; i<bios_serial_ports(); i++) {
     serial_dcb[i].devno = i;
+    serial_dcb[i].int_core = 0;
     serial_dcb[i].rx_ready = COND_INIT;
+    serial_dcb[i].tx_space = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].tx_head = serial_dcb[i].tx_count = 0;
+  }
+
+  /* Initialize the block devices */
+  for(uint i=0; i<bios_disks(); i++) {
+    block_dcb[i].devno = i;
+    block_dcb[i].spinlock = MUTEX_INIT;
+    rlnode_init(&block_dcb[i].queue, NULL);
+    block_dcb[i].inflight = 0;
   }
+}
 
+
+void initialize_device_interrupts()
+{
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
   cpu_interrupt_handler(SERIAL_TX_READY, serial_tx_handler);
+  cpu_interrupt_handler(DISK, disk_handler);
 }
 
 
@@ -92,6 +92,15 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+    /** @brief Seek operation.
+
+      Move the offset of stream 'this', as in @c Seek(). This method
+      is optional; streams which are not seekable (e.g., devices and pipes)
+      leave it NULL.
+      The function returns the new offset, or -1 on error.
+     */
+    intptr_t (*Seek)(void* this, intptr_t offset, int whence);
 } file_ops;
 
 
@@ -136,6 +145,14 @@ typedef struct device_control_block
  */
 void initialize_devices();
 
+/** 
+  @brief Install the device interrupt handlers on the current core.
+
+  This function is called at kernel startup by every core, since
+  device interrupts may be routed to any core.
+ */
+void initialize_device_interrupts();
+
 
 /**
   @brief Open a device.
@@ -156,6 +173,26 @@ int device_open(Device_type major, uint minor, void** obj, file_ops** ops);
   */
 uint device_no(Device_type major);
 
+/**
+  @brief Transfer sectors between memory and a disk.
+
+  Read or write @c count sectors of disk @c disk, starting at @c sector,
+  from or to @c buf, blocking the current thread until the transfer is done.
+  The block driver may merge the transfer with concurrent transfers of 
+  adjacent sectors, into one disk request.
+
+  This must be called with the kernel lock held, which is released 
+  during the transfer.
+
+  @param disk the disk
+  @param write non-zero to write, zero to read
+  @param sector the first sector
+  @param count the number of sectors
+  @param buf the memory of the transfer, of @c count*DISK_SECTOR_SIZE bytes
+  @returns 0 on success, or -1 on error
+  */
+int blk_transfer(uint disk, int write, uint64_t sector, uint count, void* buf);
+
 /** @} */
 
 #endif
@@ -0,0 +1,811 @@
+
+#include <string.h>
+#include <limits.h>
+
+#include "kernel_fs.h"
+#include "kernel_streams.h"
+#include "kernel_dev.h"
+#include "kernel_cc.h"
+#include "kernel_lfs.h"
+#include "kernel_shm.h"
+#include "kernel_proc.h"
+
+
+/* The root directory */
+static inode* fs_root;
+
+/* The mounted file systems */
+static rlnode mount_list;
+
+
+/*
+	The page index
+ */
+
+static void** radix_node_new()
+{
+	void** node = xmalloc(RADIX_SLOTS*sizeof(void*));
+	memset(node, 0, RADIX_SLOTS*sizeof(void*));
+	return node;
+}
+
+/* Return the slot of page 'idx' in the tree, growing the tree (and adding
+   missing nodes) if 'alloc' is true. Without 'alloc', NULL is returned if
+   the tree has no slot for 'idx'. */
+static void** radix_slot(radix_tree* t, uintptr_t idx, int alloc)
+{
+	/* Grow the tree upwards until it covers idx */
+	while((idx >> (RADIX_BITS*t->height)) != 0) {
+		if(! alloc) return NULL;
+		if(t->root) {
+			void** node = radix_node_new();
+			node[0] = t->root;
+			t->root = node;
+		}
+		t->height++;
+	}
+
+	/* Descend to the slot */
+	void** slot = &t->root;
+	for(uint level = t->height; level > 0; level--) {
+		if(*slot == NULL) {
+			if(! alloc) return NULL;
+			*slot = radix_node_new();
+		}
+		void** node = *slot;
+		slot = &node[(idx >> (RADIX_BITS*(level-1))) & (RADIX_SLOTS-1)];
+	}
+	return slot;
+}
+
+/* Free a subtree, except for the pages which belong to region 'keep' */
+static void radix_free(void* node, uint level, shm_region* keep)
+{
+	if(level > 0) {
+		for(int i=0; i<RADIX_SLOTS; i++)
+			if(((void**)node)[i]) radix_free(((void**)node)[i], level-1, keep);
+		free(node);
+	}
+	else if(keep == NULL || (char*)node < (char*)keep->addr 
+			|| (char*)node >= (char*)keep->addr + keep->size)
+		free(node);
+}
+
+static void radix_clear(radix_tree* t, shm_region* keep)
+{
+	if(t->root) radix_free(t->root, t->height, keep);
+	t->root = NULL;
+	t->height = 0;
+}
+
+
+void* inode_page(inode* ino, uintptr_t pgno, int alloc)
+{
+	void** slot = radix_slot(&ino->pages, pgno, alloc);
+	if(slot == NULL) return NULL;
+	if(*slot == NULL && alloc) {
+		*slot = xmalloc(FS_PAGE_SIZE);
+		memset(*slot, 0, FS_PAGE_SIZE);
+		ino->npages++;
+	}
+	return *slot;
+}
+
+
+
+/*
+	Inodes
+ */
+
+void inode_ref(inode* ino)
+{
+	ino->refcount++;
+}
+
+void inode_unref(inode* ino)
+{
+	assert(ino->refcount > 0);
+	if(--ino->refcount == 0)
+		ino->ops->Release(ino);
+}
+
+
+void mount_lock(mount* m)
+{
+	m->users++;
+	while(m->busy)
+		kernel_wait(&m->unlocked, SCHED_IO);
+	m->busy = 1;
+}
+
+void mount_unlock(mount* m)
+{
+	m->busy = 0;
+	m->users--;
+	kernel_broadcast(&m->unlocked);
+}
+
+/* Lock the file system of an inode, if it is mounted */
+static inline void fs_enter(inode* ino)
+{
+	if(ino->mnt) mount_lock(ino->mnt);
+}
+
+static inline void fs_leave(inode* ino)
+{
+	if(ino->mnt) mount_unlock(ino->mnt);
+}
+
+
+
+/*
+	The memory tree
+ */
+
+static const fs_ops ram_ops;
+
+static inode* inode_new(Fse_type type)
+{
+	inode* ino = xmalloc(sizeof(inode));
+	ino->type = type;
+	ino->nlink = 0;
+	ino->refcount = 0;
+	ino->size = 0;
+	ino->npages = 0;
+	ino->ops = &ram_ops;
+	ino->mnt = NULL;
+	ino->mounted = NULL;
+	ino->pages.root = NULL;
+	ino->pages.height = 0;
+	ino->mapping = NULL;
+	rlnode_init(&ino->entries, NULL);
+	ino->parent = NULL;
+	return ino;
+}
+
+static dir_entry* dir_find(inode* dir, const char* name)
+{
+	for(rlnode* p = dir->entries.next; p != &dir->entries; p = p->next) {
+		dir_entry* e = p->obj;
+		if(strcmp(e->name, name) == 0) return e;
+	}
+	return NULL;
+}
+
+static void dir_unlink(inode* dir, dir_entry* e)
+{
+	rlist_remove(&e->node);
+	dir->size--;
+	e->ino->nlink--;
+	free(e);
+}
+
+static inode* ram_lookup(inode* dir, const char* name)
+{
+	dir_entry* e = dir_find(dir, name);
+	if(e == NULL) return NULL;
+	inode_ref(e->ino);
+	return e->ino;
+}
+
+static inode* ram_create(inode* dir, const char* name, Fse_type type)
+{
+	inode* ino = inode_new(type);
+	if(type == FSE_DIR) ino->parent = dir;
+
+	dir_entry* e = xmalloc(sizeof(dir_entry));
+	strcpy(e->name, name);
+	e->ino = ino;
+	rlnode_init(&e->node, e);
+	rlist_push_back(&dir->entries, &e->node);
+	dir->size++;
+	ino->nlink++;
+
+	inode_ref(ino);
+	return ino;
+}
+
+static void ram_unlink(inode* dir, const char* name, inode* ino)
+{
+	dir_unlink(dir, dir_find(dir, name));
+}
+
+static int ram_direntry(inode* dir, intptr_t index, char* name)
+{
+	for(rlnode* p = dir->entries.next; p != &dir->entries; p = p->next)
+		if(index-- == 0) {
+			strcpy(name, ((dir_entry*)p->obj)->name);
+			return 0;
+		}
+	return -1;
+}
+
+static inode* ram_parent(inode* dir)
+{
+	inode_ref(dir->parent);
+	return dir->parent;
+}
+
+/* Release the pages of a file. The pages of a mapping are released with
+   the mapping, when it is no longer attached. */
+static void ram_free_pages(inode* ino)
+{
+	radix_clear(&ino->pages, ino->mapping);
+	if(ino->mapping) {
+		shm_unref(ino->mapping);
+		ino->mapping = NULL;
+	}
+}
+
+/* The pages of a mapping stay the storage of the file, zeroed, since 
+   processes may still have it attached */
+static void ram_truncate(inode* ino)
+{
+	shm_region* r = ino->mapping;
+	radix_clear(&ino->pages, r);
+	ino->npages = 0;
+	ino->size = 0;
+	if(r) {
+		memset(r->addr, 0, r->size);
+		for(uintptr_t pg = 0; pg < r->size / FS_PAGE_SIZE; pg++)
+			*radix_slot(&ino->pages, pg, 1) = (char*)r->addr + pg*FS_PAGE_SIZE;
+		ino->npages = r->size / FS_PAGE_SIZE;
+	}
+}
+
+/* Free the inode if it is no longer named */
+static void ram_release(inode* ino)
+{
+	if(ino->nlink == 0) {
+		ram_free_pages(ino);
+		free(ino);
+	}
+}
+
+static const fs_ops ram_ops = {
+	.Lookup = ram_lookup,
+	.Create = ram_create,
+	.Unlink = ram_unlink,
+	.DirEntry = ram_direntry,
+	.Parent = ram_parent,
+	.Page = inode_page,
+	.Truncate = ram_truncate,
+	.Release = ram_release
+};
+
+
+
+/*
+	Path names
+ */
+
+/* The result of a path lookup */
+typedef struct fs_path {
+	inode* dir;			/* The directory of the last component, or NULL */
+	inode* ino;			/* The inode named by the path, or NULL */
+	mount* locked;		/* The mount whose lock is held, or NULL */
+	char name[MAX_NAME_LENGTH+1];	/* The last component */
+} fs_path;
+
+/* Release the inodes and the lock held by a path */
+static void fs_path_release(fs_path* p)
+{
+	if(p->dir) inode_unref(p->dir);
+	if(p->ino) inode_unref(p->ino);
+	if(p->locked) mount_unlock(p->locked);
+	p->dir = p->ino = NULL;
+	p->locked = NULL;
+}
+
+/*
+	Resolve a path name.
+
+	On success, 0 is returned, 'p->ino' is the inode named by the path (or 
+	NULL if the last component of the path does not exist), and, if the last
+	component is a name (i.e., not "/", "." or ".."), 'p->dir' is the
+	directory containing it and 'p->name' holds the name. Otherwise, 
+	'p->dir' is NULL. The inodes returned are referenced, and the lock
+	of their mount (if any) is held, until @c fs_path_release is called.
+
+	On failure (an invalid path, or an intermediate component which is
+	missing or is not a directory) -1 is returned.
+ */
+static int fs_lookup(const char* path, fs_path* p)
+{
+	p->dir = p->ino = NULL;
+	p->locked = NULL;
+	if(path == NULL || strnlen(path, MAX_PATHNAME+1) > MAX_PATHNAME) return -1;
+
+	inode* cur = fs_root;
+	inode_ref(cur);
+	while(1) {
+		while(*path == '/') path++;
+		if(*path == '\0') break;
+
+		const char* e = path;
+		while(*e && *e != '/') e++;
+		size_t n = e - path;
+
+		if(n > MAX_NAME_LENGTH || cur == NULL || cur->type != FSE_DIR) 
+			goto fail;
+
+		if(p->dir) inode_unref(p->dir);
+		p->dir = NULL;
+
+		if(n == 1 && path[0] == '.') {
+			/* stay */
+		} else if(n == 2 && path[0] == '.' && path[1] == '.') {
+			inode* next;
+			if(cur->mnt && cur == cur->mnt->root) {
+				/* Leave a mounted file system */
+				next = cur->mnt->covered->parent;
+				inode_ref(next);
+				inode_unref(cur);
+				mount_unlock(p->locked);
+				p->locked = NULL;
+			} else {
+				next = cur->ops->Parent(cur);
+				inode_unref(cur);
+			}
+			cur = next;
+		} else {
+			memcpy(p->name, path, n);
+			p->name[n] = '\0';
+			p->dir = cur;
+			cur = cur->ops->Lookup(cur, p->name);
+			if(cur && cur->mounted) {
+				/* Enter a mounted file system */
+				mount* m = cur->mounted;
+				mount_lock(m);
+				p->locked = m;
+				inode_unref(cur);
+				cur = m->root;
+				inode_ref(cur);
+			}
+		}
+		path = e;
+	}
+
+	p->ino = cur;
+	return 0;
+
+fail:
+	if(cur) inode_unref(cur);
+	fs_path_release(p);
+	return -1;
+}
+
+
+
+/*
+	File streams
+ */
+
+typedef struct file_stream {
+	inode* ino;
+	intptr_t pos;
+	int flags;
+} file_stream;
+
+
+/* Directories read as the list of their entries, one per line */
+static int dir_read(file_stream* f, char* buf, unsigned int size)
+{
+	intptr_t off = 0;
+	unsigned int count = 0;
+	inode* dir = f->ino;
+	char name[MAX_NAME_LENGTH+1];
+	for(intptr_t index = 0; count < size; index++) {
+		if(dir->ops->DirEntry(dir, index, name)) break;
+		size_t len = strlen(name);
+		for(size_t i=0; i <= len && count < size; i++, off++)
+			if(off >= f->pos)
+				buf[count++] = (i<len) ? name[i] : '\n';
+	}
+	f->pos += count;
+	return count;
+}
+
+static int file_read(void* this, char* buf, unsigned int size)
+{
+	file_stream* f = this;
+	if(! (f->flags & OPEN_RDONLY)) return -1;
+
+	inode* ino = f->ino;
+	fs_enter(ino);
+	if(ino->type == FSE_DIR) {
+		int ret = dir_read(f, buf, size);
+		fs_leave(ino);
+		return ret;
+	}
+
+	if(size > INT_MAX) size = INT_MAX;
+	if(f->pos >= ino->size) 
+		size = 0;
+	else if(size > ino->size - f->pos) 
+		size = ino->size - f->pos;
+
+	unsigned int done = 0;
+	while(done < size) {
+		uintptr_t off = f->pos % FS_PAGE_SIZE;
+		unsigned int chunk = FS_PAGE_SIZE - off;
+		if(chunk > size - done) chunk = size - done;
+
+		char* page = ino->ops->Page(ino, f->pos / FS_PAGE_SIZE, 0);
+		if(page)
+			memcpy(buf+done, page+off, chunk);
+		else
+			memset(buf+done, 0, chunk);
+
+		done += chunk;
+		f->pos += chunk;
+	}
+	fs_leave(ino);
+	return done;
+}
+
+static int file_write(void* this, const char* buf, unsigned int size)
+{
+	file_stream* f = this;
+	if(! (f->flags & OPEN_WRONLY)) return -1;
+
+	inode* ino = f->ino;
+	fs_enter(ino);
+	if(f->flags & OPEN_APPEND) f->pos = ino->size;
+	if(size > INT_MAX) size = INT_MAX;
+	if(f->pos > INTPTR_MAX - (intptr_t)size) {
+		fs_leave(ino);
+		return -1;
+	}
+
+	/* The size is updated after each page, since fetching a page of a
+	   mounted file may write back the inode */
+	unsigned int done = 0;
+	while(done < size) {
+		uintptr_t off = f->pos % FS_PAGE_SIZE;
+		unsigned int chunk = FS_PAGE_SIZE - off;
+		if(chunk > size - done) chunk = size - done;
+
+		char* page = ino->ops->Page(ino, f->pos / FS_PAGE_SIZE, 1);
+		if(page == NULL) break;
+		memcpy(page+off, buf+done, chunk);
+
+		done += chunk;
+		f->pos += chunk;
+		if(f->pos > ino->size) ino->size = f->pos;
+	}
+	fs_leave(ino);
+	return (done > 0 || size == 0) ? (int)done : -1;
+}
+
+static intptr_t file_seek(void* this, intptr_t offset, int whence)
+{
+	file_stream* f = this;
+	intptr_t base;
+	switch(whence) {
+		case SEEK_SET: base = 0; break;
+		case SEEK_CUR: base = f->pos; break;
+		case SEEK_END: base = f->ino->size; break;
+		default: return -1;
+	}
+	if(offset < -base || (offset > 0 && base > INTPTR_MAX - offset)) return -1;
+	f->pos = base + offset;
+	return f->pos;
+}
+
+static int file_close(void* this)
+{
+	file_stream* f = this;
+	inode* ino = f->ino;
+	mount* m = ino->mnt;
+	if(m) mount_lock(m);
+	inode_unref(ino);
+	if(m) mount_unlock(m);
+	free(f);
+	return 0;
+}
+
+static file_ops file_fops = {
+	.Read = file_read,
+	.Write = file_write,
+	.Close = file_close,
+	.Seek = file_seek
+};
+
+
+
+/*
+	System calls
+ */
+
+Fid_t sys_Open(const char* pathname, int flags)
+{
+	fs_path p;
+	Fid_t fid = NOFILE;
+	FCB* fcb;
+
+	if((flags & OPEN_RDWR) == 0) return NOFILE;
+	if(fs_lookup(pathname, &p)) return NOFILE;
+
+	/* Reserve the fid first, so that a full table leaves no new entry behind */
+	if(! FCB_reserve(1, &fid, &fcb)) {
+		fid = NOFILE;
+		goto done;
+	}
+
+	if(p.ino == NULL) {
+		if(! (flags & OPEN_CREAT) || p.dir == NULL) goto fail;
+		p.ino = p.dir->ops->Create(p.dir, p.name, FSE_FILE);
+		if(p.ino == NULL) goto fail;
+	}
+	else if((flags & OPEN_CREAT) && (flags & OPEN_EXCL))
+		goto fail;
+
+	if(p.ino->type == FSE_DIR && (flags & OPEN_WRONLY)) goto fail;
+
+	if(p.ino->type == FSE_FILE && (flags & OPEN_TRUNC) && (flags & OPEN_WRONLY))
+		p.ino->ops->Truncate(p.ino);
+
+	file_stream* f = xmalloc(sizeof(file_stream));
+	f->ino = p.ino;
+	f->pos = 0;
+	f->flags = flags;
+	inode_ref(p.ino);
+
+	fcb->streamobj = f;
+	fcb->streamfunc = &file_fops;
+	goto done;
+
+fail:
+	FCB_unreserve(1, &fid, &fcb);
+	fid = NOFILE;
+done:
+	fs_path_release(&p);
+	return fid;
+}
+
+
+int sys_Stat(const char* pathname, file_stat* statbuf)
+{
+	fs_path p;
+	int ret = -1;
+
+	if(fs_lookup(pathname, &p)) return -1;
+	if(p.ino) {
+		statbuf->type = p.ino->type;
+		statbuf->nlink = p.ino->nlink;
+		statbuf->size = p.ino->size;
+		statbuf->pages = p.ino->npages;
+		ret = 0;
+	}
+	fs_path_release(&p);
+	return ret;
+}
+
+
+int sys_Unlink(const char* pathname)
+{
+	fs_path p;
+	int ret = -1;
+
+	if(fs_lookup(pathname, &p)) return -1;
+
+	/* Mount points and the roots of mounted file systems are busy */
+	if(p.ino && p.dir && p.dir->mnt == p.ino->mnt && p.ino->mounted == NULL
+		&& !(p.ino->type == FSE_DIR && p.ino->size > 0)) {
+		p.dir->ops->Unlink(p.dir, p.name, p.ino);
+		ret = 0;
+	}
+	fs_path_release(&p);
+	return ret;
+}
+
+
+int sys_MkDir(const char* pathname)
+{
+	fs_path p;
+	int ret = -1;
+
+	if(fs_lookup(pathname, &p)) return -1;
+	if(p.ino == NULL && p.dir != NULL) {
+		p.ino = p.dir->ops->Create(p.dir, p.name, FSE_DIR);
+		if(p.ino) ret = 0;
+	}
+	fs_path_release(&p);
+	return ret;
+}
+
+
+_Static_assert(SHM_PAGE_SIZE % FS_PAGE_SIZE == 0, "mappings must hold whole pages");
+
+void* sys_MapFile(Fid_t fd, size_t length)
+{
+	FCB* fcb = get_fcb(fd);
+	if(fcb == NULL || fcb->streamfunc != &file_fops || length == 0) return NULL;
+
+	/* Only files of the memory tree, open for reading and writing */
+	file_stream* f = fcb->streamobj;
+	inode* ino = f->ino;
+	if(ino->type != FSE_FILE || ino->mnt || (f->flags & OPEN_RDWR) != OPEN_RDWR)
+		return NULL;
+
+	if(ino->mapping == NULL) {
+		shm_region* r = shm_new(length);
+		if(r == NULL) return NULL;
+
+		/* Move the pages of the file into the region, which becomes their storage */
+		for(uintptr_t pg = 0; pg < r->size / FS_PAGE_SIZE; pg++) {
+			void** slot = radix_slot(&ino->pages, pg, 1);
+			void* page = (char*)r->addr + pg*FS_PAGE_SIZE;
+			if(*slot) {
+				memcpy(page, *slot, FS_PAGE_SIZE);
+				free(*slot);
+			} else
+				ino->npages++;
+			*slot = page;
+		}
+		ino->mapping = r;
+	}
+	else if(length > ino->mapping->size)
+		return NULL;
+
+	return shm_attach(CURPROC, ino->mapping);
+}
+
+
+static mount* mount_of_disk(uint diskno)
+{
+	for(rlnode* p = mount_list.next; p != &mount_list; p = p->next)
+		if(((mount*)p->obj)->disk == diskno) return p->obj;
+	return NULL;
+}
+
+
+int sys_Format(unsigned int diskno)
+{
+	if(diskno >= bios_disks() || mount_of_disk(diskno)) return -1;
+	return lfs_format(diskno);
+}
+
+
+int sys_Mount(unsigned int diskno, const char* mpoint)
+{
+	fs_path p;
+	int ret = -1;
+
+	if(diskno >= bios_disks() || mount_of_disk(diskno)) return -1;
+	if(fs_lookup(mpoint, &p)) return -1;
+
+	/* Only empty directories of the memory tree, except the root */
+	inode* dir = p.ino;
+	if(dir == NULL || dir == fs_root || dir->mnt || dir->type != FSE_DIR 
+		|| dir->size > 0 || dir->mounted)
+		goto done;
+
+	mount* m = lfs_mount(diskno);
+	if(m == NULL) goto done;
+
+	/* Check again, as the kernel lock was released during disk I/O */
+	if(dir->size > 0 || dir->mounted || dir->nlink == 0 || mount_of_disk(diskno)) {
+		lfs_halt(m);
+		lfs_free(m);
+		goto done;
+	}
+
+	m->covered = dir;
+	inode_ref(dir);
+	dir->mounted = m;
+	rlist_push_back(&mount_list, &m->node);
+	ret = 0;
+
+done:
+	fs_path_release(&p);
+	return ret;
+}
+
+
+int sys_Unmount(const char* mpoint)
+{
+	fs_path p;
+
+	if(fs_lookup(mpoint, &p)) return -1;
+
+	/* The path must name the root of a mounted file system, which is not
+	   used by anyone else */
+	mount* m = p.locked;
+	if(m == NULL || p.ino != m->root || m->users > 1 || lfs_busy(m)) {
+		fs_path_release(&p);
+		return -1;
+	}
+
+	/* Lookups must not enter the mount while it is written back, since the
+	   kernel lock is released during disk I/O */
+	inode* covered = m->covered;
+	covered->mounted = NULL;
+	int ret = lfs_unmount(m);
+	rlist_remove(&m->node);
+	fs_path_release(&p);
+
+	/* A Sync may have pinned the mount before it left the list */
+	while(m->users > 0)
+		kernel_wait(&m->unlocked, SCHED_IO);
+
+	inode_unref(covered);
+	lfs_free(m);
+	return ret;
+}
+
+
+int sys_Sync()
+{
+	int ret = 0;
+
+	/* Pin the mounts, since syncing sleeps */
+	size_t n = rlist_len(&mount_list);
+	mount* mounts[n+1];
+	n = 0;
+	for(rlnode* p = mount_list.next; p != &mount_list; p = p->next) {
+		mounts[n] = p->obj;
+		mounts[n++]->users++;
+	}
+
+	for(size_t i=0; i<n; i++) {
+		mount_lock(mounts[i]);
+		if(lfs_sync(mounts[i])) ret = -1;
+		mount_unlock(mounts[i]);
+
+		/* Unmount waits for the mount to be unpinned */
+		mounts[i]->users--;
+		kernel_broadcast(&mounts[i]->unlocked);
+	}
+	return ret;
+}
+
+
+
+/*
+	Initialization
+ */
+
+void initialize_filesys()
+{
+	fs_root = inode_new(FSE_DIR);
+	fs_root->parent = fs_root;
+	fs_root->nlink = 1;
+	fs_root->refcount = 1;
+	rlnode_init(&mount_list, NULL);
+}
+
+
+void halt_filesys()
+{
+	for(rlnode* p = mount_list.next; p != &mount_list; p = p->next)
+		lfs_halt(p->obj);
+}
+
+
+static void fs_free_tree(inode* dir)
+{
+	if(dir->mounted) {
+		mount* m = dir->mounted;
+		rlist_remove(&m->node);
+		lfs_free(m);
+		dir->mounted = NULL;
+		dir->refcount--;
+	}
+	while(! is_rlist_empty(&dir->entries)) {
+		dir_entry* e = dir->entries.next->obj;
+		inode* ino = e->ino;
+		if(ino->type == FSE_DIR) fs_free_tree(ino);
+		dir_unlink(dir, e);
+		if(ino->refcount == 0) ram_release(ino);
+	}
+}
+
+void finalize_filesys()
+{
+	fs_free_tree(fs_root);
+	radix_clear(&fs_root->pages, NULL);
+	free(fs_root);
+	fs_root = NULL;
+}
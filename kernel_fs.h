@@ -0,0 +1,187 @@
+#ifndef __KERNEL_FS_H
+#define __KERNEL_FS_H
+
+#include "tinyos.h"
+#include "util.h"
+
+/**
+	@file kernel_fs.h
+	@brief The file system.
+
+	@defgroup filesys File system.
+	@ingroup kernel
+	@brief The file system.
+
+	The file system of tinyos is a tree of directories and files. Every
+	file system entry is described by an @ref inode.
+
+	The tree is held in memory. A directory holds a list of named entries,
+	each pointing to an inode. The data of a file are stored in pages of
+	@ref FS_PAGE_SIZE bytes, indexed by a radix tree. Pages are allocated
+	when they are first written, so that sparse files take storage only
+	for the data written to them, and growing a file never moves existing
+	data.
+
+	A file system stored on a disk can be mounted on an (empty) directory
+	of the memory tree, hiding it. The inodes of a mounted file system
+	are accessed through a @ref fs_ops table, provided by its
+	implementation (see @ref lfs). The memory tree has its own table.
+
+	The memory tree is protected by the kernel lock, like the rest of the
+	kernel state. A mounted file system is also protected by the sleeping
+	lock of its @ref mount, since its operations block on disk I/O, which
+	releases the kernel lock.
+
+	@{
+*/
+
+/** @brief The size of the storage pages of files. */
+#define FS_PAGE_SIZE 4096
+
+/** @brief log2 of the fan-out of the nodes of the page index. */
+#define RADIX_BITS 6
+
+/** @brief The fan-out of the nodes of the page index. */
+#define RADIX_SLOTS (1<<RADIX_BITS)
+
+/** @brief A radix tree mapping page numbers to pages.
+
+	A tree of height @c h maps page numbers in the range
+	[0, RADIX_SLOTS^h). A tree of height 0 maps only page 0,
+	held directly in @c root. Missing subtrees are NULL.
+ */
+typedef struct radix_tree {
+	void* root;			/**< @brief The root node, or page 0 if height==0 */
+	uint height;		/**< @brief The number of levels of interior nodes */
+} radix_tree;
+
+
+struct fs_ops;
+struct mount;
+struct shm_region;
+
+
+/** @brief A file system entry. */
+typedef struct inode {
+	Fse_type type;			/**< @brief File or directory */
+	uint nlink;				/**< @brief Number of directory entries naming this inode */
+	uint refcount;			/**< @brief Number of streams (and other users) of this inode */
+	intptr_t size;			/**< @brief File: size in bytes, directory: number of entries */
+	unsigned long npages;	/**< @brief File: the number of pages allocated */
+
+	const struct fs_ops* ops;	/**< @brief The operations of the file system of the inode */
+	struct mount* mnt;		/**< @brief The mounted file system of the inode, or NULL */
+	struct mount* mounted;	/**< @brief A file system mounted on this directory, or NULL */
+
+	radix_tree pages;		/**< @brief Memory file: the page index */
+	struct shm_region* mapping;	/**< @brief Memory file: the region holding its first pages, if mapped */
+	rlnode entries;			/**< @brief Memory directory: the list of @ref dir_entry */
+	struct inode* parent;	/**< @brief Memory directory: the parent directory */
+} inode;
+
+
+/** @brief A named entry of a directory of the memory tree. */
+typedef struct dir_entry {
+	char name[MAX_NAME_LENGTH+1];	/**< @brief The name of the entry */
+	inode* ino;						/**< @brief The inode named */
+	rlnode node;					/**< @brief Node in the list of the directory */
+} dir_entry;
+
+
+/** @brief The operations of a file system on its inodes.
+
+	The inodes returned by @c Lookup, @c Create and @c Parent have been
+	referenced (their @c refcount increased); they are released with
+	@ref inode_unref. All operations are called with the kernel lock held,
+	and, for a mounted file system, its @ref mount lock.
+ */
+typedef struct fs_ops {
+	/** @brief Return the entry @c name of directory @c dir, or NULL */
+	inode* (*Lookup)(inode* dir, const char* name);
+
+	/** @brief Create a new entry @c name in @c dir, returning NULL if out of space */
+	inode* (*Create)(inode* dir, const char* name, Fse_type type);
+
+	/** @brief Remove the entry @c name of @c dir, which names @c ino */
+	void (*Unlink)(inode* dir, const char* name, inode* ino);
+
+	/** @brief Copy the name of entry @c index of @c dir, returning -1 past the end */
+	int (*DirEntry)(inode* dir, intptr_t index, char* name);
+
+	/** @brief Return the parent of directory @c dir */
+	inode* (*Parent)(inode* dir);
+
+	/** @brief Return page @c pgno of a file, for reading or writing.
+
+		For reading, NULL is returned for a hole. For writing, a missing page
+		is allocated, filled with zeros; NULL is returned if this is not possible.
+	  */
+	void* (*Page)(inode* ino, uintptr_t pgno, int write);
+
+	/** @brief Release all pages of a file and make its size 0 */
+	void (*Truncate)(inode* ino);
+
+	/** @brief Called when the reference count of an inode drops to 0 */
+	void (*Release)(inode* ino);
+} fs_ops;
+
+
+/** @brief A file system mounted on a directory of the memory tree. */
+typedef struct mount {
+	inode* root;			/**< @brief The root directory of the file system */
+	inode* covered;			/**< @brief The memory directory it is mounted on */
+	uint disk;				/**< @brief The disk of the file system */
+	void* fs;				/**< @brief The implementation data */
+
+	int busy;				/**< @brief The mount lock is held */
+	uint users;				/**< @brief The threads holding or waiting for the lock */
+	CondVar unlocked;		/**< @brief Signalled when the lock is released */
+	rlnode node;			/**< @brief Node in the list of mounts */
+} mount;
+
+
+/** @brief Acquire the lock of a mount, sleeping while it is held. */
+void mount_lock(mount* m);
+
+/** @brief Release the lock of a mount. */
+void mount_unlock(mount* m);
+
+
+/** @brief Increase the reference count of an inode. */
+void inode_ref(inode* ino);
+
+/** @brief Decrease the reference count of an inode, releasing it at 0. */
+void inode_unref(inode* ino);
+
+
+/** @brief Return the page of a memory file holding page number @c pgno.
+
+	If the page has not been written, NULL is returned, unless @c alloc
+	is true, in which case a new zero-filled page is added to the file.
+	Note that this does not change the size of the file.
+ */
+void* inode_page(inode* ino, uintptr_t pgno, int alloc);
+
+
+/** @brief Initialize the file system, with an empty root directory.
+
+	This is called at kernel boot.
+*/
+void initialize_filesys();
+
+/** @brief Stop the activity of mounted file systems, without syncing them.
+
+	This is called when the init process exits. Like a power-off,
+	any changes not synced are lost.
+*/
+void halt_filesys();
+
+/** @brief Release all storage held by the file system.
+
+	This is called at kernel shutdown.
+*/
+void finalize_filesys();
+
+/** @} */
+
+#endif
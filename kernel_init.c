@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_fs.h"
 
 
 
@@ -32,12 +33,15 @@ static struct {
 /* Per-core boot function for tinyos */
 void boot_tinyos_kernel()
 {
+  /* Device interrupts can be routed to any core */
+  initialize_device_interrupts();
 
   if(cpu_core_id==0) {
     /* Initialize the kenrel data structures */
     initialize_processes();
     initialize_devices();
     initialize_files();
+    initialize_filesys();
     initialize_scheduler();
 
     /* The boot task is executed normally! */
@@ -54,7 +58,11 @@ void boot_tinyos_kernel()
   run_scheduler();
 
   if(cpu_core_id==0) {
-    /* Here, we could add cleanup after the scheduler has ended. */    
+    /* Cleanup after the scheduler has ended. */
+    finalize_filesys();
+#if defined(SCHED_STATISTICS)
+    print_sched_statistics();
+#endif
   }
 }
 
@@ -0,0 +1,1220 @@
+
+#include <string.h>
+
+#include "kernel_lfs.h"
+#include "kernel_dev.h"
+#include "kernel_cc.h"
+#include "kernel_sched.h"
+#include "kernel_proc.h"
+
+
+/*
+	Disk layout
+ */
+
+#define LFS_BLOCK_SIZE FS_PAGE_SIZE
+#define LFS_BLOCK_SECTORS (LFS_BLOCK_SIZE/DISK_SECTOR_SIZE)
+#define LFS_MAGIC 0x3153464c			/* "LFS1" */
+#define LFS_SUMMARY_MAGIC 0x4d4d5553	/* "SUMM" */
+
+#define LFS_CHECKPOINT 1			/* The first checkpoint slot */
+#define LFS_SEG_START 4				/* The first block of segment 0 */
+#define LFS_SEG_BLOCKS 64			/* The blocks of a segment (256 KB) */
+#define LFS_MAX_SEGS 1920			/* Bounded by the size of a checkpoint */
+
+#define LFS_MAX_INODES 16384
+#define LFS_ROOT_INO 1
+#define LFS_IMAP_ENTRIES (LFS_BLOCK_SIZE/sizeof(uint32_t))
+#define LFS_IMAP_BLOCKS (LFS_MAX_INODES/LFS_IMAP_ENTRIES)
+
+#define LFS_INODE_SIZE 128
+#define LFS_INODE_SHIFT 5
+#define LFS_INODES_PER_BLOCK (1<<LFS_INODE_SHIFT)
+#define LFS_IMAP_PENDING 1			/* A new inode, not yet written */
+
+#define LFS_NDIRECT 24
+#define LFS_PTRS (LFS_BLOCK_SIZE/sizeof(uint32_t))
+#define LFS_MAX_BLOCKS (LFS_NDIRECT + LFS_PTRS + LFS_PTRS*LFS_PTRS)
+
+/* The block numbers of the indirect blocks of a file, in summaries and
+   in the buffer cache */
+#define LBN_IND (-1)
+#define LBN_DIND (-2)
+#define LBN_DIND_CHILD(k) (-3-(int32_t)(k))
+
+/* In summaries, inode 0 owns the inode blocks and the inode map blocks
+   (whose lbn is their index). In the buffer cache, inode 0 owns the
+   inode blocks, with their address as lbn. */
+#define LBN_INODES (-1)
+
+/* Segment usage is counted in units of inodes: a block is worth
+   LFS_INODES_PER_BLOCK units */
+#define BLOCK_UNITS LFS_INODES_PER_BLOCK
+
+
+/*
+	Tunables
+ */
+
+#define LFS_CACHE_BLOCKS 1024		/* The buffer cache (4 MB) */
+#define LFS_DIRTY_MAX (LFS_CACHE_BLOCKS/4)	/* Write back beyond this */
+#define LFS_ICACHE_MAX 512			/* Unused inodes kept in memory */
+#define LFS_HASH 256
+#define LFS_RESERVE_SEGS 4			/* Free segments only the cleaner can use */
+#define LFS_CLEAN_LOW 8				/* Clean when free segments drop below */
+#define LFS_CLEAN_HIGH 16			/* Clean until this many are free */
+#define LFS_FLUSH_INTERVAL 500000	/* Write back dirty data this often (usec) */
+
+
+typedef struct lfs_super {
+	uint32_t magic;
+	uint32_t nsegs;
+	uint32_t seg_blocks;
+	uint32_t seg_start;
+} lfs_super;
+
+typedef struct lfs_checkpoint {
+	uint32_t magic;
+	uint32_t checksum;
+	uint64_t seq;
+	uint32_t head_seg;			/* The segment at the head of the log */
+	uint32_t head_off;			/* The blocks of it already written */
+	uint32_t imap_addr[LFS_IMAP_BLOCKS];
+	uint16_t usage[LFS_MAX_SEGS];	/* Live units per segment */
+} lfs_checkpoint;
+
+typedef struct lfs_dinode {
+	uint32_t ino;
+	uint16_t type;
+	uint16_t nlink;
+	uint64_t size;
+	uint32_t parent;
+	uint32_t blocks;
+	uint32_t direct[LFS_NDIRECT];
+	uint32_t indirect;
+	uint32_t dindirect;
+} lfs_dinode;
+
+typedef struct lfs_summary {
+	uint32_t magic;
+	uint32_t nblocks;
+	uint64_t seq;
+	struct { uint32_t ino; int32_t lbn; } entry[LFS_SEG_BLOCKS-1];
+} lfs_summary;
+
+typedef struct lfs_dirent {
+	uint32_t ino;
+	char name[MAX_NAME_LENGTH+1];
+} lfs_dirent;
+
+#define LFS_DIRENTS (LFS_BLOCK_SIZE/sizeof(lfs_dirent))
+
+_Static_assert(sizeof(lfs_dinode) == LFS_INODE_SIZE, "lfs_dinode must be 128 bytes");
+_Static_assert(sizeof(lfs_checkpoint) <= LFS_BLOCK_SIZE, "lfs_checkpoint must fit in a block");
+_Static_assert(sizeof(lfs_summary) <= LFS_BLOCK_SIZE, "lfs_summary must fit in a block");
+
+
+/*
+	Memory structures
+ */
+
+typedef struct lfs_buf {
+	uint32_t ino;			/* The owner */
+	int32_t lbn;			/* The block of the owner */
+	int valid;
+	int dirty;
+	int referenced;			/* The CLOCK bit */
+	uint pins;
+	char* data;
+	rlnode hnode;			/* In the hash chain */
+	rlnode dnode;			/* In the dirty list */
+} lfs_buf;
+
+typedef struct lfs_inode {
+	inode vfs;				/* The generic inode (must be first) */
+	lfs_dinode d;			/* The disk inode */
+	int dirty;
+	rlnode hnode;			/* In the hash chain */
+	rlnode dnode;			/* In the dirty list */
+	rlnode unode;			/* In the unused list */
+} lfs_inode;
+
+typedef struct lfs {
+	mount mnt;
+	uint nsegs;
+
+	lfs_checkpoint cp;		/* The state for the next checkpoint */
+	uint16_t cp_usage[LFS_MAX_SEGS];	/* The usage in the last checkpoint */
+	uint nfree;				/* Segments free both now and on disk */
+	uint32_t imap[LFS_MAX_INODES];
+	uint8_t imap_dirty[LFS_IMAP_BLOCKS];
+	uint32_t ino_hint;
+
+	/* Buffer cache */
+	lfs_buf bufs[LFS_CACHE_BLOCKS];
+	char* cache_mem;
+	uint hand;
+	rlnode bhash[LFS_HASH];
+	rlnode dirty;
+	uint ndirty;
+
+	/* Inode cache */
+	rlnode ihash[LFS_HASH];
+	rlnode idirty;
+	rlnode iunused;
+	uint nunused;
+
+	/* Segment writer */
+	char* seg;				/* The partial segment being assembled */
+	uint seg_count;			/* Its blocks, including the summary */
+	int flushing;
+	TimerDuration last_flush;
+
+	/* Cleaner */
+	char* segread;			/* The segment being cleaned */
+	char* scratch;			/* A block for inodes and checkpoints */
+	int stop;
+	int cleaner_exited;
+	CondVar cleaner_cv;
+	CondVar cleaner_exit_cv;
+	rlnode pending_node;	/* In the list of mounts waiting for a cleaner */
+} lfs;
+
+#define FS(m) ((lfs*)(m)->fs)
+#define LFS_INODE(i) ((lfs_inode*)(i))
+
+static const fs_ops lfs_ops;
+
+static inline uint32_t seg_block(uint seg) { return LFS_SEG_START + seg*LFS_SEG_BLOCKS; }
+static inline uint addr_seg(uint32_t addr) { return (addr - LFS_SEG_START) / LFS_SEG_BLOCKS; }
+static inline uint hash_key(uint32_t ino, int32_t lbn) { return (ino*31u + (uint32_t)lbn) % LFS_HASH; }
+
+
+static int lfs_io(lfs* fs, int write, uint32_t block, uint nblocks, void* buf)
+{
+	return blk_transfer(fs->mnt.disk, write, (uint64_t)block*LFS_BLOCK_SECTORS,
+		nblocks*LFS_BLOCK_SECTORS, buf);
+}
+
+static uint32_t checksum(const void* p, size_t n)
+{
+	/* FNV-1a */
+	const uint8_t* b = p;
+	uint32_t h = 2166136261u;
+	while(n--) { h ^= *b++; h *= 16777619u; }
+	return h;
+}
+
+static void usage_add(lfs* fs, uint32_t addr, uint units)
+{
+	fs->cp.usage[addr_seg(addr)] += units;
+}
+
+static void usage_sub(lfs* fs, uint32_t addr, uint units)
+{
+	if(addr < LFS_SEG_START) return;
+	uint16_t* u = &fs->cp.usage[addr_seg(addr)];
+	*u = (*u > units) ? *u - units : 0;
+}
+
+static void count_free(lfs* fs)
+{
+	fs->nfree = 0;
+	for(uint s=0; s<fs->nsegs; s++)
+		if(fs->cp.usage[s]==0 && fs->cp_usage[s]==0 && s != fs->cp.head_seg)
+			fs->nfree++;
+}
+
+static int lfs_flush(lfs* fs, int force);
+static void lfs_clean(lfs* fs, uint target);
+
+
+
+/*
+	Buffer cache
+ */
+
+static lfs_buf* buf_find(lfs* fs, uint32_t ino, int32_t lbn)
+{
+	rlnode* chain = &fs->bhash[hash_key(ino, lbn)];
+	for(rlnode* p = chain->next; p != chain; p = p->next) {
+		lfs_buf* b = p->obj;
+		if(b->ino == ino && b->lbn == lbn) return b;
+	}
+	return NULL;
+}
+
+static void buf_drop(lfs* fs, lfs_buf* b)
+{
+	assert(b->pins == 0);
+	if(b->dirty) {
+		rlist_remove(&b->dnode);
+		fs->ndirty--;
+		b->dirty = 0;
+	}
+	if(b->valid) rlist_remove(&b->hnode);
+	b->valid = 0;
+}
+
+static void buf_dirty(lfs* fs, lfs_buf* b)
+{
+	if(! b->dirty) {
+		b->dirty = 1;
+		rlist_push_back(&fs->dirty, &b->dnode);
+		fs->ndirty++;
+	}
+}
+
+/* Find a buffer to reuse, by the CLOCK algorithm. Dirty buffers are
+   written back if no clean one is found. */
+static lfs_buf* buf_alloc(lfs* fs)
+{
+	for(int round = 0; ; round++) {
+		for(uint i=0; i < 2*LFS_CACHE_BLOCKS; i++) {
+			lfs_buf* b = &fs->bufs[fs->hand];
+			fs->hand = (fs->hand + 1) % LFS_CACHE_BLOCKS;
+			if(b->pins || b->dirty) continue;
+			if(b->valid && b->referenced) { b->referenced = 0; continue; }
+			if(b->valid) buf_drop(fs, b);
+			return b;
+		}
+		if(round > 0 || fs->flushing)
+			FATAL("lfs: no buffer available");
+		lfs_flush(fs, 0);
+	}
+}
+
+enum { BUF_READ, BUF_CREATE };
+
+/* Return the block 'lbn' of 'ino', pinned. If it is not cached, it is read
+   from 'addr' or, if 'addr' is 0, a zero-filled block is returned for
+   BUF_CREATE and NULL for BUF_READ. */
+static lfs_buf* buf_get(lfs* fs, uint32_t ino, int32_t lbn, uint32_t addr, int mode)
+{
+	lfs_buf* b = buf_find(fs, ino, lbn);
+	if(b == NULL) {
+		if(addr == 0 && mode == BUF_READ) return NULL;
+		b = buf_alloc(fs);
+		b->ino = ino;
+		b->lbn = lbn;
+		b->valid = 1;
+		rlist_push_back(&fs->bhash[hash_key(ino, lbn)], &b->hnode);
+		b->pins = 1;
+		if(addr == 0 || lfs_io(fs, 0, addr, 1, b->data))
+			memset(b->data, 0, LFS_BLOCK_SIZE);
+	} else
+		b->pins++;
+	b->referenced = 1;
+	return b;
+}
+
+static inline void buf_put(lfs_buf* b)
+{
+	assert(b->pins > 0);
+	b->pins--;
+}
+
+/* Drop all cached blocks of an inode */
+static void buf_drop_inode(lfs* fs, uint32_t ino)
+{
+	for(uint i=0; i<LFS_CACHE_BLOCKS; i++)
+		if(fs->bufs[i].valid && fs->bufs[i].ino == ino)
+			buf_drop(fs, &fs->bufs[i]);
+}
+
+
+
+/*
+	Inodes
+ */
+
+static void inode_dirty(lfs* fs, lfs_inode* li)
+{
+	if(! li->dirty) {
+		li->dirty = 1;
+		rlist_push_back(&fs->idirty, &li->dnode);
+	}
+}
+
+static lfs_inode* icache_find(lfs* fs, uint32_t ino)
+{
+	rlnode* chain = &fs->ihash[ino % LFS_HASH];
+	for(rlnode* p = chain->next; p != chain; p = p->next)
+		if(((lfs_inode*)p->obj)->d.ino == ino) return p->obj;
+	return NULL;
+}
+
+static lfs_inode* inode_alloc(lfs* fs, lfs_dinode* d)
+{
+	lfs_inode* li = xmalloc(sizeof(lfs_inode));
+	li->d = *d;
+	li->vfs.type = d->type;
+	li->vfs.nlink = d->nlink;
+	li->vfs.refcount = 0;
+	li->vfs.size = d->size;
+	li->vfs.npages = d->blocks;
+	li->vfs.ops = &lfs_ops;
+	li->vfs.mnt = &fs->mnt;
+	li->vfs.mounted = NULL;
+	li->vfs.parent = NULL;
+	li->dirty = 0;
+	rlnode_init(&li->hnode, li);
+	rlnode_init(&li->dnode, li);
+	rlnode_init(&li->unode, li);
+	rlist_push_back(&fs->ihash[d->ino % LFS_HASH], &li->hnode);
+	return li;
+}
+
+static void inode_free(lfs* fs, lfs_inode* li)
+{
+	rlist_remove(&li->hnode);
+	if(li->dirty) rlist_remove(&li->dnode);
+	if(li->vfs.refcount == 0) {
+		rlist_remove(&li->unode);
+		fs->nunused--;
+	}
+	free(li);
+}
+
+/* Return inode 'ino', referenced, or NULL if it does not exist */
+static lfs_inode* lfs_iget(lfs* fs, uint32_t ino)
+{
+	if(ino == 0 || ino >= LFS_MAX_INODES) return NULL;
+
+	lfs_inode* li = icache_find(fs, ino);
+	if(li == NULL) {
+		uint32_t a = fs->imap[ino];
+		if(a == 0 || a == LFS_IMAP_PENDING) return NULL;
+
+		uint32_t block = a >> LFS_INODE_SHIFT;
+		lfs_buf* b = buf_get(fs, 0, block, block, BUF_READ);
+		lfs_dinode d = ((lfs_dinode*) b->data)[a & (LFS_INODES_PER_BLOCK-1)];
+		buf_put(b);
+
+		/* Check again, since the disk read may have slept */
+		li = icache_find(fs, ino);
+		if(li == NULL) {
+			li = inode_alloc(fs, &d);
+			fs->nunused++;
+			rlist_push_back(&fs->iunused, &li->unode);
+		}
+	}
+
+	if(li->vfs.refcount++ == 0) {
+		rlist_remove(&li->unode);
+		fs->nunused--;
+	}
+	return li;
+}
+
+/* Evict unused, clean inodes beyond the limit */
+static void icache_trim(lfs* fs)
+{
+	rlnode* p = fs->iunused.next;
+	while(fs->nunused > LFS_ICACHE_MAX && p != &fs->iunused) {
+		lfs_inode* li = p->obj;
+		p = p->next;
+		if(! li->dirty) inode_free(fs, li);
+	}
+}
+
+
+
+/*
+	Block maps
+ */
+
+/* Return the address of block 'lbn' of a file, as known to its inode
+   and indirect blocks (0 for a hole). For indirect blocks (lbn<0), return
+   their address in their parent. */
+static uint32_t bmap(lfs* fs, lfs_inode* li, int32_t lbn)
+{
+	uint32_t ino = li->d.ino;
+	lfs_buf* b;
+	uint32_t a = 0;
+
+	if(lbn == LBN_IND) return li->d.indirect;
+	if(lbn == LBN_DIND) return li->d.dindirect;
+	if(lbn <= LBN_DIND_CHILD(0)) {
+		uint32_t k = LBN_DIND_CHILD(0) - lbn;
+		if((b = buf_get(fs, ino, LBN_DIND, li->d.dindirect, BUF_READ)) == NULL) return 0;
+		a = ((uint32_t*)b->data)[k];
+		buf_put(b);
+		return a;
+	}
+
+	uint32_t n = lbn;
+	if(n < LFS_NDIRECT) return li->d.direct[n];
+	n -= LFS_NDIRECT;
+	if(n < LFS_PTRS) {
+		if((b = buf_get(fs, ino, LBN_IND, li->d.indirect, BUF_READ)) == NULL) return 0;
+		a = ((uint32_t*)b->data)[n];
+		buf_put(b);
+		return a;
+	}
+	n -= LFS_PTRS;
+	int32_t child = LBN_DIND_CHILD(n / LFS_PTRS);
+	uint32_t caddr = bmap(fs, li, child);
+	if((b = buf_get(fs, ino, child, caddr, BUF_READ)) == NULL) return 0;
+	a = ((uint32_t*)b->data)[n % LFS_PTRS];
+	buf_put(b);
+	return a;
+}
+
+/* Set the address of block 'lbn' of a file in its parent, returning the
+   old one. The parent becomes dirty. */
+static uint32_t bmap_set(lfs* fs, lfs_inode* li, int32_t lbn, uint32_t addr)
+{
+	uint32_t ino = li->d.ino;
+	uint32_t* slot;
+	lfs_buf* b = NULL;
+
+	if(lbn == LBN_IND)
+		slot = &li->d.indirect;
+	else if(lbn == LBN_DIND)
+		slot = &li->d.dindirect;
+	else if(lbn <= LBN_DIND_CHILD(0)) {
+		b = buf_get(fs, ino, LBN_DIND, li->d.dindirect, BUF_CREATE);
+		slot = &((uint32_t*)b->data)[LBN_DIND_CHILD(0) - lbn];
+	} else {
+		uint32_t n = lbn;
+		if(n < LFS_NDIRECT)
+			slot = &li->d.direct[n];
+		else if((n -= LFS_NDIRECT) < LFS_PTRS) {
+			b = buf_get(fs, ino, LBN_IND, li->d.indirect, BUF_CREATE);
+			slot = &((uint32_t*)b->data)[n];
+		} else {
+			n -= LFS_PTRS;
+			int32_t child = LBN_DIND_CHILD(n / LFS_PTRS);
+			b = buf_get(fs, ino, child, bmap(fs, li, child), BUF_CREATE);
+			slot = &((uint32_t*)b->data)[n % LFS_PTRS];
+		}
+	}
+
+	uint32_t old = *slot;
+	*slot = addr;
+	if(b) {
+		buf_dirty(fs, b);
+		buf_put(b);
+	} else
+		inode_dirty(fs, li);
+	return old;
+}
+
+/* Release the storage of all blocks of a file */
+static void lfs_free_blocks(lfs* fs, lfs_inode* li)
+{
+	uint32_t ino = li->d.ino;
+	for(int i=0; i<LFS_NDIRECT; i++)
+		usage_sub(fs, li->d.direct[i], BLOCK_UNITS);
+
+	lfs_buf* b = buf_get(fs, ino, LBN_IND, li->d.indirect, BUF_READ);
+	if(b) {
+		for(uint i=0; i<LFS_PTRS; i++)
+			usage_sub(fs, ((uint32_t*)b->data)[i], BLOCK_UNITS);
+		buf_put(b);
+	}
+	usage_sub(fs, li->d.indirect, BLOCK_UNITS);
+
+	lfs_buf* bd = buf_get(fs, ino, LBN_DIND, li->d.dindirect, BUF_READ);
+	if(bd) {
+		for(uint k=0; k<LFS_PTRS; k++) {
+			uint32_t caddr = ((uint32_t*)bd->data)[k];
+			b = buf_get(fs, ino, LBN_DIND_CHILD(k), caddr, BUF_READ);
+			if(b) {
+				for(uint i=0; i<LFS_PTRS; i++)
+					usage_sub(fs, ((uint32_t*)b->data)[i], BLOCK_UNITS);
+				buf_put(b);
+			}
+			usage_sub(fs, caddr, BLOCK_UNITS);
+		}
+		buf_put(bd);
+	}
+	usage_sub(fs, li->d.dindirect, BLOCK_UNITS);
+
+	buf_drop_inode(fs, ino);
+	memset(li->d.direct, 0, sizeof(li->d.direct));
+	li->d.indirect = li->d.dindirect = 0;
+	li->vfs.npages = 0;
+	li->vfs.size = 0;
+	inode_dirty(fs, li);
+}
+
+
+
+/*
+	The segment writer
+ */
+
+/* Find a segment which is free, both now and in the last checkpoint */
+static int seg_alloc(lfs* fs)
+{
+	for(uint i=1; i<=fs->nsegs; i++) {
+		uint s = (fs->cp.head_seg + i) % fs->nsegs;
+		if(fs->cp.usage[s]==0 && fs->cp_usage[s]==0 && s != fs->cp.head_seg) {
+			/* Cached inode blocks of its previous use are stale */
+			for(uint j=0; j<LFS_CACHE_BLOCKS; j++) {
+				lfs_buf* b = &fs->bufs[j];
+				if(b->valid && b->ino == 0 && addr_seg(b->lbn) == s && b->pins == 0)
+					buf_drop(fs, b);
+			}
+			if(fs->nfree > 0) fs->nfree--;
+			return s;
+		}
+	}
+	return -1;
+}
+
+/* Write the partial segment being assembled */
+static int seg_write(lfs* fs)
+{
+	if(fs->seg_count <= 1) return 0;
+
+	lfs_summary* sum = (lfs_summary*) fs->seg;
+	sum->magic = LFS_SUMMARY_MAGIC;
+	sum->nblocks = fs->seg_count - 1;
+	sum->seq = fs->cp.seq + 1;
+	int ret = lfs_io(fs, 1, seg_block(fs->cp.head_seg) + fs->cp.head_off, fs->seg_count, fs->seg);
+	fs->cp.head_off += fs->seg_count;
+	fs->seg_count = 0;
+	return ret;
+}
+
+/* Append a block to the log, returning its address, or 0 if there is no free
+   segment left. A full segment is written before a new one is needed, so on
+   failure everything appended so far is on the disk. */
+static uint32_t seg_append(lfs* fs, const void* data, uint32_t ino, int32_t lbn, uint units)
+{
+	if(fs->seg_count > 0 && fs->cp.head_off + fs->seg_count == LFS_SEG_BLOCKS)
+		seg_write(fs);
+
+	if(fs->seg_count == 0) {
+		/* Start a partial segment, in a new segment if less than 2 blocks are left */
+		if(fs->cp.head_off + 2 > LFS_SEG_BLOCKS) {
+			int s = seg_alloc(fs);
+			if(s < 0) return 0;
+			fs->cp.head_seg = s;
+			fs->cp.head_off = 0;
+		}
+		memset(fs->seg, 0, LFS_BLOCK_SIZE);
+		fs->seg_count = 1;
+	}
+
+	lfs_summary* sum = (lfs_summary*) fs->seg;
+	sum->entry[fs->seg_count-1].ino = ino;
+	sum->entry[fs->seg_count-1].lbn = lbn;
+	memcpy(fs->seg + fs->seg_count*LFS_BLOCK_SIZE, data, LFS_BLOCK_SIZE);
+
+	uint32_t addr = seg_block(fs->cp.head_seg) + fs->cp.head_off + fs->seg_count;
+	fs->seg_count++;
+	usage_add(fs, addr, units);
+	return addr;
+}
+
+/* Append the dirty blocks whose lbn is in [lo, hi]. Return -1 if the disk is full. */
+static int flush_blocks(lfs* fs, int32_t lo, int32_t hi)
+{
+	rlnode* p = fs->dirty.next;
+	while(p != &fs->dirty) {
+		lfs_buf* b = p->obj;
+		p = p->next;
+		if(b->lbn < lo || b->lbn > hi) continue;
+
+		lfs_inode* li = lfs_iget(fs, b->ino);
+		assert(li);
+		b->pins++;
+		uint32_t addr = seg_append(fs, b->data, b->ino, b->lbn, BLOCK_UNITS);
+		if(addr == 0) {
+			buf_put(b);
+			inode_unref(&li->vfs);
+			return -1;
+		}
+		rlist_remove(&b->dnode);
+		fs->ndirty--;
+		b->dirty = 0;
+		usage_sub(fs, bmap_set(fs, li, b->lbn, addr), BLOCK_UNITS);
+		buf_put(b);
+		inode_unref(&li->vfs);
+
+		/* The parent may have been added to the list after p */
+		p = fs->dirty.next;
+	}
+	return 0;
+}
+
+static int write_checkpoint(lfs* fs)
+{
+	fs->cp.seq++;
+	fs->cp.magic = LFS_MAGIC;
+	fs->cp.checksum = 0;
+	fs->cp.checksum = checksum(&fs->cp, sizeof(lfs_checkpoint));
+
+	char* block = fs->scratch;
+	memset(block, 0, LFS_BLOCK_SIZE);
+	memcpy(block, &fs->cp, sizeof(lfs_checkpoint));
+	int ret = lfs_io(fs, 1, LFS_CHECKPOINT + (fs->cp.seq & 1), 1, block);
+
+	memcpy(fs->cp_usage, fs->cp.usage, sizeof(fs->cp_usage));
+	count_free(fs);
+	return ret;
+}
+
+/* Write back all dirty blocks, inodes and inode map blocks, in this order,
+   followed by a checkpoint. Without 'force', nothing is written if nothing
+   is dirty. Return -1 on an I/O error or if the disk is full. */
+static int lfs_flush(lfs* fs, int force)
+{
+	int imap_dirty = 0;
+	for(uint i=0; i<LFS_IMAP_BLOCKS; i++) imap_dirty |= fs->imap_dirty[i];
+	if(!force && fs->ndirty == 0 && is_rlist_empty(&fs->idirty) && !imap_dirty) return 0;
+
+	assert(! fs->flushing);
+	fs->flushing = 1;
+
+	/* Data blocks first, then the indirect blocks they make dirty */
+	if(flush_blocks(fs, 0, INT32_MAX) || flush_blocks(fs, INT32_MIN, LBN_DIND_CHILD(0))
+		|| flush_blocks(fs, LBN_IND, LBN_IND) || flush_blocks(fs, LBN_DIND, LBN_DIND))
+		goto full;
+	assert(fs->ndirty == 0);
+
+	/* Inodes, packed into blocks */
+	lfs_dinode* iblock = (lfs_dinode*) fs->scratch;
+	uint32_t inos[LFS_INODES_PER_BLOCK];
+	uint n = 0;
+	while(n > 0 || ! is_rlist_empty(&fs->idirty)) {
+		if(! is_rlist_empty(&fs->idirty)) {
+			lfs_inode* li = rlist_pop_front(&fs->idirty)->obj;
+			li->dirty = 0;
+			if(li->vfs.nlink == 0) continue;	/* It will be deleted on release */
+
+			li->d.type = li->vfs.type;
+			li->d.nlink = li->vfs.nlink;
+			li->d.size = li->vfs.size;
+			li->d.blocks = li->vfs.npages;
+			iblock[n] = li->d;
+			inos[n++] = li->d.ino;
+		}
+
+		if(n == LFS_INODES_PER_BLOCK || (n > 0 && is_rlist_empty(&fs->idirty))) {
+			memset(iblock + n, 0, (LFS_INODES_PER_BLOCK - n)*LFS_INODE_SIZE);
+			uint32_t addr = seg_append(fs, iblock, 0, LBN_INODES, n);
+			if(addr == 0) {
+				for(uint i=0; i<n; i++) inode_dirty(fs, icache_find(fs, inos[i]));
+				goto full;
+			}
+			for(uint i=0; i<n; i++) {
+				uint32_t old = fs->imap[inos[i]];
+				if(old != LFS_IMAP_PENDING) usage_sub(fs, old >> LFS_INODE_SHIFT, 1);
+				fs->imap[inos[i]] = (addr << LFS_INODE_SHIFT) | i;
+				fs->imap_dirty[inos[i] / LFS_IMAP_ENTRIES] = 1;
+			}
+			n = 0;
+		}
+	}
+
+	/* The inode map */
+	for(uint i=0; i<LFS_IMAP_BLOCKS; i++)
+		if(fs->imap_dirty[i]) {
+			uint32_t addr = seg_append(fs, &fs->imap[i*LFS_IMAP_ENTRIES], 0, i, BLOCK_UNITS);
+			if(addr == 0) goto full;
+			usage_sub(fs, fs->cp.imap_addr[i], BLOCK_UNITS);
+			fs->cp.imap_addr[i] = addr;
+			fs->imap_dirty[i] = 0;
+		}
+
+	int ret = seg_write(fs);
+	if(write_checkpoint(fs)) ret = -1;
+
+	fs->flushing = 0;
+	fs->last_flush = bios_clock();
+	if(fs->nfree < LFS_CLEAN_LOW) kernel_signal(&fs->cleaner_cv);
+	return ret;
+
+full:
+	/* What is still dirty stays so; the checkpoint is not written, since the
+	   metadata on the disk would not match it */
+	fs->flushing = 0;
+	kernel_signal(&fs->cleaner_cv);
+	return -1;
+}
+
+
+
+/*
+	The cleaner
+ */
+
+/* Copy the live blocks of a segment to the head of the log */
+static int clean_segment(lfs* fs, uint s)
+{
+	if(lfs_io(fs, 0, seg_block(s), LFS_SEG_BLOCKS, fs->segread)) return -1;
+
+	uint off = 0;
+	while(off + 1 < LFS_SEG_BLOCKS) {
+		lfs_summary* sum = (lfs_summary*)(fs->segread + off*LFS_BLOCK_SIZE);
+		if(sum->magic != LFS_SUMMARY_MAGIC || sum->nblocks == 0
+			|| off + 1 + sum->nblocks > LFS_SEG_BLOCKS) break;
+
+		for(uint j=0; j<sum->nblocks; j++) {
+			uint32_t addr = seg_block(s) + off + 1 + j;
+			char* data = fs->segread + (off + 1 + j)*LFS_BLOCK_SIZE;
+			uint32_t ino = sum->entry[j].ino;
+			int32_t lbn = sum->entry[j].lbn;
+
+			if(ino == 0 && lbn >= 0) {
+				/* An inode map block */
+				if(lbn < LFS_IMAP_BLOCKS && fs->cp.imap_addr[lbn] == addr)
+					fs->imap_dirty[lbn] = 1;
+			}
+			else if(ino == 0) {
+				/* An inode block */
+				lfs_dinode* di = (lfs_dinode*) data;
+				for(uint i=0; i<LFS_INODES_PER_BLOCK; i++) {
+					if(di[i].ino == 0 || di[i].ino >= LFS_MAX_INODES) continue;
+					if(fs->imap[di[i].ino] != ((addr << LFS_INODE_SHIFT) | i)) continue;
+					lfs_inode* li = lfs_iget(fs, di[i].ino);
+					inode_dirty(fs, li);
+					inode_unref(&li->vfs);
+				}
+			}
+			else if(ino < LFS_MAX_INODES && fs->imap[ino] != 0) {
+				/* A block of a file: live if its inode still points to it */
+				lfs_buf* b = buf_find(fs, ino, lbn);
+				if(b && b->dirty) continue;
+				lfs_inode* li = lfs_iget(fs, ino);
+				if(li == NULL) continue;
+				if(bmap(fs, li, lbn) == addr) {
+					b = buf_get(fs, ino, lbn, 0, BUF_CREATE);
+					memcpy(b->data, data, LFS_BLOCK_SIZE);
+					buf_dirty(fs, b);
+					buf_put(b);
+				}
+				inode_unref(&li->vfs);
+			}
+		}
+		off += 1 + sum->nblocks;
+	}
+
+	/* What was not copied is dead */
+	fs->cp.usage[s] = 0;
+	return 0;
+}
+
+/* Clean segments with the fewest live blocks, until 'target' are free.
+   Segments are free only after a checkpoint, so one is written after
+   each segment cleaned. */
+static void lfs_clean(lfs* fs, uint target)
+{
+	if(fs->nfree < target) lfs_flush(fs, 1);
+
+	for(uint round = 0; fs->nfree < target && round < fs->nsegs; round++) {
+		int victim = -1;
+		for(uint s=0; s<fs->nsegs; s++) {
+			if(s == fs->cp.head_seg || fs->cp.usage[s] == 0) continue;
+			if(victim < 0 || fs->cp.usage[victim] > fs->cp.usage[s]) victim = s;
+		}
+
+		/* Cleaning an almost full segment would use up as much as it frees */
+		if(victim < 0 || fs->cp.usage[victim] >= (LFS_SEG_BLOCKS-2)*BLOCK_UNITS)
+			break;
+
+		if(clean_segment(fs, victim) || lfs_flush(fs, 1)) break;
+	}
+}
+
+
+/* The mounts whose cleaner thread has not started yet */
+static rlnode cleaner_pending = { .prev = &cleaner_pending, .next = &cleaner_pending };
+
+static void lfs_cleaner_thread()
+{
+	kernel_lock();
+	lfs* fs = rlist_pop_front(&cleaner_pending)->obj;
+
+	while(! fs->stop) {
+		kernel_timedwait(&fs->cleaner_cv, SCHED_IO, LFS_FLUSH_INTERVAL);
+		if(fs->stop) break;
+
+		/* The cleaner gives way to the users of the file system */
+		if(fs->mnt.busy) continue;
+
+		mount_lock(&fs->mnt);
+		if(fs->nfree < LFS_CLEAN_LOW)
+			lfs_clean(fs, LFS_CLEAN_HIGH);
+		if(bios_clock() - fs->last_flush >= LFS_FLUSH_INTERVAL)
+			lfs_flush(fs, 0);
+		icache_trim(fs);
+		mount_unlock(&fs->mnt);
+	}
+
+	fs->cleaner_exited = 1;
+	kernel_broadcast(&fs->cleaner_exit_cv);
+	kernel_sleep(EXITED, SCHED_IO);
+}
+
+
+
+/*
+	File system operations
+ */
+
+/* Make sure that there is room in the log for the dirty blocks, plus one
+   more, and the metadata they may make dirty. Only the cleaner can use
+   the last LFS_RESERVE_SEGS free segments. */
+static int lfs_reserve(lfs* fs)
+{
+	if(fs->ndirty >= LFS_DIRTY_MAX && lfs_flush(fs, 0)) return -1;
+
+	for(int round = 0; ; round++) {
+		uint segs = (fs->nfree > LFS_RESERVE_SEGS) ? fs->nfree - LFS_RESERVE_SEGS : 0;
+		uint avail = segs * (LFS_SEG_BLOCKS-2);
+		if(avail >= 2*(fs->ndirty+1) + LFS_IMAP_BLOCKS + 4) return 0;
+
+		switch(round) {
+			case 0: if(lfs_flush(fs, 0)) return -1; break;
+			case 1: lfs_clean(fs, LFS_CLEAN_HIGH); break;
+			default: return -1;
+		}
+	}
+}
+
+/* Return a page of a file. With 'reserve', a page is only made dirty if there
+   is room for it in the log, outside the segments reserved for the cleaner. */
+static void* lfs_getpage(inode* ino, uintptr_t pgno, int write, int reserve)
+{
+	lfs* fs = FS(ino->mnt);
+	lfs_inode* li = LFS_INODE(ino);
+	uint32_t n = li->d.ino;
+	if(pgno >= LFS_MAX_BLOCKS) return NULL;
+
+	lfs_buf* b = buf_find(fs, n, pgno);
+	if(b == NULL || (write && !b->dirty)) {
+		if(write && reserve && lfs_reserve(fs)) return NULL;
+		uint32_t addr = bmap(fs, li, pgno);
+		if(addr == 0 && !write) return NULL;
+		if(addr == 0 && buf_find(fs, n, pgno) == NULL) ino->npages++;
+		b = buf_get(fs, n, pgno, addr, BUF_CREATE);
+	} else
+		b->pins++;
+	b->referenced = 1;
+
+	if(write) {
+		buf_dirty(fs, b);
+		inode_dirty(fs, li);
+	}
+	buf_put(b);
+	return b->data;
+}
+
+static void* lfs_page(inode* ino, uintptr_t pgno, int write)
+{
+	return lfs_getpage(ino, pgno, write, 1);
+}
+
+static void lfs_truncate(inode* ino)
+{
+	lfs_free_blocks(FS(ino->mnt), LFS_INODE(ino));
+}
+
+static void lfs_release(inode* ino)
+{
+	lfs* fs = FS(ino->mnt);
+	lfs_inode* li = LFS_INODE(ino);
+
+	if(ino->nlink > 0) {
+		rlist_push_back(&fs->iunused, &li->unode);
+		fs->nunused++;
+		return;
+	}
+
+	/* Delete the inode */
+	lfs_free_blocks(fs, li);
+	uint32_t a = fs->imap[li->d.ino];
+	if(a != LFS_IMAP_PENDING) usage_sub(fs, a >> LFS_INODE_SHIFT, 1);
+	fs->imap[li->d.ino] = 0;
+	fs->imap_dirty[li->d.ino / LFS_IMAP_ENTRIES] = 1;
+
+	rlist_push_back(&fs->iunused, &li->unode);
+	fs->nunused++;
+	inode_free(fs, li);
+}
+
+static inode* lfs_lookup(inode* dir, const char* name)
+{
+	lfs* fs = FS(dir->mnt);
+	for(intptr_t i = 0; i < dir->size; i++) {
+		lfs_dirent* e = (lfs_dirent*) lfs_page(dir, i / LFS_DIRENTS, 0) + i % LFS_DIRENTS;
+		if(strcmp(e->name, name) == 0) {
+			lfs_inode* li = lfs_iget(fs, e->ino);
+			return li ? &li->vfs : NULL;
+		}
+	}
+	return NULL;
+}
+
+static int lfs_direntry(inode* dir, intptr_t index, char* name)
+{
+	if(index >= dir->size) return -1;
+	lfs_dirent* e = (lfs_dirent*) lfs_page(dir, index / LFS_DIRENTS, 0) + index % LFS_DIRENTS;
+	strcpy(name, e->name);
+	return 0;
+}
+
+static inode* lfs_create(inode* dir, const char* name, Fse_type type)
+{
+	lfs* fs = FS(dir->mnt);
+	if(lfs_reserve(fs)) return NULL;
+
+	/* Find a free inode number */
+	uint32_t n = 0;
+	for(uint i=0; i<LFS_MAX_INODES; i++) {
+		uint32_t c = (fs->ino_hint + i) % LFS_MAX_INODES;
+		if(c > LFS_ROOT_INO && fs->imap[c] == 0) { n = c; break; }
+	}
+	if(n == 0) return NULL;
+
+	/* Append the entry to the directory */
+	intptr_t index = dir->size;
+	lfs_dirent* e = lfs_page(dir, index / LFS_DIRENTS, 1);
+	if(e == NULL) return NULL;
+	e += index % LFS_DIRENTS;
+	e->ino = n;
+	strcpy(e->name, name);
+	dir->size++;
+
+	lfs_dinode d;
+	memset(&d, 0, sizeof(d));
+	d.ino = n;
+	d.type = type;
+	d.nlink = 1;
+	d.parent = LFS_INODE(dir)->d.ino;
+	lfs_inode* li = inode_alloc(fs, &d);
+	li->vfs.refcount = 1;
+	fs->imap[n] = LFS_IMAP_PENDING;
+	fs->ino_hint = n + 1;
+	inode_dirty(fs, li);
+	return &li->vfs;
+}
+
+static void lfs_unlink(inode* dir, const char* name, inode* ino)
+{
+	intptr_t last = dir->size - 1;
+	lfs_dirent moved = *((lfs_dirent*) lfs_page(dir, last / LFS_DIRENTS, 0) + last % LFS_DIRENTS);
+
+	/* Move the last entry into the place of the removed one */
+	for(intptr_t i = 0; i <= last; i++) {
+		lfs_dirent* e = (lfs_dirent*) lfs_page(dir, i / LFS_DIRENTS, 0) + i % LFS_DIRENTS;
+		if(strcmp(e->name, name) == 0) {
+			/* Removing files must be possible on a full disk */
+			e = (lfs_dirent*) lfs_getpage(dir, i / LFS_DIRENTS, 1, 0) + i % LFS_DIRENTS;
+			*e = moved;
+			break;
+		}
+	}
+	dir->size--;
+	inode_dirty(FS(dir->mnt), LFS_INODE(dir));
+
+	ino->nlink--;
+	inode_dirty(FS(dir->mnt), LFS_INODE(ino));
+}
+
+static inode* lfs_parent(inode* dir)
+{
+	lfs_inode* li = lfs_iget(FS(dir->mnt), LFS_INODE(dir)->d.parent);
+	return &li->vfs;
+}
+
+static const fs_ops lfs_ops = {
+	.Lookup = lfs_lookup,
+	.Create = lfs_create,
+	.Unlink = lfs_unlink,
+	.DirEntry = lfs_direntry,
+	.Parent = lfs_parent,
+	.Page = lfs_page,
+	.Truncate = lfs_truncate,
+	.Release = lfs_release
+};
+
+
+
+/*
+	Mounting
+ */
+
+static lfs* lfs_alloc(uint disk)
+{
+	lfs* fs = xmalloc(sizeof(lfs));
+	memset(fs, 0, sizeof(lfs));
+
+	fs->mnt.disk = disk;
+	fs->mnt.fs = fs;
+	fs->mnt.unlocked = COND_INIT;
+	rlnode_init(&fs->mnt.node, &fs->mnt);
+
+	uint64_t blocks = bios_disk_sectors(disk) / LFS_BLOCK_SECTORS;
+	fs->nsegs = (blocks > LFS_SEG_START) ? (blocks - LFS_SEG_START) / LFS_SEG_BLOCKS : 0;
+	if(fs->nsegs > LFS_MAX_SEGS) fs->nsegs = LFS_MAX_SEGS;
+
+	fs->cache_mem = xmalloc(LFS_CACHE_BLOCKS * LFS_BLOCK_SIZE);
+	for(uint i=0; i<LFS_CACHE_BLOCKS; i++) {
+		fs->bufs[i].data = fs->cache_mem + i*LFS_BLOCK_SIZE;
+		rlnode_init(&fs->bufs[i].hnode, &fs->bufs[i]);
+		rlnode_init(&fs->bufs[i].dnode, &fs->bufs[i]);
+	}
+	for(uint i=0; i<LFS_HASH; i++) {
+		rlnode_init(&fs->bhash[i], NULL);
+		rlnode_init(&fs->ihash[i], NULL);
+	}
+	rlnode_init(&fs->dirty, NULL);
+	rlnode_init(&fs->idirty, NULL);
+	rlnode_init(&fs->iunused, NULL);
+
+	fs->seg = xmalloc(LFS_SEG_BLOCKS * LFS_BLOCK_SIZE);
+	fs->segread = xmalloc(LFS_SEG_BLOCKS * LFS_BLOCK_SIZE);
+	fs->scratch = xmalloc(LFS_BLOCK_SIZE);
+	fs->ino_hint = LFS_ROOT_INO + 1;
+	fs->cleaner_cv = COND_INIT;
+	fs->cleaner_exit_cv = COND_INIT;
+	fs->cleaner_exited = 1;
+	rlnode_init(&fs->pending_node, fs);
+	return fs;
+}
+
+void lfs_free(mount* m)
+{
+	lfs* fs = FS(m);
+	assert(fs->cleaner_exited);
+	for(uint i=0; i<LFS_HASH; i++)
+		while(! is_rlist_empty(&fs->ihash[i])) {
+			lfs_inode* li = fs->ihash[i].next->obj;
+			li->vfs.refcount = 0;
+			rlist_remove(&li->hnode);
+			free(li);
+		}
+	free(fs->cache_mem);
+	free(fs->seg);
+	free(fs->segread);
+	free(fs->scratch);
+	free(fs);
+}
+
+
+int lfs_format(uint disk)
+{
+	lfs* fs = lfs_alloc(disk);
+	int ret = -1;
+	if(fs->nsegs < 4*LFS_CLEAN_HIGH) goto done;
+
+	/* The superblock, with both checkpoint slots cleared */
+	char* block = fs->segread;
+	memset(block, 0, LFS_BLOCK_SIZE);
+	if(lfs_io(fs, 1, LFS_CHECKPOINT, 1, block) || lfs_io(fs, 1, LFS_CHECKPOINT+1, 1, block))
+		goto done;
+	*(lfs_super*)block = (lfs_super){ LFS_MAGIC, fs->nsegs, LFS_SEG_BLOCKS, LFS_SEG_START };
+	if(lfs_io(fs, 1, 0, 1, block)) goto done;
+
+	/* The root directory, and the first checkpoint */
+	lfs_dinode d;
+	memset(&d, 0, sizeof(d));
+	d.ino = d.parent = LFS_ROOT_INO;
+	d.type = FSE_DIR;
+	d.nlink = 1;
+	lfs_inode* root = inode_alloc(fs, &d);
+	root->vfs.refcount = 1;
+	fs->imap[LFS_ROOT_INO] = LFS_IMAP_PENDING;
+	for(uint i=0; i<LFS_IMAP_BLOCKS; i++) fs->imap_dirty[i] = 1;
+	inode_dirty(fs, root);
+	count_free(fs);
+	ret = lfs_flush(fs, 1);
+
+done:
+	lfs_free(&fs->mnt);
+	return ret;
+}
+
+
+mount* lfs_mount(uint disk)
+{
+	lfs* fs = lfs_alloc(disk);
+	char* block = fs->segread;
+
+	/* Check the superblock */
+	if(lfs_io(fs, 0, 0, 1, block)) goto fail;
+	lfs_super* super = (lfs_super*) block;
+	if(super->magic != LFS_MAGIC || super->seg_blocks != LFS_SEG_BLOCKS
+		|| super->seg_start != LFS_SEG_START || super->nsegs > fs->nsegs)
+		goto fail;
+	fs->nsegs = super->nsegs;
+
+	/* Pick the last valid checkpoint */
+	int found = 0;
+	for(uint slot = 0; slot < 2; slot++) {
+		if(lfs_io(fs, 0, LFS_CHECKPOINT + slot, 1, block)) goto fail;
+		lfs_checkpoint* cp = (lfs_checkpoint*) block;
+		uint32_t sum = cp->checksum;
+		cp->checksum = 0;
+		if(cp->magic != LFS_MAGIC || checksum(cp, sizeof(lfs_checkpoint)) != sum) continue;
+		cp->checksum = sum;
+		if(!found || cp->seq > fs->cp.seq) fs->cp = *cp;
+		found = 1;
+	}
+	if(! found) goto fail;
+	memcpy(fs->cp_usage, fs->cp.usage, sizeof(fs->cp_usage));
+	count_free(fs);
+
+	/* Read the inode map */
+	for(uint i=0; i<LFS_IMAP_BLOCKS; i++)
+		if(fs->cp.imap_addr[i]
+			&& lfs_io(fs, 0, fs->cp.imap_addr[i], 1, &fs->imap[i*LFS_IMAP_ENTRIES]))
+			goto fail;
+
+	lfs_inode* root = lfs_iget(fs, LFS_ROOT_INO);
+	if(root == NULL || root->vfs.type != FSE_DIR) goto fail;
+	fs->mnt.root = &root->vfs;
+	fs->last_flush = bios_clock();
+
+	/* Start the cleaner */
+	fs->cleaner_exited = 0;
+	rlist_push_back(&cleaner_pending, &fs->pending_node);
+	wakeup(spawn_thread(get_pcb(0), lfs_cleaner_thread));
+	return &fs->mnt;
+
+fail:
+	lfs_free(&fs->mnt);
+	return NULL;
+}
+
+
+int lfs_busy(mount* m)
+{
+	lfs* fs = FS(m);
+	for(uint i=0; i<LFS_HASH; i++)
+		for(rlnode* p = fs->ihash[i].next; p != &fs->ihash[i]; p = p->next) {
+			inode* ino = p->obj;
+			if(ino->refcount > ((ino == m->root) ? 2 : 0)) return 1;
+		}
+	return 0;
+}
+
+
+int lfs_sync(mount* m)
+{
+	return lfs_flush(FS(m), 0);
+}
+
+
+void lfs_halt(mount* m)
+{
+	lfs* fs = FS(m);
+	fs->stop = 1;
+	kernel_broadcast(&fs->cleaner_cv);
+	while(! fs->cleaner_exited)
+		kernel_wait(&fs->cleaner_exit_cv, SCHED_IO);
+}
+
+
+int lfs_unmount(mount* m)
+{
+	lfs_halt(m);
+	return lfs_flush(FS(m), 0);
+}
@@ -0,0 +1,90 @@
+#ifndef __KERNEL_LFS_H
+#define __KERNEL_LFS_H
+
+#include "kernel_fs.h"
+
+/**
+	@file kernel_lfs.h
+	@brief A log-structured file system on a disk.
+
+	@defgroup lfs Log-structured file system.
+	@ingroup filesys
+	@brief A log-structured file system on a disk.
+
+	The file system treats the disk as a log. Blocks are never updated in
+	place: every time a block is written back, it is appended to the log,
+	at a new address. The disk is divided into fixed-size segments, and
+	the log is written a segment at a time, with large sequential writes,
+	no matter how scattered the updates were.
+
+	The layout of the disk, in blocks of @ref FS_PAGE_SIZE bytes, is
+	- block 0: the superblock, with the geometry of the file system,
+	- blocks 1 and 2: two checkpoint slots, written alternately,
+	- from block 4 on: the segments.
+
+	Each write to the log is a "partial segment": a summary block, naming
+	the owner of each of the blocks that follow it, and the blocks.
+	An inode (@c lfs_dinode) is 128 bytes; the inodes written together are
+	packed into inode blocks. The inode map, kept in memory, gives the
+	current address of each inode; it is written to the log as well.
+
+	A checkpoint holds the addresses of the inode map blocks, the number
+	of live blocks of each segment, and the head of the log. Checkpoints
+	are written after the segments they refer to, and carry a sequence
+	number and a checksum, so that mounting picks the last complete one.
+	What was written after it is ignored; the file system is always
+	consistent, even if the system halts without @c Unmount.
+
+	File blocks are accessed through a buffer cache with CLOCK replacement.
+	Dirty blocks are written back in batches: when too many are dirty, on
+	@c Sync and @c Unmount, and periodically by the cleaner thread.
+	The writer appends the blocks in dependency order (data, indirect
+	blocks, inodes, inode map), since writing a block changes its address
+	in its parent.
+
+	The cleaner is a kernel thread per mounted file system. It picks the
+	segments with the fewest live blocks, copies their live blocks to the
+	head of the log and, after a checkpoint, reuses them. A segment is
+	only reused if it is free in the last checkpoint on disk as well.
+
+	@{
+*/
+
+/** @brief Write an empty file system to a disk.
+	@returns 0 on success, or -1 if the disk is too small or on I/O error
+ */
+int lfs_format(uint disk);
+
+/** @brief Mount the file system of a disk.
+
+	The returned mount has no covered directory yet, and its lock is not held.
+	@returns the mount, or NULL if the disk does not hold a valid file system
+ */
+mount* lfs_mount(uint disk);
+
+/** @brief Return non-zero if any inode of the mount, except its root, is in use. */
+int lfs_busy(mount* m);
+
+/** @brief Write back all dirty blocks and inodes, and a checkpoint.
+
+	This must be called with the lock of the mount held.
+	@returns 0 on success, or -1 on I/O error
+ */
+int lfs_sync(mount* m);
+
+/** @brief Stop the cleaner and sync the file system.
+
+	This must be called with the lock of the mount held.
+	@returns 0 on success, or -1 on I/O error
+ */
+int lfs_unmount(mount* m);
+
+/** @brief Stop the cleaner of the file system, without syncing it. */
+void lfs_halt(mount* m);
+
+/** @brief Release the memory of a mount, whose cleaner has been stopped. */
+void lfs_free(mount* m);
+
+/** @} */
+
+#endif
@@ -1,7 +1,10 @@
+#include <string.h>
 #include "tinyos.h"
 #include "kernel_pipe.h"
 #include "kernel_cc.h"
 
+_Static_assert((PIPE_BUFFER_SIZE & (PIPE_BUFFER_SIZE-1)) == 0, "the positions wrap around a power of 2");
+
 static file_ops readOperations = {
     .Open = NULL,
     .Read = pipe_read,
@@ -33,27 +36,30 @@ Pipe_CB* pipe_init() {
     new_Pipe_CB->w_position = 0;
     new_Pipe_CB->r_position = 0;
 
+    // Nobody is inside, or sleeping
+    new_Pipe_CB->w_waiting = 0;
+    new_Pipe_CB->r_waiting = 0;
+    new_Pipe_CB->writing = 0;
+    new_Pipe_CB->reading = 0;
+    new_Pipe_CB->users = 0;
+
+    // A byte stream, unless set otherwise
+    new_Pipe_CB->packet = 0;
+
     // Condition variables initialized 
     new_Pipe_CB->has_space = COND_INIT;
     new_Pipe_CB->has_data = COND_INIT;
 
-    // Current word length
-    new_Pipe_CB->word_length = 0;
-
     return new_Pipe_CB;
 }
 
-/**
-    @brief @brief Construct and returns two file id's by reference.
-
+/*
+    Construct a pipe and return its two file id's by reference.
+    
     Firstly acquire a number of FCBs and corresponding fids by calling FCB_reserve().
     Then the pipe is initialized, streams are connected to the pipe control block (@c streamobj)
-   
-    @param pipe a pointer to a pipe_t structure for storing the file ids.
-    @returns 0 on success, or -1 on error. Possible reasons for error:
-        - the available file ids for the process are exhausted.
 */
-int sys_Pipe(pipe_t* pipe)
+static int pipe_create(pipe_t* pipe, int packet)
 {
     // Arguments for FCB_reserve
     Fid_t fid[2];
@@ -71,6 +77,7 @@ int sys_Pipe(pipe_t* pipe)
 
     // Initialize new Pipe Control block
     Pipe_CB* new_pipe_cb = pipe_init();
+    new_pipe_cb->packet = packet;
 
     // Set streams to point to the pipe_cb objects
     fcb[0]->streamobj = new_pipe_cb;
@@ -86,6 +93,148 @@ int sys_Pipe(pipe_t* pipe)
     return 0;
 }
 
+/**
+    @brief Construct and returns two file id's by reference.
+
+    @param pipe a pointer to a pipe_t structure for storing the file ids.
+    @returns 0 on success, or -1 on error. Possible reasons for error:
+        - the available file ids for the process are exhausted.
+*/
+int sys_Pipe(pipe_t* pipe)
+{
+    return pipe_create(pipe, 0);
+}
+
+/**
+    @brief Construct a packet pipe and return its two file id's by reference.
+
+    @param pipe a pointer to a pipe_t structure for storing the file ids.
+    @returns 0 on success, or -1 on error. Possible reasons for error:
+        - the available file ids for the process are exhausted.
+*/
+int sys_PacketPipe(pipe_t* pipe)
+{
+    return pipe_create(pipe, 1);
+}
+
+
+/*
+    Shorthands for the atomic accesses to the ring. Positions are published
+    with release stores and read with acquire loads. The waiting flags are
+    sequentially consistent: a thread going to sleep sets its flag and then
+    checks the position of its peer, while the peer advances its position
+    and then checks the flag, so that at least one of them sees the other.
+*/
+#define load_acquire(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define store_release(x,v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define load_sc(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define store_sc(x,v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+
+
+/*
+    Take the turn at one end of the pipe, and release the kernel lock.
+    This is called with the kernel lock held.
+*/
+static void pipe_enter(Pipe_CB* pipe_CB, int* busy, CondVar* cv)
+{
+    pipe_CB->users++;
+    while(*busy)
+        kernel_wait(cv, SCHED_PIPE);
+    *busy = 1;
+    kernel_unlock();
+}
+
+/*
+    Reacquire the kernel lock and give up the turn. If both ends have been 
+    closed meanwhile (by a socket shutdown), the last thread out frees the pipe.
+*/
+static void pipe_leave(Pipe_CB* pipe_CB, int* busy, CondVar* cv)
+{
+    kernel_lock();
+    *busy = 0;
+    kernel_broadcast(cv);
+    if(--pipe_CB->users == 0 && pipe_CB->reader == NULL && pipe_CB->writer == NULL)
+        free(pipe_CB);
+}
+
+/*
+    Wake the peer, if it sleeps. This is called without the kernel lock, 
+    after publishing a new position.
+*/
+static void pipe_wakeup(int* waiting, CondVar* cv)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(load_sc(*waiting)) {
+        kernel_lock();
+        kernel_broadcast(cv);
+        kernel_unlock();
+    }
+}
+
+/*
+    Return the free space of the ring, after sleeping (with the kernel lock) 
+    until it is at least @c need bytes. Return 0 if the reader is closed.
+*/
+static unsigned int pipe_wait_space(Pipe_CB* pipe_CB, unsigned int w, unsigned int need)
+{
+    unsigned int space = PIPE_BUFFER_SIZE - (w - load_acquire(pipe_CB->r_position));
+    if(space >= need) 
+        return space;
+
+    kernel_lock();
+    store_sc(pipe_CB->w_waiting, 1);
+    while((space = PIPE_BUFFER_SIZE - (w - load_sc(pipe_CB->r_position))) < need && pipe_CB->reader != NULL)
+        kernel_wait(&pipe_CB->has_space, SCHED_PIPE);
+    pipe_CB->w_waiting = 0;
+    if(pipe_CB->reader == NULL)
+        space = 0;
+    kernel_unlock();
+    return space;
+}
+
+/*
+    Return the data in the ring, after sleeping (with the kernel lock) until
+    there are some. Return 0 if the ring is empty and the writer is closed.
+*/
+static unsigned int pipe_wait_data(Pipe_CB* pipe_CB, unsigned int r)
+{
+    unsigned int avail = load_acquire(pipe_CB->w_position) - r;
+    if(avail > 0)
+        return avail;
+
+    kernel_lock();
+    store_sc(pipe_CB->r_waiting, 1);
+    while((avail = load_sc(pipe_CB->w_position) - r) == 0 && pipe_CB->writer != NULL)
+        /* if we expect someone to write, sleep till then*/
+        kernel_wait(&pipe_CB->has_data, SCHED_PIPE);
+    pipe_CB->r_waiting = 0;
+    kernel_unlock();
+    return avail;
+}
+
+/* Copy into the ring at a position, up to the end of the buffer and then from its beginning */
+static void ring_put(Pipe_CB* pipe_CB, unsigned int w, const char* buf, unsigned int n)
+{
+    unsigned int pos = w % PIPE_BUFFER_SIZE;
+    unsigned int n1 = (n < PIPE_BUFFER_SIZE - pos) ? n : PIPE_BUFFER_SIZE - pos;
+    memcpy(pipe_CB->buffer + pos, buf, n1);
+    memcpy(pipe_CB->buffer, buf + n1, n - n1);
+}
+
+/* Copy from the ring at a position, up to the end of the buffer and then from its beginning */
+static void ring_get(Pipe_CB* pipe_CB, unsigned int r, char* buf, unsigned int n)
+{
+    unsigned int pos = r % PIPE_BUFFER_SIZE;
+    unsigned int n1 = (n < PIPE_BUFFER_SIZE - pos) ? n : PIPE_BUFFER_SIZE - pos;
+    memcpy(buf, pipe_CB->buffer + pos, n1);
+    memcpy(buf + n1, pipe_CB->buffer, n - n1);
+}
+
+/* The length prefix of a message in a packet pipe */
+typedef unsigned int packet_len;
+
+_Static_assert(MAX_PACKET_SIZE + sizeof(packet_len) <= PIPE_BUFFER_SIZE, "a message must fit in the pipe");
+
 
 /**
     @brief Function to write at a Pipe Control Block .
@@ -97,56 +246,65 @@ int sys_Pipe(pipe_t* pipe)
     4) The reader is activated.\n
     5) The writer is activated in order to proceed (sockets).\n
 
-    The "size" bytes of source buffer are stored into the PipeCB buffer one by one. 
-    At every entry the word length counter and writer possition increments.
-    If word length == length of pipe buffer the pipe is waiting until space is available
-    
-    The pipe buffer is bounded(ring).
+    The writer takes its turn at the pipe and releases the kernel lock.
+    Then the "size" bytes of source buffer are copied into the free space 
+    of the ring, and the new writer position is published to the reader.
+    If the ring is full, the writer sleeps until the reader frees space, 
+    or the reader is closed.
+
+    In a packet pipe, the writer waits until the whole message fits, 
+    and copies its length and its bytes before publishing them at once.
 
-    At the end broadcast that data is available to read(wake up reader).
-    
     @param pipecb_t A pointer to a pipe_CB object.
     @param *buf The buffer with the data to write.
     @param size The max size to write at the pipe's buffer(bytes).
-    @returns The number of bytes we wrote.
+    @returns The number of bytes we wrote, or -1 if the reader was closed
+        before anything was written.
 */
 int pipe_write(void* pipecb_t, const char *buf, unsigned int size){
     Pipe_CB* pipe_CB = (Pipe_CB*)pipecb_t;
     
     if(pipe_CB==NULL || buf==NULL || size < 1 || pipe_CB->writer == NULL || pipe_CB->reader == NULL)
         return -1;
+    if(pipe_CB->packet && size > MAX_PACKET_SIZE)
+        return -1;
 
-    // Initialize buffer counter  
-    int buffer_counter=0;
-
-
-    while(buffer_counter < size && pipe_CB->reader != NULL){
-        // Store byte from our given buffer to the pipe_CB buffer
-        pipe_CB->buffer[pipe_CB->w_position] = buf[buffer_counter];
-        
-        // Increment w_position
-        pipe_CB->w_position++;
-        // Increment word length(distance between w and r position)
-        pipe_CB->word_length++;
-        
+    pipe_enter(pipe_CB, &pipe_CB->writing, &pipe_CB->has_space);
+
+    // Only the writer changes w_position
+    unsigned int w = pipe_CB->w_position;
+    unsigned int buffer_counter = 0;
+
+    if(pipe_CB->packet) {
+        packet_len len = size;
+        if(pipe_wait_space(pipe_CB, w, sizeof(len) + size) > 0) {
+            ring_put(pipe_CB, w, (const char*)&len, sizeof(len));
+            ring_put(pipe_CB, w + sizeof(len), buf, size);
+            w += sizeof(len) + size;
+            buffer_counter = size;
+            store_release(pipe_CB->w_position, w);
+            pipe_wakeup(&pipe_CB->r_waiting, &pipe_CB->has_data);
+        }
+    }
+    else while(buffer_counter < size) {
+        unsigned int space = pipe_wait_space(pipe_CB, w, 1);
+        if(space == 0) break;
 
-        // If writer wrote all buffer and reader is sleeping
-        // until new data is read from the pipe, to free space 
-        while(pipe_CB->word_length == (int)PIPE_BUFFER_SIZE)
-            kernel_wait(&pipe_CB->has_space,SCHED_PIPE);
+        unsigned int n = size - buffer_counter;
+        if(n > space) n = space;
+        ring_put(pipe_CB, w, buf + buffer_counter, n);
+        w += n;
+        buffer_counter += n;
+        store_release(pipe_CB->w_position, w);
 
-        // When writer pointer reaches end of buffer, cycle to the beginning
-        if(pipe_CB->w_position == ((int)PIPE_BUFFER_SIZE - 1)){
-            pipe_CB->w_position = 0;
-        }
         // Signal the reader that there are data available to read
-        kernel_broadcast(&pipe_CB->has_data);
-        // Increment buffer counter 
-        buffer_counter++;
-
+        pipe_wakeup(&pipe_CB->r_waiting, &pipe_CB->has_data);
     }
     
-    if(pipe_CB->reader == NULL && pipe_CB->word_length == size)
+    pipe_leave(pipe_CB, &pipe_CB->writing, &pipe_CB->has_space);
+
+    // The reader was closed
+    if(buffer_counter == 0)
         return -1;
     return buffer_counter;
 }
@@ -161,13 +319,15 @@ int pipe_write(void* pipecb_t, const char *buf, unsigned int size){
     3) The given size is valid.\n
     4) The reader is activated in order to proceed (sockets).\n
 
-    The "size" bytes of pipe's buffer are stored into the given buffer one by one. At every char
-    we read, the reader position increments, and word length decrements.
-    If word length = 0 in the pipe buffer the pipe reader is waiting until data are available
-    
-    The pipe buffer is bounded.
+    The reader takes its turn at the pipe and releases the kernel lock.
+    Then the available bytes of the ring are copied into the given buffer, 
+    and the new reader position is published to the writer, until "size" 
+    bytes have been read.
+    If the ring is empty, the reader sleeps until the writer adds data, 
+    or the writer is closed.
 
-    At the end broadcast that new space is available to write. (wake up writer) 
+    In a packet pipe, the reader copies the next message, discarding what
+    does not fit in the buffer.
     
     @param pipecb_t A pointer to a pipe_cb to read data from.
     @param *buf The buffer to store the data
@@ -180,40 +340,45 @@ int pipe_read(void* pipecb_t, char *buf, unsigned int size){
     if(pipe_CB==NULL || buf==NULL || size<1 || pipe_CB->reader == NULL )
         return -1;
 
-    // Initialize buffer counter
-    int buffer_counter=0;
-    
-    while(buffer_counter < size){
-        // No data to Read
-        while(pipe_CB->word_length==0){
-            if(pipe_CB->writer == NULL)
-                /*  In case there is no more data stored and writer is closed,
-                    return how much data has already been read.
-                    If writer was already closed when pipe_read() was called
-                    then it will return 0.
-                */
-                return buffer_counter;
-            /* if we expect someone to write, sleep till then*/
-            kernel_wait(&pipe_CB->has_data, SCHED_PIPE);
-        }
-
-        // Store the data that read
-        buf[buffer_counter] = pipe_CB->buffer[pipe_CB->r_position];
-        // Move to the next read position
-        pipe_CB->r_position++;
-        // Word length decrements
-        pipe_CB->word_length--;
-
-        // // When reader pointer reaches end of buffer, cycle to the beginning (Bounded Buffer)
-        if(pipe_CB->r_position == ((int)PIPE_BUFFER_SIZE - 1)){
-            pipe_CB->r_position = 0;
+    pipe_enter(pipe_CB, &pipe_CB->reading, &pipe_CB->has_data);
+
+    // Only the reader changes r_position
+    unsigned int r = pipe_CB->r_position;
+    unsigned int buffer_counter = 0;
+
+    if(pipe_CB->packet) {
+        // A message is published whole, with its length
+        if(pipe_wait_data(pipe_CB, r) > 0) {
+            packet_len len;
+            ring_get(pipe_CB, r, (char*)&len, sizeof(len));
+            buffer_counter = (len < size) ? len : size;
+            ring_get(pipe_CB, r + sizeof(len), buf, buffer_counter);
+            r += sizeof(len) + len;
+            store_release(pipe_CB->r_position, r);
+            pipe_wakeup(&pipe_CB->w_waiting, &pipe_CB->has_space);
         }
-        // If word_length < PIPE_BUFFER_SIZE then there is space to write new data.
-        if(pipe_CB->word_length<PIPE_BUFFER_SIZE)
-            kernel_broadcast(&pipe_CB->has_space);
-        // Increment buffer_counter
-        buffer_counter++;
     }
+    else while(buffer_counter < size) {
+        /*  In case there is no more data stored and writer is closed,
+            return how much data has already been read.
+            If writer was already closed when pipe_read() was called
+            then it will return 0.
+        */
+        unsigned int avail = pipe_wait_data(pipe_CB, r);
+        if(avail == 0) break;
+
+        unsigned int n = size - buffer_counter;
+        if(n > avail) n = avail;
+        ring_get(pipe_CB, r, buf + buffer_counter, n);
+        r += n;
+        buffer_counter += n;
+        store_release(pipe_CB->r_position, r);
+
+        // There is space to write new data.
+        pipe_wakeup(&pipe_CB->w_waiting, &pipe_CB->has_space);
+    }
+
+    pipe_leave(pipe_CB, &pipe_CB->reading, &pipe_CB->has_data);
     
     return buffer_counter;
     
@@ -242,8 +407,8 @@ int pipe_writer_close(void* _pipecb){
     // Wake reader to read the remaining data
     kernel_broadcast(&pipe_CB->has_data);
 
-    // If reader FCB is NULL too, free pipe control block
-    if (pipe_CB->reader == NULL)
+    // If reader FCB is NULL too, and nobody is inside, free pipe control block
+    if (pipe_CB->reader == NULL && pipe_CB->users == 0)
         free(pipe_CB);
     return 0;
 }
@@ -269,8 +434,11 @@ int pipe_reader_close(void* _pipecb){
     // Set reader FCB to null
     pipe_CB->reader = NULL;
 
-    // Deallocate the Pipe Control Bock if both reader-writer are closed
-    if(pipe_CB->writer == NULL)
+    // Wake a writer waiting for space, to fail
+    kernel_broadcast(&pipe_CB->has_space);
+
+    // Deallocate the Pipe Control Bock if both reader-writer are closed, and nobody is inside
+    if(pipe_CB->writer == NULL && pipe_CB->users == 0)
         free(pipe_CB);
 
     return 0;
@@ -1,12 +1,27 @@
 #include "tinyos.h"
 #include "kernel_streams.h"
-/* Size of Buffer 16kB*/
+/* Size of Buffer 16kB (a power of 2)*/
 #define PIPE_BUFFER_SIZE 16384
 
 /**
   @brief Pipe Control Block.
 
   This structure holds all information pertaining to a Pipe.
+
+  The buffer is a single-producer/single-consumer ring: only the writer
+  advances @c w_position and only the reader advances @c r_position. Both
+  are free-running counters (the index in the buffer is the counter modulo
+  @c PIPE_BUFFER_SIZE), published with release stores and read with
+  acquire loads, so that data is copied without the kernel lock.
+  Threads sharing an end take turns, so each end is used by one thread
+  at a time.
+
+  The kernel lock is only taken to sleep when the ring is empty or full;
+  the sleeper sets its @c waiting flag, and the peer takes the lock to
+  wake it only when the flag is set.
+
+  In a packet pipe, each message is stored in the ring after its length,
+  and both are published together, so a reader always finds whole messages.
  */
 typedef struct pipe_control_block {
     /* Pointers to read/write from buffer*/
@@ -16,17 +31,24 @@ typedef struct pipe_control_block {
     CondVar has_space;
     /* For blocking reader until data are available*/ 
     CondVar has_data;
-    /* Write and Read position in buffer*/
-    int w_position, r_position;
+    /* Write and Read position in buffer (free-running)*/
+    unsigned int w_position, r_position;
+    /* Set when the writer/reader sleeps on a full/empty ring*/
+    int w_waiting, r_waiting;
+    /* Set while a thread is writing/reading*/
+    int writing, reading;
+    /* Number of threads inside read or write*/
+    unsigned int users;
+    /* Set for a packet pipe, whose messages are prefixed by their length*/
+    int packet;
     /* Bounded (cyclic) byte buffer*/
     char buffer[PIPE_BUFFER_SIZE];
-
-    int word_length;
     
 } Pipe_CB;
 
 Pipe_CB* pipe_init();
 int sys_Pipe(pipe_t* pipe);
+int sys_PacketPipe(pipe_t* pipe);
 
 int pipe_write(void* pipecb_t, const char *buf, unsigned int n);
 
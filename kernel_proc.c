@@ -5,6 +5,8 @@
 #include "kernel_streams.h"
 #include "kernel_sched.h"  //added it to include PTCB structure
 #include "kernel_threads.h"
+#include "kernel_fs.h"
+#include "kernel_shm.h"
 
 
 /*
@@ -52,6 +54,7 @@ static inline void initialize_PCB(PCB* pcb)
   rlnode_init(& pcb->children_node, pcb);
   rlnode_init(& pcb->exited_node, pcb);
   pcb->child_exit = COND_INIT;
+  rlnode_init(& pcb->shm_list, NULL);
 }
 
 
@@ -168,8 +171,14 @@ Pid_t sys_Exec(Task call, int argl, void* args)
        if(newproc->FIDT[i])
           FCB_incref(newproc->FIDT[i]);
     }
+
+    /* Inherit shared memory attachments */
+    shm_inherit(curproc, newproc);
   }
 
+  /* The nice value is inherited */
+  sched_init_fair_entity(&newproc->fair, newproc->parent ? newproc->parent->fair.nice : 0);
+
 
   /* Set the main thread's function */
   newproc->main_task = call;
@@ -329,6 +338,9 @@ void sys_Exit(int exitval)
    */
   if(get_pid(curproc)==1) {
     while(sys_WaitChild(NOPROC,NULL)!=NOPROC);
+
+    /* Stop the daemons of mounted file systems, so that the system can halt */
+    halt_filesys();
   }
 
   sys_ThreadExit(exitval);
@@ -63,6 +63,10 @@ typedef struct process_control_block {
   rlnode ptcb_list;  // the list of ptcb's and thus tcb's that hang below this PCB
   int thread_count;  // the number of threads "children" to this process
 
+  fair_entity fair;  /**< @brief Fair-share scheduling data */
+
+  rlnode shm_list;   /**< @brief The shared memory regions attached to the process */
+
 } PCB;
 
 
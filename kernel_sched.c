@@ -12,9 +12,32 @@
 #endif
 
 //rafael
-#define QUEUES  5 // Number Of Queues for the MLFQ implementation
-#define BOOST_THRESHOLD  500  // Scheduling Operations Buffer: how many scheduling operations are between two priority boosts
-int SCHED_OPERATIONS = 0;  // global variable to count total scheduling operations *since last boost*
+#define QUEUES  32 // Number Of Queues for the MLFQ implementation (at most 64, see SCHED_BITMAP)
+#define BOOST_PERIOD  (50*QUANTUM)  // Default time between two priority boosts, in microseconds
+
+/* 
+	The tunable scheduler parameters (see SetSchedConfig). 
+	Protected by sched_spinlock. Reset to the defaults at each boot.
+*/
+static const sched_config SCHED_DEFAULTS = { QUEUES, QUANTUM, QUANTUM/4, BOOST_PERIOD, 0, 1 };
+static sched_config SCHED_CONFIG;
+
+static TimerDuration next_boost = 0;  // the time of the next priority boost
+static unsigned int boost_epoch = 0;  // the number of priority boosts so far
+
+/*
+	Admission control for deadline threads. Bandwidth is measured in
+	millionths of a core, and at most EDF_MAX_BANDWIDTH of each core can
+	be reserved. Protected by sched_spinlock.
+*/
+#define EDF_MAX_BANDWIDTH 950000
+static unsigned long edf_bandwidth = 0;  // the bandwidth reserved by deadline threads
+static unsigned int edf_threads = 0;     // the number of deadline threads
+
+static inline unsigned long edf_bandwidth_of(TimerDuration runtime, TimerDuration period)
+{
+	return (runtime * 1000000 + period - 1) / period;
+}
 
 
 
@@ -184,6 +207,15 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->curr_cause = SCHED_IDLE;
 
 	tcb->priority_level = 1; // the initialisation of MLFQ priority level.This may change at first use.
+	tcb->inherited_level = -1;
+	tcb->pi_held = 0;
+	tcb->boost_epoch = boost_epoch;
+	tcb->policy = SCHED_POLICY_MLFQ;
+
+	/* Inherit the affinity of the creator (there is none at boot) */
+	TCB* creator = cur_thread();
+	tcb->affinity = (creator != NULL) ? creator->affinity : ~0ul;
+	tcb->last_core = (creator != NULL) ? creator->last_core : 0;
 
 	/* Compute the stack segment address and size */
 	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
@@ -208,6 +240,12 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
  */
 void release_TCB(TCB* tcb)
 {
+	/* Release the bandwidth of a deadline thread */
+	if (tcb->policy == SCHED_POLICY_DEADLINE) {
+		edf_bandwidth -= edf_bandwidth_of(tcb->dl_runtime, tcb->dl_period);
+		edf_threads--;
+	}
+
 #ifndef NVALGRIND
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
@@ -244,16 +282,56 @@ void release_TCB(TCB* tcb)
 */
 
 rlnode SCHED[QUEUES];  // initialise the queues
+uint64_t SCHED_BITMAP;  // bit i is set iff SCHED[i] is not empty
 //rlnode SCHED; /* The scheduler queue */
 rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
+rlnode EDF_QUEUE; /* The ready deadline threads, by absolute deadline */
+rlnode EDF_THROTTLED; /* The deadline threads out of budget, by replenishment time */
 Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
 
+/*
+  Helpers to keep SCHED_BITMAP in sync with the queues.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static inline void sched_level_push(int level, TCB* tcb)
+{
+	rlist_push_back(&SCHED[level], &tcb->sched_node);
+	SCHED_BITMAP |= (1ull << level);
+}
+
+static inline void sched_level_remove(TCB* tcb)
+{
+	rlnode* node = &tcb->sched_node;
+	/* If tcb is alone in its queue, its neighbour is the queue head */
+	if (node->next == node->prev)
+		SCHED_BITMAP &= ~(1ull << (node->next - SCHED));
+	rlist_remove(node);
+}
+
+/* Check if a thread may run on the current core */
+static inline int sched_allowed(TCB* tcb)
+{
+	return (tcb->affinity >> cpu_core_id) & 1;
+}
+
 /* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
+void yield_handler() { yield(CURCORE.timer_event ? SCHED_EVENT : SCHED_QUANTUM); }
 
-/* Interrupt handle for inter-core interrupts */
+/* 
+  Interrupt handler for inter-core interrupts. These are sent to a core
+  that should preempt its current thread for a woken thread, or to a
+  tickless core whose timer must be set, when a thread is queued for it.
+*/
 void ici_handler()
-{ /* noop for now... */
+{
+	if (CURCORE.ici_resched) {
+		CURCORE.ici_resched = 0;
+		yield(SCHED_EVENT);
+	} else if (!CURCORE.timer_armed) {
+		CURCORE.timer_armed = 1;
+		bios_set_timer(CURTHREAD->its);
+	}
 }
 
 /*
@@ -280,73 +358,521 @@ static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Priority boost.
+
+  Every boost_period microseconds, all threads are moved to the top queue.
+  To keep this cheap, the boost appends the lower queues to the top queue
+  (one splice per level), and counts a new boost epoch. The priority_level
+  of each thread is fixed lazily, the next time the thread passes through 
+  the scheduler queue, by comparing its boost_epoch to the current one.
 
   *** MUST BE CALLED WITH sched_spinlock HELD ***
 */
-static void sched_queue_add(TCB* tcb)
+static void sched_boost_check(TCB* tcb)
 {
+	if (tcb->boost_epoch != boost_epoch) {
+		tcb->boost_epoch = boost_epoch;
+		tcb->priority_level = 0;
+	}
+}
 
-	/*
-		Here, we implement the algorithm for the MLFQ
-		first:
-			-Increment number of scheduler Operations
-			-Check at which level queue we re at(our thread)(might need to use tcb->its or create new tcb field "priority")
-			-If sched_cause=sched_quantum, then put to below queue, if it exists
-			-if sched_cause = sched_io (blocked waiting for input output), put it to the above queue
-			-If sched_cause = mutex, put to lowermost, or exactly below queue
-			-Else, if sched_cause is something else, leave the priority(level) as it is
-
-		After that, we re gonna implement the priority boost:
-			-Traverse all the lists of the MLFQ
-			-Increase the priority of all threads by 1 level(except the ones that are already in the top Queue)
-			(alternatively, we can put every thread at the first queue)
-
-		Last but not least, we have to comment out the line that adds the tcb to the SCHED list, below.
-	*/
+static void sched_boost()
+{
+	TimerDuration now = bios_clock();
+	if (SCHED_CONFIG.boost_period == 0 || now < next_boost)
+		return;
+
+	for (uint64_t b = SCHED_BITMAP & ~1ull; b; b &= b - 1)
+		rlist_append(&SCHED[0], &SCHED[__builtin_ctzll(b)]);
+	if (SCHED_BITMAP)
+		SCHED_BITMAP = 1;
+	boost_epoch++;
+	next_boost = now + SCHED_CONFIG.boost_period;
+}
 
-	SCHED_OPERATIONS++;  /*a scheduling operation is a sched queue add*/
+/*
+  Return the MLFQ level of a thread that leaves the core, according
+  to the cause of the end of its time-slice:
+	-If sched_cause=sched_quantum, then put to below queue, if it exists
+	-if sched_cause = sched_io (blocked waiting for input output), put it to the above queue
+	-If sched_cause = mutex, put to lowermost queue
+	-Else, if sched_cause is something else, leave the priority(level) as it is
 
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static int sched_feedback_level(TCB* tcb)
+{
+	sched_boost_check(tcb);
 
-	// Priority assignment based on the last SCHED_CAUSE
-	// int current_queue= (tcb->its / QUANTUM)-1;  //here we store the priority of our thread
 	int current_queue = tcb->priority_level;
-	if((tcb->curr_cause==SCHED_QUANTUM) && (current_queue != (QUEUES-1))){ // demote if not already in lowermost queue AND yielded because of QUANTUM
-		rlist_push_back(&SCHED[current_queue+1], &tcb->sched_node);  // push (insert) to lower priority queue
-		tcb->priority_level++;
+	if((tcb->curr_cause==SCHED_QUANTUM) && (current_queue != (QUEUES-1))) // demote if not already in lowermost queue AND yielded because of QUANTUM
+		return current_queue+1;
+	else if((tcb->curr_cause==SCHED_IO) && (current_queue != 0))  // if the thread yielded because of I/O and we are NOT in the highest priority queue
+		return current_queue-1;
+	else if(tcb->curr_cause==SCHED_MUTEX)  // if yielded because of MUTEX lock, demote/push to Last Queue
+		return QUEUES-1;
+	else
+		return current_queue;  // leave priority as is
+}
+
+/*
+  Deadline scheduling.
+
+  Deadline threads are kept in EDF_QUEUE, sorted by absolute deadline, and 
+  are dispatched before any MLFQ thread. The budget of a deadline thread is 
+  charged in yield() with the time it ran, and enforced by the ALARM timer
+  (the time-slice of a deadline thread is its remaining budget). A thread 
+  that exhausts its budget is throttled in EDF_THROTTLED, until its next
+  period starts. When a thread wakes up, it keeps its current deadline only 
+  if its remaining budget does not exceed its bandwidth until that deadline 
+  (this is the Constant Bandwidth Server rule).
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static TimerDuration edf_deadline(TCB* tcb) { return tcb->dl_abs_deadline; }
+static TimerDuration edf_replenish_time(TCB* tcb) 
+{ 
+	return tcb->dl_abs_deadline - tcb->dl_deadline + tcb->dl_period; 
+}
+
+/* Insert into list, after the entries with a smaller or equal key */
+static void edf_insert(rlnode* list, TCB* tcb, TimerDuration (*key)(TCB*))
+{
+	rlnode* n = list->next;
+	for (; n != list; n = n->next)
+		if (key(tcb) < key(n->tcb))
+			break;
+	rl_splice(n->prev, &tcb->sched_node);
+}
+
+static void edf_add(TCB* tcb)
+{
+	if (tcb->dl_budget > 0)
+		edf_insert(&EDF_QUEUE, tcb, edf_deadline);
+	else
+		edf_insert(&EDF_THROTTLED, tcb, edf_replenish_time);
+}
+
+static TCB* edf_first_allowed()
+{
+	for (rlnode* n = EDF_QUEUE.next; n != &EDF_QUEUE; n = n->next)
+		if (sched_allowed(n->tcb))
+			return n->tcb;
+	return NULL;
+}
+
+static void edf_wakeup(TCB* tcb)
+{
+	TimerDuration now = bios_clock();
+	if (now >= tcb->dl_abs_deadline
+		|| (tcb->dl_budget > 0 && 
+			(TimerDuration)tcb->dl_budget * tcb->dl_period > (tcb->dl_abs_deadline - now) * tcb->dl_runtime)) {
+		tcb->dl_abs_deadline = now + tcb->dl_deadline;
+		tcb->dl_budget = tcb->dl_runtime;
 	}
-	else if((tcb->curr_cause==SCHED_IO) && (current_queue != 0)){  // if the thread yielded because of I/O and we are NOT in the highest priority queue
-		rlist_push_back(&SCHED[current_queue-1], &tcb->sched_node);
-		tcb->priority_level--;
+}
+
+static void edf_replenish_expired()
+{
+	TimerDuration now = bios_clock();
+
+	while (!is_rlist_empty(&EDF_THROTTLED)) {
+		TCB* tcb = EDF_THROTTLED.next->tcb;
+		if (edf_replenish_time(tcb) > now)
+			break;
+		rlist_remove(&tcb->sched_node);
+
+		while (tcb->dl_budget <= 0) {
+			tcb->dl_abs_deadline += tcb->dl_period;
+			tcb->dl_budget += tcb->dl_runtime;
+		}
+		if (tcb->dl_abs_deadline < now) {
+			tcb->dl_abs_deadline = now + tcb->dl_deadline;
+			tcb->dl_budget = tcb->dl_runtime;
+		}
+		edf_insert(&EDF_QUEUE, tcb, edf_deadline);
 	}
-	// else if sched cause == MUTEX, send to last queue
-	else if((tcb->curr_cause==SCHED_MUTEX) && (current_queue != (QUEUES-1))){  // if yielded because of MUTEX lock, demote/push to Last Queue
-	    rlist_push_back(&SCHED[QUEUES-1],&tcb->sched_node);
-		tcb->priority_level = QUEUES-1;
+}
+
+/*
+  Return the time of the next event of the deadline threads: a replenishment,
+  or the timeout of a sleeping deadline thread. Return NO_TIMEOUT if there
+  is no such event, and the current time if a deadline thread is ready.
+*/
+static TimerDuration edf_next_event()
+{
+	if (edf_threads == 0)
+		return NO_TIMEOUT;
+	if (!is_rlist_empty(&EDF_QUEUE))
+		return bios_clock();
+
+	TimerDuration event = is_rlist_empty(&EDF_THROTTLED) ? NO_TIMEOUT
+		: edf_replenish_time(EDF_THROTTLED.next->tcb);
+
+	for (rlnode* n = TIMEOUT_LIST.next; n != &TIMEOUT_LIST && n->tcb->wakeup_time < event; n = n->next)
+		if (n->tcb->policy == SCHED_POLICY_DEADLINE) {
+			event = n->tcb->wakeup_time;
+			break;
+		}
+	return event;
+}
+
+/*
+  Fair-share scheduling.
+
+  The processes with ready threads are kept in FAIR_HEAP, a pairing heap 
+  ordered by virtual runtime. The threads of each process wait in FIFO 
+  order, in its ready list. In yield(), the process of the current thread
+  is charged with the time the thread ran, scaled by its weight.
+
+  A process which had no ready threads is placed at no less than one 
+  quantum behind fair_min_vruntime, the (monotonic) least virtual runtime.
+  Thus, a process that slept for a long time cannot monopolize the CPU.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static fair_entity* FAIR_HEAP;         // the heap root, or NULL
+static uint64_t fair_min_vruntime;     // the least virtual runtime
+
+/* The weights for nice values -20 to 19; each step is about 25% */
+static const unsigned int nice_to_weight[40] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	9548,  7620,  6100,  4904,  3906,
+	3121,  2501,  1991,  1586,  1277,
+	1024,   820,   655,   526,   423,
+	335,   272,   215,   172,   137,
+	110,    87,    70,    56,    45,
+	36,    29,    23,    18,    15,
+};
+#define NICE_0_WEIGHT 1024
+
+void sched_init_fair_entity(fair_entity* fe, int nice)
+{
+	fe->vruntime = 0;
+	fe->nice = nice;
+	fe->weight = nice_to_weight[nice + 20];
+	rlnode_init(&fe->ready, NULL);
+	fe->queued = 0;
+	fe->child = fe->sibling = fe->prev = NULL;
+}
+
+/* Meld two heaps, returning the new root */
+static fair_entity* fair_meld(fair_entity* a, fair_entity* b)
+{
+	if (a == NULL) return b;
+	if (b == NULL) return a;
+	if (b->vruntime < a->vruntime) {
+		fair_entity* t = a; a = b; b = t;
 	}
-	else
-		rlist_push_back(&SCHED[current_queue], &tcb->sched_node);  // leave priority as is
+	/* b becomes the first child of a */
+	b->prev = a;
+	b->sibling = a->child;
+	if (a->child)
+		a->child->prev = b;
+	a->child = b;
+	return a;
+}
 
+/* Meld a list of siblings into a heap, in two passes */
+static fair_entity* fair_merge_pairs(fair_entity* first)
+{
+	/* Meld pairs from left to right, collecting them in reverse */
+	fair_entity* pairs = NULL;
+	while (first) {
+		fair_entity* a = first;
+		fair_entity* b = a->sibling;
+		first = b ? b->sibling : NULL;
+		a->sibling = a->prev = NULL;
+		if (b)
+			b->sibling = b->prev = NULL;
+		fair_entity* m = fair_meld(a, b);
+		m->sibling = pairs;
+		pairs = m;
+	}
 
-	// At a rate determined by BOOST_THRESHOLD, the scheduler gives a boost in the priority of low priority threads
-	// append all queues, in series, to the first queue
-	if(SCHED_OPERATIONS==BOOST_THRESHOLD){
-		int i;
-		for(i=0;i<(QUEUES-1);i++){
-			rlist_append(&SCHED[i],&SCHED[i+1]);
+	/* Meld the pairs from right to left */
+	fair_entity* root = NULL;
+	while (pairs) {
+		fair_entity* next = pairs->sibling;
+		pairs->sibling = NULL;
+		root = fair_meld(root, pairs);
+		pairs = next;
+	}
+	return root;
+}
 
-			rlnode* p = SCHED[i].next;
-			while(p!=&SCHED[i]) {
-				p->tcb->priority_level = i;
-				p = p->next;
-			}
+static void fair_insert(fair_entity* fe)
+{
+	fe->child = fe->sibling = fe->prev = NULL;
+	FAIR_HEAP = fair_meld(FAIR_HEAP, fe);
+	fe->queued = 1;
+}
+
+static void fair_remove(fair_entity* fe)
+{
+	if (fe == FAIR_HEAP) {
+		FAIR_HEAP = fair_merge_pairs(fe->child);
+	} else {
+		/* Unlink fe from its parent or previous sibling */
+		if (fe->prev->child == fe)
+			fe->prev->child = fe->sibling;
+		else
+			fe->prev->sibling = fe->sibling;
+		if (fe->sibling)
+			fe->sibling->prev = fe->prev;
+		FAIR_HEAP = fair_meld(FAIR_HEAP, fair_merge_pairs(fe->child));
+	}
+	fe->child = fe->sibling = fe->prev = NULL;
+	fe->queued = 0;
+}
+
+static void fair_add(TCB* tcb)
+{
+	fair_entity* fe = &tcb->owner_pcb->fair;
+	rlist_push_back(&fe->ready, &tcb->sched_node);
+
+	if (!fe->queued) {
+		uint64_t lag = SCHED_CONFIG.quantum;
+		uint64_t floor = (fair_min_vruntime > lag) ? fair_min_vruntime - lag : 0;
+		if (fe->vruntime < floor)
+			fe->vruntime = floor;
+		fair_insert(fe);
+	}
+}
+
+static void fair_remove_thread(TCB* tcb)
+{
+	fair_entity* fe = &tcb->owner_pcb->fair;
+	rlist_remove(&tcb->sched_node);
+	if (is_rlist_empty(&fe->ready))
+		fair_remove(fe);
+}
+
+/* Remove a thread of the process with the least vruntime, to run it */
+static TCB* fair_take(TCB* tcb)
+{
+	fair_entity* fe = &tcb->owner_pcb->fair;
+	if (fe->vruntime > fair_min_vruntime)
+		fair_min_vruntime = fe->vruntime;
+
+	fair_remove_thread(tcb);
+	return tcb;
+}
+
+static TCB* fair_first_allowed(fair_entity* fe)
+{
+	for (rlnode* n = fe->ready.next; n != &fe->ready; n = n->next)
+		if (sched_allowed(n->tcb))
+			return n->tcb;
+	return NULL;
+}
+
+static void fair_charge(TCB* tcb, TimerDuration runtime)
+{
+	fair_entity* fe = &tcb->owner_pcb->fair;
+	int queued = fe->queued;
+
+	/* The heap is re-ordered by re-inserting fe */
+	if (queued)
+		fair_remove(fe);
+	fe->vruntime += runtime * NICE_0_WEIGHT / fe->weight;
+	if (queued)
+		fair_insert(fe);
+}
+
+/*
+  A preempted thread keeps the core, unless another process 
+  has less virtual runtime, or another thread of the same process
+  is waiting.
+*/
+static TCB* fair_select(TCB* current)
+{
+	int runnable = (current->state == READY && current->type != IDLE_THREAD 
+		&& current->policy == SCHED_POLICY_MLFQ && sched_allowed(current));
+
+	/* Set aside the processes with no thread allowed on this core */
+	fair_entity* stash = NULL;
+	TCB* tcb = NULL;
+	while (FAIR_HEAP != NULL && (tcb = fair_first_allowed(FAIR_HEAP)) == NULL) {
+		fair_entity* fe = FAIR_HEAP;
+		fair_remove(fe);
+		fe->sibling = stash;
+		stash = fe;
+	}
+
+	TCB* next_thread;
+	fair_entity* fe = &current->owner_pcb->fair;
+	if (tcb == NULL)
+		next_thread = runnable ? current : &CURCORE.idle_thread;
+	else if (runnable && (current->curr_cause == SCHED_QUANTUM || current->curr_cause == SCHED_EVENT)
+		&& FAIR_HEAP != fe && fe->vruntime <= FAIR_HEAP->vruntime)
+		next_thread = current;
+	else
+		next_thread = fair_take(tcb);
+
+	while (stash) {
+		fair_entity* next = stash->sibling;
+		fair_insert(stash);
+		stash = next;
+	}
+	return next_thread;
+}
+
+/*
+  Move the queued threads between the multi-level feedback queue and
+  the fair-share heap.
+*/
+static void sched_set_fair_share(int fair_share)
+{
+	if (fair_share) {
+		while (SCHED_BITMAP) {
+			TCB* tcb = SCHED[__builtin_ctzll(SCHED_BITMAP)].next->tcb;
+			sched_level_remove(tcb);
+			fair_add(tcb);
 		}
-		SCHED_OPERATIONS=0;
+	} else {
+		while (FAIR_HEAP) {
+			TCB* tcb = fair_take(FAIR_HEAP->ready.next->tcb);
+			sched_level_push(sched_effective_priority(tcb), tcb);
+		}
+	}
+	SCHED_CONFIG.fair_share = fair_share;
+}
+
+/*
+  Insert a READY thread into the scheduler queue of its class, or
+  remove it.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void sched_queue_insert(TCB* tcb)
+{
+	if (tcb->policy == SCHED_POLICY_DEADLINE)
+		edf_add(tcb);
+	else if (SCHED_CONFIG.fair_share)
+		fair_add(tcb);
+	else
+		// A thread holding a PIMutex may run at the level of its top waiter
+		sched_level_push(sched_effective_priority(tcb), tcb);
+}
+
+static void sched_queue_remove(TCB* tcb)
+{
+	if (tcb->policy == SCHED_POLICY_DEADLINE)
+		rlist_remove(&tcb->sched_node);
+	else if (SCHED_CONFIG.fair_share)
+		fair_remove_thread(tcb);
+	else
+		sched_level_remove(tcb);
+}
+
+/* The rank of the idle thread, and of a core that was sent an ICI to reschedule */
+#define IDLE_RANK QUEUES
+#define KICKED_RANK (-2)
+
+/*
+  The rank of a thread, used to pick a core to preempt for it: deadline
+  threads come first, then the MLFQ levels (all threads are equal in
+  fair-share mode), then the idle thread.
+*/
+static inline int sched_rank(TCB* tcb)
+{
+	if (tcb->type == IDLE_THREAD)
+		return IDLE_RANK;
+	if (tcb->policy == SCHED_POLICY_DEADLINE)
+		return -1;
+	if (SCHED_CONFIG.fair_share)
+		return 0;
+	return sched_effective_priority(tcb);
+}
+
+/*
+  Check if some thread is waiting for a core.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static inline int sched_contended()
+{
+	return SCHED_BITMAP != 0 || !is_rlist_empty(&EDF_QUEUE) || FAIR_HEAP != NULL;
+}
+
+/*
+  A thread was queued. Among the cores it may run on, pick the one whose
+  current thread has the lowest rank, if that is below the thread's own
+  (an idle core is always picked), preferring the core the thread last
+  ran on. The chosen core is sent an inter-core interrupt to reschedule.
+
+  Else, if the thread may run on a core whose current thread runs without
+  a time-slice limit (tickless), that core is sent an inter-core interrupt
+  to set its timer, so that the thread eventually gets the core.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void sched_wake_core(TCB* tcb)
+{
+	uint ncores = cpu_cores();
+	int rank = sched_rank(tcb);
+	CCB* target = NULL;
+	CCB* tickless = NULL;
+
+	for (uint i = 0; i < ncores; i++) {
+		uint c = (tcb->last_core + i) % ncores;
+		CCB* ccb = &cctx[c];
+		if (!((tcb->affinity >> c) & 1))
+			continue;
+		if (ccb->rank > rank) {
+			rank = ccb->rank;
+			target = ccb;
+		} else if (ccb->tickless && tickless == NULL)
+			tickless = ccb;
+	}
+
+	if (target != NULL) {
+		target->rank = KICKED_RANK;
+		target->ici_resched = 1;
+		target->tickless = 0;
+		SCHED_STAT_INC(ici_kicks);
+		cpu_ici(target->id);
+	} else if (tickless != NULL) {
+		tickless->tickless = 0;
+		SCHED_STAT_INC(tickless_arms);
+		cpu_ici(tickless->id);
 	}
+}
 
+/*
+  Return the time of the next event for the timer, or NO_TIMEOUT: the next 
+  deadline-thread event, or the earliest timeout. Timeouts are events in
+  both modes, so that a sleeping thread is woken up on time, rather than
+  at the end of the next quantum.
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static TimerDuration sched_next_event()
+{
+	TimerDuration event = edf_next_event();
+	if (!is_rlist_empty(&TIMEOUT_LIST)
+		&& TIMEOUT_LIST.next->tcb->wakeup_time < event)
+		event = TIMEOUT_LIST.next->tcb->wakeup_time;
+	return event;
+}
+
+/*
+  Add TCB to the end of the scheduler list.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void sched_queue_add(TCB* tcb)
+{
+	/* The priority boost is done in sched_queue_select(). */
+	if (tcb->policy == SCHED_POLICY_MLFQ && !SCHED_CONFIG.fair_share)
+		tcb->priority_level = sched_feedback_level(tcb);
+
+	sched_queue_insert(tcb);
+
+	/* Get the thread a core */
+	sched_wake_core(tcb);
 }
 
 /*
@@ -366,6 +892,10 @@ static void sched_make_ready(TCB* tcb)
 		tcb->wakeup_time = NO_TIMEOUT;
 	}
 
+	/* A waking deadline thread may need a new deadline */
+	if (tcb->policy == SCHED_POLICY_DEADLINE)
+		edf_wakeup(tcb);
+
 	/* Mark as ready */
 	tcb->state = READY;
 
@@ -393,6 +923,45 @@ static void sched_wakeup_expired_timeouts()
 	}
 }
 
+/*
+  Return the first thread of the highest priority level which may run
+  on this core, storing its level in *level, or NULL.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static TCB* sched_first_allowed(int* level)
+{
+	for (uint64_t b = SCHED_BITMAP; b; b &= b - 1) {
+		int l = __builtin_ctzll(b);
+		for (rlnode* n = SCHED[l].next; n != &SCHED[l]; n = n->next)
+			if (sched_allowed(n->tcb)) {
+				*level = l;
+				return n->tcb;
+			}
+	}
+	return NULL;
+}
+
+/*
+  Check if the current thread, preempted at the end of its quantum,
+  has higher priority than the best queued thread (at best_level). 
+  If so, apply its new level and return 1.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static int sched_keeps_core(TCB* current, int best_level)
+{
+	int level = sched_feedback_level(current);
+	int inherited = current->inherited_level;
+	int effective = (inherited >= 0 && inherited < level) ? inherited : level;
+
+	if (best_level <= effective)
+		return 0;
+
+	current->priority_level = level;
+	return 1;
+}
+
 /*
   Remove the head of the scheduler list, if any, and
   return it. Return NULL if the list is empty.
@@ -411,30 +980,93 @@ static TCB* sched_queue_select(TCB* current)
 		-If it is, make sure the next thread to be executed is the idle_thread
 	*/
 
-	int non_empty_list;  //the first queue found to be non empty
-	for(non_empty_list=0;non_empty_list<(QUEUES-1);non_empty_list++){
-		if(is_rlist_empty(&SCHED[non_empty_list])!=1)
-			break;
+	sched_boost();
+	edf_replenish_expired();
+
+	/* Only threads whose affinity includes this core are considered */
+	int allowed = sched_allowed(current);
+	int dl_current = (current->state == READY && current->policy == SCHED_POLICY_DEADLINE);
+	TCB* edf_next = edf_first_allowed();
+
+	TCB* next_thread;
+	if (dl_current && allowed && current->dl_budget > 0 && (edf_next == NULL
+			|| current->dl_abs_deadline <= edf_next->dl_abs_deadline)) {
+		// a deadline thread keeps the core, while it is the most urgent one
+		next_thread = current;
+	} else if (edf_next != NULL) {
+		// deadline threads are dispatched before the MLFQ
+		rlist_remove(&edf_next->sched_node);
+		next_thread = edf_next;
+	} else if (SCHED_CONFIG.fair_share) {
+		next_thread = fair_select(current);
+	} else {
+		// the first element of the highest priority non-empty queue
+		int level = QUEUES;
+		TCB* tcb = sched_first_allowed(&level);
+
+		if (current->state == READY && current->type != IDLE_THREAD && !dl_current && allowed
+			&& (current->curr_cause == SCHED_QUANTUM || current->curr_cause == SCHED_EVENT)
+			&& sched_keeps_core(current, level)) {
+			// a preempted thread keeps the core, if no ready thread has a higher priority
+			next_thread = current;
+		} else if (tcb != NULL) {
+			sched_level_remove(tcb);
+			next_thread = tcb;
+		} else {
+			// all the queues are empty, so the core runs the current (unless throttled) or the idle thread
+			next_thread = (current->state == READY && !dl_current && allowed) ? current : &CURCORE.idle_thread;
+		}
 	}
 
-	// select the first element of highest priority list we found to be non empty
-	rlnode* sel = rlist_pop_front(&SCHED[non_empty_list]);
+	if (next_thread->policy == SCHED_POLICY_DEADLINE) {
+		// the time-slice of a deadline thread is its remaining budget
+		next_thread->its = next_thread->dl_budget;
+	} else if (SCHED_CONFIG.fair_share) {
+		next_thread->its = SCHED_CONFIG.quantum;
+	} else {
+		sched_boost_check(next_thread);
 
-	// check if all the queues are empty, and if thats the case, make the core to run the idle_thread:
-	TCB* next_thread = sel->tcb;
-	if((non_empty_list==(QUEUES-1))){
-		if(next_thread == NULL)
-			next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		// Quantum time is specified for each thread according its priority(lower priority, longer quantum)
+		next_thread->its = SCHED_CONFIG.quantum + sched_effective_priority(next_thread)*SCHED_CONFIG.quantum_step;
 	}
 
-
-	// Quantum time is specified for each thread according its priority(high priority high quantum)
-	//next_thread->its = (non_empty_list+1)*QUANTUM;
-	next_thread->its = QUANTUM;
+	CURCORE.rank = sched_rank(next_thread);
 
 	return next_thread;
 }
 
+int sched_effective_priority(TCB* tcb)
+{
+	/* Deadline threads rank above all MLFQ levels */
+	if (tcb->policy == SCHED_POLICY_DEADLINE)
+		return 0;
+
+	int level = tcb->inherited_level;
+	return (level >= 0 && level < tcb->priority_level) ? level : tcb->priority_level;
+}
+
+void sched_set_inherited_priority(TCB* tcb, int level)
+{
+	int oldpre = preempt_off;
+	Mutex_Lock(&sched_spinlock);
+
+	sched_boost_check(tcb);
+	int old = sched_effective_priority(tcb);
+	tcb->inherited_level = level;
+
+	/* A READY thread with a clean context is in the scheduler queue */
+	int new = sched_effective_priority(tcb);
+	if (tcb->state == READY && tcb->phase == CTX_CLEAN && new != old 
+		&& tcb->policy == SCHED_POLICY_MLFQ && !SCHED_CONFIG.fair_share) {
+		sched_level_remove(tcb);
+		sched_level_push(new, tcb);
+	}
+
+	Mutex_Unlock(&sched_spinlock);
+	if (oldpre)
+		preempt_on;
+}
+
 /*
   Make the process ready.
  */
@@ -483,12 +1115,15 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 		sched_register_timeout(tcb, timeout);
 
 	/* Release mx */
-	if (mx != NULL)
-		Mutex_Unlock(mx);
+	int handoff = (mx != NULL) && mutex_release(mx);
 
 	/* Release the schduler spinlock before calling yield() !!! */
 	Mutex_Unlock(&sched_spinlock);
 
+	/* If mx has morphed waiters, wake one up (this needs the spinlock) */
+	if (handoff)
+		mutex_handoff(mx);
+
 	/* call this to schedule someone else */
 	yield(cause);
 
@@ -502,7 +1137,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 void yield(enum SCHED_CAUSE cause)
 {
 	/* Reset the timer, so that we are not interrupted by ALARM */
-	TimerDuration remaining = bios_cancel_timer();
+	TimerDuration remaining = CURCORE.timer_armed ? bios_cancel_timer() : 0;
 
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
@@ -511,6 +1146,11 @@ void yield(enum SCHED_CAUSE cause)
 
 	Mutex_Lock(&sched_spinlock);
 
+	/* The core is in the scheduler, it need not be sent an ICI */
+	CURCORE.timer_armed = 0;
+	CURCORE.tickless = 0;
+	CURCORE.ici_resched = 0;
+
 	/* Update CURTHREAD state */
 	if (current->state == RUNNING)
 		current->state = READY;
@@ -520,6 +1160,12 @@ void yield(enum SCHED_CAUSE cause)
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
 
+	/* Charge a deadline thread, or the process in fair-share mode, for the time-slice */
+	if (current->policy == SCHED_POLICY_DEADLINE)
+		current->dl_budget -= bios_clock() - current->slice_start;
+	else if (SCHED_CONFIG.fair_share && current->type != IDLE_THREAD)
+		fair_charge(current, bios_clock() - current->slice_start);
+
 	/* Wake up threads whose sleep timeout has expired */
 	sched_wakeup_expired_timeouts();
 
@@ -534,6 +1180,7 @@ void yield(enum SCHED_CAUSE cause)
 
 	/* Switch contexts */
 	if (current != next) {
+		SCHED_STAT_INC(ctx_switches);
 		CURTHREAD = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
@@ -566,6 +1213,7 @@ void gain(int preempt)
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	current->last_core = cpu_core_id;
 
 	/* Take care of the previous thread */
 	TCB* prev = CURCORE.previous_thread;
@@ -586,6 +1234,30 @@ void gain(int preempt)
 		}
 	}
 
+	/* 
+	  In tickless mode, the time-slice is enforced only when some thread is 
+	  waiting (and always for a deadline thread, whose slice is its budget).
+	*/
+	TimerDuration timer = NO_TIMEOUT;
+	if (!SCHED_CONFIG.tickless || current->policy == SCHED_POLICY_DEADLINE
+		|| (current->type != IDLE_THREAD && sched_contended()))
+		timer = current->rts;
+	CURCORE.tickless = (timer == NO_TIMEOUT && current->type != IDLE_THREAD);
+
+	/* Cut the time-slice short for the next event */
+	TimerDuration event = sched_next_event();
+	CURCORE.timer_event = 0;
+	if (event != NO_TIMEOUT) {
+		TimerDuration now = bios_clock();
+		TimerDuration delay = (event > now) ? event - now : 1;
+		if (delay < timer) {
+			timer = delay;
+			CURCORE.timer_event = 1;
+		}
+	}
+	CURCORE.timer_armed = (timer != NO_TIMEOUT);
+	current->slice_start = bios_clock();
+
 	Mutex_Unlock(&sched_spinlock);
 
 	/* Reset preemption as needed */
@@ -593,7 +1265,10 @@ void gain(int preempt)
 		preempt_on;
 
 	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+	if (timer != NO_TIMEOUT) {
+		SCHED_STAT_INC(timer_arms);
+		bios_set_timer(timer);
+	}
 }
 
 static void idle_thread()
@@ -625,10 +1300,228 @@ void initialize_scheduler()
 	int counter;
 	for(counter=0;counter<QUEUES;counter++)
 		rlnode_init(&SCHED[counter], NULL);
+	SCHED_BITMAP = 0;
 
 	rlnode_init(&TIMEOUT_LIST, NULL);  //the timeout list hosts the threads that are waiting for something
+	rlnode_init(&EDF_QUEUE, NULL);
+	rlnode_init(&EDF_THROTTLED, NULL);
+	edf_bandwidth = 0;
+	edf_threads = 0;
+
+	FAIR_HEAP = NULL;
+	fair_min_vruntime = 0;
+
+	SCHED_CONFIG = SCHED_DEFAULTS;
+	boost_epoch = 0;
+	next_boost = bios_clock() + SCHED_CONFIG.boost_period;
+
+#if defined(SCHED_STATISTICS)
+	sched_stats = (sched_statistics){ 0 };
+#endif
+}
+
+int sys_GetSchedConfig(sched_config* config)
+{
+	if (config == NULL)
+		return -1;
+
+	int preempt = preempt_off;
+	Mutex_Lock(&sched_spinlock);
+	*config = SCHED_CONFIG;
+	Mutex_Unlock(&sched_spinlock);
+	if (preempt)
+		preempt_on;
+	return 0;
+}
+
+int sys_SetSchedConfig(const sched_config* config)
+{
+	if (config == NULL || config->quantum < 1000 || config->quantum > 1000000
+		|| config->quantum_step > 1000000)
+		return -1;
+
+	int preempt = preempt_off;
+	Mutex_Lock(&sched_spinlock);
+	SCHED_CONFIG.quantum = config->quantum;
+	SCHED_CONFIG.quantum_step = config->quantum_step;
+	SCHED_CONFIG.boost_period = config->boost_period;
+	SCHED_CONFIG.tickless = config->tickless;
+	next_boost = bios_clock() + config->boost_period;
+	if (!config->fair_share != !SCHED_CONFIG.fair_share)
+		sched_set_fair_share(config->fair_share != 0);
+	Mutex_Unlock(&sched_spinlock);
+	if (preempt)
+		preempt_on;
+	return 0;
+}
+
+/* Return the TCB of a live thread of the current process, or NULL */
+static TCB* sched_find_thread(Tid_t tid)
+{
+	PTCB* ptcb = (PTCB*) tid;
+	if (tid == NOTHREAD || rlist_find(&CURPROC->ptcb_list, ptcb, NULL) == NULL || ptcb->exited)
+		return NULL;
+	return ptcb->tcb;
+}
+
+int sys_SetSchedParams(Tid_t tid, const sched_params* params)
+{
+	TCB* tcb = sched_find_thread(tid);
+	if (tcb == NULL || params == NULL)
+		return -1;
+
+	unsigned long bw = 0;
+	if (params->policy == SCHED_POLICY_DEADLINE) {
+		if (params->runtime < 1000 || params->runtime > params->deadline 
+			|| params->deadline > params->period || params->period > 10000000)
+			return -1;
+		bw = edf_bandwidth_of(params->runtime, params->period);
+	} else if (params->policy != SCHED_POLICY_MLFQ)
+		return -1;
+
+	int ret = -1;
+	int preempt = preempt_off;
+	Mutex_Lock(&sched_spinlock);
+
+	unsigned long oldbw = (tcb->policy == SCHED_POLICY_DEADLINE) 
+		? edf_bandwidth_of(tcb->dl_runtime, tcb->dl_period) : 0;
+
+	if (edf_bandwidth - oldbw + bw <= cpu_cores() * EDF_MAX_BANDWIDTH) {
+		/* A READY thread with a clean context is in the scheduler queue */
+		int queued = (tcb->state == READY && tcb->phase == CTX_CLEAN);
+		if (queued)
+			sched_queue_remove(tcb);
+
+		if (tcb->policy == SCHED_POLICY_DEADLINE)
+			edf_threads--;
+		edf_bandwidth += bw - oldbw;
+
+		tcb->policy = params->policy;
+		if (tcb->policy == SCHED_POLICY_DEADLINE) {
+			TimerDuration now = bios_clock();
+			tcb->dl_runtime = params->runtime;
+			tcb->dl_deadline = params->deadline;
+			tcb->dl_period = params->period;
+			tcb->dl_abs_deadline = now + params->deadline;
+			tcb->dl_budget = params->runtime;
+			tcb->slice_start = now;
+			edf_threads++;
+		}
+
+		if (queued)
+			sched_queue_insert(tcb);
+		ret = 0;
+	}
+
+	Mutex_Unlock(&sched_spinlock);
+	if (preempt)
+		preempt_on;
+	return ret;
+}
+
+int sys_GetSchedParams(Tid_t tid, sched_params* params)
+{
+	TCB* tcb = sched_find_thread(tid);
+	if (tcb == NULL || params == NULL)
+		return -1;
+
+	int preempt = preempt_off;
+	Mutex_Lock(&sched_spinlock);
+	*params = (sched_params){ .policy = tcb->policy };
+	if (tcb->policy == SCHED_POLICY_DEADLINE) {
+		params->runtime = tcb->dl_runtime;
+		params->deadline = tcb->dl_deadline;
+		params->period = tcb->dl_period;
+	}
+	Mutex_Unlock(&sched_spinlock);
+	if (preempt)
+		preempt_on;
+	return 0;
+}
+
+int sys_SetAffinity(Tid_t tid, unsigned long mask)
+{
+	TCB* tcb = sched_find_thread(tid);
+	unsigned long all = (1ul << cpu_cores()) - 1;
+	if (tcb == NULL || (mask & all) == 0)
+		return -1;
+
+	int preempt = preempt_off;
+	int leave = 0;
+	Mutex_Lock(&sched_spinlock);
+	tcb->affinity = mask;
+	if (tcb->state == READY && tcb->phase == CTX_CLEAN) {
+		/* A queued thread may now be runnable on another core */
+		sched_wake_core(tcb);
+	} else if (tcb->state == RUNNING && !((mask >> tcb->last_core) & 1)) {
+		/* A running thread must leave a core it may no longer use */
+		if (tcb == CURTHREAD)
+			leave = 1;
+		else {
+			CCB* ccb = &cctx[tcb->last_core];
+			ccb->rank = KICKED_RANK;
+			ccb->ici_resched = 1;
+			ccb->tickless = 0;
+			cpu_ici(ccb->id);
+		}
+	}
+	Mutex_Unlock(&sched_spinlock);
+	if (leave)
+		yield(SCHED_USER);
+	if (preempt)
+		preempt_on;
+	return 0;
+}
+
+int sys_GetAffinity(Tid_t tid, unsigned long* mask)
+{
+	TCB* tcb = sched_find_thread(tid);
+	if (tcb == NULL || mask == NULL)
+		return -1;
+	*mask = tcb->affinity & ((1ul << cpu_cores()) - 1);
+	return 0;
 }
 
+int sys_SetNice(Pid_t pid, int nice)
+{
+	PCB* pcb = (pid >= 0 && pid < MAX_PROC) ? get_pcb(pid) : NULL;
+	if (pcb == NULL || pcb->pstate != ALIVE || nice < -20 || nice > 19)
+		return -1;
+
+	int preempt = preempt_off;
+	Mutex_Lock(&sched_spinlock);
+	pcb->fair.nice = nice;
+	pcb->fair.weight = nice_to_weight[nice + 20];
+	Mutex_Unlock(&sched_spinlock);
+	if (preempt)
+		preempt_on;
+	return 0;
+}
+
+int sys_GetNice(Pid_t pid, int* nice)
+{
+	PCB* pcb = (pid >= 0 && pid < MAX_PROC) ? get_pcb(pid) : NULL;
+	if (pcb == NULL || pcb->pstate != ALIVE || nice == NULL)
+		return -1;
+	*nice = pcb->fair.nice;
+	return 0;
+}
+
+#if defined(SCHED_STATISTICS)
+
+sched_statistics sched_stats;
+
+void print_sched_statistics()
+{
+	fprintf(stderr, "Scheduler: ctx_switches=%lu mutex_yields=%lu broadcasts=%lu morphed=%lu"
+		" timer_arms=%lu tickless_arms=%lu ici_kicks=%lu\n",
+		sched_stats.ctx_switches, sched_stats.mutex_yields, 
+		sched_stats.broadcasts, sched_stats.morphed,
+		sched_stats.timer_arms, sched_stats.tickless_arms, sched_stats.ici_kicks);
+}
+
+#endif
+
 void run_scheduler()
 {
 	CCB* curcore = &CURCORE;
@@ -637,6 +1530,11 @@ void run_scheduler()
 	curcore->id = cpu_core_id;
 
 	curcore->current_thread = &curcore->idle_thread;
+	curcore->timer_event = 0;
+	curcore->timer_armed = 0;
+	curcore->tickless = 0;
+	curcore->rank = IDLE_RANK;
+	curcore->ici_resched = 0;
 
 	curcore->idle_thread.owner_pcb = get_pcb(0);
 	curcore->idle_thread.type = IDLE_THREAD;
@@ -648,6 +1546,13 @@ void run_scheduler()
 	curcore->idle_thread.its = QUANTUM;
 	curcore->idle_thread.rts = QUANTUM;
 
+	curcore->idle_thread.inherited_level = -1;
+	curcore->idle_thread.pi_held = 0;
+	curcore->idle_thread.boost_epoch = 0;
+	curcore->idle_thread.policy = SCHED_POLICY_MLFQ;
+	curcore->idle_thread.affinity = ~0ul;
+	curcore->idle_thread.last_core = cpu_core_id;
+
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
 
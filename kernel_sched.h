@@ -92,9 +92,32 @@ enum SCHED_CAUSE {
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_USER, /**< @brief User-space code called yield */
+	SCHED_EVENT /**< @brief The time-slice was cut short by a timer event */
 };
 
+/**
+  @brief The fair-share scheduling data of a process.
+
+  In fair-share mode (see @c sched_config), the scheduler picks the process 
+  with the least virtual runtime, and then its ready threads in FIFO order.
+  The virtual runtime of a process advances with the CPU time of its threads,
+  scaled by the weight of its nice value.
+
+  The processes with ready threads are kept in a pairing heap. All fields are
+  protected by the scheduler spinlock.
+ */
+typedef struct fair_entity {
+	uint64_t vruntime;      /**< @brief The virtual runtime, in weighted microseconds */
+	unsigned int weight;    /**< @brief The weight of @c nice */
+	int nice;               /**< @brief The nice value, from -20 to 19 */
+	rlnode ready;           /**< @brief The ready threads of the process */
+	int queued;             /**< @brief Set if the entity is in the heap */
+	struct fair_entity* child;    /**< @brief First child in the heap */
+	struct fair_entity* sibling;  /**< @brief Next sibling in the heap */
+	struct fair_entity* prev;     /**< @brief Previous sibling, or parent for a first child */
+} fair_entity;
+
 /** 
 	@brief The process thread control block
     
@@ -153,6 +176,21 @@ typedef struct thread_control_block {
 	
 	int priority_level;  // the priority level indicator for the MLFQ
 
+	int inherited_level; /**< @brief Priority level inherited from a @c PIMutex waiter, or -1 */
+	int pi_held;         /**< @brief Number of @c PIMutex objects held by this thread */
+	unsigned int boost_epoch; /**< @brief The last priority boost applied to @c priority_level */
+
+	sched_policy policy;         /**< @brief The scheduling class of the thread */
+	TimerDuration dl_runtime;    /**< @brief Deadline class: the budget per period */
+	TimerDuration dl_deadline;   /**< @brief Deadline class: the relative deadline */
+	TimerDuration dl_period;     /**< @brief Deadline class: the period */
+	TimerDuration dl_abs_deadline; /**< @brief Deadline class: the current absolute deadline */
+	int64_t dl_budget;           /**< @brief Deadline class: the remaining budget */
+	TimerDuration slice_start;   /**< @brief When the current time-slice started */
+
+	unsigned long affinity;      /**< @brief The cores this thread may run on, one bit per core */
+	uint last_core;              /**< @brief The core this thread last ran on */
+
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
 
@@ -188,6 +226,11 @@ typedef struct core_control_block {
 	TCB* current_thread; /**< @brief Points to the thread currently owning the core */
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
+	int timer_event; /**< @brief The core timer was set for an event, not the end of the time-slice */
+	int timer_armed; /**< @brief The core timer may be running */
+	int tickless;    /**< @brief The current thread runs without a time-slice limit */
+	int rank;        /**< @brief The rank of the current thread (lower is more urgent) */
+	int ici_resched; /**< @brief The core was sent an ICI to reschedule */
 
 } CCB;
 
@@ -282,6 +325,27 @@ int wakeup(TCB* tcb);
    */
 void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
 
+/**
+  @brief Return the priority level a thread is scheduled at.
+
+  This is the thread's MLFQ level, unless it has inherited a higher 
+  priority (that is, a lower level) through a @c PIMutex.
+ */
+int sched_effective_priority(TCB* tcb);
+
+/**
+  @brief Set the priority level inherited by a thread.
+
+  If the thread is in the scheduler queue, it is moved to the queue of
+  its new effective priority. Pass -1 to drop the inherited priority.
+ */
+void sched_set_inherited_priority(TCB* tcb, int level);
+
+/**
+  @brief Initialize the fair-share data of a new process.
+ */
+void sched_init_fair_entity(fair_entity* fe, int nice);
+
 /**
   @brief Give up the CPU.
 
@@ -314,6 +378,39 @@ void initialize_scheduler(void);
   */
 #define QUANTUM (10000L)
 
+
+/*
+	Scheduler statistics. Turn on (or build with 'make SCHED_STATS=1') to
+	have the scheduler count some events, printed when the kernel shuts down.
+ */
+#if 0
+#define SCHED_STATISTICS
+#endif
+
+#if defined(SCHED_STATISTICS)
+
+/** @brief Scheduler event counters */
+typedef struct sched_statistics {
+	unsigned long ctx_switches;	/**< @brief context switches in @c yield */
+	unsigned long mutex_yields;	/**< @brief yields on @c Mutex_Lock contention */
+	unsigned long broadcasts;	/**< @brief calls to @c Cond_Broadcast */
+	unsigned long morphed;		/**< @brief waiters requeued on their mutex by @c Cond_Broadcast */
+	unsigned long timer_arms;	/**< @brief timer programming in @c gain */
+	unsigned long tickless_arms;	/**< @brief timers set on a tickless core, for a waiting thread */
+	unsigned long ici_kicks;	/**< @brief cores sent an ICI to reschedule, for a woken thread */
+} sched_statistics;
+
+extern sched_statistics sched_stats;
+
+#define SCHED_STAT_INC(field) __atomic_fetch_add(&sched_stats.field, 1, __ATOMIC_RELAXED)
+
+/** @brief Print the scheduler statistics to @c stderr */
+void print_sched_statistics(void);
+
+#else
+#define SCHED_STAT_INC(field)
+#endif
+
 /** @} */
 
 #endif
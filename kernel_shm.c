@@ -0,0 +1,204 @@
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "kernel_shm.h"
+#include "kernel_proc.h"
+#include "kernel_cc.h"
+
+
+/* The named regions */
+static rlnode shm_names = { .prev = &shm_names, .next = &shm_names };
+
+/* An attachment of a region to a process */
+typedef struct shm_attachment {
+	shm_region* region;
+	rlnode node;			/* In the list of the process */
+} shm_attachment;
+
+
+shm_region* shm_new(size_t size)
+{
+	if(size == 0 || size > SIZE_MAX - SHM_PAGE_SIZE) return NULL;
+	size = (size + SHM_PAGE_SIZE - 1) & ~(size_t)(SHM_PAGE_SIZE - 1);
+
+	void* addr = aligned_alloc(SHM_PAGE_SIZE, size);
+	if(addr == NULL) return NULL;
+	memset(addr, 0, size);
+
+	shm_region* r = xmalloc(sizeof(shm_region));
+	r->name[0] = '\0';
+	r->addr = addr;
+	r->size = size;
+	r->refcount = 1;
+	rlnode_init(&r->node, r);
+	return r;
+}
+
+void shm_ref(shm_region* r)
+{
+	r->refcount++;
+}
+
+void shm_unref(shm_region* r)
+{
+	assert(r->refcount > 0);
+	if(--r->refcount == 0) {
+		if(r->name[0]) rlist_remove(&r->node);
+		free(r->addr);
+		free(r);
+	}
+}
+
+void* shm_attach(PCB* pcb, shm_region* r)
+{
+	shm_attachment* a = xmalloc(sizeof(shm_attachment));
+	a->region = r;
+	rlnode_init(&a->node, a);
+	rlist_push_back(&pcb->shm_list, &a->node);
+	shm_ref(r);
+	return r->addr;
+}
+
+void shm_inherit(PCB* parent, PCB* child)
+{
+	for(rlnode* p = parent->shm_list.next; p != &parent->shm_list; p = p->next)
+		shm_attach(child, ((shm_attachment*)p->obj)->region);
+}
+
+static void shm_detach(shm_attachment* a)
+{
+	rlist_remove(&a->node);
+	shm_unref(a->region);
+	free(a);
+}
+
+void shm_detach_all(PCB* pcb)
+{
+	while(! is_rlist_empty(&pcb->shm_list))
+		shm_detach(pcb->shm_list.next->obj);
+}
+
+
+static shm_region* shm_find(const char* name)
+{
+	for(rlnode* p = shm_names.next; p != &shm_names; p = p->next)
+		if(strcmp(((shm_region*)p->obj)->name, name) == 0) return p->obj;
+	return NULL;
+}
+
+static int shm_valid_name(const char* name)
+{
+	return name == NULL || strnlen(name, MAX_SHM_NAME+1) <= MAX_SHM_NAME;
+}
+
+
+void* sys_ShmCreate(const char* name, size_t size)
+{
+	if(! shm_valid_name(name)) return NULL;
+	if(name && name[0] && shm_find(name)) return NULL;
+
+	shm_region* r = shm_new(size);
+	if(r == NULL) return NULL;
+	if(name && name[0]) {
+		strcpy(r->name, name);
+		rlist_push_back(&shm_names, &r->node);
+	}
+
+	/* The creation reference passes to the attachment */
+	void* addr = shm_attach(CURPROC, r);
+	shm_unref(r);
+	return addr;
+}
+
+
+void* sys_ShmAttach(const char* name, size_t* size)
+{
+	if(name == NULL || name[0] == '\0' || ! shm_valid_name(name)) return NULL;
+	shm_region* r = shm_find(name);
+	if(r == NULL) return NULL;
+	if(size) *size = r->size;
+	return shm_attach(CURPROC, r);
+}
+
+
+int sys_ShmDetach(void* addr)
+{
+	PCB* pcb = CURPROC;
+	for(rlnode* p = pcb->shm_list.next; p != &pcb->shm_list; p = p->next) {
+		shm_attachment* a = p->obj;
+		if(a->region->addr == addr) {
+			shm_detach(a);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+
+/*
+	Futexes
+
+	A waiting thread is queued in a hash bucket by the address of its
+	futex word. A wake-up marks the first waiters on the same address as
+	woken, and signals them.
+ */
+
+#define FUTEX_HASH 64
+
+typedef struct futex_waiter {
+	volatile int* addr;
+	int woken;
+	CondVar cv;
+	rlnode node;
+} futex_waiter;
+
+static rlnode futex_table[FUTEX_HASH];
+
+static rlnode* futex_bucket(volatile int* addr)
+{
+	uintptr_t h = (uintptr_t)addr / sizeof(int);
+	rlnode* b = &futex_table[(h ^ (h >> 6)) % FUTEX_HASH];
+	/* Buckets are initialized lazily: a zeroed node is an empty list */
+	if(b->next == NULL) rlnode_init(b, NULL);
+	return b;
+}
+
+
+int sys_FutexWait(volatile int* addr, int val, timeout_t timeout)
+{
+	if(addr == NULL) return -1;
+	if(*addr != val) return -1;
+
+	futex_waiter w = { .addr = addr, .woken = 0, .cv = COND_INIT };
+	rlnode_init(&w.node, &w);
+	rlist_push_back(futex_bucket(addr), &w.node);
+
+	TimerDuration usec = (timeout == (timeout_t)-1) ? NO_TIMEOUT : timeout*1000ul;
+	while(! w.woken)
+		if(! kernel_timedwait(&w.cv, SCHED_USER, usec)) break;
+
+	if(! w.woken) rlist_remove(&w.node);
+	return w.woken ? 0 : -1;
+}
+
+
+int sys_FutexWake(volatile int* addr, int count)
+{
+	if(addr == NULL) return -1;
+
+	int n = 0;
+	rlnode* b = futex_bucket(addr);
+	for(rlnode* p = b->next; p != b && n < count; ) {
+		futex_waiter* w = p->obj;
+		p = p->next;
+		if(w->addr == addr) {
+			rlist_remove(&w->node);
+			w->woken = 1;
+			kernel_signal(&w->cv);
+			n++;
+		}
+	}
+	return n;
+}
@@ -0,0 +1,71 @@
+#ifndef __KERNEL_SHM_H
+#define __KERNEL_SHM_H
+
+#include "tinyos.h"
+#include "util.h"
+
+/**
+	@file kernel_shm.h
+	@brief Shared memory regions and futexes.
+
+	@defgroup shm Shared memory.
+	@ingroup kernel
+	@brief Shared memory regions and futexes.
+
+	All processes of tinyos run in the same address space, so sharing
+	memory is a matter of lifetime, not of mapping: a @ref shm_region is
+	a block of memory which stays allocated as long as some process has
+	it attached (or the kernel holds a reference to it).
+
+	Each process keeps the list of its attachments in its PCB. A process
+	created by @c Exec inherits the attachments of its parent, and all
+	attachments of a process are dropped when it exits.
+
+	Regions may have a name, by which other processes attach them. The
+	memory of a mapped file is also a region (see @c MapFile), which is
+	referenced by the inode of the file.
+
+	Futexes let the threads of different processes block on a word of
+	shared memory.
+
+	@{
+*/
+
+/** @brief The alignment and size granularity of regions. */
+#define SHM_PAGE_SIZE 4096
+
+/** @brief A shared memory region. */
+typedef struct shm_region {
+	char name[MAX_SHM_NAME+1];	/**< @brief The name, empty for anonymous regions */
+	void* addr;					/**< @brief The memory, page-aligned and zero-filled */
+	size_t size;				/**< @brief The size of the memory, in bytes */
+	uint refcount;				/**< @brief The attachments and kernel references */
+	rlnode node;				/**< @brief Node in the list of named regions */
+} shm_region;
+
+
+/** @brief Allocate a new anonymous region of @c size bytes, with a reference count of 1.
+
+	The size is rounded up to a multiple of @ref SHM_PAGE_SIZE.
+	@returns the region, or NULL if memory is exhausted
+ */
+shm_region* shm_new(size_t size);
+
+/** @brief Increase the reference count of a region. */
+void shm_ref(shm_region* r);
+
+/** @brief Decrease the reference count of a region, freeing it at 0. */
+void shm_unref(shm_region* r);
+
+/** @brief Attach a region to a process, returning its address. */
+void* shm_attach(PCB* pcb, shm_region* r);
+
+/** @brief Give a new process the attachments of its parent. */
+void shm_inherit(PCB* parent, PCB* child);
+
+/** @brief Drop all attachments of an exiting process. */
+void shm_detach_all(PCB* pcb);
+
+/** @} */
+
+#endif
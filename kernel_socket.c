@@ -1,7 +1,13 @@
+#include <string.h>
 #include "kernel_cc.h"
 #include "tinyos.h"
 #include "kernel_socket.h"
 
+/* Datagram sockets are at the end of the file */
+static SCB* DGRAM_PORT_MAP[MAX_PORT+1];
+static int dgram_recv(SCB* scb, void* buf, unsigned int size, port_t* from, TimerDuration timeout);
+static void dgram_close(SCB* scb);
+
 /*	The function that Read() uses to get data from a socket	
 	Arguments:
 	-scb_t pointer to an SCB object
@@ -10,6 +16,9 @@
 */
 int socket_read(void* scb_t, char *buf, unsigned int size){
 	SCB* scb=(SCB*) scb_t;
+	/* A datagram socket receives a message */
+	if(scb != NULL && scb->type == SOCKET_DGRAM)
+		return dgram_recv(scb, buf, size, NULL, NO_TIMEOUT);
 	/* We need the SCB to exist and be a peer socket*/
 	if(scb == NULL ||scb->type != SOCKET_PEER)
 		return -1;
@@ -55,6 +64,9 @@ int socket_close(void* scb_t){
 			pipe_reader_close(scb->peer_s.read_pipe);  // just close the pipes
 			pipe_writer_close(scb->peer_s.write_pipe);
 			break;
+		case SOCKET_DGRAM:
+			dgram_close(scb);
+			break;
 		default:
 			break;
 	}
@@ -81,6 +93,7 @@ SCB* new_socket(port_t p){
 	// Initialization
 	socket->refcount = 0;
 	socket->port = p;
+	socket->packet = 0;
 	socket->type = SOCKET_UNBOUND;  /* at the beginning of its little life, it is unbound*/
 	return socket;
 }
@@ -131,6 +144,21 @@ Fid_t sys_Socket(port_t port)
 	return fid;
 }
 
+/**
+	@brief Return a new packet socket bound on a port.
+	This is @c sys_Socket, marking the socket as a packet socket.
+	Its connection will use packet pipes.
+	@param port The port the new socket will be bound to
+	@returns A file id for the new socket, or NOFILE on error.
+*/
+Fid_t sys_PacketSocket(port_t port)
+{
+	Fid_t fid = sys_Socket(port);
+	if(fid != NOFILE)
+		get_scb(fid)->packet = 1;
+	return fid;
+}
+
 /**
 	@brief Initialize a socket as a listening socket.
 	A listening socket is one which can be passed as an argument to
@@ -226,8 +254,9 @@ Fid_t sys_Accept(Fid_t lsock)
 	if (server_scb == NULL)
 		return NOFILE;
 
-	// Set the type of server to peer(it was unbound)
+	// Set the type of server to peer(it was unbound), of the same kind as the listener
 	server_scb->type = SOCKET_PEER;
+	server_scb->packet = listener->packet;
 	// Get the pointer to the requester Socket 
 	SCB* client_scb = c_req->peer;
 	// Set the type of client (requester socket)
@@ -240,6 +269,7 @@ Fid_t sys_Accept(Fid_t lsock)
 	// Initialise da pipes
 	Pipe_CB* p1 = pipe_init();
 	Pipe_CB* p2 = pipe_init();
+	p1->packet = p2->packet = listener->packet;
 
 	// Connect pipe1 
 	p1->writer = server_scb->fcb;
@@ -296,6 +326,7 @@ Fid_t sys_Accept(Fid_t lsock)
 	   - the file id @c sock is not legal (i.e., an unconnected, non-listening socket)
 	   - the given port is illegal.
 	   - the port does not have a listening socket bound to it by @c Listen.
+	   - one of the socket and the listener is a packet socket, and the other is not.
 	   - the timeout has expired without a successful connection.
 */
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
@@ -303,7 +334,8 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	// Get the pointer to our SCB struct from the Fid_t argument
 	SCB* socket = get_scb(sock);  
 
-	if(socket == NULL || socket->type != SOCKET_UNBOUND || port > MAX_PORT || port < 1 || PORT_MAP[port] == NULL  || PORT_MAP[port]->type != SOCKET_LISTENER){
+	if(socket == NULL || socket->type != SOCKET_UNBOUND || port > MAX_PORT || port < 1 || PORT_MAP[port] == NULL  || PORT_MAP[port]->type != SOCKET_LISTENER
+		|| PORT_MAP[port]->packet != socket->packet){
 		return -1;
 	}
 	// Increase refcount of SCB
@@ -316,7 +348,7 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	request->peer = socket; 
 	request->connected_cv = COND_INIT;
 	//initialise the rlnode of the request to point to itself(intrusive lists u know)
-	rlnode_init(&request->queue_node, &request);
+	rlnode_init(&request->queue_node, request);
 
 
 	SCB* listener_scb = PORT_MAP[port];
@@ -413,6 +445,199 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 	return -1;
 }
 
+
+
+/*
+	Datagram sockets
+
+	A datagram socket bound to a port is in DGRAM_PORT_MAP, and has a queue
+	of the messages sent to the port. The messages are kept in buffers of
+	a pool shared by all ports; a message takes a buffer from the pool when 
+	it is sent, and returns it when it is received. Senders block while the 
+	queue of the port is full (DGRAM_QUEUE_SIZE) or the pool is exhausted 
+	(DGRAM_POOL_SIZE), so that a slow receiver cannot take the whole pool.
+
+	Buffers are allocated the first time they are needed, and are kept in 
+	the free list of the pool afterwards.
+*/
+
+#define DGRAM_QUEUE_SIZE 64
+#define DGRAM_POOL_SIZE 1024
+
+typedef struct datagram {
+	port_t from;			// the port of the sender
+	unsigned int size;		// the size of the message
+	rlnode node;			// in the queue of the port, or the free list of the pool
+	char data[MAX_DATAGRAM_SIZE];
+} datagram;
+
+static rlnode dgram_pool = { .prev = &dgram_pool, .next = &dgram_pool };
+static unsigned int dgram_allocated = 0;
+static CondVar dgram_pool_space = COND_INIT;
+
+/* Take a buffer from the pool, or return NULL if the pool is exhausted */
+static datagram* dgram_alloc()
+{
+	if(! is_rlist_empty(&dgram_pool))
+		return rlist_pop_front(&dgram_pool)->obj;
+	if(dgram_allocated == DGRAM_POOL_SIZE)
+		return NULL;
+	dgram_allocated++;
+	datagram* d = xmalloc(sizeof(datagram));
+	rlnode_init(&d->node, d);
+	return d;
+}
+
+/* Return a buffer to the pool */
+static void dgram_free(datagram* d)
+{
+	rlist_push_front(&dgram_pool, &d->node);
+	kernel_broadcast(&dgram_pool_space);
+}
+
+/* Return the datagram socket of a file id, or NULL */
+static SCB* get_dgram(Fid_t sock)
+{
+	FCB* fcb = get_fcb(sock);
+	if(fcb == NULL || fcb->streamfunc != &socketOperations)
+		return NULL;
+	SCB* scb = fcb->streamobj;
+	return (scb->type == SOCKET_DGRAM) ? scb : NULL;
+}
+
+/* Unbind a datagram socket, drop its messages and fail its waiting senders */
+static void dgram_close(SCB* scb)
+{
+	if(scb->port != NOPORT) {
+		DGRAM_PORT_MAP[scb->port] = NULL;
+		scb->port = NOPORT;
+	}
+	while(! is_rlist_empty(&scb->dgram_s.queue))
+		dgram_free(rlist_pop_front(&scb->dgram_s.queue)->obj);
+	scb->dgram_s.count = 0;
+
+	/* Senders to this port may be waiting on either condition */
+	kernel_broadcast(&scb->dgram_s.has_space);
+	kernel_broadcast(&dgram_pool_space);
+}
+
+/* Wait for a message at a bound datagram socket, and copy it out */
+static int dgram_recv(SCB* scb, void* buf, unsigned int size, port_t* from, TimerDuration timeout)
+{
+	if(scb->port == NOPORT || buf == NULL)
+		return -1;
+
+	while(is_rlist_empty(&scb->dgram_s.queue))
+		if(! kernel_timedwait(&scb->dgram_s.has_msg, SCHED_PIPE, timeout))
+			break;
+	if(is_rlist_empty(&scb->dgram_s.queue))
+		return -1;
+
+	datagram* d = rlist_pop_front(&scb->dgram_s.queue)->obj;
+	scb->dgram_s.count--;
+	kernel_signal(&scb->dgram_s.has_space);
+
+	unsigned int n = (d->size < size) ? d->size : size;
+	memcpy(buf, d->data, n);
+	if(from) *from = d->from;
+	dgram_free(d);
+	return n;
+}
+
+
+/**
+	@brief Return a new datagram socket bound on a port.
+	@param port The port the new socket will be bound to, or NOPORT
+	@returns A file id for the new socket, or NOFILE on error. Possible
+		reasons for error:
+		- the port is iilegal, or bound to another datagram socket
+		- the available file ids for the process are exhausted
+*/
+Fid_t sys_DatagramSocket(port_t port)
+{
+	if(port < 0 || port > MAX_PORT || (port != NOPORT && DGRAM_PORT_MAP[port] != NULL))
+		return NOFILE;
+
+	Fid_t fid = sys_Socket(port);
+	if(fid == NOFILE)
+		return NOFILE;
+
+	SCB* socket = get_scb(fid);
+	socket->type = SOCKET_DGRAM;
+	rlnode_init(&socket->dgram_s.queue, NULL);
+	socket->dgram_s.count = 0;
+	socket->dgram_s.has_msg = COND_INIT;
+	socket->dgram_s.has_space = COND_INIT;
+	if(port != NOPORT)
+		DGRAM_PORT_MAP[port] = socket;
+	return fid;
+}
+
+
+/**
+	@brief Send a message to the datagram socket of a port.
+	The sender blocks while the queue of the receiver is full, or the pool
+	is exhausted. Meanwhile, it holds a reference to the receiver, which 
+	may be closed.
+	@returns @c size on success, or -1 on error.
+*/
+int sys_SendTo(Fid_t sock, const void* buf, unsigned int size, port_t port)
+{
+	SCB* socket = get_dgram(sock);
+	if(socket == NULL || buf == NULL || size < 1 || size > MAX_DATAGRAM_SIZE 
+		|| port < 1 || port > MAX_PORT || DGRAM_PORT_MAP[port] == NULL)
+		return -1;
+
+	/* Our socket may be closed while we wait */
+	port_t from = socket->port;
+	SCB* receiver = DGRAM_PORT_MAP[port];
+	receiver->refcount++;
+
+	int ret = -1;
+	while(receiver->port != NOPORT) {
+		datagram* d;
+		if(receiver->dgram_s.count < DGRAM_QUEUE_SIZE && (d = dgram_alloc()) != NULL) {
+			d->from = from;
+			d->size = size;
+			memcpy(d->data, buf, size);
+			rlist_push_back(&receiver->dgram_s.queue, &d->node);
+			receiver->dgram_s.count++;
+			kernel_signal(&receiver->dgram_s.has_msg);
+			ret = size;
+			break;
+		}
+		if(receiver->dgram_s.count < DGRAM_QUEUE_SIZE)
+			kernel_wait(&dgram_pool_space, SCHED_PIPE);
+		else
+			kernel_wait(&receiver->dgram_s.has_space, SCHED_PIPE);
+	}
+
+	receiver->refcount--;
+	if(receiver->refcount < 0)
+		free(receiver);
+	return ret;
+}
+
+
+/**
+	@brief Receive a message from the port of a datagram socket.
+	@returns the number of bytes received, or -1 on error or timeout.
+*/
+int sys_RecvFrom(Fid_t sock, void* buf, unsigned int size, port_t* from, timeout_t timeout)
+{
+	SCB* socket = get_dgram(sock);
+	if(socket == NULL)
+		return -1;
+
+	/* make sure that the socket will not be closed while we wait */
+	FCB* fcb = get_fcb(sock);
+	FCB_incref(fcb);
+	int ret = dgram_recv(socket, buf, size, from, 
+		(timeout == (timeout_t)-1) ? NO_TIMEOUT : timeout*1000ul);
+	FCB_decref(fcb);
+	return ret;
+}
+
 /*
 // A function to decrement the refcount SCB counter and 
 // delete/free the space if no one points to the arg SCB
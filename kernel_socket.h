@@ -41,11 +41,20 @@ typedef struct peer_socket{
 }peer_st;
 
 
+// Datagram socket (receives the messages sent to its port)
+typedef struct datagram_socket{
+  rlnode queue;       // the messages waiting to be received
+  uint count;         // the length of the queue
+  CondVar has_msg;    // for blocking receivers until a message arrives
+  CondVar has_space;  // for blocking senders while the queue is full
+}dgram_st;
+
 // Socket type
 typedef enum socket_type{
 	SOCKET_UNBOUND,
 	SOCKET_PEER,
-	SOCKET_LISTENER
+	SOCKET_LISTENER,
+	SOCKET_DGRAM
 }S_type;
 
 // Socket Control Block
@@ -58,12 +67,15 @@ typedef struct Socket_Control_Block{
 	enum socket_type type;
 	// The port to bound
 	port_t port;
+	// Packet socket (messages instead of bytes)
+	int packet;
 
 	// Only one type of it 
 	union {
 		listen_st listen_s;
 		unbound_st unbound_s;
 		peer_st peer_s;
+		dgram_st dgram_s;
 	};
 
 }SCB;
@@ -75,6 +87,8 @@ SCB* PORT_MAP[MAX_PORT+1];
 
 Fid_t sys_Socket(port_t port);
 
+Fid_t sys_PacketSocket(port_t port);
+
 int sys_Listen(Fid_t sock);
 
 Fid_t sys_Accept(Fid_t lsock);
@@ -83,6 +97,12 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout);
 
 int sys_ShutDown(Fid_t sock, shutdown_mode how);
 
+Fid_t sys_DatagramSocket(port_t port);
+
+int sys_SendTo(Fid_t sock, const void* buf, unsigned int size, port_t port);
+
+int sys_RecvFrom(Fid_t sock, void* buf, unsigned int size, port_t* from, timeout_t timeout);
+
 int socket_write(void* scb_t, const char *buf, unsigned int size);
 
 int socket_read(void* scb_t, char *buf, unsigned int size);
@@ -208,6 +208,17 @@ int sys_Close(int fd)
 }
 
 
+intptr_t sys_Seek(Fid_t fd, intptr_t offset, int whence)
+{
+  FCB* fcb = get_fcb(fd);
+
+  if(fcb==NULL || fcb->streamfunc->Seek==NULL)
+    return -1;
+
+  return fcb->streamfunc->Seek(fcb->streamobj, offset, whence);
+}
+
+
 /*
   Copy file descriptor oldfd into file descriptor newfd.
 
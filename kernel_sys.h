@@ -22,13 +22,47 @@ SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
+SYSCALL(Open, Fid_t, (const char* pathname, int flags), (pathname, flags))\
+SYSCALL(Seek, intptr_t, (Fid_t fd, intptr_t offset, int whence), (fd, offset, whence))\
+SYSCALL(Stat, int, (const char* pathname, file_stat* statbuf), (pathname, statbuf))\
+SYSCALL(Unlink, int, (const char* pathname), (pathname))\
+SYSCALL(MkDir, int, (const char* pathname), (pathname))\
+SYSCALL(Format, int, (unsigned int diskno), (diskno))\
+SYSCALL(Mount, int, (unsigned int diskno, const char* mpoint), (diskno, mpoint))\
+SYSCALL(Unmount, int, (const char* mpoint), (mpoint))\
+SYSCALL(Sync, int, (), ())\
+SYSCALL(ShmCreate, void*, (const char* name, size_t size), (name, size))\
+SYSCALL(ShmAttach, void*, (const char* name, size_t* size), (name, size))\
+SYSCALL(ShmDetach, int, (void* addr), (addr))\
+SYSCALL(MapFile, void*, (Fid_t fd, size_t length), (fd, length))\
+SYSCALL(FutexWait, int, (volatile int* addr, int val, timeout_t timeout), (addr, val, timeout))\
+SYSCALL(FutexWake, int, (volatile int* addr, int count), (addr, count))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(PacketPipe, int, (pipe_t* pipe), (pipe))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
+SYSCALL(PacketSocket, Fid_t, (port_t port), (port))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
+SYSCALL(DatagramSocket, Fid_t, (port_t port), (port))\
+SYSCALL(SendTo, int, (Fid_t sock, const void* buf, unsigned int size, port_t port), (sock,buf,size,port))\
+SYSCALL(RecvFrom, int, (Fid_t sock, void* buf, unsigned int size, port_t* from, timeout_t timeout), (sock,buf,size,from,timeout))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(GetSchedConfig, int, (sched_config* config), (config))\
+SYSCALL(SetSchedConfig, int, (const sched_config* config), (config))\
+SYSCALL(SetSchedParams, int, (Tid_t tid, const sched_params* params), (tid, params))\
+SYSCALL(GetSchedParams, int, (Tid_t tid, sched_params* params), (tid, params))\
+SYSCALL(SetNice, int, (Pid_t pid, int nice), (pid, nice))\
+SYSCALL(GetNice, int, (Pid_t pid, int* nice), (pid, nice))\
+SYSCALL(SetAffinity, int, (Tid_t tid, unsigned long mask), (tid, mask))\
+SYSCALL(GetAffinity, int, (Tid_t tid, unsigned long* mask), (tid, mask))\
+SYSCALL(SetTerminalCore, int, (unsigned int termno, unsigned int core), (termno, core))\
+SYSCALL(GetTerminalCore, int, (unsigned int termno), (termno))\
+SYSCALL(GetDiskDevices, unsigned int, (), ())\
+SYSCALL(GetDiskSectors, unsigned long, (unsigned int diskno), (diskno))\
+SYSCALL(ReadSectors, int, (unsigned int diskno, unsigned long sector, unsigned int count, void* buf), (diskno, sector, count, buf))\
+SYSCALL(WriteSectors, int, (unsigned int diskno, unsigned long sector, unsigned int count, const void* buf), (diskno, sector, count, buf))\
 
 
 
@@ -17,6 +17,7 @@
 #include "kernel_threads.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
+#include "kernel_shm.h"
 
 /**
 @brief A function used as an argument in spawn_thread().
@@ -222,6 +223,9 @@ void sys_ThreadExit(int exitval)
       }
     }
 
+    /* Detach shared memory */
+    shm_detach_all(curproc);
+
     /* Disconnect my main_thread */
     curproc->main_thread = NULL;
 
@@ -2,6 +2,7 @@
 #ifndef __TINYOS_H__
 #define __TINYOS_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -202,6 +203,194 @@ void Cond_Signal(CondVar*);
 void Cond_Broadcast(CondVar*); 
 
 
+/** @brief Counting semaphores.
+
+  A semaphore holds a non-negative count. @c Sem_Wait decrements the count,
+  blocking while it is zero, and @c Sem_Post increments it. Blocked threads
+  are served in FIFO order: a post hands the unit directly to the oldest
+  waiter.
+
+  @see Sem_Wait
+  @see Sem_Post
+  @see SEMAPHORE_INIT
+ */
+typedef struct {
+  int count;            /**< The available units */
+  void *waitset;        /**< The set of waiting threads */
+  Mutex lock;           /**< A mutex to protect the semaphore */
+} Semaphore;
+
+/** @brief  This macro is used to initialize semaphores. 
+
+   It is used as follows:
+  @code
+  Semaphore my_sem = SEMAPHORE_INIT(5);
+  @endcode
+ */
+#define SEMAPHORE_INIT(n) ((Semaphore){ (n), NULL, MUTEX_INIT })
+
+/** @brief Decrement a semaphore, blocking while its count is zero. 
+  @see Sem_Post
+ */
+void Sem_Wait(Semaphore* sem);
+
+/** @brief Decrement a semaphore, blocking for at most @c timeout milliseconds.
+  @returns 1 if the semaphore was decremented, 0 if the timeout expired
+ */
+int Sem_TimedWait(Semaphore* sem, timeout_t timeout);
+
+/** @brief Decrement a semaphore if this can be done without blocking.
+  @returns 1 if the semaphore was decremented, 0 otherwise
+ */
+int Sem_TryWait(Semaphore* sem);
+
+/** @brief Increment a semaphore, waking up one waiting thread (if any). 
+
+  This operation is non-blocking.
+  @see Sem_Wait
+ */
+void Sem_Post(Semaphore* sem);
+
+
+/** @brief Reader-writer locks.
+
+  A reader-writer lock can be held either by any number of readers, or by
+  a single writer. Blocked threads are served in FIFO order, and a reader
+  does not overtake a waiting writer, so that writers are not starved.
+
+  @see RWLock_ReadLock
+  @see RWLock_WriteLock
+  @see RWLOCK_INIT
+ */
+typedef struct {
+  int state;            /**< The number of readers, or -1 if write-locked */
+  void *waitset;        /**< The set of waiting threads */
+  Mutex lock;           /**< A mutex to protect the lock */
+} RWLock;
+
+/** @brief  This macro is used to initialize reader-writer locks. 
+
+   It is used as follows:
+  @code
+  RWLock my_rwlock = RWLOCK_INIT;
+  @endcode
+ */
+#define RWLOCK_INIT ((RWLock){ 0, NULL, MUTEX_INIT })
+
+/** @brief Lock for reading, waiting as long as it takes. */
+void RWLock_ReadLock(RWLock* rw);
+
+/** @brief Lock for reading, waiting for at most @c timeout milliseconds. 
+  @returns 1 if the lock was acquired, 0 if the timeout expired
+ */
+int RWLock_TimedReadLock(RWLock* rw, timeout_t timeout);
+
+/** @brief Lock for reading, if this can be done without blocking. 
+  @returns 1 if the lock was acquired, 0 otherwise
+ */
+int RWLock_TryReadLock(RWLock* rw);
+
+/** @brief Release a read lock. */
+void RWLock_ReadUnlock(RWLock* rw);
+
+/** @brief Lock for writing, waiting as long as it takes. */
+void RWLock_WriteLock(RWLock* rw);
+
+/** @brief Lock for writing, waiting for at most @c timeout milliseconds. 
+  @returns 1 if the lock was acquired, 0 if the timeout expired
+ */
+int RWLock_TimedWriteLock(RWLock* rw, timeout_t timeout);
+
+/** @brief Lock for writing, if this can be done without blocking. 
+  @returns 1 if the lock was acquired, 0 otherwise
+ */
+int RWLock_TryWriteLock(RWLock* rw);
+
+/** @brief Release a write lock. */
+void RWLock_WriteUnlock(RWLock* rw);
+
+
+/** @brief Priority-inheritance mutexes.
+
+  A blocking mutex which avoids priority inversion: while a thread waits 
+  for a @c PIMutex, the owner of the mutex is scheduled at the priority of
+  the waiter, if that is higher than its own. When the owner unlocks the 
+  mutex, it passes it to the waiting thread with the highest priority.
+
+  Unlike @c Mutex, a @c PIMutex puts waiting threads to sleep, and it can
+  only be unlocked by its owner.
+
+  @see PIMutex_Lock
+  @see PIMutex_Unlock
+  @see PIMUTEX_INIT
+ */
+typedef struct {
+  void *owner;          /**< The owner thread, or NULL */
+  void *waitset;        /**< The set of waiting threads */
+  Mutex lock;           /**< A mutex to protect the PIMutex */
+} PIMutex;
+
+/** @brief  This macro is used to initialize priority-inheritance mutexes. 
+
+   It is used as follows:
+  @code
+  PIMutex my_mutex = PIMUTEX_INIT;
+  @endcode
+ */
+#define PIMUTEX_INIT ((PIMutex){ NULL, NULL, MUTEX_INIT })
+
+/** @brief Lock a priority-inheritance mutex, waiting as long as it takes. */
+void PIMutex_Lock(PIMutex* pm);
+
+/** @brief Lock a priority-inheritance mutex, if this can be done without blocking. 
+  @returns 1 if the mutex was locked, 0 otherwise
+ */
+int PIMutex_TryLock(PIMutex* pm);
+
+/** @brief Unlock a priority-inheritance mutex that you locked. */
+void PIMutex_Unlock(PIMutex* pm);
+
+
+/** @brief Barriers.
+
+  A barrier synchronizes a fixed number of threads: each thread calling
+  @c Barrier_Sync blocks until all of them have called it. The barrier
+  can then be reused for the next round.
+
+  For many threads, the implementation is a combining tree, so that 
+  arriving threads contend on small nodes of the tree, and the release 
+  is propagated down the tree instead of waking up all threads at once.
+  For a few threads, the tree is a single node.
+
+  @see Barrier_Init
+  @see Barrier_Sync
+  @see Barrier_Destroy
+ */
+typedef struct {
+  unsigned int n;       /**< The number of threads to synchronize */
+  unsigned int fanin;   /**< The fan-in of the combining tree */
+  unsigned long long ticket;  /**< The number of arrivals so far */
+  void *tree;           /**< The combining tree */
+} Barrier;
+
+/** @brief Initialize a barrier for @c n threads. 
+
+  @returns 0 on success, or -1 if @c n is 0
+  @see Barrier_Destroy
+ */
+int Barrier_Init(Barrier* bar, unsigned int n);
+
+/** @brief Wait until @c n threads have reached the barrier. */
+void Barrier_Sync(Barrier* bar);
+
+/** @brief Release the resources of a barrier. 
+
+  No thread may be waiting on the barrier.
+ */
+void Barrier_Destroy(Barrier* bar);
+
+
+
 /*******************************************
  *
  * Process creation
@@ -399,6 +588,25 @@ unsigned int GetTerminalDevices();
  */
 Fid_t OpenTerminal(unsigned int termno);
 
+/** @brief Route the interrupts of a terminal device to a core.
+
+  By default, the interrupts of all terminals are handled by core 0. 
+  Threads doing I/O on a terminal can be placed on the core of its
+  interrupts, with @c SetAffinity.
+
+  @param termno the terminal number
+  @param core the core that will handle the interrupts of the terminal
+  @returns 0 on success, or -1 if the terminal or the core does not exist
+ */
+int SetTerminalCore(unsigned int termno, unsigned int core);
+
+/** @brief Return the core handling the interrupts of a terminal device.
+
+  @param termno the terminal number
+  @returns the core, or -1 if the terminal does not exist
+ */
+int GetTerminalCore(unsigned int termno);
+
 
 /** @brief Open a stream on the null device.
 
@@ -414,6 +622,49 @@ Fid_t OpenTerminal(unsigned int termno);
 Fid_t OpenNull();
 
 
+/** @brief Return the number of disk devices available. 
+
+  Disks are numbered starting from 0. 
+ */
+unsigned int GetDiskDevices();
+
+/** @brief Return the size of disk device 'diskno' in sectors.
+
+  The size of a sector is @c DISK_SECTOR_SIZE bytes.
+
+  @param diskno the disk number
+  @returns the number of sectors, or 0 if the disk does not exist
+ */
+unsigned long GetDiskSectors(unsigned int diskno);
+
+/** @brief Read sectors from a disk device.
+
+  Read @c count sectors from disk @c diskno, starting at sector @c sector,
+  into @c buf, which must have room for @c count*DISK_SECTOR_SIZE bytes.
+  The calling thread blocks until the sectors are read. Concurrent 
+  reads of adjacent sectors may be merged into one disk request.
+
+  @param diskno the disk number
+  @param sector the first sector
+  @param count the number of sectors
+  @param buf the buffer to read into
+  @returns 0 on success, or -1 on error. Possible errors are:
+   - The disk does not exist.
+   - The sectors are beyond the end of the disk.
+   - There was an I/O error.
+ */
+int ReadSectors(unsigned int diskno, unsigned long sector, unsigned int count, void* buf);
+
+/** @brief Write sectors to a disk device.
+
+  Like @c ReadSectors, but the @c count*DISK_SECTOR_SIZE bytes of @c buf 
+  are written to the disk.
+
+  @see ReadSectors
+ */
+int WriteSectors(unsigned int diskno, unsigned long sector, unsigned int count, const void* buf);
+
+
 /** 
   @brief Read bytes from a stream. 
 
@@ -489,6 +740,286 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+/*******************************************
+ *
+ * Files
+ *
+ *******************************************/
+
+/** @brief The maximum length of a file name (a path component), 
+  excluding the terminating 0. */
+#define MAX_NAME_LENGTH 31
+
+/** @brief The maximum length of a path name, excluding the 
+  terminating 0. */
+#define MAX_PATHNAME 255
+
+/** @brief Open the file for reading. */
+#define OPEN_RDONLY 0x01
+/** @brief Open the file for writing. */
+#define OPEN_WRONLY 0x02
+/** @brief Open the file for reading and writing. */
+#define OPEN_RDWR   (OPEN_RDONLY|OPEN_WRONLY)
+/** @brief Create the file, if it does not exist. */
+#define OPEN_CREAT  0x04
+/** @brief With @c OPEN_CREAT, fail if the file exists. */
+#define OPEN_EXCL   0x08
+/** @brief Truncate the file to 0 bytes when opened for writing. */
+#define OPEN_TRUNC  0x10
+/** @brief Every write appends to the end of the file. */
+#define OPEN_APPEND 0x20
+
+/* The values of the @c whence argument of @c Seek. They are the values
+   of the host's <stdio.h>, so that both headers can be included. */
+/** @brief Seek relative to the start of the stream. */
+#define SEEK_SET 0
+/** @brief Seek relative to the current offset. */
+#define SEEK_CUR 1
+/** @brief Seek relative to the end of the stream. */
+#define SEEK_END 2
+
+/** @brief The type of a file system entry. */
+typedef enum {
+	FSE_FILE,		/**< @brief A regular file */
+	FSE_DIR			/**< @brief A directory */
+} Fse_type;
+
+/** @brief Information about a file system entry, returned by @c Stat. */
+typedef struct file_stat {
+	Fse_type type;			/**< @brief The type of the entry */
+	unsigned int nlink;		/**< @brief The number of directory entries for it */
+	intptr_t size;			/**< @brief Size in bytes (files) or number of entries (directories) */
+	unsigned long pages;	/**< @brief The number of pages of storage of a file */
+} file_stat;
+
+/** @brief Open a file or directory by name.
+
+  The file system of tinyos is held in memory; it starts empty at 
+  every boot and contains only the root directory @c "/". File systems
+  stored on disks can be mounted on its directories (see @c Mount).
+  Path names are resolved from the root directory, whether they start
+  with a @c '/' or not. The components of a path are separated by 
+  @c '/' and may be @c "." and @c "..".
+
+  The @c flags must contain @c OPEN_RDONLY, @c OPEN_WRONLY or both 
+  (@c OPEN_RDWR), possibly or-ed with @c OPEN_CREAT, @c OPEN_EXCL, 
+  @c OPEN_TRUNC and @c OPEN_APPEND, with the usual Unix meaning.
+
+  A new stream starts at offset 0. Reading a file at an offset beyond the
+  end of the file returns 0 (end of file). Writing beyond the end of a 
+  file extends it; the unwritten bytes in between (a "hole") read as 0s 
+  and take no storage.
+
+  Directories can only be opened for reading; reading a directory 
+  returns the names of its entries, one per line.
+
+  @param pathname the path of the file
+  @param flags the open mode flags
+  @returns a new file id, or @c NOFILE on error. Possible errors are:
+   - The path name is invalid, or a directory in it does not exist.
+   - The file does not exist and @c OPEN_CREAT was not given.
+   - The file exists and @c OPEN_CREAT|OPEN_EXCL was given.
+   - The file is a directory and @c OPEN_WRONLY was given.
+   - The maximum number of file descriptors has been reached.
+ */
+Fid_t Open(const char* pathname, int flags);
+
+/** @brief Move the offset of a stream.
+
+  The new offset is @c offset bytes relative to the start of the stream 
+  (@c whence==SEEK_SET), the current offset (@c whence==SEEK_CUR) or the 
+  end of the stream (@c whence==SEEK_END), as in @c lseek(2).
+  It is legal to seek beyond the end of a file.
+
+  @param fd the file id
+  @param offset the offset
+  @param whence one of @c SEEK_SET, @c SEEK_CUR and @c SEEK_END
+  @returns the new offset, or -1 on error. Possible errors are:
+   - The file id is invalid.
+   - The stream does not support seeking (e.g., it is a pipe).
+   - The new offset would be negative, or @c whence is invalid.
+ */
+intptr_t Seek(Fid_t fd, intptr_t offset, int whence);
+
+/** @brief Return information about a file or directory.
+
+  @param pathname the path of the file
+  @param statbuf the structure to fill
+  @returns 0 on success, or -1 if the file does not exist.
+ */
+int Stat(const char* pathname, file_stat* statbuf);
+
+/** @brief Remove a file or an empty directory.
+
+  The entry is removed from its directory at once. The storage of a 
+  file is released when the last stream on it is closed.
+
+  @param pathname the path of the file
+  @returns 0 on success, or -1 on error. Possible errors are:
+   - The file does not exist.
+   - The file is a non-empty directory, or the root directory.
+   - The file is a mount point, or the root of a mounted file system.
+ */
+int Unlink(const char* pathname);
+
+/** @brief Create a new, empty directory.
+
+  @param pathname the path of the new directory
+  @returns 0 on success, or -1 on error. Possible errors are:
+   - The path name is invalid, or its parent directory does not exist.
+   - An entry with this name already exists.
+ */
+int MkDir(const char* pathname);
+
+/** @brief Write a new, empty file system to a disk.
+
+  All data on the disk are lost. The disk must have at least 16 MB.
+
+  @param diskno the number of the disk (see @c bios_disks)
+  @returns 0 on success, or -1 on error. Possible errors are:
+   - There is no such disk, or it is too small.
+   - The disk is mounted.
+   - There was an I/O error.
+ */
+int Format(unsigned int diskno);
+
+/** @brief Mount the file system of a disk on a directory.
+
+  The directory @c mpoint must be an empty directory of the memory file
+  system, other than the root. After the call, its path names the root
+  directory of the file system of the disk.
+
+  The file system on the disk is log-structured: writes are collected
+  in memory and written to the disk in large batches. Changes become
+  durable when @c Sync or @c Unmount are called, and periodically (about
+  every half second). If the system halts without @c Unmount, the file
+  system is found as it was at its last durable point, with no damage.
+
+  @param diskno the number of the disk
+  @param mpoint the path of the directory
+  @returns 0 on success, or -1 on error. Possible errors are:
+   - There is no such disk, or it is already mounted.
+   - The disk does not contain a file system (see @c Format).
+   - @c mpoint is not an empty directory of the memory file system, 
+     or it is the root directory.
+ */
+int Mount(unsigned int diskno, const char* mpoint);
+
+/** @brief Unmount the file system mounted on a directory.
+
+  All changes are written to the disk.
+
+  @param mpoint the path of the mount point
+  @returns 0 on success, or -1 on error. Possible errors are:
+   - No file system is mounted on @c mpoint.
+   - Some file of the file system is open, or in use by another process.
+   - There was an I/O error (the file system is unmounted anyway).
+ */
+int Unmount(const char* mpoint);
+
+/** @brief Write all changes to mounted file systems to their disks.
+
+  @returns 0 on success, or -1 on I/O error.
+ */
+int Sync();
+
+
+/*******************************************
+ *
+ * Shared memory
+ *
+ *******************************************/
+
+/** @brief The maximum length of the name of a shared memory region, 
+  excluding the terminating 0. */
+#define MAX_SHM_NAME 31
+
+/** @brief Create a shared memory region, and attach it to the calling process.
+
+  The region is at least @c size bytes long, page-aligned and filled with 
+  zeros. If @c name is not NULL or empty, other processes can attach the
+  region by this name (see @c ShmAttach). An anonymous region can be 
+  shared with child processes, since a process created by @c Exec inherits
+  all the attachments of its parent.
+
+  A region exists as long as some process has it attached. Detaching it
+  (by @c ShmDetach or by exiting) from all processes releases its memory
+  and its name.
+
+  @param name the name of the region, or NULL
+  @param size the size of the region
+  @returns the address of the region, or NULL on error. Possible errors are:
+   - @c size is 0, or there is not enough memory.
+   - @c name is too long, or a region by this name exists.
+ */
+void* ShmCreate(const char* name, size_t size);
+
+/** @brief Attach the shared memory region with the given name.
+
+  A process may attach a region many times; each attachment returns the
+  same address, and must be detached separately.
+
+  @param name the name of the region
+  @param size if not NULL, the size of the region is stored here
+  @returns the address of the region, or NULL if no such region exists.
+ */
+void* ShmAttach(const char* name, size_t* size);
+
+/** @brief Detach a shared memory region from the calling process.
+
+  @param addr the address of the region, as returned when it was attached
+  @returns 0 on success, or -1 if the process has no region attached at @c addr.
+ */
+int ShmDetach(void* addr);
+
+/** @brief Map a file into memory.
+
+  The first @c length bytes of the file (rounded up to whole pages) are 
+  placed in a shared memory region, attached to the calling process.
+  The region becomes the storage of these pages: writes to the memory
+  change the file (but never its size, which the stream calls maintain),
+  and writes to the file through streams are seen in the memory.
+
+  All mappings of a file share one region; a file can be mapped again
+  with at most its original @c length. The mapping is released by 
+  @c ShmDetach. If the file is truncated (by @c Open with @c OPEN_TRUNC),
+  the region is zeroed and remains its storage. If the file is removed, 
+  the region remains valid but it is no longer part of any file.
+
+  Only files of the memory file system can be mapped.
+
+  @param fd a file id open for reading and writing
+  @param length the number of bytes to map
+  @returns the address of the mapping, or NULL on error. Possible errors are:
+   - @c fd is not an open stream of a memory file, open for reading and writing.
+   - @c length is 0, or larger than the length of an existing mapping.
+ */
+void* MapFile(Fid_t fd, size_t length);
+
+/** @brief Wait on a futex.
+
+  If @c *addr equals @c val, the calling thread blocks until another
+  thread calls @c FutexWake on @c addr, or the timeout expires. The check
+  and the blocking are atomic with respect to @c FutexWake. 
+  Futexes work on any memory, but are meant for shared memory regions,
+  to build synchronization between processes.
+
+  @param addr the address of the futex word
+  @param val the expected value of the futex word
+  @param timeout the timeout in milliseconds, or @c (timeout_t)-1 to wait for ever
+  @returns 0 if woken by @c FutexWake, or -1 if @c *addr!=val, or the timeout expired.
+ */
+int FutexWait(volatile int* addr, int val, timeout_t timeout);
+
+/** @brief Wake up threads waiting on a futex.
+
+  @param addr the address of the futex word
+  @param count the maximum number of threads to wake
+  @returns the number of threads woken up.
+ */
+int FutexWake(volatile int* addr, int count);
+
+
 /*******************************************
  *
  * Pipes
@@ -531,6 +1062,36 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+/**
+	@brief The largest message of a packet pipe or socket.
+
+	A message, together with its length prefix, must fit in the buffer of a pipe.
+*/
+#define MAX_PACKET_SIZE 16380
+
+/**
+	@brief Construct and return a packet pipe.
+
+	A packet pipe is like a pipe made by @c Pipe(), except that it 
+	preserves message boundaries. Each call to @c Write() on the
+	write end puts a single message of @c size bytes in the pipe, 
+	atomically: the call blocks until the whole message fits in the
+	buffer, and messages of concurrent writers are never interleaved.
+	A message may be between 1 and @c MAX_PACKET_SIZE bytes; @c Write() 
+	fails for larger sizes.
+
+	Each call to @c Read() on the read end returns the next message.
+	If the message is longer than the size given to @c Read(), the
+	rest of the message is discarded. @c Read() returns 0 when the 
+	write end is closed and there are no more messages.
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the available file ids for the process are exhausted.
+	@see Pipe
+*/
+int PacketPipe(pipe_t* pipe);
+
 /*******************************************
  *
  * Sockets (local)
@@ -571,6 +1132,28 @@ typedef int16_t port_t;
 */
 Fid_t Socket(port_t port);
 
+/**
+	@brief Return a new packet socket bound on a port.
+
+	This call is like @c Socket(), except that the new socket is a packet
+	socket: once connected, each @c Write() on it sends a single message,
+	and each @c Read() receives a single message, as for the ends of a 
+	packet pipe (see @c PacketPipe()).
+
+	A packet socket can only be connected to a packet socket: a listening
+	packet socket accepts packet sockets, and @c Connect() from a packet 
+	socket to the port of a stream listener (and vice versa) fails.
+
+	@param port the port the new socket will be bound to
+	@returns a file id for the new socket, or NOFILE on error. Possible
+		reasons for error:
+		- the port is iilegal
+		- the available file ids for the process are exhausted
+	@see Socket
+	@see PacketPipe
+*/
+Fid_t PacketSocket(port_t port);
+
 /**
 	@brief Initialize a socket as a listening socket.
 
@@ -644,6 +1227,7 @@ Fid_t Accept(Fid_t lsock);
 	   - the file id @c sock is not legal (i.e., an unconnected, non-listening socket)
 	   - the given port is illegal.
 	   - the port does not have a listening socket bound to it by @c Listen.
+	   - one of the socket and the listener is a packet socket, and the other is not.
 	   - the timeout has expired without a successful connection.
 */
 int Connect(Fid_t sock, port_t port, timeout_t timeout);
@@ -694,6 +1278,243 @@ typedef enum {
 int ShutDown(Fid_t sock, shutdown_mode how);
 
 
+/**
+	@brief The largest message of a datagram socket.
+*/
+#define MAX_DATAGRAM_SIZE 1024
+
+/**
+	@brief Return a new datagram socket bound on a port.
+
+	A datagram socket is not connected: it sends messages to any port 
+	with @c SendTo(), and receives the messages sent to its port, from 
+	any number of senders, with @c RecvFrom(). Each message is delivered 
+	whole, and the messages of each sender arrive in the order they were 
+	sent.
+
+	Datagram ports are separate from the ports of other sockets: a 
+	datagram socket may be bound to the port of a listening socket. 
+	However, each port has at most one datagram socket bound to it.
+	If the @c port argument is NOPORT, the socket can only send.
+
+	The messages sent to a port wait in a bounded queue, until received.
+	The messages of all ports are stored in a shared pool of buffers.
+
+	On a datagram socket, @c Read() is equivalent to @c RecvFrom() without
+	a timeout, and @c Write() fails.
+
+	@param port the port the new socket will be bound to
+	@returns a file id for the new socket, or NOFILE on error. Possible
+		reasons for error:
+		- the port is iilegal
+		- the port is bound to another datagram socket
+		- the available file ids for the process are exhausted
+	@see SendTo
+	@see RecvFrom
+*/
+Fid_t DatagramSocket(port_t port);
+
+/**
+	@brief Send a message to the datagram socket of a port.
+
+	The call blocks while the queue of the port is full, or the buffer
+	pool is exhausted.
+
+	@param sock a datagram socket
+	@param buf the message
+	@param size the size of the message, between 1 and @c MAX_DATAGRAM_SIZE
+	@param port the port of the receiver
+	@returns @c size on success, or -1 on error. Possible reasons for error:
+		- the file id @c sock is not a datagram socket
+		- the size is illegal
+		- no datagram socket is bound to @c port, or it was closed while waiting
+*/
+int SendTo(Fid_t sock, const void* buf, unsigned int size, port_t port);
+
+/**
+	@brief Receive a message from the port of a datagram socket.
+
+	The call blocks until a message is available, or the timeout expires.
+	If the message is longer than @c size, the rest of it is discarded.
+
+	@param sock a datagram socket bound to a port
+	@param buf the buffer for the message
+	@param size the size of the buffer
+	@param from if not NULL, the port of the sender is stored here (NOPORT
+	       if the sender is not bound)
+	@param timeout the timeout in milliseconds, or @c (timeout_t)-1 to wait for ever
+	@returns the number of bytes stored in @c buf, or -1 on error. Possible reasons 
+		for error:
+		- the file id @c sock is not a datagram socket bound to a port
+		- the timeout expired
+*/
+int RecvFrom(Fid_t sock, void* buf, unsigned int size, port_t* from, timeout_t timeout);
+
+
+
+/*******************************************
+ *
+ * Scheduling
+ *
+ *******************************************/
+
+/** @brief The tunable parameters of the scheduler.
+
+  By default, the scheduler is a multi-level feedback queue. A thread at level @c l 
+  (where level 0 has the highest priority) gets a time-slice of
+  @c quantum + l * @c quantum_step microseconds. Every @c boost_period 
+  microseconds, all threads are moved to level 0.
+
+  If @c fair_share is set, the CPU is instead shared fairly among processes,
+  in proportion to the weights of their nice values (see @c SetNice), 
+  regardless of how many threads each process has. Each time-slice is 
+  @c quantum microseconds. The mode can be changed at any time.
+
+  All parameters are reset to their defaults at each boot.
+
+  If @c tickless is set (the default), a core does not program its timer
+  to end the time-slice of a thread while no other thread is waiting for
+  it, nor to poll while idle. The timer is set when another thread becomes ready,
+  and for timeouts.
+
+  @see GetSchedConfig
+  @see SetSchedConfig
+ */
+typedef struct sched_config {
+  unsigned int levels;          /**< @brief The number of priority levels (read-only) */
+  unsigned long quantum;        /**< @brief The time-slice of level 0, in microseconds */
+  unsigned long quantum_step;   /**< @brief The time-slice increase per level, in microseconds */
+  unsigned long boost_period;   /**< @brief The time between priority boosts in microseconds, 
+                                     or 0 for no boosts */
+  int fair_share;               /**< @brief Non-zero for fair-share scheduling among processes */
+  int tickless;                 /**< @brief Non-zero to skip the timer when it is not needed */
+} sched_config;
+
+/** @brief Get the current scheduler parameters.
+
+  @param config the location to store the parameters
+  @returns 0 on success, or -1 if @c config is NULL
+ */
+int GetSchedConfig(sched_config* config);
+
+/** @brief Set the scheduler parameters.
+
+  The @c levels field is ignored. The new parameters take effect 
+  at the next time-slice of each thread.
+
+  @param config the new parameters
+  @returns 0 on success, or -1 on error. Possible reasons for error are:
+    - @c config is NULL
+    - @c quantum is not between 1 msec and 1 sec
+    - @c quantum_step is more than 1 sec
+ */
+int SetSchedConfig(const sched_config* config);
+
+
+/** @brief The scheduling class of a thread.
+
+  @see SetSchedParams
+ */
+typedef enum {
+  SCHED_POLICY_MLFQ,      /**< @brief The multi-level feedback queue (the default) */
+  SCHED_POLICY_DEADLINE   /**< @brief Earliest deadline first, with a reserved budget */
+} sched_policy;
+
+/** @brief The scheduling parameters of a thread.
+
+  A thread of the @c SCHED_POLICY_DEADLINE class is guaranteed @c runtime 
+  microseconds of CPU time in every @c period microseconds, to be used
+  within @c deadline microseconds from the start of the period. Deadline threads
+  are always dispatched before the threads of the multi-level feedback queue,
+  in order of their absolute deadlines. A deadline thread that exhausts its runtime 
+  is throttled until its next period.
+
+  The fields @c runtime, @c deadline and @c period are ignored for
+  @c SCHED_POLICY_MLFQ.
+
+  @see SetSchedParams
+  @see GetSchedParams
+ */
+typedef struct sched_params {
+  sched_policy policy;      /**< @brief The scheduling class */
+  unsigned long runtime;    /**< @brief The CPU time reserved per period, in microseconds */
+  unsigned long deadline;   /**< @brief The relative deadline, in microseconds */
+  unsigned long period;     /**< @brief The period, in microseconds */
+} sched_params;
+
+/** @brief Set the scheduling class and parameters of a thread.
+
+  A new deadline thread is admitted only if the total CPU bandwidth 
+  (the sum of @c runtime/period) of the deadline threads stays within
+  95% of the available cores. The bandwidth of a thread is released when 
+  it exits, or returns to @c SCHED_POLICY_MLFQ.
+
+  @param tid the thread, which must belong to the current process
+  @param params the new parameters
+  @returns 0 on success, or -1 on error. Possible reasons for error are:
+    - @c tid is not a live thread of the current process
+    - @c params is NULL, or its policy is invalid
+    - @c runtime is less than 1 msec, or not 
+      @c runtime <= @c deadline <= @c period
+    - the bandwidth of the new parameters cannot be admitted
+ */
+int SetSchedParams(Tid_t tid, const sched_params* params);
+
+/** @brief Get the scheduling class and parameters of a thread.
+
+  @param tid the thread, which must belong to the current process
+  @param params the location to store the parameters
+  @returns 0 on success, or -1 on error.
+ */
+int GetSchedParams(Tid_t tid, sched_params* params);
+
+/** @brief Set the nice value of a process.
+
+  The nice value determines the share of the CPU of a process in fair-share 
+  mode. Each step of nice changes the weight of a process by about 25%, 
+  and a weight of 1024 corresponds to nice 0. New processes inherit the 
+  nice value of their parent.
+
+  @param pid the process
+  @param nice the nice value, from -20 (highest share) to 19 (lowest share)
+  @returns 0 on success, or -1 if @c pid is not a live process or
+    @c nice is out of range
+ */
+int SetNice(Pid_t pid, int nice);
+
+/** @brief Get the nice value of a process.
+
+  @param pid the process
+  @param nice the location to store the nice value
+  @returns 0 on success, or -1 on error
+ */
+int GetNice(Pid_t pid, int* nice);
+
+/** @brief Set the cores a thread may run on.
+
+  Bit @c c of @c mask allows the thread to run on core @c c. Bits 
+  for cores that do not exist are ignored. A thread running on a core
+  that the new mask excludes is moved off that core at once; in 
+  particular, when @c tid is the caller, @c SetAffinity returns on an 
+  allowed core. New threads inherit the mask of the thread that creates them.
+
+  @param tid the thread, which must belong to the current process
+  @param mask the allowed cores
+  @returns 0 on success, or -1 if @c tid is not a live thread of the
+    current process, or @c mask contains no existing core
+  @see GetAffinity
+ */
+int SetAffinity(Tid_t tid, unsigned long mask);
+
+/** @brief Get the cores a thread may run on.
+
+  @param tid the thread, which must belong to the current process
+  @param mask the location to store the mask of allowed cores 
+  @returns 0 on success, or -1 on error
+  @see SetAffinity
+ */
+int GetAffinity(Tid_t tid, unsigned long* mask);
+
 
 /*******************************************
  *
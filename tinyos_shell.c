@@ -31,6 +31,16 @@ int Symposium_thr(size_t,const char**);
 int RemoteServer(size_t,const char**);
 int RemoteClient(size_t,const char**);
 int Echo(size_t,const char**);
+int Cat(size_t,const char**);
+int Dir(size_t,const char**);
+int MakeDir(size_t,const char**);
+int Remove(size_t,const char**);
+int FileIO(size_t,const char**);
+int FormatDisk(size_t,const char**);
+int MountDisk(size_t,const char**);
+int UnmountDisk(size_t,const char**);
+int SyncDisks(size_t,const char**);
+int SmallFiles(size_t,const char**);
 
 
 struct { const char * cmdname; Program prog; uint nargs; const char* help; } 
@@ -54,6 +64,16 @@ COMMANDS[]  =
 	{"rserver", RemoteServer, 0, "A server for remote execution."},
 	{"rcli", RemoteClient, 1, "Remote client: rcli <cmd> [<args...>]."},
 	{"echo", Echo, 0, "echo [<args...>], send the <args...> to stdout"},
+	{"cat", Cat, 0, "cat [<files...>]: copy the files (or stdin) to stdout"},
+	{"dir", Dir, 0, "dir [<dir>]: list the files of a directory (default: /)"},
+	{"mkdir", MakeDir, 1, "mkdir <dirs...>: create directories"},
+	{"rm", Remove, 1, "rm <files...>: remove files or empty directories"},
+	{"fio", FileIO, 1, "fio <file> [<size-KB> [<block-bytes>]]: benchmark sequential and random file I/O"},
+	{"format", FormatDisk, 1, "format <disk>: write an empty file system to a disk"},
+	{"mount", MountDisk, 2, "mount <disk> <dir>: mount the file system of a disk on an empty directory"},
+	{"umount", UnmountDisk, 1, "umount <dir>: unmount the file system mounted on a directory"},
+	{"sync", SyncDisks, 0, "sync: write all changes of mounted file systems to disk"},
+	{"smallfiles", SmallFiles, 1, "smallfiles <dir> [<files> [<appends> [<bytes>]]]: benchmark creating and appending to small files"},
 
 	{NULL, NULL, 0, NULL}
 };
@@ -405,6 +425,263 @@ int ListPrograms(size_t argc, const char** argv)
 
 
 
+/*************************************
+
+	File programs
+
+***************************************/
+
+int Cat(size_t argc, const char** argv)
+{
+	char buf[1024];
+	int n;
+
+	if(argc < 2) {
+		while((n = Read(0, buf, sizeof(buf))) > 0)
+			Write(1, buf, n);
+		return 0;
+	}
+
+	for(size_t i=1; i<argc; i++) {
+		Fid_t f = Open(argv[i], OPEN_RDONLY);
+		if(f==NOFILE) {
+			printf("cat: cannot open '%s'\n", argv[i]);
+			return 1;
+		}
+		while((n = Read(f, buf, sizeof(buf))) > 0)
+			Write(1, buf, n);
+		Close(f);
+	}
+	return 0;
+}
+
+
+int Dir(size_t argc, const char** argv)
+{
+	const char* path = (argc>=2) ? argv[1] : "/";
+	Fid_t f = Open(path, OPEN_RDONLY);
+	if(f==NOFILE) {
+		printf("dir: cannot open '%s'\n", path);
+		return 1;
+	}
+
+	FILE* fin = fidopen(f, "r");
+	char* name = NULL;
+	size_t len = 0;
+	ssize_t n;
+	while((n = getline(&name, &len, fin)) > 0) {
+		name[n-1] = '\0';
+		char entry[MAX_PATHNAME+1];
+		snprintf(entry, sizeof(entry), "%s/%s", path, name);
+
+		file_stat st;
+		if(Stat(entry, &st)==0) {
+			if(st.type==FSE_DIR)
+				printf("%-32s %12s\n", name, "<dir>");
+			else
+				printf("%-32s %12zd %6lu pages\n", name, (ssize_t)st.size, st.pages);
+		}
+	}
+	free(name);
+	fclose(fin);
+	return 0;
+}
+
+
+int MakeDir(size_t argc, const char** argv)
+{
+	checkargs(1);
+	for(size_t i=1; i<argc; i++)
+		if(MkDir(argv[i])) {
+			printf("mkdir: cannot create '%s'\n", argv[i]);
+			return 1;
+		}
+	return 0;
+}
+
+
+int Remove(size_t argc, const char** argv)
+{
+	checkargs(1);
+	for(size_t i=1; i<argc; i++)
+		if(Unlink(argv[i])) {
+			printf("rm: cannot remove '%s'\n", argv[i]);
+			return 1;
+		}
+	return 0;
+}
+
+
+/*
+	An fio-like benchmark of the file system. It creates a file of <size>
+	KB and accesses it in blocks of <bs> bytes: sequential write, 
+	sequential read, random write and random read.
+ */
+int FileIO(size_t argc, const char** argv)
+{
+	checkargs(1);
+	const char* path = argv[1];
+	unsigned long size = (argc>=3) ? getint(2) : 16384;
+	unsigned int bs = (argc>=4) ? getint(3) : 4096;
+	size *= 1024;
+	if(bs==0 || size < bs) {
+		printf("fio: the block size must be positive and at most the file size\n");
+		return 1;
+	}
+	unsigned long nblocks = size / bs;
+
+	Fid_t f = Open(path, OPEN_RDWR|OPEN_CREAT|OPEN_TRUNC);
+	if(f==NOFILE) {
+		printf("fio: cannot open '%s'\n", path);
+		return 1;
+	}
+
+	char* buf = malloc(bs);
+	memset(buf, 'x', bs);
+	unsigned short seed[3] = { 1, 2, 3 };
+
+	printf("%-10s %10s %10s %12s\n", "phase", "blocks", "MB/s", "IOPS");
+	const char* phase[] = { "seqwrite", "seqread", "randwrite", "randread" };
+	int status = 0;
+	for(int p=0; p<4 && status==0; p++) {
+		int write = (p % 2 == 0);
+		int rnd = (p >= 2);
+
+		Seek(f, 0, SEEK_SET);
+		TimerDuration t0 = bios_clock();
+		unsigned long done;
+		for(done=0; done<nblocks; done++) {
+			if(rnd)
+				Seek(f, (intptr_t)(nrand48(seed) % nblocks) * bs, SEEK_SET);
+			int n = write ? Write(f, buf, bs) : Read(f, buf, bs);
+			if(n != bs) { status = 1; break; }
+		}
+		double secs = (bios_clock() - t0) * 1E-6;
+		if(secs <= 0.0) secs = 1E-6;
+
+		printf("%-10s %10lu %10.1f %12.0f\n", phase[p], done,
+			done * (double)bs / secs / (1<<20), done / secs);
+	}
+	if(status) printf("fio: I/O error\n");
+
+	free(buf);
+	Close(f);
+	Unlink(path);
+	return status;
+}
+
+
+int FormatDisk(size_t argc, const char** argv)
+{
+	checkargs(1);
+	if(Format(getint(1))) {
+		printf("format: cannot format disk %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
+
+
+int MountDisk(size_t argc, const char** argv)
+{
+	checkargs(2);
+	if(Mount(getint(1), argv[2])) {
+		printf("mount: cannot mount disk %s on '%s'\n", argv[1], argv[2]);
+		return 1;
+	}
+	return 0;
+}
+
+
+int UnmountDisk(size_t argc, const char** argv)
+{
+	checkargs(1);
+	if(Unmount(argv[1])) {
+		printf("umount: cannot unmount '%s'\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
+
+
+int SyncDisks(size_t argc, const char** argv)
+{
+	if(Sync()) {
+		printf("sync: I/O error\n");
+		return 1;
+	}
+	return 0;
+}
+
+
+/*
+	A small-file benchmark. It creates <nfiles> files in <dir>, then 
+	appends <bytes> bytes to each of them, <appends> times, round-robin, 
+	and finally syncs, reads them back and removes them.
+ */
+int SmallFiles(size_t argc, const char** argv)
+{
+	checkargs(1);
+	const char* dir = argv[1];
+	int nfiles = (argc>=3) ? getint(2) : 1000;
+	int appends = (argc>=4) ? getint(3) : 4;
+	unsigned int bytes = (argc>=5) ? getint(4) : 1024;
+	if(nfiles <= 0 || appends <= 0 || bytes == 0) {
+		printf("smallfiles: the arguments must be positive\n");
+		return 1;
+	}
+
+	char* buf = malloc(bytes);
+	memset(buf, 'x', bytes);
+	char path[MAX_PATHNAME+1];
+	int status = 0;
+
+	printf("%-10s %10s %10s %12s\n", "phase", "ops", "secs", "ops/s");
+	const char* phase[] = { "create", "append", "sync", "read", "remove" };
+	for(int p=0; p<5 && status==0; p++) {
+		TimerDuration t0 = bios_clock();
+		int ops = (p==1) ? nfiles*appends : (p==2) ? 1 : nfiles;
+
+		if(p==2) 
+			status = Sync();
+		for(int i=0; p!=2 && i<ops && status==0; i++) {
+			snprintf(path, sizeof(path), "%s/f%d", dir, i % nfiles);
+			Fid_t f;
+			switch(p) {
+			case 0:
+				f = Open(path, OPEN_WRONLY|OPEN_CREAT|OPEN_EXCL);
+				status = (f==NOFILE) || Close(f);
+				break;
+			case 1:
+				f = Open(path, OPEN_WRONLY|OPEN_APPEND);
+				status = (f==NOFILE) || Write(f, buf, bytes) != bytes;
+				if(f!=NOFILE) Close(f);
+				break;
+			case 3:
+				f = Open(path, OPEN_RDONLY);
+				for(int a=0; a<appends && f!=NOFILE && status==0; a++)
+					status = Read(f, buf, bytes) != bytes;
+				status |= (f==NOFILE);
+				if(f!=NOFILE) Close(f);
+				break;
+			case 4:
+				status = Unlink(path);
+				break;
+			}
+		}
+
+		double secs = (bios_clock() - t0) * 1E-6;
+		if(secs <= 0.0) secs = 1E-6;
+		printf("%-10s %10d %10.3f %12.0f\n", phase[p], ops, secs, ops / secs);
+	}
+	if(status) printf("smallfiles: I/O error\n");
+
+	free(buf);
+	return status;
+}
+
+
+
 /*************************************
 
 	A remote server
@@ -813,6 +1090,38 @@ static inline Fid_t savefid(Fid_t fsaved)
 
 int process_line(int argc, const char** argv)
 {
+	/* Take out the redirections '< file', '> file' and '>> file' */
+	const char* args[argc];
+	const char* infile = NULL;
+	const char* outfile = NULL;
+	int outflags = 0;
+	int nargs = 0;
+	for(int i=0; i<argc; i++) {
+		int in = strcmp(argv[i],"<")==0;
+		int out = strcmp(argv[i],">")==0;
+		int app = strcmp(argv[i],">>")==0;
+		if(in || out || app) {
+			if(i+1 == argc) {
+				printf("Error: missing file name after '%s'.\n", argv[i]);
+				return 0;
+			}
+			if(in) 
+				infile = argv[++i];
+			else {
+				outfile = argv[++i];
+				outflags = OPEN_WRONLY|OPEN_CREAT|(app ? OPEN_APPEND : OPEN_TRUNC);
+			}
+		}
+		else
+			args[nargs++] = argv[i];
+	}
+	if(nargs==0) {
+		printf("Error: no command given.\n");
+		return 0;
+	}
+	argc = nargs;
+	argv = args;
+
 	/* Split up into pipeline fragments */
 	int Vargc[argc];
 	Vargc[0]=0;
@@ -848,6 +1157,18 @@ int process_line(int argc, const char** argv)
 		comd[i] = c;
 	}
 
+	/* Open the redirected files */
+	Fid_t fin = NOFILE, fout = NOFILE;
+	if(infile && (fin = Open(infile, OPEN_RDONLY))==NOFILE) {
+		printf("Cannot open '%s'\n", infile);
+		return 0;
+	}
+	if(outfile && (fout = Open(outfile, outflags))==NOFILE) {
+		printf("Cannot open '%s'\n", outfile);
+		if(fin!=NOFILE) Close(fin);
+		return 0;
+	}
+
 	/* Construct pipeline */
 	int child[frag];
 	int savein, saveout;
@@ -855,6 +1176,11 @@ int process_line(int argc, const char** argv)
 	savein = savefid(0);
 	saveout = savefid(1);
 
+	if(fin!=NOFILE) {
+		Dup2(fin, 0);
+		Close(fin);
+	}
+
 	pipe_t pipe;
 	for(int i=0; i<frag; i++) {
 		if(i<frag-1) {
@@ -863,9 +1189,8 @@ int process_line(int argc, const char** argv)
 			Dup2(pipe.write,1);
 			Close(pipe.write);
 		} else {
-			/* Last fragment, restore saved 1 */
-			Dup2(saveout, 1);
-			Close(saveout);				
+			/* Last fragment, restore saved 1 or redirect it */
+			Dup2((fout!=NOFILE) ? fout : saveout, 1);
 		}
 
 		child[i] = Execute(COMMANDS[comd[i]].prog, Vargc[i], Vargv[i]);
@@ -875,9 +1200,12 @@ int process_line(int argc, const char** argv)
 			Dup2(pipe.read,0);
 			Close(pipe.read);
 		} else {
-			/* Last fragment, restore saved 1 */
+			/* Last fragment, restore saved 0 and 1 */
 			Dup2(savein, 0);
 			Close(savein);
+			Dup2(saveout, 1);
+			Close(saveout);
+			if(fout!=NOFILE) Close(fout);
 		}
 	}
 
@@ -1007,10 +1335,11 @@ int boot_shell(int argl, void* args)
 
 void usage(const char* pname)
 {
-  printf("usage:\n  %s <ncores> <nterm> <philosophers> <bites>\n\n  \
+  printf("usage:\n  %s <ncores> <nterm> [<disk files...>]\n\n  \
     where:\n\
     <ncores> is the number of cpu cores to use,\n\
-    <nterm> is the number of terminals to use,\n",
+    <nterm> is the number of terminals to use,\n\
+    <disk files...> are host files attached as disks 0, 1, ...\n",
 	 pname);
   exit(1);
 }
@@ -1020,10 +1349,16 @@ int main(int argc, const char** argv)
 {
   unsigned int ncores, nterm;
 
-  if(argc!=3) usage(argv[0]); 
+  if(argc<3) usage(argv[0]); 
   ncores = atoi(argv[1]);
   nterm = atoi(argv[2]);
 
+  for(int i=3; i<argc; i++)
+    if(vm_attach_disk(argv[i])==-1) {
+      fprintf(stderr, "Cannot attach disk '%s': %s\n", argv[i], strerror(errno));
+      exit(1);
+    }
+
   /* boot TinyOS */
   printf("*** Booting TinyOS with %d cores and %d terminals\n", ncores, nterm);
   boot(ncores, nterm, boot_shell, 0, NULL);
@@ -560,16 +560,33 @@ int execute(void (*procfunc)(void), unsigned int timeout)
 
 
 
-int execute_boot(int ncores, int nterm, Task bootfunc, int argl, void* args, unsigned int timeout)
+/* The size of a scratch disk (the file is sparse) */
+#define SCRATCH_DISK_SIZE (64ul << 20)
+
+/* Attach a disk on a new, empty file, which is removed when the disk is detached */
+static void attach_scratch_disk()
+{
+	char path[] = "/tmp/tinyos_disk_XXXXXX";
+	int fd = mkstemp(path);
+	if(fd==-1) error(1, errno, "creating a scratch disk");
+	if(ftruncate(fd, SCRATCH_DISK_SIZE)==-1) error(1, errno, "sizing a scratch disk");
+	close(fd);
+	if(vm_attach_disk(path)==-1) error(1, errno, "attaching a scratch disk");
+	unlink(path);
+}
+
+int execute_boot(int ncores, int nterm, int ndisks, Task bootfunc, int argl, void* args, unsigned int timeout)
 {
 	void run_boot() 
 	{
 		for(uint i=0;i<nterm; i++)
 			term_proxy_init(&PROXY[i], i);
+		for(uint i=0;i<ndisks; i++)
+			attach_scratch_disk();
 
 		boot(ncores, nterm, bootfunc, argl, args);		
 
-
+		vm_detach_disks();
 		for(uint i=0;i<nterm; i++)
 			term_proxy_close(&PROXY[i]);
 	}
@@ -596,7 +613,7 @@ int run_boot_test(const Test* test, uint ncores, uint nterm, int argl, void* arg
 	assert(test->type == BOOT_FUNC);
 
 	if(! skipped) {
-		status = execute_boot(ncores, nterm, test->boot, argl, args, test->timeout);
+		status = execute_boot(ncores, nterm, test->disks, test->boot, argl, args, test->timeout);
 		result = WIFEXITED(status) && WEXITSTATUS(status)==129 ? 1 : 0;
 		if(WIFSIGNALED(status))
 			MSG("Test crashed, signal=%d (%s)\n", 
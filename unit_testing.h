@@ -332,6 +332,7 @@ typedef struct Test
 	unsigned int timeout;				/**< time to kill test (see DEFAULT_TIMEOUT) */
 	unsigned int minimum_terminals;		/**< Minimum no. of terminals required. Default: 0 */
 	unsigned int minimum_cores;			/**< Minimum no. of cores required. Default: 1 */
+	unsigned int disks;					/**< No. of scratch disks attached to the VM. Default: 0 */
 } Test;
 
 
@@ -1,6 +1,9 @@
 
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <time.h>
 #include <math.h>
@@ -12,6 +15,37 @@
 #include "unit_testing.h"
 
 
+/* Wall-clock time in seconds */
+static double wall_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1E-9*ts.tv_nsec;
+}
+
+/* Calibrate a CPU-bound loop, returning the iterations per msec */
+static double spin_loops_per_ms()
+{
+	volatile unsigned long spin;
+	double t0 = wall_time();
+	for(spin=0; spin<10000000; spin++);
+	return 1E7 / ((wall_time()-t0)*1000);
+}
+
+/* Spin for about ms msec, using a calibrated loop */
+static void spin_ms(double ms, double loops_per_ms)
+{
+	for(volatile unsigned long spin=0; spin < ms*loops_per_ms; spin++);
+}
+
+/* The factor by which wall time stretches, when the simulated cores outnumber the host's */
+static double host_share()
+{
+	long hostcpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpu_cores() > hostcpus) ? (double)cpu_cores()/hostcpus : 1.0;
+}
+
+
 /*
  *
  *   TESTS
@@ -404,6 +438,42 @@ BOOT_TEST(test_cond_timedwait_timeout,
 }
 
 
+BOOT_TEST(test_timeout_accuracy,
+	"Test that short timed waits wake up on time, and report the percentiles of\n"
+	"the wakeup error."
+	)
+{
+	enum { N = 300 };
+	double err[N];    /* usec */
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	Mutex_Lock(&mx);
+	for(int i=0; i<N; i++) {
+		timeout_t t = 1 + i%3;
+		double t0 = wall_time();
+		Cond_TimedWait(&mx, &cv, t);
+		err[i] = (wall_time()-t0)*1E6 - t*1000.0;
+	}
+	Mutex_Unlock(&mx);
+
+	int cmp(const void* a, const void* b) { 
+		double x = *(double*)a, y = *(double*)b;
+		return (x>y) - (x<y); 
+	}
+	qsort(err, N, sizeof(double), cmp);
+	MSG("wakeup error (usec): min=%.0f p50=%.0f p90=%.0f p99=%.0f max=%.0f\n",
+		err[0], err[N/2], err[N*9/10], err[N*99/100], err[N-1]);
+
+	/* A wait is never cut short (allowing for rounding to usec), and 
+	   usually ends well within a msec of its timeout. */
+	ASSERT(err[0] > -2.0);
+	ASSERT(err[N/2] < 1000.0*host_share());
+	return 0;
+}
+
+
 /*
 	Test that a timed wait on a condition variable terminates at a signal.
  */
@@ -477,1112 +547,3261 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 
 
 
-/*********************************************
- *
- *
- *
- *  I/O  tests
- *
- *
- *
- *********************************************/
+BOOT_TEST(test_cond_broadcast_rounds,
+	"Test that repeated broadcasts wake up all waiters, some of which use short timeouts,\n"
+	"and that the mutex is re-acquired in mutual exclusion."
+	)
+{
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	CondVar done_cv = COND_INIT;
+	int round = 0;
+	int arrived = 0;
+	int inside = 0;
 
+	const int N = 20;
+	const int R = 50;
 
+	int waiter(int argl, void* args)
+	{
+		for(int r=1; r<=R; r++) {
+			Mutex_Lock(&m);
+			ASSERT(inside == 0);
+			arrived ++;
+			Cond_Signal(&done_cv);
+			while(round < r) {
+				if(argl & 1)
+					Cond_TimedWait(&m, &cv, 1);
+				else
+					Cond_Wait(&m, &cv);
+				ASSERT(inside == 0);
+			}
+			inside = 1;
+			for(volatile int k=0; k<1000; k++);
+			inside = 0;
+			Mutex_Unlock(&m);
+		}
+		return 0;
+	}
 
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) tids[i] = CreateThread(waiter, i, NULL);
 
-BOOT_TEST(test_get_terminals,
-	"Test that the number returned by GetTerminalDevices() is equal to the\n"
-	"number of serial ports in the VM."
-	)
-{
-	ASSERT(bios_serial_ports()==GetTerminalDevices());
-	return 0;
-}
+	for(int r=1; r<=R; r++) {
+		Mutex_Lock(&m);
+		while(arrived < r*N) Cond_Wait(&m, &done_cv);
+		round = r;
+		Cond_Broadcast(&cv);
+		Mutex_Unlock(&m);
+	}
 
-BOOT_TEST(test_dup2_error_on_nonfile,
-	"Test that Dup2 will return an error if oldfd is not a file.")
-{
-	for(Fid_t fid = 0; fid < MAX_FILEID; fid++)
-		ASSERT(Dup2(fid, MAX_FILEID-1-fid)==-1);
-	return 0;
-}
+	/* Broadcasting on an empty condition must be harmless */
+	Cond_Broadcast(&cv);
 
-BOOT_TEST(test_dup2_error_on_invalid_fid,
-	"Test that Dup2 returns error when some fid is invalid."
-	)
-{
-	ASSERT(Dup2(NOFILE, 3)==-1);
-	ASSERT(Dup2(MAX_FILEID, 3)==-1);
-	Fid_t fid = OpenNull(0);
-	assert(fid!=NOFILE);
-	ASSERT(Dup2(fid, NOFILE)==-1);
-	ASSERT(Dup2(fid, MAX_FILEID)==-1);		
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
 	return 0;
 }
 
 
-BOOT_TEST(test_open_terminals,
-	"Test that every legal terminal can be opened."
+
+BOOT_TEST(test_cond_broadcast_unlocked,
+	"Test that broadcasts made without holding the mutex wake up all waiters, including\n"
+	"waiters of the first one's mutex that are requeued after waiters of another mutex.",
+	.minimum_cores = 2, .timeout = 30
 	)
 {
-	Fid_t term[MAX_TERMINALS];
-	for(uint i=0; i<GetTerminalDevices(); i++) {
-		term[i] = OpenTerminal(i);
-		ASSERT(term[i]!=NOFILE);
+	/* The first and the last waiter use m, the ones in between m2 */
+	enum { N = 32, R = 200 };
+	Mutex m = MUTEX_INIT, m2 = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Semaphore go[N], queued = SEMAPHORE_INIT(0), woken = SEMAPHORE_INIT(0);
+	for(int i=0; i<N; i++) go[i] = SEMAPHORE_INIT(0);
+	volatile int round = 0;
+
+	int waiter(int argl, void* args)
+	{
+		Mutex* mx = (argl == 0 || argl == N-1) ? &m : &m2;
+		for(int r=1; r<=R; r++) {
+			Sem_Wait(&go[argl]);
+			Mutex_Lock(mx);
+			Sem_Post(&queued);
+			while(round < r) Cond_Wait(mx, &cv);
+			Mutex_Unlock(mx);
+			Sem_Post(&woken);
+		}
+		return 0;
 	}
-	return 0;
-}
 
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) tids[i] = CreateThread(waiter, i, NULL);
+
+	for(int r=1; r<=R; r++) {
+		/* Queue the waiters on cv in order; once we get its mutex, a waiter is queued */
+		for(int i=0; i<N; i++) {
+			Mutex* mx = (i == 0 || i == N-1) ? &m : &m2;
+			Sem_Post(&go[i]);
+			Sem_Wait(&queued);
+			Mutex_Lock(mx);
+			Mutex_Unlock(mx);
+		}
+		round = r;
+		Cond_Broadcast(&cv);
 
-BOOT_TEST(test_close_error_on_invalid_fid,
-	"Test that Close returns error on invalid fid."
-	)
-{
-	ASSERT(Close(NOFILE)==-1);
-	ASSERT(Close(MAX_FILEID)==-1);
-	return 0;
-}
+		/* We do not touch m until all have returned */
+		for(int i=0; i<N; i++) Sem_Wait(&woken);
+	}
 
-BOOT_TEST(test_close_success_on_valid_nonfile_fid,
-	"Test that Close returns success on valid fid, even if there is no\n"
-	"open file for this id."
-	)
-{
-	for(Fid_t i=0; i<MAX_FILEID; i++)
-		ASSERT(Close(i)==0);
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
 	return 0;
 }
 
-BOOT_TEST(test_close_terminals,
-	"Test that terminals can be opened and then closed without error."
+
+
+BOOT_TEST(test_semaphore,
+	"Test the counting semaphore: try and timed variants, and units posted by many threads."
 	)
 {
-	Fid_t term[MAX_TERMINALS];
-	for(uint i=0; i<GetTerminalDevices(); i++) {
-		term[i] = OpenTerminal(i);
-		ASSERT(term[i]!=NOFILE);
-	}
-	for(uint i=0; i<GetTerminalDevices(); i++) {
-		ASSERT(Close(term[i])==0);
-	}	
-	return 0;	
-}
+	Semaphore sem = SEMAPHORE_INIT(2);
 
+	ASSERT(Sem_TryWait(&sem)==1);
+	ASSERT(Sem_TimedWait(&sem, 10)==1);
+	ASSERT(Sem_TryWait(&sem)==0);
+	ASSERT(Sem_TimedWait(&sem, 10)==0);
 
+	const int N = 10;
+	const int K = 100;
 
-void checked_read(Fid_t fid, const char* message)
-{
-	int mlen = strlen(message);
-	char buffer[mlen];
-	ASSERT(Read(fid, buffer, mlen)==mlen);
-	ASSERT(memcmp(buffer, message, mlen)==0);
-}
+	int poster(int argl, void* args)
+	{
+		for(int i=0; i<K; i++) Sem_Post(&sem);
+		return 0;
+	}
 
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) tids[i] = CreateThread(poster, 0, NULL);
+	for(int i=0; i<N*K; i++) Sem_Wait(&sem);
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
 
+	ASSERT(Sem_TryWait(&sem)==0);
+	return 0;
+}
 
-BOOT_TEST(test_read_kbd,
-	"Test that we can read a few bytes from the keyboard on terminal 0.",
-	.minimum_terminals = 1
+
+BOOT_TEST(test_rwlock,
+	"Test that a reader-writer lock admits many readers or one writer, with the try\n"
+	"and timed variants."
 	)
 {
-	assert(GetTerminalDevices()>0);
-	Fid_t fterm = OpenTerminal(0);
-	ASSERT(fterm!=NOFILE);
+	RWLock rw = RWLOCK_INIT;
+
+	/* Many readers, no writers */
+	ASSERT(RWLock_TryReadLock(&rw)==1);
+	ASSERT(RWLock_TimedReadLock(&rw, 10)==1);
+	ASSERT(RWLock_TryWriteLock(&rw)==0);
+	ASSERT(RWLock_TimedWriteLock(&rw, 10)==0);
+	RWLock_ReadUnlock(&rw);
+	RWLock_ReadUnlock(&rw);
+
+	/* One writer, no readers */
+	ASSERT(RWLock_TryWriteLock(&rw)==1);
+	ASSERT(RWLock_TryReadLock(&rw)==0);
+	ASSERT(RWLock_TimedReadLock(&rw, 10)==0);
+	RWLock_WriteUnlock(&rw);
+
+	/* Readers and writers on a shared pair of counters */
+	int a = 0, b = 0;
+	int readers = 0, max_readers = 0;
+	Mutex m = MUTEX_INIT;
+	const int N = 8;
+	const int K = 200;
 
-	sendme(0, "Hello");
-	checked_read(fterm, "Hello");
+	int worker(int argl, void* args)
+	{
+		for(int i=0; i<K; i++) {
+			if((i+argl) % 4 == 0) {
+				RWLock_WriteLock(&rw);
+				ASSERT(readers == 0);
+				a++;
+				for(volatile int k=0; k<100; k++);
+				b++;
+				RWLock_WriteUnlock(&rw);
+			} else {
+				RWLock_ReadLock(&rw);
+				Mutex_Lock(&m);
+				readers++;
+				if(readers > max_readers) max_readers = readers;
+				Mutex_Unlock(&m);
+				ASSERT(a == b);
+				for(volatile int k=0; k<100; k++);
+				Mutex_Lock(&m);
+				readers--;
+				Mutex_Unlock(&m);
+				RWLock_ReadUnlock(&rw);
+			}
+		}
+		return 0;
+	}
+
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) tids[i] = CreateThread(worker, i, NULL);
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(a == N*K/4);
+	ASSERT(a == b);
+	ASSERT(max_readers >= 1);
 	return 0;
 }
 
 
-BOOT_TEST(test_read_kbd_big,
-	"Test that we can read massively from the keyboard on terminal 0.",
-	.minimum_terminals = 1, .timeout = 20
+
+BOOT_TEST(test_pimutex_latency,
+	"Test that a high-priority thread waiting on a PIMutex held by a low-priority\n"
+	"thread is not delayed by CPU-bound threads of medium priority.",
+	.timeout = 30
 	)
 {
-	assert(GetTerminalDevices()>0);
-	Fid_t fterm = OpenTerminal(0);
-	ASSERT(fterm!=NOFILE);
+	/* Calibrate a CPU-bound loop, before other threads compete for the core.
+	   This is done in another thread, so that the main thread is not demoted. */
+	double loops_per_ms;
+	int calibrate(int argl, void* args) { loops_per_ms = spin_loops_per_ms(); return 0; }
+	ThreadJoin(CreateThread(calibrate, 0, NULL), NULL);
+	void work(double ms) { spin_ms(ms, loops_per_ms); }
+
+	const double CS = 20.0;   /* critical section length, in msec */
+	const int K = 20;         /* samples */
+
+	/* Priority boosts would raise the CPU-bound threads over the lock holder */
+	sched_config cfg, noboost;
+	GetSchedConfig(&cfg);
+	noboost = cfg;
+	noboost.boost_period = 0;
+	SetSchedConfig(&noboost);
+
+	PIMutex pm = PIMUTEX_INIT;
+	int stop = 0;
+
+	int cpu_bound(int argl, void* args)
+	{
+		volatile unsigned long x = 0;
+		while(! stop) x++;
+		return 0;
+	}
 
-	char bytes[1025];
-	FUDGE(bytes);
-	bytes[1024]='\0';
+	int low_priority(int argl, void* args)
+	{
+		while(! stop) {
+			PIMutex_Lock(&pm);
+			work(CS);
+			PIMutex_Unlock(&pm);
+			work(CS/4);
+		}
+		return 0;
+	}
 
-	/* send me 1Mbyte */
-	for(int i=0; i<1024; i++)
-		sendme(0, bytes);
+	Tid_t tids[4];
+	tids[0] = CreateThread(low_priority, 0, NULL);
+	for(int i=1; i<4; i++) tids[i] = CreateThread(cpu_bound, 0, NULL);
 
-	/* Read 16kb bytes at a time */
-	char buffer[16384];
-	uint count = 0;
-	uint total = 1<<20;	
-	while(count < total)
-	{
-		int remain = total-count;
+	/* The main thread sleeps most of the time, so it keeps a high priority,
+	   while the other threads sink to lower levels. */
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&m);
+	Cond_TimedWait(&m, &cv, 100);
+	Mutex_Unlock(&m);
+	double lat[K];
+	for(int k=0; k<K; k++) {
+		Mutex_Lock(&m);
+		Cond_TimedWait(&m, &cv, 15);
+		Mutex_Unlock(&m);
 
-		int rc = Read(fterm, buffer, (remain<16384)? remain: 16384);
-		ASSERT(rc>0);
-		count += rc;
+		double t = wall_time();
+		PIMutex_Lock(&pm);
+		lat[k] = (wall_time()-t)*1000;
+		PIMutex_Unlock(&pm);
+	}
+	stop = 1;
+	for(int i=0; i<4; i++) ThreadJoin(tids[i], NULL);
+
+	int cmp(const void* a, const void* b) { 
+		double x = *(double*)a, y = *(double*)b;
+		return (x>y) - (x<y); 
 	}
+	qsort(lat, K, sizeof(double), cmp);
+	MSG("PIMutex wait (msec): median=%.1f max=%.1f\n", lat[K/2], lat[K-1]);
+
+	/* Allow for a few quanta (of 10 msec), on top of the critical section.
+	   When the simulated cores outnumber the host's, they share its processors,
+	   and the wall time of everything stretches accordingly. */
+	ASSERT(lat[K-1] < (3*CS + 30)*host_share());
 
+	SetSchedConfig(&cfg);
 	return 0;
 }
 
 
-BOOT_TEST(test_dup2_copies_file,
-	"This test copies that Dup2 copies the file to another file descriptor.",
-	.minimum_terminals = 1
+BOOT_TEST(test_sched_config,
+	"Test that the scheduler parameters can be read and changed, and that invalid\n"
+	"parameters are rejected."
 	)
 {
-	Fid_t fterm = OpenTerminal(0);
-	ASSERT(fterm!=NOFILE);
-
-	if(fterm!=0) {
-		ASSERT(Dup2(fterm, 0)==0);
-		Close(fterm);		
+	sched_config cfg, cfg2;
+	ASSERT(GetSchedConfig(NULL)==-1);
+	ASSERT(SetSchedConfig(NULL)==-1);
+	ASSERT(GetSchedConfig(&cfg)==0);
+	ASSERT(cfg.levels > 0);
+	ASSERT(cfg.quantum > 0);
+
+	cfg2 = cfg;
+	cfg2.quantum = 10;
+	ASSERT(SetSchedConfig(&cfg2)==-1);
+	cfg2.quantum = 2000;
+	cfg2.quantum_step = 10000000;
+	ASSERT(SetSchedConfig(&cfg2)==-1);
+
+	cfg2.levels = cfg.levels + 1;
+	cfg2.quantum = 2000;
+	cfg2.quantum_step = 1000;
+	cfg2.boost_period = 20000;
+	ASSERT(SetSchedConfig(&cfg2)==0);
+	ASSERT(GetSchedConfig(&cfg2)==0);
+	ASSERT(cfg2.levels == cfg.levels);
+	ASSERT(cfg2.quantum == 2000);
+	ASSERT(cfg2.quantum_step == 1000);
+	ASSERT(cfg2.boost_period == 20000);
+
+	/* Run a few CPU-bound threads with frequent boosts */
+	int cpu_bound(int argl, void* args)
+	{
+		volatile unsigned long x;
+		for(x=0; x < 20000000; x++);
+		return 0;
 	}
+	Tid_t tids[4];
+	for(int i=0; i<4; i++) tids[i] = CreateThread(cpu_bound, 0, NULL);
+	for(int i=0; i<4; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
 
-	sendme(0, "zavarakatranemia");
+	/* No boosts */
+	cfg2.boost_period = 0;
+	ASSERT(SetSchedConfig(&cfg2)==0);
+	for(int i=0; i<4; i++) tids[i] = CreateThread(cpu_bound, 0, NULL);
+	for(int i=0; i<4; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
 
-	ASSERT(Dup2(0,1)==0);
-	ASSERT(Dup2(0,2)==0);
-	ASSERT(Dup2(0,3)==0);
-	ASSERT(Dup2(0,4)==0);
+	ASSERT(SetSchedConfig(&cfg)==0);
+	return 0;
+}
 
-	checked_read(1, "zava");
-	checked_read(3, "raka");
-	checked_read(2, "trane");
-	checked_read(4, "mia");
 
+static int sched_config_boot(int argl, void* args)
+{
+	sched_config cfg;
+	ASSERT(GetSchedConfig(&cfg)==0);
+	if(argl==0) {
+		cfg.quantum = 2000;
+		cfg.boost_period = 0;
+		cfg.fair_share = 1;
+		cfg.tickless = 0;
+		ASSERT(SetSchedConfig(&cfg)==0);
+	} else {
+		/* The previous boot must not leak into this one */
+		ASSERT(cfg.quantum != 2000);
+		ASSERT(cfg.boost_period != 0);
+		ASSERT(cfg.fair_share == 0);
+		ASSERT(cfg.tickless == 1);
+	}
 	return 0;
 }
 
+BARE_TEST(test_sched_config_reset,
+	"Test that the scheduler parameters are reset to their defaults at boot."
+	)
+{
+	boot(1, 0, sched_config_boot, 0, NULL);
+	boot(1, 0, sched_config_boot, 1, NULL);
+}
+
 
-BOOT_TEST(test_read_error_on_bad_fid,
-	"Test that Read will return an error when called on a bad fid"
+BOOT_TEST(test_sched_params,
+	"Test that the scheduling class of a thread can be read and changed, and that invalid\n"
+	"parameters and excessive bandwidth are rejected."
 	)
 {
-	char buffer[10];
-	ASSERT(Read(0, buffer, 10)==-1);
+	sched_params p;
+	Tid_t self = ThreadSelf();
+	ASSERT(GetSchedParams(self, &p)==0);
+	ASSERT(p.policy == SCHED_POLICY_MLFQ);
+	ASSERT(GetSchedParams(NOTHREAD, &p)==-1);
+	ASSERT(GetSchedParams(self, NULL)==-1);
+	ASSERT(SetSchedParams(self, NULL)==-1);
+
+	/* Invalid parameters */
+	sched_params bad[] = {
+		{ 7, 1000, 2000, 2000 },
+		{ SCHED_POLICY_DEADLINE, 10, 2000, 2000 },
+		{ SCHED_POLICY_DEADLINE, 3000, 2000, 4000 },
+		{ SCHED_POLICY_DEADLINE, 1000, 4000, 2000 },
+	};
+	for(unsigned i=0; i<sizeof(bad)/sizeof(bad[0]); i++)
+		ASSERT(SetSchedParams(self, &bad[i])==-1);
+
+	/* Admission control: each core can be reserved only up to 95% */
+	sched_params dl = { SCHED_POLICY_DEADLINE, 5000, 10000, 10000 };
+	sched_params greedy = { SCHED_POLICY_DEADLINE, 9000, 10000, 10000 };
+	int sleeper(int argl, void* args) { 
+		Mutex m = MUTEX_INIT; CondVar cv = COND_INIT;
+		Mutex_Lock(&m); Cond_TimedWait(&m, &cv, 50); Mutex_Unlock(&m);
+		return 0;
+	}
+	Tid_t t = CreateThread(sleeper, 0, NULL);
+	ASSERT(SetSchedParams(t, &dl)==0);
+	ASSERT(GetSchedParams(t, &p)==0);
+	ASSERT(p.policy == SCHED_POLICY_DEADLINE);
+	ASSERT(p.runtime==5000 && p.deadline==10000 && p.period==10000);
+	if(cpu_cores()==1)
+		ASSERT(SetSchedParams(self, &greedy)==-1);
+
+	/* The bandwidth is released when the thread exits */
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(SetSchedParams(self, &greedy)==0);
+	ASSERT(GetSchedParams(self, &p)==0);
+	ASSERT(p.policy == SCHED_POLICY_DEADLINE);
+
+	sched_params mlfq = { SCHED_POLICY_MLFQ };
+	ASSERT(SetSchedParams(self, &mlfq)==0);
+	ASSERT(GetSchedParams(self, &p)==0);
+	ASSERT(p.policy == SCHED_POLICY_MLFQ);
 	return 0;
 }
 
 
-BOOT_TEST(test_read_from_many_terminals,
-	"Test that Read can read from all terminals",
-	.minimum_terminals = 2
+BOOT_TEST(test_sched_deadline,
+	"Test that a periodic deadline thread meets all its deadlines, while CPU-bound\n"
+	"threads load all the cores.",
+	.timeout = 30
 	)
 {
-	Fid_t term[MAX_TERMINALS];
-	for(uint i = 0; i < GetTerminalDevices(); i++) {
-		term[i] = OpenTerminal(i);
-		ASSERT(term[i]!=NOFILE);
+	double loops_per_ms;
+	int calibrate(int argl, void* args) { loops_per_ms = spin_loops_per_ms(); return 0; }
+	ThreadJoin(CreateThread(calibrate, 0, NULL), NULL);
+
+	/* The work and the budget stretch with the wall time, when the host is shared */
+	const double WORK = 2.0;                       /* msec of work per period */
+	const double PERIOD = 50.0;                    /* in msec */
+	const double DEADLINE = 10.0*host_share();     /* in msec, shorter than the quanta of MLFQ */
+	const unsigned long RUNTIME = (unsigned long)(4*WORK*host_share()*1000);
+	const int K = 20;
+
+	int stop = 0;
+	int cpu_bound(int argl, void* args)
+	{
+		volatile unsigned long x = 0;
+		while(! stop) x++;
+		return 0;
 	}
 
-	for(uint i = 0; i < GetTerminalDevices(); i++) {
-		char message[32];
-		sprintf(message, "This is terminal %d", i);
+	int misses = 0;
+	double lateness = 0.0;
+	int periodic(int argl, void* args)
+	{
+		sched_params p = { SCHED_POLICY_DEADLINE, RUNTIME, DEADLINE*1000, PERIOD*1000 };
+		ASSERT(SetSchedParams(ThreadSelf(), &p)==0);
 
-		sendme(i, message);
+		Mutex m = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		double release = wall_time();
+		for(int k=0; k<K; k++) {
+			/* Sleep until the next release */
+			release += PERIOD/1000;
+			Mutex_Lock(&m);
+			double now;
+			while((now = wall_time()) < release)
+				Cond_TimedWait(&m, &cv, (timeout_t) ceil((release-now)*1000));
+			Mutex_Unlock(&m);
+
+			spin_ms(WORK, loops_per_ms);
+			double late = (wall_time() - release)*1000;
+			if(late > lateness) lateness = late;
+			if(late > DEADLINE) misses++;
+		}
+		return 0;
 	}
-	for(uint i = 0; i < GetTerminalDevices(); i++) {
-		char message[32];
-		sprintf(message, "This is terminal %d", i);
 
-		checked_read(term[i], message);
-	}
+	int N = 2*cpu_cores();
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) tids[i] = CreateThread(cpu_bound, 0, NULL);
 
+	Tid_t t = CreateThread(periodic, 0, NULL);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	stop = 1;
+	for(int i=0; i<N; i++) ThreadJoin(tids[i], NULL);
 
+	MSG("Deadline thread: max completion=%.1f msec (deadline %.1f), misses=%d\n", 
+		lateness, DEADLINE, misses);
+	ASSERT(misses == 0);
 	return 0;
 }
 
 
-
-BOOT_TEST(test_child_inherits_files,
-	"Test that a child process inherits files.",
-	.minimum_terminals = 1
+BOOT_TEST(test_fair_share,
+	"Test that in fair-share mode, processes share the CPU in proportion to their\n"
+	"nice weights, regardless of their number of threads.",
+	.timeout = 30
 	)
 {
-	Fid_t fterm = OpenTerminal(0);
-	ASSERT(fterm!=NOFILE);
-	if(fterm!=0)
-		ASSERT(Dup2(fterm, 0)==0);
-
-	int greeted_child(int argl, void* args)
+	int nice;
+	ASSERT(GetNice(GetPid(), &nice)==0);
+	ASSERT(nice == 0);
+	ASSERT(GetNice(GetPid(), NULL)==-1);
+	ASSERT(GetNice(MAX_PROC, &nice)==-1);
+	ASSERT(SetNice(GetPid(), 20)==-1);
+	ASSERT(SetNice(GetPid(), -21)==-1);
+	ASSERT(SetNice(-1, 0)==-1);
+
+	sched_config cfg, fair;
+	GetSchedConfig(&cfg);
+	fair = cfg;
+	fair.fair_share = 1;
+	ASSERT(SetSchedConfig(&fair)==0);
+	ASSERT(GetSchedConfig(&fair)==0);
+	ASSERT(fair.fair_share);
+
+	int stop;
+	unsigned long work[2];
+	int nthreads[2];
+
+	int spinner(int argl, void* args)
 	{
-		checked_read(0, "Hello child");
-		checked_read(0, "Hello again");
+		unsigned long x = 0;
+		while(! stop) x++;
+		__atomic_fetch_add(&work[argl], x, __ATOMIC_RELAXED);
+		return 0;
+	}
+	int group(int argl, void* args)
+	{
+		Tid_t tids[nthreads[argl]];
+		for(int i=0; i<nthreads[argl]; i++) tids[i] = CreateThread(spinner, argl, NULL);
+		for(int i=0; i<nthreads[argl]; i++) ThreadJoin(tids[i], NULL);
 		return 0;
 	}
 
-	sendme(0, "Hello child");
-	Pid_t cpid = Exec(greeted_child, 0, NULL);
-	ASSERT(Close(0)==0);
-	ASSERT(Close(fterm)==0);
-	sendme(0, "Hello again");
-	ASSERT(cpid!=NOPROC);
-	ASSERT(WaitChild(NOPROC, NULL)==cpid);
-	return 0;
-}
+	/* Run two processes for a while, and return the ratio of their work */
+	double run(int n0, int n1, int nice1)
+	{
+		stop = 0;
+		work[0] = work[1] = 0;
+		nthreads[0] = n0;
+		nthreads[1] = n1;
+		Pid_t p0 = Exec(group, 0, NULL);
+		Pid_t p1 = Exec(group, 1, NULL);
+		ASSERT(SetNice(p1, nice1)==0);
+		ASSERT(GetNice(p1, &nice)==0 && nice==nice1);
+
+		Mutex m = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		Mutex_Lock(&m);
+		Cond_TimedWait(&m, &cv, 500);
+		Mutex_Unlock(&m);
+		stop = 1;
+		WaitChild(p0, NULL);
+		WaitChild(p1, NULL);
+		return (double)work[0] / work[1];
+	}
 
+	int C = cpu_cores();
+	double r1 = run(C, 4*C, 0);
+	/* Nice 5 has weight 335, versus 1024 for nice 0 */
+	double r2 = run(C, C, 5);
+	MSG("Work ratio: %.2f with 4x threads, %.2f with nice 5\n", r1, r2);
 
+	ASSERT(SetSchedConfig(&cfg)==0);
+	ASSERT(r1 > 0.5 && r1 < 2.0);
+	ASSERT(r2 > 1.5 && r2 < 6.0);
+	return 0;
+}
 
 
-BOOT_TEST(test_null_device,
-	"Test the null device."
+BOOT_TEST(test_affinity,
+	"Test that threads run only on the cores of their affinity mask, and that\n"
+	"terminal interrupts can be routed to any core.",
+	.timeout = 30
 	)
 {
-
-	void test_read(Fid_t fid)
+	unsigned int C = cpu_cores();
+	unsigned long all = (1ul << C) - 1, mask;
+	Tid_t self = ThreadSelf();
+	ASSERT(GetAffinity(self, &mask)==0);
+	ASSERT(mask == all);
+	ASSERT(GetAffinity(self, NULL)==-1);
+	ASSERT(GetAffinity(NOTHREAD, &mask)==-1);
+	ASSERT(SetAffinity(NOTHREAD, all)==-1);
+	ASSERT(SetAffinity(self, 0)==-1);
+	ASSERT(SetAffinity(self, 1ul << C)==-1);
+
+	int stop = 0;
+	int wrong = 0;
+	unsigned long samples[C];
+
+	int pinned(int argl, void* args)
 	{
-		char z[] = "zavarakatranemia";
-		char z1[] = "\0\0\0\0\0\0\0\0\0\0anemia";
-		ASSERT(Read(fid, z, 10)==10);
-		ASSERT(memcmp(z,z1, 17)==0);
+		unsigned long n = 0;
+		while(! stop) {
+			if(cpu_core_id != argl) __atomic_fetch_add(&wrong, 1, __ATOMIC_RELAXED);
+			n++;
+		}
+		samples[argl] = n;
+		return 0;
+	}
+	int unpinned(int argl, void* args)
+	{
+		volatile unsigned long x = 0;
+		while(! stop) x++;
+		return 0;
 	}
 
-	Fid_t fn = OpenNull();
-	ASSERT(fn!=-1);
-
-	test_read(fn);
-	ASSERT(Write(fn, NULL, 123456)==123456);
+	/* New threads inherit the affinity of their creator */
+	Tid_t tids[2*C];
+	for(unsigned int c=0; c<C; c++) {
+		ASSERT(SetAffinity(self, 1ul << c)==0);
+		tids[c] = CreateThread(pinned, c, NULL);
+		ASSERT(GetAffinity(tids[c], &mask)==0);
+		ASSERT(mask == 1ul << c);
+	}
+	ASSERT(SetAffinity(self, all)==0);
+	for(unsigned int c=0; c<C; c++) tids[C+c] = CreateThread(unpinned, 0, NULL);
 
-	ASSERT(Close(fn)==0);
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&m);
+	Cond_TimedWait(&m, &cv, 300);
+	Mutex_Unlock(&m);
+	stop = 1;
+	for(unsigned int i=0; i<2*C; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(wrong == 0);
+	for(unsigned int c=0; c<C; c++) ASSERT(samples[c] > 0);
+
+	/* Terminal interrupt routing */
+	unsigned int T = GetTerminalDevices();
+	ASSERT(SetTerminalCore(T, 0)==-1);
+	ASSERT(GetTerminalCore(T)==-1);
+	if(T > 0) {
+		ASSERT(GetTerminalCore(0)==0);
+		ASSERT(SetTerminalCore(0, C)==-1);
+		ASSERT(SetTerminalCore(0, C-1)==0);
+		ASSERT(GetTerminalCore(0)==C-1);
+		ASSERT(SetTerminalCore(0, 0)==0);
+	}
 	return 0;
 }
 
 
-
-/***********************************************************************************8
-*************************************************/
-
-
-
-
-void checked_write(Fid_t fid, const char* message)
+BOOT_TEST(test_affinity_running,
+	"Test that a running thread, including the caller, leaves a core at once when\n"
+	"its affinity no longer allows that core.",
+	.minimum_cores = 2, .timeout = 30
+	)
 {
-	int mlen = strlen(message);
-	for(int count=0; count < mlen;) {
-		int wno = Write(fid, message+count, 1);
-		ASSERT(wno>0);
-		count += wno;
+	unsigned int C = cpu_cores();
+	unsigned long all = (1ul << C) - 1;
+	Tid_t self = ThreadSelf();
+
+	int stop = 0;
+	int where = -1;
+	int spinner(int argl, void* args)
+	{
+		while(! stop) __atomic_store_n(&where, cpu_core_id, __ATOMIC_RELAXED);
+		return 0;
 	}
-}
 
+	/* The spinner runs alone on core 1, without a time-slice limit, while 
+	   this thread stays away from core 1 */
+	ASSERT(SetAffinity(self, 1ul << 1)==0);
+	ASSERT(cpu_core_id == 1);
+	Tid_t tid = CreateThread(spinner, 0, NULL);
+	ASSERT(SetAffinity(self, 1ul << 0)==0);
+	ASSERT(cpu_core_id == 0);
 
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&m);
+	for(int i=0; i<100 && __atomic_load_n(&where, __ATOMIC_RELAXED) != 1; i++)
+		Cond_TimedWait(&m, &cv, 10);
+	ASSERT(where == 1);
+
+	/* Re-pin the spinner while it runs */
+	ASSERT(SetAffinity(tid, all & ~(1ul << 1))==0);
+	for(int i=0; i<100 && __atomic_load_n(&where, __ATOMIC_RELAXED) == 1; i++)
+		Cond_TimedWait(&m, &cv, 10);
+	ASSERT(where != 1);
+	Mutex_Unlock(&m);
 
-BOOT_TEST(test_write_con,
-	"Test that we can write a few bytes to the console on terminal 0.",
-	.minimum_terminals = 1
-	)
-{
-	assert(GetTerminalDevices()>0);
-	Fid_t fterm = OpenTerminal(0);
-	ASSERT(fterm!=NOFILE);
+	stop = 1;
+	ASSERT(ThreadJoin(tid, NULL)==0);
 
-	expect(0, "Hello");
-	checked_write(fterm, "Hello");
+	/* Re-pin the caller */
+	ASSERT(SetAffinity(self, 1ul << (C-1))==0);
+	ASSERT(cpu_core_id == C-1);
+	ASSERT(SetAffinity(self, all)==0);
 	return 0;
 }
 
 
-BOOT_TEST(test_write_con_big,
-	"Test that we can write massively to the console on terminal 0.",
-	.minimum_terminals = 1
+BOOT_TEST(test_tickless_wakeup,
+	"Test that a thread woken up for a core whose current thread runs without a\n"
+	"time-slice limit (tickless) gets the core, with and without tickless mode.",
+	.timeout = 30
 	)
 {
-	assert(GetTerminalDevices()>0);
-	Fid_t fterm = OpenTerminal(0);
-	ASSERT(fterm!=NOFILE);
-
-	char bytes[1025];
-	FUDGE(bytes);
-	bytes[1024]='\0';
-
-	/* send me 1Mbyte */
-	for(int i=0; i<1024; i++)
-		expect(0, bytes);
+	sched_config cfg, mode;
+	GetSchedConfig(&cfg);
+	ASSERT(cfg.tickless);
 
-	/* Create a 16kb block */
-	char buffer[16384];
-	FUDGE(buffer);
+	unsigned int C = cpu_cores();
+	unsigned int T = C-1;   /* the core of the CPU hog and the waiter */
+	unsigned long all = (1ul << C) - 1;
+	Tid_t self = ThreadSelf();
 
-	int total = 1<<20;
-	int count = 0;
+	Mutex m = MUTEX_INIT;
+	CondVar wake = COND_INIT, reply = COND_INIT;
+	int stop, signalled, replied;
+	double t0, t1;
 
-	while(count < total)
+	int hog(int argl, void* args)
 	{
-		int remain = total-count;
-
-		int rc = Write(fterm, buffer, (remain<16384)? remain: 16384);
-		ASSERT(rc>0);
-		count += rc;
+		volatile unsigned long x = 0;
+		while(! stop) x++;
+		return 0;
+	}
+	int waiter(int argl, void* args)
+	{
+		Mutex_Lock(&m);
+		while(! stop) {
+			while(! signalled && ! stop) Cond_Wait(&m, &wake);
+			signalled = 0;
+			t1 = wall_time();
+			replied = 1;
+			Cond_Signal(&reply);
+		}
+		Mutex_Unlock(&m);
+		return 0;
 	}
 
-	return 0;
-}
+	for(int tickless=1; tickless>=0; tickless--) {
+		mode = cfg;
+		mode.tickless = tickless;
+		ASSERT(SetSchedConfig(&mode)==0);
+		stop = signalled = replied = 0;
+
+		/* The hog and the waiter run on core T, the main thread on core 0 */
+		ASSERT(SetAffinity(self, 1ul << T)==0);
+		Tid_t th = CreateThread(hog, 0, NULL);
+		Tid_t tw = CreateThread(waiter, 0, NULL);
+		ASSERT(SetAffinity(self, 1)==0);
+
+		double worst = 0.0;
+		for(int k=0; k<5; k++) {
+			Mutex_Lock(&m);
+			/* Let the hog run alone for a while */
+			Cond_TimedWait(&m, &reply, 30);
+			replied = 0;
+			signalled = 1;
+			t0 = wall_time();
+			Cond_Signal(&wake);
+			while(! replied) Cond_Wait(&m, &reply);
+			if(t1 - t0 > worst) worst = t1 - t0;
+			Mutex_Unlock(&m);
+		}
 
+		Mutex_Lock(&m);
+		stop = 1;
+		Cond_Broadcast(&wake);
+		Mutex_Unlock(&m);
+		ASSERT(ThreadJoin(th, NULL)==0);
+		ASSERT(ThreadJoin(tw, NULL)==0);
+		ASSERT(SetAffinity(self, all)==0);
 
+		MSG("tickless=%d: worst wakeup latency %.1f msec\n", tickless, worst*1000);
+		/* The waiter may wait for the rest of the time-slice of the hog */
+		ASSERT(worst < 0.2*host_share());
+	}
 
-BOOT_TEST(test_write_error_on_bad_fid,
-	"Test that Write will return an error when called on a bad fid"
-	)
-{
-	char buffer[10];
-	ASSERT(Write(0, buffer, 10)==-1);
+	ASSERT(SetSchedConfig(&cfg)==0);
 	return 0;
 }
 
 
-BOOT_TEST(test_write_to_many_terminals,
-	"Test that Write can send to all terminals",
-	.minimum_terminals = 2
+BOOT_TEST(test_wakeup_preempts,
+	"Test that a woken thread of higher priority preempts a CPU hog on another\n"
+	"core at once, instead of waiting for the end of its time-slice.",
+	.timeout = 30
 	)
 {
-	Fid_t term[MAX_TERMINALS];
-	for(uint i = 0; i < GetTerminalDevices(); i++) {
-		term[i] = OpenTerminal(i);
-		ASSERT(term[i]!=NOFILE);
-	}
+	unsigned int C = cpu_cores();
+	unsigned int T = C-1;   /* the core of the CPU hog and the waiter */
+	unsigned long all = (1ul << C) - 1;
+	Tid_t self = ThreadSelf();
 
-	for(uint i = 0; i < GetTerminalDevices(); i++) {
-		char message[32];
-		sprintf(message, "This is terminal %d", i);
+	Mutex m = MUTEX_INIT;
+	CondVar wake = COND_INIT, reply = COND_INIT;
+	int stop = 0, signalled = 0, replied = 0;
+	double t0, t1;
 
-		expect(i, message);
+	int hog(int argl, void* args)
+	{
+		volatile unsigned long x = 0;
+		while(! stop) x++;
+		return 0;
+	}
+	int waiter(int argl, void* args)
+	{
+		Mutex_Lock(&m);
+		while(! stop) {
+			while(! signalled && ! stop) Cond_Wait(&m, &wake);
+			signalled = 0;
+			t1 = wall_time();
+			replied = 1;
+			Cond_Signal(&reply);
+		}
+		Mutex_Unlock(&m);
+		return 0;
 	}
-	for(uint i = 0; i < GetTerminalDevices(); i++) {
-		char message[32];
-		sprintf(message, "This is terminal %d", i);
 
-		checked_write(term[i], message);
+	/* The hog and the waiter run on core T, the main thread on core 0 */
+	ASSERT(SetAffinity(self, 1ul << T)==0);
+	Tid_t th = CreateThread(hog, 0, NULL);
+	Tid_t tw = CreateThread(waiter, 0, NULL);
+	ASSERT(SetAffinity(self, 1)==0);
+
+	double worst = 0.0;
+	for(int k=0; k<10; k++) {
+		Mutex_Lock(&m);
+		/* Let the hog run alone, and sink in the feedback queues */
+		Cond_TimedWait(&m, &reply, 50);
+		replied = 0;
+		signalled = 1;
+		t0 = wall_time();
+		Cond_Signal(&wake);
+		while(! replied) Cond_Wait(&m, &reply);
+		/* The first rounds are skipped, the hog has not sunk yet */
+		if(k >= 2 && t1 - t0 > worst) worst = t1 - t0;
+		Mutex_Unlock(&m);
 	}
 
+	Mutex_Lock(&m);
+	stop = 1;
+	Cond_Broadcast(&wake);
+	Mutex_Unlock(&m);
+	ASSERT(ThreadJoin(th, NULL)==0);
+	ASSERT(ThreadJoin(tw, NULL)==0);
+	ASSERT(SetAffinity(self, all)==0);
 
+	MSG("worst wakeup latency %.1f msec\n", worst*1000);
+	/* The hog is preempted by an inter-core interrupt, not its timer */
+	ASSERT(worst < 0.005*host_share());
 	return 0;
 }
 
 
-
-
-TEST_SUITE(basic_tests, 
-	"A suite of basic tests, focusing on the functional behaviour of the\n"
-	"tinyos3 API, but not the operational (concurrency and I/O multiplexing)."
+BOOT_TEST(test_barrier,
+	"Test that no thread passes a barrier before all threads reach it, for many rounds\n"
+	"and for various numbers of threads."
 	)
 {
-	&test_boot,
-	&test_pid_of_init_is_one,
-	&test_waitchild_error_on_nonchild,
-	&test_waitchild_error_on_invalid_pid,
-	&test_exec_getpid_wait,
-	&test_exec_copies_arguments,
-	&test_exit_returns_status,
-	&test_main_return_returns_status,
-	&test_wait_for_any_child,
-	&test_orphans_adopted_by_init,
-	&test_cond_timedwait_timeout,
-	&test_cond_timedwait_signal,
-	&test_cond_timedwait_broadcast,
-	&test_null_device,
-	&test_get_terminals,
-	&test_open_terminals,
-	&test_dup2_error_on_nonfile,
-	&test_dup2_error_on_invalid_fid,
-	&test_dup2_copies_file,
-	&test_close_error_on_invalid_fid,
-	&test_close_success_on_valid_nonfile_fid,
-	&test_close_terminals,
-	&test_read_kbd,
-	&test_read_kbd_big,
-	&test_read_error_on_bad_fid,
-	&test_read_from_many_terminals,
-	&test_write_con,
-	&test_write_con_big,
-	&test_write_error_on_bad_fid,
-	&test_write_to_many_terminals,
-	&test_child_inherits_files,
-	NULL
-};
+	ASSERT(Barrier_Init(NULL, 0)==-1);
+
+	const int R = 20;
+	int sizes[] = { 1, 3, 4, 5, 17, 40, 70 };
+
+	for(int k=0; k<sizeof(sizes)/sizeof(int); k++) {
+		int N = sizes[k];
+		Barrier bar;
+		ASSERT(Barrier_Init(&bar, N)==0);
+		int arrived[R];
+		for(int r=0; r<R; r++) arrived[r] = 0;
+
+		int sync_thread(int argl, void* args)
+		{
+			for(int r=0; r<R; r++) {
+				__atomic_fetch_add(&arrived[r], 1, __ATOMIC_RELAXED);
+				Barrier_Sync(&bar);
+				ASSERT(arrived[r] == N);
+			}
+			return 0;
+		}
 
+		Tid_t tids[N];
+		for(int i=0; i<N; i++) tids[i] = CreateThread(sync_thread, i, NULL);
+		for(int i=0; i<N; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+		Barrier_Destroy(&bar);
+	}
+	return 0;
+}
 
 
 /*********************************************
  *
  *
  *
- *  Thread tests
+ *  I/O  tests
  *
  *
  *
  *********************************************/
 
 
-void sleep_thread(int sec) {
-	Mutex mx = MUTEX_INIT;
-	CondVar cond = COND_INIT;
-
-	Mutex_Lock(&mx);
-	ASSERT(Cond_TimedWait(&mx,&cond,1000*sec)==0);
-}
 
-/* 
-	Helper that spawns a process, waits for its completion
-	and returns its status.
- */
 
-int run_get_status(Task task, int argl, void* args)
+BOOT_TEST(test_get_terminals,
+	"Test that the number returned by GetTerminalDevices() is equal to the\n"
+	"number of serial ports in the VM."
+	)
 {
-	Pid_t pid = Exec(task, argl, args);
-	ASSERT(pid!=NOPROC);
-
-	int exitval;
-	ASSERT(WaitChild(pid, &exitval)==pid);
-
-	return exitval;
+	ASSERT(bios_serial_ports()==GetTerminalDevices());
+	return 0;
 }
 
-
-BOOT_TEST(test_threadself,
-	"Test that ThreadSelf is somewhat sane")
+BOOT_TEST(test_dup2_error_on_nonfile,
+	"Test that Dup2 will return an error if oldfd is not a file.")
 {
-	ASSERT(ThreadSelf() != NOTHREAD);
-	ASSERT(ThreadSelf() == ThreadSelf());
+	for(Fid_t fid = 0; fid < MAX_FILEID; fid++)
+		ASSERT(Dup2(fid, MAX_FILEID-1-fid)==-1);
 	return 0;
 }
 
-
-
-BOOT_TEST(test_join_illegal_tid_gives_error,
-	"Test that ThreadJoin rejects an illegal Tid")
+BOOT_TEST(test_dup2_error_on_invalid_fid,
+	"Test that Dup2 returns error when some fid is invalid."
+	)
 {
-	int* illegal_ptr = (int*) -1;
+	ASSERT(Dup2(NOFILE, 3)==-1);
+	ASSERT(Dup2(MAX_FILEID, 3)==-1);
+	Fid_t fid = OpenNull(0);
+	assert(fid!=NOFILE);
+	ASSERT(Dup2(fid, NOFILE)==-1);
+	ASSERT(Dup2(fid, MAX_FILEID)==-1);		
+	return 0;
+}
 
-	ASSERT(ThreadJoin(NOTHREAD, illegal_ptr)==-1);
 
-	/* Test with random numbers. Since we only have one thread, any call is an illegal call. */
-	for(int i=0; i<100; i++) {
-		Tid_t random_tid = lrand48();
-		ASSERT(ThreadJoin(random_tid, illegal_ptr)==-1);
+BOOT_TEST(test_open_terminals,
+	"Test that every legal terminal can be opened."
+	)
+{
+	Fid_t term[MAX_TERMINALS];
+	for(uint i=0; i<GetTerminalDevices(); i++) {
+		term[i] = OpenTerminal(i);
+		ASSERT(term[i]!=NOFILE);
 	}
-
-	/* In addition, we cannot join ourselves ! */
-	ASSERT(ThreadJoin(ThreadSelf(), illegal_ptr)==-1);
-
 	return 0;
 }
 
 
-BOOT_TEST(test_detach_illegal_tid_gives_error,
-	"Test that ThreadDetach rejects an illegal Tid")
+BOOT_TEST(test_close_error_on_invalid_fid,
+	"Test that Close returns error on invalid fid."
+	)
 {
-	ASSERT(ThreadDetach(NOTHREAD)==-1);
-
-	/* Test with random numbers. Since we only have one thread, any call is an illegal call. */
-	for(int i=0; i<100; i++) {
-		Tid_t random_tid = lrand48();
-		if(random_tid==ThreadSelf()) /* Very unlikely, but still... */
-			continue;
-		ASSERT(ThreadDetach(random_tid)==-1);
-	}
-
+	ASSERT(Close(NOFILE)==-1);
+	ASSERT(Close(MAX_FILEID)==-1);
 	return 0;
 }
 
-
-BOOT_TEST(test_create_join_thread,
-	"Test that a process thread can be created and joined. Also, that "
-	"the argument of the thread is passed correctly."
+BOOT_TEST(test_close_success_on_valid_nonfile_fid,
+	"Test that Close returns success on valid fid, even if there is no\n"
+	"open file for this id."
 	)
 {
-	int flag = 0;
+	for(Fid_t i=0; i<MAX_FILEID; i++)
+		ASSERT(Close(i)==0);
+	return 0;
+}
 
-	int task(int argl, void* args) {
-		ASSERT(args == &flag);
-		*(int*)args = 1;
-		return 2;
+BOOT_TEST(test_close_terminals,
+	"Test that terminals can be opened and then closed without error."
+	)
+{
+	Fid_t term[MAX_TERMINALS];
+	for(uint i=0; i<GetTerminalDevices(); i++) {
+		term[i] = OpenTerminal(i);
+		ASSERT(term[i]!=NOFILE);
 	}
+	for(uint i=0; i<GetTerminalDevices(); i++) {
+		ASSERT(Close(term[i])==0);
+	}	
+	return 0;	
+}
 
-	Tid_t t = CreateThread(task, sizeof(flag), &flag);
 
-	/* Success in creating thread */
-	ASSERT(t!=NOTHREAD);
-	int exitval;
-	
-	/* Join should succeed */
-	ASSERT(ThreadJoin(t, &exitval)==0);
 
-	/* Exit status should be correct */
-	ASSERT(exitval==2);
+void checked_read(Fid_t fid, const char* message)
+{
+	int mlen = strlen(message);
+	char buffer[mlen];
+	ASSERT(Read(fid, buffer, mlen)==mlen);
+	ASSERT(memcmp(buffer, message, mlen)==0);
+}
 
-	/* Shared variable should be updates */
-	ASSERT(flag==1);
 
-	/* A second Join should fail! */
-	ASSERT(ThreadJoin(t, NULL)==-1);
 
+BOOT_TEST(test_read_kbd,
+	"Test that we can read a few bytes from the keyboard on terminal 0.",
+	.minimum_terminals = 1
+	)
+{
+	assert(GetTerminalDevices()>0);
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
 
+	sendme(0, "Hello");
+	checked_read(fterm, "Hello");
 	return 0;
 }
 
-BOOT_TEST(test_detach_self,
-	"Test that a thread can detach itself")
+
+BOOT_TEST(test_read_kbd_big,
+	"Test that we can read massively from the keyboard on terminal 0.",
+	.minimum_terminals = 1, .timeout = 20
+	)
 {
-	ASSERT(ThreadDetach(ThreadSelf())==0);
+	assert(GetTerminalDevices()>0);
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	char bytes[1025];
+	FUDGE(bytes);
+	bytes[1024]='\0';
+
+	/* send me 1Mbyte */
+	for(int i=0; i<1024; i++)
+		sendme(0, bytes);
+
+	/* Read 16kb bytes at a time */
+	char buffer[16384];
+	uint count = 0;
+	uint total = 1<<20;	
+	while(count < total)
+	{
+		int remain = total-count;
+
+		int rc = Read(fterm, buffer, (remain<16384)? remain: 16384);
+		ASSERT(rc>0);
+		count += rc;
+	}
+
 	return 0;
 }
 
 
-
-BOOT_TEST(test_detach_other,
-	"Test that a thread can detach another thread.")
+BOOT_TEST(test_dup2_copies_file,
+	"This test copies that Dup2 copies the file to another file descriptor.",
+	.minimum_terminals = 1
+	)
 {
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
 
-	/* The detached thread will finish last */
-	int tdo_thread(int argl, void* args) {
-		fibo(40);
-		return 100;
+	if(fterm!=0) {
+		ASSERT(Dup2(fterm, 0)==0);
+		Close(fterm);		
 	}
 
-	int myproc(int argl, void* args) {
-		Tid_t t = CreateThread(tdo_thread, 0, NULL);
-		ASSERT(ThreadDetach(t)==0);
-		ASSERT(ThreadJoin(t, NULL)==-1);
-		return 42;
-	}
+	sendme(0, "zavarakatranemia");
 
+	ASSERT(Dup2(0,1)==0);
+	ASSERT(Dup2(0,2)==0);
+	ASSERT(Dup2(0,3)==0);
+	ASSERT(Dup2(0,4)==0);
 
-	ASSERT(run_get_status(myproc, 0, NULL) == 42);
+	checked_read(1, "zava");
+	checked_read(3, "raka");
+	checked_read(2, "trane");
+	checked_read(4, "mia");
 
 	return 0;
 }
 
 
-BOOT_TEST(test_multiple_detach,
-	"Test that a thread can be detached many times.")
+BOOT_TEST(test_read_error_on_bad_fid,
+	"Test that Read will return an error when called on a bad fid"
+	)
 {
-	ASSERT(ThreadDetach(ThreadSelf())==0);
-	ASSERT(ThreadDetach(ThreadSelf())==0);
-	ASSERT(ThreadDetach(ThreadSelf())==0);
-	ASSERT(ThreadDetach(ThreadSelf())==0);
-
+	char buffer[10];
+	ASSERT(Read(0, buffer, 10)==-1);
 	return 0;
 }
 
 
-
-
-BOOT_TEST(test_join_many_threads,
-	"Test that many threads joining the same thread work ok")
+BOOT_TEST(test_read_from_many_terminals,
+	"Test that Read can read from all terminals",
+	.minimum_terminals = 2
+	)
 {
-	/* A thread to be joined */
-	int joined_thread(int argl, void* args) {
-		sleep_thread(1);
-		return 5213;
+	Fid_t term[MAX_TERMINALS];
+	for(uint i = 0; i < GetTerminalDevices(); i++) {
+		term[i] = OpenTerminal(i);
+		ASSERT(term[i]!=NOFILE);
 	}
 
-	Tid_t joined_tid = NOTHREAD; 
-
-	int some_thread_joined = 0;
+	for(uint i = 0; i < GetTerminalDevices(); i++) {
+		char message[32];
+		sprintf(message, "This is terminal %d", i);
 
-	int joiner_thread(int argl, void* args) {
-		int retval;
-		int rc = ThreadJoin(joined_tid,&retval);
-		if(rc==0) some_thread_joined = 1;
-		ASSERT(rc==-1 || retval==5213);
-		return 0;
+		sendme(i, message);
 	}
+	for(uint i = 0; i < GetTerminalDevices(); i++) {
+		char message[32];
+		sprintf(message, "This is terminal %d", i);
 
+		checked_read(term[i], message);
+	}
 
-	int mymain(int argl, void* args) {
-		Tid_t tids[5];
 
+	return 0;
+}
 
-		joined_tid = CreateThread(joined_thread, 0, NULL);
-		ASSERT(joined_tid != NOTHREAD);
 
-		for(int i=0;i<5;i++) {
-			tids[i] = CreateThread(joiner_thread,0,NULL);
-			ASSERT(tids[i]!=NOTHREAD);
-		}
 
-		/* Wait for all joiner_threads to finish */
-		for(int i=0;i<5;i++) {
-			ASSERT(ThreadJoin(tids[i], NULL)==0);
-			/* tids[i] should be cleaned by ThreadJoin */
-			ASSERT(ThreadDetach(tids[i])==-1);
-		}
+BOOT_TEST(test_child_inherits_files,
+	"Test that a child process inherits files.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+	if(fterm!=0)
+		ASSERT(Dup2(fterm, 0)==0);
 
-		/* Check that at least one succeeded at joining */
-		ASSERT(some_thread_joined);
+	int greeted_child(int argl, void* args)
+	{
+		checked_read(0, "Hello child");
+		checked_read(0, "Hello again");
 		return 0;
 	}
 
-
-	ASSERT(run_get_status(mymain, 0, NULL)==0);
+	sendme(0, "Hello child");
+	Pid_t cpid = Exec(greeted_child, 0, NULL);
+	ASSERT(Close(0)==0);
+	ASSERT(Close(fterm)==0);
+	sendme(0, "Hello again");
+	ASSERT(cpid!=NOPROC);
+	ASSERT(WaitChild(NOPROC, NULL)==cpid);
 	return 0;
 }
 
 
-BOOT_TEST(test_join_main_thread,
-	"Test that the main thread can be joined by another thread")
-{
 
-	Tid_t mttid;
 
-	int notmain_thread(int argl, void* args) {
-		ASSERT(ThreadJoin(mttid, NULL)==0);
-		return 0;
-	}
+BOOT_TEST(test_null_device,
+	"Test the null device."
+	)
+{
 
-	int main_thread(int argl, void* args) {
-		mttid = ThreadSelf();
-		ASSERT(CreateThread(notmain_thread,0,NULL)!=NOTHREAD);
-		return 42;
+	void test_read(Fid_t fid)
+	{
+		char z[] = "zavarakatranemia";
+		char z1[] = "\0\0\0\0\0\0\0\0\0\0anemia";
+		ASSERT(Read(fid, z, 10)==10);
+		ASSERT(memcmp(z,z1, 17)==0);
 	}
 
-	ASSERT(run_get_status(main_thread, 0, NULL) == 42);
+	Fid_t fn = OpenNull();
+	ASSERT(fn!=-1);
+
+	test_read(fn);
+	ASSERT(Write(fn, NULL, 123456)==123456);
+
+	ASSERT(Close(fn)==0);
 	return 0;
 }
 
 
-BOOT_TEST(test_detach_main_thread,
-	"Test that the main thread can be detached")
+
+/***********************************************************************************8
+*************************************************/
+
+
+
+
+void checked_write(Fid_t fid, const char* message)
 {
-	Tid_t mttid;
+	int mlen = strlen(message);
+	for(int count=0; count < mlen;) {
+		int wno = Write(fid, message+count, 1);
+		ASSERT(wno>0);
+		count += wno;
+	}
+}
 
-	int notmain_thread(int argl, void* args) {
-		ASSERT(ThreadJoin(mttid, NULL)==-1);
+
+
+BOOT_TEST(test_write_con,
+	"Test that we can write a few bytes to the console on terminal 0.",
+	.minimum_terminals = 1
+	)
+{
+	assert(GetTerminalDevices()>0);
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	expect(0, "Hello");
+	checked_write(fterm, "Hello");
+	return 0;
+}
+
+
+BOOT_TEST(test_write_con_big,
+	"Test that we can write massively to the console on terminal 0.",
+	.minimum_terminals = 1
+	)
+{
+	assert(GetTerminalDevices()>0);
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	char bytes[1025];
+	FUDGE(bytes);
+	bytes[1024]='\0';
+
+	/* send me 1Mbyte */
+	for(int i=0; i<1024; i++)
+		expect(0, bytes);
+
+	/* Create a 16kb block */
+	char buffer[16384];
+	FUDGE(buffer);
+
+	int total = 1<<20;
+	int count = 0;
+
+	while(count < total)
+	{
+		int remain = total-count;
+
+		int rc = Write(fterm, buffer, (remain<16384)? remain: 16384);
+		ASSERT(rc>0);
+		count += rc;
+	}
+
+	return 0;
+}
+
+
+
+/* The steps of test_serial_hangup, taken in turn by the terminal and the VM */
+static int hangup_step;
+
+static void hangup_wait(int step)
+{
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&m);
+	while(__atomic_load_n(&hangup_step, __ATOMIC_ACQUIRE) < step)
+		Cond_TimedWait(&m, &cv, 1);
+	Mutex_Unlock(&m);
+}
+
+static void hangup_next(int step)
+{
+	__atomic_store_n(&hangup_step, step, __ATOMIC_RELEASE);
+}
+
+/* A host thread playing terminal 0, which hangs up and re-connects */
+static void* hangup_terminal(void* arg)
+{
+	int con, kbd;
+	CHECK(con = open("con0", O_RDONLY));
+	CHECK(kbd = open("kbd0", O_WRONLY));
+	CHECK(write(kbd, "a", 1));
+	while(__atomic_load_n(&hangup_step, __ATOMIC_ACQUIRE) < 1) usleep(1000);
+
+	/* Hang up the keyboard, and re-connect long after */
+	CHECK(close(kbd));
+	usleep(100000);
+	CHECK(kbd = open("kbd0", O_WRONLY));
+	CHECK(write(kbd, "b", 1));
+
+	/* Hang up the console while it is written, and re-connect */
+	CHECK(close(con));
+	hangup_next(2);
+	while(__atomic_load_n(&hangup_step, __ATOMIC_ACQUIRE) < 3) usleep(1000);
+	usleep(100000);
+	CHECK(con = open("con0", O_RDONLY));
+	hangup_next(4);
+
+	/* The bytes written while hung up may be lost */
+	char c;
+	int rc;
+	do {
+		while((rc = read(con, &c, 1))==-1 && errno==EINTR);
+	} while(rc==1 && c!='x');
+	assert(rc==1 && c=='x');
+	hangup_next(5);
+
+	/* Hang up the console while it is closed with bytes to send */
+	while(__atomic_load_n(&hangup_step, __ATOMIC_ACQUIRE) < 6) usleep(1000);
+	CHECK(close(con));
+
+	CHECK(close(kbd));
+	return NULL;
+}
+
+static int hangup_task(int argl, void* args)
+{
+	Fid_t term = OpenTerminal(0);
+	ASSERT(term != NOFILE);
+	char c;
+	ASSERT(Read(term, &c, 1)==1 && c=='a');
+	hangup_next(1);
+	ASSERT(Read(term, &c, 1)==1 && c=='b');
+
+	hangup_wait(2);
+	ASSERT(Write(term, "y", 1)==1);
+	hangup_next(3);
+	hangup_wait(4);
+	ASSERT(Write(term, "x", 1)==1);
+	hangup_wait(5);
+
+	/* Fill the console FIFO and part of the transmit ring, and close */
+	static char block[66 << 10];
+	for(unsigned int count = 0; count < sizeof(block); ) {
+		int rc = Write(term, block + count, sizeof(block) - count);
+		ASSERT(rc > 0);
+		count += rc;
+	}
+	hangup_next(6);
+	ASSERT(Close(term)==0);
+	return 0;
+}
+
+BARE_TEST(test_serial_hangup,
+	"Test that the serial devices of a terminal work again after the terminal hangs\n"
+	"up and re-connects, and that closing a hung-up console does not wait for it.",
+	.timeout = 10
+	)
+{
+	/* The terminal thread does not take the signals of the VM */
+	sigset_t fullmask, oldmask;
+	CHECK(sigfillset(&fullmask));
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &fullmask, &oldmask));
+	pthread_t terminal;
+	CHECKRC(pthread_create(&terminal, NULL, hangup_terminal, NULL));
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &oldmask, NULL));
+
+	boot(1, 1, hangup_task, 0, NULL);
+	CHECKRC(pthread_join(terminal, NULL));
+}
+
+
+BOOT_TEST(test_disk_sectors,
+	"Test that the sectors and blocks written to a disk by many threads concurrently, in\n"
+	"ascending and descending order, are read back, and that transfers beyond the end of\n"
+	"the disk fail.",
+	.disks = 1
+	)
+{
+	ASSERT(GetDiskDevices()==1);
+	unsigned long S = GetDiskSectors(0);
+	ASSERT(S == (64ul << 20)/DISK_SECTOR_SIZE);
+	ASSERT(GetDiskSectors(1)==0);
+
+	char buf[4*DISK_SECTOR_SIZE];
+	ASSERT(ReadSectors(1, 0, 1, buf)==-1);
+	ASSERT(ReadSectors(0, S, 1, buf)==-1);
+	ASSERT(WriteSectors(0, S-1, 2, buf)==-1);
+	ASSERT(ReadSectors(0, S-4, 4, buf)==0);
+
+	/* Thread t writes sectors t, T+t, 2T+t, ..., so the concurrent writes 
+	   are adjacent, and may be merged */
+	enum { T = 8, K = 64 };
+	int writer(int argl, void* args) {
+		char sector[DISK_SECTOR_SIZE];
+		for(int k=0; k<K; k++) {
+			memset(sector, (k*T + argl) & 0xff, DISK_SECTOR_SIZE);
+			ASSERT(WriteSectors(0, k*T + argl, 1, sector)==0);
+		}
 		return 0;
 	}
+	Tid_t tids[T];
+	for(int t=0; t<T; t++) tids[t] = CreateThread(writer, t, NULL);
+	for(int t=0; t<T; t++) ASSERT(ThreadJoin(tids[t], NULL)==0);
+
+	static char all[T*K*DISK_SECTOR_SIZE];
+	ASSERT(ReadSectors(0, 0, T*K, all)==0);
+	for(int s=0; s<T*K; s++)
+		for(int i=0; i<DISK_SECTOR_SIZE; i++)
+			if(all[s*DISK_SECTOR_SIZE+i] != (char)(s & 0xff)) {
+				ASSERT_MSG(0, "sector %d differs at byte %d\n", s, i);
+				return 0;
+			}
 
-	int main_thread(int argl, void* args) {
-		mttid = ThreadSelf();
-		ASSERT(CreateThread(notmain_thread,0,NULL)!=NOTHREAD);
-		sleep_thread(1);
-		ASSERT(ThreadDetach(ThreadSelf())==0);
-		return 42;
+	/* Again with 4 Kbyte blocks, in descending order, so that queued requests
+	   also grow at their start; then read back concurrently, so that reads
+	   merge too */
+	enum { B = 8 };
+	int block_writer(int argl, void* args) {
+		char block[B*DISK_SECTOR_SIZE];
+		for(int k=K-1; k>=0; k--) {
+			memset(block, (k*T + argl + 1) & 0xff, sizeof(block));
+			ASSERT(WriteSectors(0, (k*T + argl)*B, B, block)==0);
+		}
+		return 0;
+	}
+	int block_reader(int argl, void* args) {
+		char block[B*DISK_SECTOR_SIZE];
+		for(int k=K-1; k>=0; k--) {
+			ASSERT(ReadSectors(0, (k*T + argl)*B, B, block)==0);
+			for(int i=0; i<sizeof(block); i++)
+				if(block[i] != (char)((k*T + argl + 1) & 0xff)) {
+					ASSERT_MSG(0, "block %d differs at byte %d\n", k*T + argl, i);
+					return 0;
+				}
+		}
+		return 0;
 	}
+	for(int t=0; t<T; t++) tids[t] = CreateThread(block_writer, t, NULL);
+	for(int t=0; t<T; t++) ASSERT(ThreadJoin(tids[t], NULL)==0);
+	for(int t=0; t<T; t++) tids[t] = CreateThread(block_reader, t, NULL);
+	for(int t=0; t<T; t++) ASSERT(ThreadJoin(tids[t], NULL)==0);
+	return 0;
+}
 
 
-	ASSERT(run_get_status(main_thread, 0, NULL) == 42);
+BOOT_TEST(test_write_error_on_bad_fid,
+	"Test that Write will return an error when called on a bad fid"
+	)
+{
+	char buffer[10];
+	ASSERT(Write(0, buffer, 10)==-1);
 	return 0;
 }
 
 
-BOOT_TEST(test_detach_after_join,
-	"Test that a thread can be detached after joining")
+BOOT_TEST(test_write_to_many_terminals,
+	"Test that Write can send to all terminals",
+	.minimum_terminals = 2
+	)
 {
-	/* A thread to be joined */
-	int joined_thread(int argl, void* args) {
-		sleep_thread(1);
-		ThreadDetach(ThreadSelf());
-		return 5213;
+	Fid_t term[MAX_TERMINALS];
+	for(uint i = 0; i < GetTerminalDevices(); i++) {
+		term[i] = OpenTerminal(i);
+		ASSERT(term[i]!=NOFILE);
 	}
 
-	Tid_t joined_tid;
+	for(uint i = 0; i < GetTerminalDevices(); i++) {
+		char message[32];
+		sprintf(message, "This is terminal %d", i);
 
+		expect(i, message);
+	}
+	for(uint i = 0; i < GetTerminalDevices(); i++) {
+		char message[32];
+		sprintf(message, "This is terminal %d", i);
 
-	int joiner_thread(int argl, void* args) 
-	{
-		int retval;
-		int rc = ThreadJoin(joined_tid,&retval);
-		ASSERT(rc==-1);
+		checked_write(term[i], message);
+	}
+
+
+	return 0;
+}
+
+
+
+
+TEST_SUITE(basic_tests, 
+	"A suite of basic tests, focusing on the functional behaviour of the\n"
+	"tinyos3 API, but not the operational (concurrency and I/O multiplexing)."
+	)
+{
+	&test_boot,
+	&test_pid_of_init_is_one,
+	&test_waitchild_error_on_nonchild,
+	&test_waitchild_error_on_invalid_pid,
+	&test_exec_getpid_wait,
+	&test_exec_copies_arguments,
+	&test_exit_returns_status,
+	&test_main_return_returns_status,
+	&test_wait_for_any_child,
+	&test_orphans_adopted_by_init,
+	&test_cond_timedwait_timeout,
+	&test_timeout_accuracy,
+	&test_cond_timedwait_signal,
+	&test_cond_timedwait_broadcast,
+	&test_cond_broadcast_rounds,
+	&test_cond_broadcast_unlocked,
+	&test_semaphore,
+	&test_rwlock,
+	&test_pimutex_latency,
+	&test_sched_config,
+	&test_sched_config_reset,
+	&test_sched_params,
+	&test_sched_deadline,
+	&test_fair_share,
+	&test_affinity,
+	&test_affinity_running,
+	&test_tickless_wakeup,
+	&test_wakeup_preempts,
+	&test_barrier,
+	&test_null_device,
+	&test_get_terminals,
+	&test_open_terminals,
+	&test_dup2_error_on_nonfile,
+	&test_dup2_error_on_invalid_fid,
+	&test_dup2_copies_file,
+	&test_close_error_on_invalid_fid,
+	&test_close_success_on_valid_nonfile_fid,
+	&test_close_terminals,
+	&test_read_kbd,
+	&test_read_kbd_big,
+	&test_read_error_on_bad_fid,
+	&test_read_from_many_terminals,
+	&test_write_con,
+	&test_write_con_big,
+	&test_serial_hangup,
+	&test_disk_sectors,
+	&test_write_error_on_bad_fid,
+	&test_write_to_many_terminals,
+	&test_child_inherits_files,
+	NULL
+};
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Thread tests
+ *
+ *
+ *
+ *********************************************/
+
+
+void sleep_thread(int sec) {
+	Mutex mx = MUTEX_INIT;
+	CondVar cond = COND_INIT;
+
+	Mutex_Lock(&mx);
+	ASSERT(Cond_TimedWait(&mx,&cond,1000*sec)==0);
+}
+
+/* 
+	Helper that spawns a process, waits for its completion
+	and returns its status.
+ */
+
+int run_get_status(Task task, int argl, void* args)
+{
+	Pid_t pid = Exec(task, argl, args);
+	ASSERT(pid!=NOPROC);
+
+	int exitval;
+	ASSERT(WaitChild(pid, &exitval)==pid);
+
+	return exitval;
+}
+
+
+BOOT_TEST(test_threadself,
+	"Test that ThreadSelf is somewhat sane")
+{
+	ASSERT(ThreadSelf() != NOTHREAD);
+	ASSERT(ThreadSelf() == ThreadSelf());
+	return 0;
+}
+
+
+
+BOOT_TEST(test_join_illegal_tid_gives_error,
+	"Test that ThreadJoin rejects an illegal Tid")
+{
+	int* illegal_ptr = (int*) -1;
+
+	ASSERT(ThreadJoin(NOTHREAD, illegal_ptr)==-1);
+
+	/* Test with random numbers. Since we only have one thread, any call is an illegal call. */
+	for(int i=0; i<100; i++) {
+		Tid_t random_tid = lrand48();
+		ASSERT(ThreadJoin(random_tid, illegal_ptr)==-1);
+	}
+
+	/* In addition, we cannot join ourselves ! */
+	ASSERT(ThreadJoin(ThreadSelf(), illegal_ptr)==-1);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_detach_illegal_tid_gives_error,
+	"Test that ThreadDetach rejects an illegal Tid")
+{
+	ASSERT(ThreadDetach(NOTHREAD)==-1);
+
+	/* Test with random numbers. Since we only have one thread, any call is an illegal call. */
+	for(int i=0; i<100; i++) {
+		Tid_t random_tid = lrand48();
+		if(random_tid==ThreadSelf()) /* Very unlikely, but still... */
+			continue;
+		ASSERT(ThreadDetach(random_tid)==-1);
+	}
+
+	return 0;
+}
+
+
+BOOT_TEST(test_create_join_thread,
+	"Test that a process thread can be created and joined. Also, that "
+	"the argument of the thread is passed correctly."
+	)
+{
+	int flag = 0;
+
+	int task(int argl, void* args) {
+		ASSERT(args == &flag);
+		*(int*)args = 1;
+		return 2;
+	}
+
+	Tid_t t = CreateThread(task, sizeof(flag), &flag);
+
+	/* Success in creating thread */
+	ASSERT(t!=NOTHREAD);
+	int exitval;
+	
+	/* Join should succeed */
+	ASSERT(ThreadJoin(t, &exitval)==0);
+
+	/* Exit status should be correct */
+	ASSERT(exitval==2);
+
+	/* Shared variable should be updates */
+	ASSERT(flag==1);
+
+	/* A second Join should fail! */
+	ASSERT(ThreadJoin(t, NULL)==-1);
+
+
+	return 0;
+}
+
+BOOT_TEST(test_detach_self,
+	"Test that a thread can detach itself")
+{
+	ASSERT(ThreadDetach(ThreadSelf())==0);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_detach_other,
+	"Test that a thread can detach another thread.")
+{
+
+	/* The detached thread will finish last */
+	int tdo_thread(int argl, void* args) {
+		fibo(40);
+		return 100;
+	}
+
+	int myproc(int argl, void* args) {
+		Tid_t t = CreateThread(tdo_thread, 0, NULL);
+		ASSERT(ThreadDetach(t)==0);
+		ASSERT(ThreadJoin(t, NULL)==-1);
+		return 42;
+	}
+
+
+	ASSERT(run_get_status(myproc, 0, NULL) == 42);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_multiple_detach,
+	"Test that a thread can be detached many times.")
+{
+	ASSERT(ThreadDetach(ThreadSelf())==0);
+	ASSERT(ThreadDetach(ThreadSelf())==0);
+	ASSERT(ThreadDetach(ThreadSelf())==0);
+	ASSERT(ThreadDetach(ThreadSelf())==0);
+
+	return 0;
+}
+
+
+
+
+BOOT_TEST(test_join_many_threads,
+	"Test that many threads joining the same thread work ok")
+{
+	/* A thread to be joined */
+	int joined_thread(int argl, void* args) {
+		sleep_thread(1);
+		return 5213;
+	}
+
+	Tid_t joined_tid = NOTHREAD; 
+
+	int some_thread_joined = 0;
+
+	int joiner_thread(int argl, void* args) {
+		int retval;
+		int rc = ThreadJoin(joined_tid,&retval);
+		if(rc==0) some_thread_joined = 1;
+		ASSERT(rc==-1 || retval==5213);
+		return 0;
+	}
+
+
+	int mymain(int argl, void* args) {
+		Tid_t tids[5];
+
+
+		joined_tid = CreateThread(joined_thread, 0, NULL);
+		ASSERT(joined_tid != NOTHREAD);
+
+		for(int i=0;i<5;i++) {
+			tids[i] = CreateThread(joiner_thread,0,NULL);
+			ASSERT(tids[i]!=NOTHREAD);
+		}
+
+		/* Wait for all joiner_threads to finish */
+		for(int i=0;i<5;i++) {
+			ASSERT(ThreadJoin(tids[i], NULL)==0);
+			/* tids[i] should be cleaned by ThreadJoin */
+			ASSERT(ThreadDetach(tids[i])==-1);
+		}
+
+		/* Check that at least one succeeded at joining */
+		ASSERT(some_thread_joined);
+		return 0;
+	}
+
+
+	ASSERT(run_get_status(mymain, 0, NULL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_join_main_thread,
+	"Test that the main thread can be joined by another thread")
+{
+
+	Tid_t mttid;
+
+	int notmain_thread(int argl, void* args) {
+		ASSERT(ThreadJoin(mttid, NULL)==0);
+		return 0;
+	}
+
+	int main_thread(int argl, void* args) {
+		mttid = ThreadSelf();
+		ASSERT(CreateThread(notmain_thread,0,NULL)!=NOTHREAD);
+		return 42;
+	}
+
+	ASSERT(run_get_status(main_thread, 0, NULL) == 42);
+	return 0;
+}
+
+
+BOOT_TEST(test_detach_main_thread,
+	"Test that the main thread can be detached")
+{
+	Tid_t mttid;
+
+	int notmain_thread(int argl, void* args) {
+		ASSERT(ThreadJoin(mttid, NULL)==-1);
+		return 0;
+	}
+
+	int main_thread(int argl, void* args) {
+		mttid = ThreadSelf();
+		ASSERT(CreateThread(notmain_thread,0,NULL)!=NOTHREAD);
+		sleep_thread(1);
+		ASSERT(ThreadDetach(ThreadSelf())==0);
+		return 42;
+	}
+
+
+	ASSERT(run_get_status(main_thread, 0, NULL) == 42);
+	return 0;
+}
+
+
+BOOT_TEST(test_detach_after_join,
+	"Test that a thread can be detached after joining")
+{
+	/* A thread to be joined */
+	int joined_thread(int argl, void* args) {
+		sleep_thread(1);
+		ThreadDetach(ThreadSelf());
+		return 5213;
+	}
+
+	Tid_t joined_tid;
+
+
+	int joiner_thread(int argl, void* args) 
+	{
+		int retval;
+		int rc = ThreadJoin(joined_tid,&retval);
+		ASSERT(rc==-1);
+		return 0;
+	}
+
+
+	int main_thread(int argl, void* args) 
+	{
+
+	 	joined_tid = CreateThread(joined_thread, 0, NULL);
+	 	ASSERT(joined_thread != NOTHREAD);
+
+		Tid_t tids[5];
+		for(int i=0;i<5;i++) {
+			tids[i] = CreateThread(joiner_thread,0,NULL);
+			ASSERT(tids[i]!=NOTHREAD);
+		}
+
+		for(int i=0;i<5;i++) {
+			ASSERT(ThreadJoin(tids[i], NULL)==0);
+		}
+
+		return 0;		
+	}
+
+
+	run_get_status(main_thread, 0, NULL);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_exit_many_threads,
+	"Test that if many process threads call Exit, the process will clean up correctly."
+	)
+{
+
+	int task(int argl, void* args) {
+		fibo(40);
+		Exit(40 + argl);
+		return 0;
+	}
+
+	int mthread(int argl, void* args){
+		for(int i=0;i<5;i++)
+			ASSERT(CreateThread(task, i, NULL) != NOTHREAD);
+
+		/* This thread calls ThreadExit probably before the children all exit */
+		ThreadExit(0);
+		return 0;
+	}
+
+
+	int status = run_get_status(mthread, 0, NULL);
+	ASSERT(40 <= status && status < 45);
+	return 0;
+}
+
+
+BOOT_TEST(test_main_exit_cleanup,
+	"Test that a process where only the main thread calls Exit, will clean up correctly."
+	)
+{
+
+	int task(int argl, void* args) {
+		fibo(40);
+		ThreadExit(2);
+		FAIL("We should not be here");
+		return 0;
+	}
+
+	int main_thread(int argl, void* args){
+		for(int i=0;i<5;i++)
+			ASSERT(CreateThread(task, 0, NULL) != NOTHREAD);
+
+		/* This thread calls exit probably before the children all exit */
+		return 42;
+	}
+
+	ASSERT(run_get_status(main_thread, 0, NULL)==42);
+	return 0;
+}
+
+
+BOOT_TEST(test_noexit_cleanup,
+	"Test that a process where no thread calls Exit, will clean up correctly."
+	)
+{
+
+	int task(int argl, void* args) {
+		fibo(40);
+		ThreadExit(2);
+		FAIL("We should not be here");
+		return 0;
+	}
+
+	int mthread(int argl, void* args){
+		for(int i=0;i<5;i++)
+			ASSERT(CreateThread(task, 0, NULL) != NOTHREAD);
+
+		/* This thread calls exit probably before the children all exit */
+		ThreadExit(0);
+		FAIL("We should not be here");
+		return 42;
+	}
+
+
+	run_get_status(mthread, 0, NULL);
+	return 0;
+}
+
+
+BOOT_TEST(test_cyclic_joins,
+	"Test that a set of cyclically joined threads will not deadlock once the cycle breaks")
+{
+	const unsigned int N=5;
+	barrier B = BARRIER_INIT;
+	Tid_t tids[N];
+
+	int join_thread(int argl, void* args) {
+		BarrierSync(&B, N+1);
+		ThreadJoin(tids[argl], NULL);
+		return argl;
+	}
+
+
+	int main_thread(int argl, void* args) 
+	{
+
+		/* spawn all N threads */
+		for(unsigned int i=0;i<N;i++) {
+			tids[i] = CreateThread(join_thread, (i+1)%N, NULL);
+			assert(tids[i]!=NOTHREAD); /* small assert! do not proceed unless threads are created! */
+		}
+
+		/* allow threads to join */
+		BarrierSync(&B, N+1);
+
+		/* Wait for threads to proceed */
+		sleep_thread(1);
+
+		/* Now, threads are in deadlock! To break the deadlock,
+		   detach thread 0. */
+		ThreadDetach(tids[0]);
+
+		return 0;
+	}
+
+	run_get_status(main_thread, 0, NULL);
+	return 0;
+}
+
+
+TEST_SUITE(thread_tests, 
+	"A suite of tests for threads."
+	)
+{
+	&test_join_illegal_tid_gives_error,
+	&test_detach_illegal_tid_gives_error,
+	&test_detach_self,
+	&test_detach_other,
+	&test_multiple_detach,
+	&test_join_main_thread,
+	&test_detach_main_thread,
+	&test_detach_after_join,
+	&test_create_join_thread,
+	&test_join_many_threads,
+	&test_exit_many_threads,
+	&test_main_exit_cleanup,
+	&test_noexit_cleanup,
+	&test_cyclic_joins,
+	NULL
+};
+
+
+
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Pipe tests
+ *
+ *
+ *
+ *********************************************/
+
+
+
+BOOT_TEST(test_pipe_open,
+	"Open a pipe and put just a little data in it"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
+
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	}
+	char buffer[12] = { [0] = 0 };
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
+		ASSERT(strcmp(buffer, "Hello world")==0);
+	}
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_fails_on_exhausted_fid,
+	"Test that Pipe will fail if the fids are exhausted."
+	)
+{
+	pipe_t pipe;
+	for(uint i=0; i< (MAX_FILEID/2); i++ )
+		ASSERT(Pipe(&pipe)==0);
+	for(uint i=0; i< (MAX_FILEID/2); i++ )
+		ASSERT(Pipe(&pipe)==-1);	
+	return 0;
+}
+
+
+
+BOOT_TEST(test_pipe_close_reader,
+	"Open a pipe and put just a little data in it"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
+
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	}
+	Close(pipe.read);
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==-1);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_pipe_close_writer,
+	"Open a pipe and put just a little data in it"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
+
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	}
+
+	char buffer[12] = { [0] = 0 };
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
+		ASSERT(strcmp(buffer, "Hello world")==0);
+	}
+	Close(pipe.write);
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Read(pipe.read, buffer, 12))==0);
+	}
+	return 0;
+}
+
+
+/* Takes one integer argument, writes that many bytes to stdout.
+ */
+int data_producer(int argl, void* args)
+{
+	assert(argl == sizeof(int));
+	int nbytes = *(int*)args;
+
+	Close(0);
+
+	char buffer[32768];
+
+	while(nbytes>0) {
+		unsigned int n = (nbytes<32768) ? nbytes : 32768;
+		int rc = Write(1, buffer, n);
+		assert(rc>0);
+		nbytes -= rc;
+	}
+	Close(1);
+	return 0;
+}
+
+/* Takes one integer argument. Reads its standard input to exhaustion,
+   asserts it read that many bytes. */
+int data_consumer(int argl, void* args) 
+{
+	assert(argl == sizeof(int));
+	int nbytes = *(int*)args;
+	Close(1);
+
+	char buffer[16384];
+	int count = 0;
+
+	int rc = 1;
+	while(rc) {
+		rc = Read(0, buffer, 16384);
+		assert(rc>=0);
+		count += rc;
+	}
+	ASSERT(count == nbytes);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_single_producer,
+	"Test blocking in the pipe by a single producer single consumer sending 10Mbytes of data."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+
+	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
+	if(pipe.read != 0) {
+		if(pipe.write==0) {
+			/* Get a null stream! */
+			Fid_t fid = OpenNull();
+			assert(fid!=NOFILE);
+			Dup2(0, fid);
+			pipe.write = fid;
+		}
+		Dup2(pipe.read, 0);
+		Close(pipe.read);
+	}
+	if(pipe.write!=1)  {
+		Dup2(pipe.write, 1);
+		Close(pipe.write);
+	}
+
+	int N = 10000000;
+	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+	ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+
+	Close(0);
+	Close(1);
+
+	WaitChild(NOPROC,NULL);
+	WaitChild(NOPROC,NULL);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_multi_producer,
+	"Test blocking in the pipe by 10 producers and single consumer sending 10Mbytes of data."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+
+	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
+	if(pipe.read != 0) {
+		if(pipe.write==0) {
+			/* Get a null stream! */
+			Fid_t fid = OpenNull();
+			assert(fid!=NOFILE);
+			Dup2(0, fid);
+			pipe.write = fid;
+		}
+		Dup2(pipe.read, 0);
+		Close(pipe.read);
+	}
+	if(pipe.write!=1)  {
+		Dup2(pipe.write, 1);
+		Close(pipe.write);
+	}
+
+	int N = 1000000;
+	for(int i=0;i<10;i++)
+		ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+	N = 10*N;
+	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+
+	Close(0);
+	Close(1);
+
+	for(int i=0;i<10;i++)
+		WaitChild(NOPROC,NULL);
+	WaitChild(NOPROC,NULL);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_data_integrity,
+	"Test that data arrive in order through a pipe, with transfers of odd sizes\n"
+	"that wrap around the buffer, between two threads."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	enum { TOTAL = 1000003 };
+
+	int writer(int argl, void* args) {
+		pipe_t* p = args;
+		unsigned char buffer[7919];
+		unsigned int sent = 0;
+		while(sent < TOTAL) {
+			unsigned int n = (TOTAL-sent < 7919) ? TOTAL-sent : 1 + sent % 7919;
+			for(unsigned int i=0; i<n; i++) buffer[i] = (sent+i) % 251;
+			ASSERT(Write(p->write, (char*)buffer, n)==n);
+			sent += n;
+		}
+		Close(p->write);
 		return 0;
 	}
+	Tid_t t = CreateThread(writer, sizeof(pipe), &pipe);
 
+	unsigned char buffer[5003];
+	unsigned int received = 0;
+	int rc;
+	while((rc = Read(pipe.read, (char*)buffer, 1 + received % 5003)) > 0) {
+		for(int i=0; i<rc; i++) ASSERT(buffer[i] == (received+i) % 251);
+		received += rc;
+	}
+	ASSERT(rc==0);
+	ASSERT(received == TOTAL);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	return 0;
+}
 
-	int main_thread(int argl, void* args) 
-	{
-
-	 	joined_tid = CreateThread(joined_thread, 0, NULL);
-	 	ASSERT(joined_thread != NOTHREAD);
-
-		Tid_t tids[5];
-		for(int i=0;i<5;i++) {
-			tids[i] = CreateThread(joiner_thread,0,NULL);
-			ASSERT(tids[i]!=NOTHREAD);
-		}
 
-		for(int i=0;i<5;i++) {
-			ASSERT(ThreadJoin(tids[i], NULL)==0);
-		}
+BOOT_TEST(test_pipe_close_reader_wakes_writer,
+	"Test that a writer blocked on a full pipe returns, when the reader is closed."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
 
-		return 0;		
+	int writer(int argl, void* args) {
+		static char buffer[100000];
+		return Write(*(Fid_t*)args, buffer, sizeof(buffer));
 	}
+	Tid_t t = CreateThread(writer, sizeof(Fid_t), &pipe.write);
 
+	/* Wait until the writer has filled the pipe */
+	char c;
+	ASSERT(Read(pipe.read, &c, 1)==1);
+	ASSERT(Close(pipe.read)==0);
 
-	run_get_status(main_thread, 0, NULL);
+	int rc = 0;
+	ASSERT(ThreadJoin(t, &rc)==0);
+	ASSERT(rc > 0 && rc < 100000);
+	ASSERT(Write(pipe.write, &c, 1)==-1);
 	return 0;
 }
 
 
-
-BOOT_TEST(test_exit_many_threads,
-	"Test that if many process threads call Exit, the process will clean up correctly."
+BOOT_TEST(test_packet_pipe,
+	"Test that a packet pipe preserves message boundaries, truncates long messages\n"
+	"at the reader, and does not interleave the messages of concurrent writers."
 	)
 {
-
-	int task(int argl, void* args) {
-		fibo(40);
-		Exit(40 + argl);
+	pipe_t pipe;
+	ASSERT(PacketPipe(&pipe)==0);
+
+	char buffer[MAX_PACKET_SIZE+1];
+	ASSERT(Write(pipe.write, "Hello", 5)==5);
+	ASSERT(Write(pipe.write, " world", 7)==7);
+	ASSERT(Write(pipe.write, "Hello world", 12)==12);
+	ASSERT(Write(pipe.write, buffer, MAX_PACKET_SIZE+1)==-1);
+
+	ASSERT(Read(pipe.read, buffer, 100)==5);
+	ASSERT(memcmp(buffer, "Hello", 5)==0);
+	ASSERT(Read(pipe.read, buffer, 100)==7);
+	ASSERT(strcmp(buffer, " world")==0);
+	ASSERT(Read(pipe.read, buffer, 5)==5);		/* The rest is discarded */
+	ASSERT(memcmp(buffer, "Hello", 5)==0);
+
+	/* Writers of large messages, which wrap around the buffer */
+	enum { WRITERS = 4, MESSAGES = 200 };
+	int writer(int argl, void* args) {
+		static char msg[WRITERS][MAX_PACKET_SIZE];
+		memset(msg[argl], 'a'+argl, MAX_PACKET_SIZE);
+		for(int i=0; i<MESSAGES; i++)
+			ASSERT(Write(*(Fid_t*)args, msg[argl], 1000 + (i*997) % (MAX_PACKET_SIZE-1000)) > 0);
 		return 0;
 	}
-
-	int mthread(int argl, void* args){
-		for(int i=0;i<5;i++)
-			ASSERT(CreateThread(task, i, NULL) != NOTHREAD);
-
-		/* This thread calls ThreadExit probably before the children all exit */
-		ThreadExit(0);
-		return 0;
+	Tid_t t[WRITERS];
+	for(int i=0; i<WRITERS; i++)
+		t[i] = CreateThread(writer, i, &pipe.write);
+
+	int count[WRITERS] = { 0 };
+	for(int k=0; k<WRITERS*MESSAGES; k++) {
+		int rc = Read(pipe.read, buffer, sizeof(buffer));
+		ASSERT(rc >= 1000);
+		int w = buffer[0]-'a';
+		ASSERT(w>=0 && w<WRITERS);
+		ASSERT(rc == 1000 + (count[w]*997) % (MAX_PACKET_SIZE-1000));
+		for(int i=0; i<rc; i++) ASSERT(buffer[i]==buffer[0]);
+		count[w]++;
 	}
+	for(int i=0; i<WRITERS; i++) ASSERT(ThreadJoin(t[i], NULL)==0);
 
-
-	int status = run_get_status(mthread, 0, NULL);
-	ASSERT(40 <= status && status < 45);
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(Read(pipe.read, buffer, 100)==0);
 	return 0;
 }
 
 
-BOOT_TEST(test_main_exit_cleanup,
-	"Test that a process where only the main thread calls Exit, will clean up correctly."
+TEST_SUITE(pipe_tests,
+	"A suite of tests for pipes. We are focusing on correctness, not performance."
 	)
 {
+	&test_pipe_open,
+	&test_pipe_fails_on_exhausted_fid,
+	&test_pipe_close_reader,
+	&test_pipe_close_writer,
+	&test_pipe_single_producer,
+	&test_pipe_multi_producer,
+	&test_pipe_data_integrity,
+	&test_pipe_close_reader_wakes_writer,
+	&test_packet_pipe,
+	NULL
+};
 
-	int task(int argl, void* args) {
-		fibo(40);
-		ThreadExit(2);
-		FAIL("We should not be here");
-		return 0;
-	}
 
-	int main_thread(int argl, void* args){
-		for(int i=0;i<5;i++)
-			ASSERT(CreateThread(task, 0, NULL) != NOTHREAD);
 
-		/* This thread calls exit probably before the children all exit */
-		return 42;
-	}
 
-	ASSERT(run_get_status(main_thread, 0, NULL)==42);
-	return 0;
-}
+/*********************************************
+ *
+ *
+ *
+ *  File tests
+ *
+ *
+ *
+ *********************************************/
 
 
-BOOT_TEST(test_noexit_cleanup,
-	"Test that a process where no thread calls Exit, will clean up correctly."
+BOOT_TEST(test_open_create,
+	"Test the OPEN_CREAT, OPEN_EXCL and OPEN_TRUNC flags of Open, and the access modes."
 	)
 {
+	char buffer[16] = { [0] = 0 };
+
+	ASSERT(Open("a", OPEN_RDONLY)==NOFILE);
+	ASSERT(Open("a", OPEN_CREAT)==NOFILE);
+
+	Fid_t f = Open("a", OPEN_WRONLY|OPEN_CREAT|OPEN_EXCL);
+	ASSERT(f!=NOFILE);
+	ASSERT(Write(f, "Hello world", 12)==12);
+	ASSERT(Read(f, buffer, 12)==-1);
+	ASSERT(Close(f)==0);
+
+	ASSERT(Open("a", OPEN_WRONLY|OPEN_CREAT|OPEN_EXCL)==NOFILE);
+
+	f = Open("/a", OPEN_RDONLY);
+	ASSERT(f!=NOFILE);
+	ASSERT(Write(f, "Hello world", 12)==-1);
+	ASSERT(Read(f, buffer, 16)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+	ASSERT(Read(f, buffer, 16)==0);
+	ASSERT(Close(f)==0);
+
+	f = Open("a", OPEN_RDWR|OPEN_TRUNC);
+	ASSERT(f!=NOFILE);
+	ASSERT(Read(f, buffer, 16)==0);
+	ASSERT(Close(f)==0);
+
+	file_stat st;
+	ASSERT(Stat("a", &st)==0);
+	ASSERT(st.type==FSE_FILE);
+	ASSERT(st.size==0 && st.pages==0 && st.nlink==1);
+
+	/* With no free fid, Open fails without creating the file */
+	Fid_t fids[MAX_FILEID];
+	int n = 0;
+	while((fids[n] = Open("a", OPEN_RDONLY)) != NOFILE) n++;
+	ASSERT(Open("b", OPEN_RDWR|OPEN_CREAT)==NOFILE);
+	ASSERT(Stat("b", &st)==-1);
+	for(int i=0; i<n; i++) ASSERT(Close(fids[i])==0);
+	return 0;
+}
 
-	int task(int argl, void* args) {
-		fibo(40);
-		ThreadExit(2);
-		FAIL("We should not be here");
-		return 0;
-	}
 
-	int mthread(int argl, void* args){
-		for(int i=0;i<5;i++)
-			ASSERT(CreateThread(task, 0, NULL) != NOTHREAD);
+BOOT_TEST(test_file_seek,
+	"Test Seek on files, OPEN_APPEND, and that Seek fails on other streams."
+	)
+{
+	char buffer[16] = { [0] = 0 };
+	Fid_t f = Open("a", OPEN_RDWR|OPEN_CREAT);
+	ASSERT(f!=NOFILE);
+	ASSERT(Write(f, "0123456789", 10)==10);
+
+	ASSERT(Seek(f, 0, SEEK_CUR)==10);
+	ASSERT(Seek(f, 2, SEEK_SET)==2);
+	ASSERT(Read(f, buffer, 3)==3);
+	ASSERT(memcmp(buffer, "234", 3)==0);
+	ASSERT(Seek(f, -1, SEEK_CUR)==4);
+	ASSERT(Write(f, "x", 1)==1);
+	ASSERT(Seek(f, -3, SEEK_END)==7);
+	ASSERT(Read(f, buffer, 16)==3);
+	ASSERT(memcmp(buffer, "789", 3)==0);
+
+	ASSERT(Seek(f, -11, SEEK_END)==-1);
+	ASSERT(Seek(f, 0, 42)==-1);
+	ASSERT(Seek(f, 0, SEEK_CUR)==10);
+	ASSERT(Seek(f, INTPTR_MAX-1, SEEK_SET)==INTPTR_MAX-1);
+	ASSERT(Write(f, "xy", 2)==-1);
+	ASSERT(Close(f)==0);
+
+	f = Open("a", OPEN_RDWR|OPEN_APPEND);
+	ASSERT(f!=NOFILE);
+	ASSERT(Write(f, "ab", 2)==2);
+	ASSERT(Seek(f, 0, SEEK_SET)==0);
+	ASSERT(Read(f, buffer, 16)==12);
+	ASSERT(memcmp(buffer, "0123x56789ab", 12)==0);
+	ASSERT(Close(f)==0);
 
-		/* This thread calls exit probably before the children all exit */
-		ThreadExit(0);
-		FAIL("We should not be here");
-		return 42;
-	}
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(Seek(pipe.read, 0, SEEK_SET)==-1);
+	ASSERT(Seek(OpenNull(), 0, SEEK_SET)==-1);
+	ASSERT(Seek(MAX_FILEID, 0, SEEK_SET)==-1);
+	return 0;
+}
 
 
-	run_get_status(mthread, 0, NULL);
+BOOT_TEST(test_file_sparse,
+	"Test that writing beyond the end of a file leaves a hole, which reads as zeros and takes no pages."
+	)
+{
+	const intptr_t far = (intptr_t)1 << 40;
+	Fid_t f = Open("sparse", OPEN_RDWR|OPEN_CREAT);
+	ASSERT(f!=NOFILE);
+	ASSERT(Seek(f, far, SEEK_SET)==far);
+	ASSERT(Write(f, "end", 3)==3);
+
+	file_stat st;
+	ASSERT(Stat("sparse", &st)==0);
+	ASSERT(st.size==far+3);
+	ASSERT(st.pages==1);
+
+	/* The hole reads as zeros, across page boundaries */
+	char buffer[10000];
+	memset(buffer, 1, sizeof(buffer));
+	ASSERT(Seek(f, far-9997, SEEK_SET)==far-9997);
+	ASSERT(Read(f, buffer, sizeof(buffer))==10000);
+	for(int i=0; i<9997; i++) ASSERT(buffer[i]==0);
+	ASSERT(memcmp(buffer+9997, "end", 3)==0);
+
+	ASSERT(Seek(f, 12345, SEEK_SET)==12345);
+	ASSERT(Write(f, "mid", 3)==3);
+	ASSERT(Stat("sparse", &st)==0);
+	ASSERT(st.size==far+3);
+	ASSERT(st.pages==2);
 	return 0;
 }
 
 
-BOOT_TEST(test_cyclic_joins,
-	"Test that a set of cyclically joined threads will not deadlock once the cycle breaks")
+BOOT_TEST(test_file_large,
+	"Write a large file with writes of odd sizes, and read it back."
+	)
 {
-	const unsigned int N=5;
-	barrier B = BARRIER_INIT;
-	Tid_t tids[N];
+	const unsigned int size = 8 << 20;
+	const unsigned int chunk = 12345;
+	char* buffer = malloc(chunk);
+
+	Fid_t f = Open("large", OPEN_RDWR|OPEN_CREAT);
+	ASSERT(f!=NOFILE);
+	for(unsigned int pos=0; pos < size; ) {
+		unsigned int n = (size-pos < chunk) ? size-pos : chunk;
+		for(unsigned int i=0; i<n; i++) buffer[i] = (pos+i) % 251;
+		ASSERT(Write(f, buffer, n)==n);
+		pos += n;
+	}
 
-	int join_thread(int argl, void* args) {
-		BarrierSync(&B, N+1);
-		ThreadJoin(tids[argl], NULL);
-		return argl;
+	file_stat st;
+	ASSERT(Stat("large", &st)==0);
+	ASSERT(st.size==size);
+	ASSERT(st.pages==size/4096);
+
+	ASSERT(Seek(f, 0, SEEK_SET)==0);
+	unsigned int pos = 0;
+	int n;
+	while((n = Read(f, buffer, chunk)) > 0) {
+		for(int i=0; i<n; i++)
+			ASSERT(buffer[i] == (char)((pos+i) % 251));
+		pos += n;
 	}
+	ASSERT(n==0);
+	ASSERT(pos==size);
 
+	free(buffer);
+	return 0;
+}
 
-	int main_thread(int argl, void* args) 
-	{
 
-		/* spawn all N threads */
-		for(unsigned int i=0;i<N;i++) {
-			tids[i] = CreateThread(join_thread, (i+1)%N, NULL);
-			assert(tids[i]!=NOTHREAD); /* small assert! do not proceed unless threads are created! */
-		}
+BOOT_TEST(test_mkdir_unlink,
+	"Test directories: MkDir, path resolution, listing a directory and Unlink."
+	)
+{
+	ASSERT(MkDir("d")==0);
+	ASSERT(MkDir("d")==-1);
+	ASSERT(MkDir("/d/e")==0);
+	ASSERT(MkDir("x/e")==-1);
+	ASSERT(MkDir("/")==-1);
+
+	Fid_t f = Open("d/e/../e/./f", OPEN_WRONLY|OPEN_CREAT);
+	ASSERT(f!=NOFILE);
+	ASSERT(Close(f)==0);
+	ASSERT(Open("d/e/f/g", OPEN_WRONLY|OPEN_CREAT)==NOFILE);
+	ASSERT(Open("d/e/f/..", OPEN_RDONLY)==NOFILE);
+	ASSERT(Open("d", OPEN_WRONLY)==NOFILE);
+
+	file_stat st;
+	ASSERT(Stat("d/e", &st)==0);
+	ASSERT(st.type==FSE_DIR && st.size==1);
+	ASSERT(Stat("/", &st)==0);
+	ASSERT(st.type==FSE_DIR && st.size==1);
+
+	/* Names too long */
+	char name[MAX_NAME_LENGTH+2];
+	memset(name, 'n', sizeof(name));
+	name[MAX_NAME_LENGTH+1] = 0;
+	ASSERT(MkDir(name)==-1);
+	name[MAX_NAME_LENGTH] = 0;
+	ASSERT(MkDir(name)==0);
+
+	/* List a directory */
+	ASSERT(MkDir("d/e2")==0);
+	f = Open("d", OPEN_RDONLY);
+	ASSERT(f!=NOFILE);
+	char buffer[16] = { [0] = 0 };
+	ASSERT(Read(f, buffer, 3)==3);
+	ASSERT(Read(f, buffer+3, sizeof(buffer)-3)==2);
+	ASSERT(strcmp(buffer, "e\ne2\n")==0);
+	ASSERT(Read(f, buffer, sizeof(buffer))==0);
+	ASSERT(Close(f)==0);
+
+	ASSERT(Unlink("d")==-1);
+	ASSERT(Unlink("d/e")==-1);
+	ASSERT(Unlink("d/e/f")==0);
+	ASSERT(Unlink("d/e/f")==-1);
+	ASSERT(Unlink("d/e")==0);
+	ASSERT(Unlink("d/e2")==0);
+	ASSERT(Unlink("d")==0);
+	ASSERT(Unlink("/")==-1);
+	ASSERT(Stat("d", &st)==-1);
+	return 0;
+}
 
-		/* allow threads to join */
-		BarrierSync(&B, N+1);
 
-		/* Wait for threads to proceed */
-		sleep_thread(1);
+BOOT_TEST(test_unlink_open_file,
+	"Test that an unlinked file remains usable by its open streams."
+	)
+{
+	char buffer[16] = { [0] = 0 };
+	Fid_t f = Open("a", OPEN_RDWR|OPEN_CREAT);
+	ASSERT(f!=NOFILE);
+	ASSERT(Write(f, "Hello world", 12)==12);
+	ASSERT(Unlink("a")==0);
+
+	file_stat st;
+	ASSERT(Stat("a", &st)==-1);
+	ASSERT(Open("a", OPEN_RDONLY)==NOFILE);
+
+	ASSERT(Seek(f, 0, SEEK_SET)==0);
+	ASSERT(Read(f, buffer, 16)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* A new file by the same name is a different file */
+	Fid_t g = Open("a", OPEN_RDWR|OPEN_CREAT);
+	ASSERT(g!=NOFILE);
+	ASSERT(Read(g, buffer, 16)==0);
+	ASSERT(Close(f)==0);
+	ASSERT(Close(g)==0);
+	return 0;
+}
 
-		/* Now, threads are in deadlock! To break the deadlock,
-		   detach thread 0. */
-		ThreadDetach(tids[0]);
 
+BOOT_TEST(test_file_shared_by_processes,
+	"Test that the files created by a process can be opened by others."
+	)
+{
+	int child(int argl, void* args) {
+		Fid_t f = Open("shared", OPEN_WRONLY|OPEN_CREAT|OPEN_APPEND);
+		ASSERT(f!=NOFILE);
+		ASSERT(Write(f, args, argl)==argl);
 		return 0;
 	}
 
-	run_get_status(main_thread, 0, NULL);
+	for(int i=0; i<4; i++)
+		Exec(child, 4, "abcd");
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	char buffer[32] = { [0] = 0 };
+	Fid_t f = Open("shared", OPEN_RDONLY);
+	ASSERT(f!=NOFILE);
+	ASSERT(Read(f, buffer, sizeof(buffer))==16);
+	ASSERT(strcmp(buffer, "abcdabcdabcdabcd")==0);
 	return 0;
 }
 
 
-TEST_SUITE(thread_tests, 
-	"A suite of tests for threads."
+TEST_SUITE(file_tests,
+	"A suite of tests for the file system."
 	)
 {
-	&test_join_illegal_tid_gives_error,
-	&test_detach_illegal_tid_gives_error,
-	&test_detach_self,
-	&test_detach_other,
-	&test_multiple_detach,
-	&test_join_main_thread,
-	&test_detach_main_thread,
-	&test_detach_after_join,
-	&test_create_join_thread,
-	&test_join_many_threads,
-	&test_exit_many_threads,
-	&test_main_exit_cleanup,
-	&test_noexit_cleanup,
-	&test_cyclic_joins,
+	&test_open_create,
+	&test_file_seek,
+	&test_file_sparse,
+	&test_file_large,
+	&test_mkdir_unlink,
+	&test_unlink_open_file,
+	&test_file_shared_by_processes,
 	NULL
 };
 
 
 
-
-
-
-
 /*********************************************
  *
  *
  *
- *  Pipe tests
+ *  Disk file system tests
  *
  *
  *
  *********************************************/
 
 
+/* Write (or, if !write, check) 'size' bytes of a pattern determined by 'seed', 
+   at the current offset of 'f' */
+static int lfs_pattern(Fid_t f, unsigned int size, unsigned int seed, int write)
+{
+	char buffer[4096], data[4096];
+	for(unsigned int pos = 0; pos < size; ) {
+		unsigned int n = (size-pos < sizeof(buffer)) ? size-pos : sizeof(buffer);
+		for(unsigned int i=0; i<n; i++) data[i] = (pos + i + seed) % 253;
+		if(write) {
+			if(Write(f, data, n) != n) return -1;
+		} else {
+			if(Read(f, buffer, n) != n || memcmp(buffer, data, n) != 0) return -1;
+		}
+		pos += n;
+	}
+	return 0;
+}
+
 
-BOOT_TEST(test_pipe_open,
-	"Open a pipe and put just a little data in it"
+BOOT_TEST(test_lfs_mount,
+	"Test Format, Mount and Unmount, and that files persist across mounts.",
+	.disks = 1
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
+	ASSERT(Format(1)==-1);
+	ASSERT(MkDir("mnt")==0);
+	ASSERT(Mount(0, "mnt")==-1);		/* Not formatted */
+	ASSERT(Format(0)==0);
+
+	Fid_t f = Open("file", OPEN_WRONLY|OPEN_CREAT);
+	ASSERT(Mount(0, "/")==-1);
+	ASSERT(Mount(0, "file")==-1);
+	ASSERT(Mount(0, "nodir")==-1);
+	ASSERT(Mount(1, "mnt")==-1);
+	Close(f);
 
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
-	}
-	char buffer[12] = { [0] = 0 };
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
-		ASSERT(strcmp(buffer, "Hello world")==0);
-	}
+	ASSERT(Mount(0, "mnt")==0);
+	ASSERT(MkDir("mnt2")==0);
+	ASSERT(Mount(0, "mnt2")==-1);		/* Already mounted */
+	ASSERT(Format(0)==-1);
+
+	file_stat st;
+	ASSERT(Stat("mnt", &st)==0);
+	ASSERT(st.type==FSE_DIR && st.size==0);
+
+	ASSERT(MkDir("mnt/d")==0);
+	f = Open("mnt/d/a", OPEN_RDWR|OPEN_CREAT);
+	ASSERT(f!=NOFILE);
+	ASSERT(Write(f, "Hello world", 12)==12);
+	ASSERT(Unmount("mnt")==-1);			/* A file is open */
+	ASSERT(Close(f)==0);
+	ASSERT(Unlink("mnt")==-1);
+	ASSERT(Unlink("mnt/d")==-1);
+	ASSERT(Unmount("mnt/d")==-1);
+	ASSERT(Unmount("mnt2")==-1);
+
+	/* ".." leaves the mounted file system */
+	ASSERT(Stat("mnt/d/../../mnt2", &st)==0);
+
+	ASSERT(Unmount("mnt")==0);
+	ASSERT(Stat("mnt/d", &st)==-1);
+	ASSERT(Unmount("mnt")==-1);
+
+	ASSERT(Mount(0, "mnt2")==0);
+	char buffer[16] = { [0] = 0 };
+	f = Open("mnt2/d/a", OPEN_RDONLY);
+	ASSERT(f!=NOFILE);
+	ASSERT(Read(f, buffer, 16)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+	ASSERT(Close(f)==0);
+
+	ASSERT(Open("mnt2/d/a", OPEN_WRONLY|OPEN_CREAT|OPEN_EXCL)==NOFILE);
+	ASSERT(Unlink("mnt2/d")==-1);
+	ASSERT(Unlink("mnt2/d/a")==0);
+	ASSERT(Unlink("mnt2/d")==0);
+	ASSERT(Stat("mnt2", &st)==0);
+	ASSERT(st.size==0);
+	ASSERT(Sync()==0);
+	ASSERT(Unmount("mnt2")==0);
 	return 0;
 }
 
 
-BOOT_TEST(test_pipe_fails_on_exhausted_fid,
-	"Test that Pipe will fail if the fids are exhausted."
+BOOT_TEST(test_lfs_unmount_busy,
+	"Test Unmount while another thread opens, stats and syncs files under the mount point.",
+	.disks = 1, .minimum_cores = 2, .timeout = 60
 	)
 {
-	pipe_t pipe;
-	for(uint i=0; i< (MAX_FILEID/2); i++ )
-		ASSERT(Pipe(&pipe)==0);
-	for(uint i=0; i< (MAX_FILEID/2); i++ )
-		ASSERT(Pipe(&pipe)==-1);	
+	enum { ROUNDS = 50 };
+	ASSERT(Format(0)==0);
+	ASSERT(MkDir("mnt")==0);
+	ASSERT(Mount(0, "mnt")==0);
+	Fid_t f = Open("mnt/a", OPEN_WRONLY|OPEN_CREAT);
+	ASSERT(Write(f, "a", 1)==1);
+	ASSERT(Close(f)==0);
+
+	volatile int stop = 0;
+	int opener(int argl, void* args)
+	{
+		file_stat st;
+		while(! stop) {
+			Fid_t f = Open("mnt/a", OPEN_RDONLY);
+			if(f != NOFILE) ASSERT(Close(f)==0);
+			Stat("mnt/a", &st);
+			Sync();
+		}
+		return 0;
+	}
+	Tid_t t = CreateThread(opener, 0, NULL);
+
+	/* Unmount fails while a file is open */
+	for(int r=0; r<ROUNDS; r++) {
+		while(Unmount("mnt") != 0);
+		ASSERT(Mount(0, "mnt")==0);
+	}
+
+	stop = 1;
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(Unmount("mnt")==0);
+	ASSERT(Mount(0, "mnt")==0);
+	file_stat st;
+	ASSERT(Stat("mnt/a", &st)==0 && st.size==1);
+	ASSERT(Unmount("mnt")==0);
 	return 0;
 }
 
 
-
-BOOT_TEST(test_pipe_close_reader,
-	"Open a pipe and put just a little data in it"
+BOOT_TEST(test_lfs_large_file,
+	"Test a file large enough to need double-indirect blocks, and a sparse file, across mounts.",
+	.disks = 1, .timeout = 60
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
-
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	const unsigned int size = 12 << 20;
+	ASSERT(Format(0)==0);
+	ASSERT(MkDir("mnt")==0);
+	ASSERT(Mount(0, "mnt")==0);
+
+	Fid_t f = Open("mnt/large", OPEN_RDWR|OPEN_CREAT);
+	ASSERT(f!=NOFILE);
+	ASSERT(lfs_pattern(f, size, 0, 1)==0);
+	ASSERT(Seek(f, 0, SEEK_SET)==0);
+	ASSERT(lfs_pattern(f, size, 0, 0)==0);
+	ASSERT(Close(f)==0);
+
+	/* A sparse file, with a page in each level of the block map */
+	f = Open("mnt/sparse", OPEN_RDWR|OPEN_CREAT);
+	intptr_t offsets[] = { 5000, 100 << 12, 3000l << 12, 900000l << 12 };
+	for(int i=0; i<4; i++) {
+		ASSERT(Seek(f, offsets[i], SEEK_SET)==offsets[i]);
+		ASSERT(lfs_pattern(f, 100, i, 1)==0);
 	}
-	Close(pipe.read);
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==-1);
+	ASSERT(Seek(f, 1l << 40, SEEK_SET)==1l << 40);
+	ASSERT(Write(f, "x", 1)==-1);		/* Too far */
+	ASSERT(Close(f)==0);
+
+	ASSERT(Unmount("mnt")==0);
+	ASSERT(Mount(0, "mnt")==0);
+
+	file_stat st;
+	ASSERT(Stat("mnt/large", &st)==0);
+	ASSERT(st.size==size && st.pages==size/4096);
+	f = Open("mnt/large", OPEN_RDONLY);
+	ASSERT(lfs_pattern(f, size, 0, 0)==0);
+	ASSERT(Close(f)==0);
+
+	ASSERT(Stat("mnt/sparse", &st)==0);
+	ASSERT(st.size==offsets[3]+100 && st.pages==4);
+	f = Open("mnt/sparse", OPEN_RDONLY);
+	char buffer[100];
+	ASSERT(Read(f, buffer, 100)==100);
+	for(int i=0; i<100; i++) ASSERT(buffer[i]==0);
+	for(int i=0; i<4; i++) {
+		ASSERT(Seek(f, offsets[i], SEEK_SET)==offsets[i]);
+		ASSERT(lfs_pattern(f, 100, i, 0)==0);
 	}
+	ASSERT(Close(f)==0);
+
+	ASSERT(Unmount("mnt")==0);
 	return 0;
 }
 
-BOOT_TEST(test_pipe_close_writer,
-	"Open a pipe and put just a little data in it"
+
+BOOT_TEST(test_lfs_cleaner,
+	"Overwrite a file many times over, so that the log wraps around the disk and\n"
+	"the cleaner must reclaim segments, then check its contents.",
+	.disks = 1, .timeout = 120
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
-
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	/* 32 Mbytes of live data, on a 64 Mbyte disk, overwritten 4 times */
+	enum { BLOCKS = 8192, BS = 4096, ROUNDS = 4 };
+	static unsigned char version[BLOCKS];
+	memset(version, 0, sizeof(version));
+
+	ASSERT(Format(0)==0);
+	ASSERT(MkDir("mnt")==0);
+	ASSERT(Mount(0, "mnt")==0);
+
+	Fid_t f = Open("mnt/data", OPEN_RDWR|OPEN_CREAT);
+	ASSERT(f!=NOFILE);
+	ASSERT(lfs_pattern(f, BLOCKS*BS, 0, 1)==0);
+
+	/* Random overwrites, with a version per block */
+	unsigned int seed = 42;
+	for(int i=0; i<ROUNDS*BLOCKS; i++) {
+		unsigned int b = rand_r(&seed) % BLOCKS;
+		version[b]++;
+		ASSERT(Seek(f, (intptr_t)b*BS, SEEK_SET)==(intptr_t)b*BS);
+		if(lfs_pattern(f, BS, b*BS + version[b], 1)) {
+			ASSERT_MSG(0, "write %d of block %u failed\n", i, b);
+			return 0;
+		}
 	}
+	ASSERT(Close(f)==0);
 
-	char buffer[12] = { [0] = 0 };
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
-		ASSERT(strcmp(buffer, "Hello world")==0);
-	}
-	Close(pipe.write);
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Read(pipe.read, buffer, 12))==0);
-	}
+	ASSERT(Unmount("mnt")==0);
+	ASSERT(Mount(0, "mnt")==0);
+
+	f = Open("mnt/data", OPEN_RDONLY);
+	ASSERT(f!=NOFILE);
+	for(unsigned int b=0; b<BLOCKS; b++)
+		if(lfs_pattern(f, BS, b*BS + version[b], 0)) {
+			ASSERT_MSG(0, "block %u differs\n", b);
+			break;
+		}
+	ASSERT(Close(f)==0);
+
+	/* Filling the disk fails cleanly; removing a file frees its storage */
+	f = Open("mnt/fill", OPEN_WRONLY|OPEN_CREAT);
+	ASSERT(f!=NOFILE);
+	ASSERT(lfs_pattern(f, 64 << 20, 0, 1)==-1);
+	ASSERT(Close(f)==0);
+	ASSERT(Open("mnt/empty", OPEN_WRONLY|OPEN_CREAT)==NOFILE);
+	ASSERT(MkDir("mnt/dir")==-1);
+	ASSERT(Sync()==0);
+	ASSERT(Unlink("mnt/fill")==0);
+	ASSERT(Unlink("mnt/data")==0);
+	f = Open("mnt/data2", OPEN_WRONLY|OPEN_CREAT);
+	ASSERT(lfs_pattern(f, 40 << 20, 0, 1)==0);
+	ASSERT(Close(f)==0);
+	ASSERT(Unmount("mnt")==0);
 	return 0;
 }
 
 
-/* Takes one integer argument, writes that many bytes to stdout.
- */
-int data_producer(int argl, void* args)
+BOOT_TEST(test_lfs_small_files,
+	"Create, append to and remove many small files in many directories, across mounts.",
+	.disks = 1, .timeout = 60
+	)
 {
-	assert(argl == sizeof(int));
-	int nbytes = *(int*)args;
+	enum { DIRS = 10, FILES = 300 };
+	char path[64];
+	ASSERT(Format(0)==0);
+	ASSERT(MkDir("mnt")==0);
+	ASSERT(Mount(0, "mnt")==0);
+
+	for(int d=0; d<DIRS; d++) {
+		sprintf(path, "mnt/d%d", d);
+		ASSERT(MkDir(path)==0);
+	}
+	for(int k=0; k<3; k++)
+		for(int d=0; d<DIRS; d++)
+			for(int i=0; i<FILES; i++) {
+				sprintf(path, "mnt/d%d/file%d", d, i);
+				Fid_t f = Open(path, OPEN_WRONLY|OPEN_CREAT|OPEN_APPEND);
+				ASSERT(f!=NOFILE);
+				ASSERT(Write(f, path, strlen(path))==strlen(path));
+				ASSERT(Close(f)==0);
+			}
 
-	Close(0);
+	/* Remove the odd files */
+	for(int d=0; d<DIRS; d++)
+		for(int i=1; i<FILES; i+=2) {
+			sprintf(path, "mnt/d%d/file%d", d, i);
+			ASSERT(Unlink(path)==0);
+		}
 
-	char buffer[32768];
+	ASSERT(Unmount("mnt")==0);
+	ASSERT(Mount(0, "mnt")==0);
+
+	file_stat st;
+	char buffer[200];
+	for(int d=0; d<DIRS; d++) {
+		sprintf(path, "mnt/d%d", d);
+		ASSERT(Stat(path, &st)==0);
+		ASSERT(st.type==FSE_DIR && st.size==FILES/2);
+		for(int i=0; i<FILES; i++) {
+			sprintf(path, "mnt/d%d/file%d", d, i);
+			Fid_t f = Open(path, OPEN_RDONLY);
+			if(i % 2) { ASSERT(f==NOFILE); continue; }
+			ASSERT(f!=NOFILE);
+			int len = strlen(path);
+			ASSERT(Read(f, buffer, sizeof(buffer))==3*len);
+			for(int k=0; k<3; k++) ASSERT(memcmp(buffer+k*len, path, len)==0);
+			ASSERT(Close(f)==0);
+		}
+	}
+	ASSERT(Unmount("mnt")==0);
+	return 0;
+}
 
-	while(nbytes>0) {
-		unsigned int n = (nbytes<32768) ? nbytes : 32768;
-		int rc = Write(1, buffer, n);
-		assert(rc>0);
-		nbytes -= rc;
+
+static int lfs_crash_boot(int argl, void* args)
+{
+	/* argl is the boot number */
+	ASSERT(MkDir("mnt")==0);
+	if(argl == 0)
+		ASSERT(Format(0)==0);
+	ASSERT(Mount(0, "mnt")==0);
+
+	if(argl == 0) {
+		Fid_t f = Open("mnt/durable", OPEN_WRONLY|OPEN_CREAT);
+		ASSERT(lfs_pattern(f, 1 << 20, 7, 1)==0);
+		ASSERT(Close(f)==0);
+		ASSERT(Sync()==0);
+
+		/* Changes which may or may not reach the disk */
+		f = Open("mnt/durable", OPEN_WRONLY|OPEN_APPEND);
+		ASSERT(lfs_pattern(f, 3 << 20, 8, 1)==0);
+		ASSERT(Close(f)==0);
+		f = Open("mnt/volatile", OPEN_WRONLY|OPEN_CREAT);
+		ASSERT(lfs_pattern(f, 3 << 20, 9, 1)==0);
+		ASSERT(Close(f)==0);
+		/* Halt without unmounting */
+	} else {
+		file_stat st;
+		ASSERT(Stat("mnt/durable", &st)==0);
+		ASSERT(st.size >= (1 << 20));
+		Fid_t f = Open("mnt/durable", OPEN_RDONLY);
+		ASSERT(lfs_pattern(f, 1 << 20, 7, 0)==0);
+		if(st.size > (1 << 20))
+			ASSERT(lfs_pattern(f, st.size - (1 << 20), 8, 0)==0);
+		ASSERT(Close(f)==0);
+
+		/* The file system is usable */
+		f = Open("mnt/after", OPEN_RDWR|OPEN_CREAT);
+		ASSERT(lfs_pattern(f, 1 << 20, 10, 1)==0);
+		ASSERT(Close(f)==0);
+		ASSERT(Unmount("mnt")==0);
 	}
-	Close(1);
 	return 0;
 }
 
-/* Takes one integer argument. Reads its standard input to exhaustion,
-   asserts it read that many bytes. */
-int data_consumer(int argl, void* args) 
+BARE_TEST(test_lfs_crash,
+	"Test that the file system is consistent, and keeps the synced data, after\n"
+	"the system halts without unmounting it."
+	)
 {
-	assert(argl == sizeof(int));
-	int nbytes = *(int*)args;
-	Close(1);
+	char path[] = "/tmp/tinyos_lfs_XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT(fd != -1);
+	ASSERT(ftruncate(fd, 64 << 20)==0);
+	close(fd);
+
+	ASSERT(vm_attach_disk(path)==0);
+	boot(1, 0, lfs_crash_boot, 0, NULL);
+	boot(1, 0, lfs_crash_boot, 1, NULL);
+	vm_detach_disks();
+	unlink(path);
+}
 
-	char buffer[16384];
-	int count = 0;
 
-	int rc = 1;
-	while(rc) {
-		rc = Read(0, buffer, 16384);
-		assert(rc>=0);
-		count += rc;
-	}
-	ASSERT(count == nbytes);
+TEST_SUITE(lfs_tests,
+	"A suite of tests for the log-structured file system on disks."
+	)
+{
+	&test_lfs_mount,
+	&test_lfs_unmount_busy,
+	&test_lfs_large_file,
+	&test_lfs_cleaner,
+	&test_lfs_small_files,
+	&test_lfs_crash,
+	NULL
+};
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Shared memory tests
+ *
+ *
+ *
+ *********************************************/
+
+
+BOOT_TEST(test_shm_named,
+	"Test creating, attaching and detaching named shared memory regions."
+	)
+{
+	char* a = ShmCreate("region", 100);
+	ASSERT(a != NULL);
+	ASSERT(((uintptr_t)a % 4096) == 0);
+	for(int i=0; i<4096; i++) ASSERT(a[i]==0);
+	strcpy(a, "shared");
+
+	ASSERT(ShmCreate("region", 100)==NULL);
+	ASSERT(ShmCreate("x", 0)==NULL);
+	ASSERT(ShmCreate("a_name_which_is_much_too_long_for_a_region", 100)==NULL);
+	ASSERT(ShmAttach("nothing", NULL)==NULL);
+	ASSERT(ShmAttach(NULL, NULL)==NULL);
+
+	size_t size = 0;
+	char* b = ShmAttach("region", &size);
+	ASSERT(b == a && size == 4096);
+	ASSERT(strcmp(b, "shared")==0);
+
+	/* Anonymous regions have no name */
+	char* c = ShmCreate(NULL, 10000);
+	ASSERT(c != NULL && c != a);
+	ASSERT(ShmCreate("", 1) != NULL);
+
+	ASSERT(ShmDetach(a + 1)==-1);
+	ASSERT(ShmDetach(a)==0);
+	ASSERT(ShmAttach("region", NULL)==a);
+	ASSERT(ShmDetach(a)==0);
+	ASSERT(ShmDetach(a)==0);
+	ASSERT(ShmDetach(a)==-1);
+
+	/* The name is released with the region */
+	ASSERT(ShmAttach("region", NULL)==NULL);
+	ASSERT(ShmCreate("region", 100)!=NULL);
+	ASSERT(ShmDetach(c)==0);
 	return 0;
 }
 
 
-BOOT_TEST(test_pipe_single_producer,
-	"Test blocking in the pipe by a single producer single consumer sending 10Mbytes of data."
+BOOT_TEST(test_shm_between_processes,
+	"Test that processes share data through shared memory, synchronizing with futexes,\n"
+	"and that a region outlives its creator while attached."
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-
-	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
-	if(pipe.read != 0) {
-		if(pipe.write==0) {
-			/* Get a null stream! */
-			Fid_t fid = OpenNull();
-			assert(fid!=NOFILE);
-			Dup2(0, fid);
-			pipe.write = fid;
+	enum { N = 4, COUNT = 1000 };
+	struct shared { volatile int turn; int data[N]; };
+
+	/* Each child waits for its turn, adds to its slot, and passes the turn on */
+	int child(int argl, void* args) {
+		struct shared* sh = ShmAttach("ring", NULL);
+		ASSERT(sh != NULL);
+		for(int k=0; k<COUNT; k++) {
+			int t;
+			while((t = sh->turn) % N != argl)
+				FutexWait(&sh->turn, t, 1000);
+			sh->data[argl]++;
+			__atomic_add_fetch(&sh->turn, 1, __ATOMIC_SEQ_CST);
+			FutexWake(&sh->turn, N);
 		}
-		Dup2(pipe.read, 0);
-		Close(pipe.read);
-	}
-	if(pipe.write!=1)  {
-		Dup2(pipe.write, 1);
-		Close(pipe.write);
+		ASSERT(ShmDetach(sh)==0);
+		return 0;
 	}
 
-	int N = 10000000;
-	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
-	ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
-
-	Close(0);
-	Close(1);
-
-	WaitChild(NOPROC,NULL);
-	WaitChild(NOPROC,NULL);
+	struct shared* sh = ShmCreate("ring", sizeof(struct shared));
+	ASSERT(sh != NULL);
+	for(int i=0; i<N; i++)
+		ASSERT(Exec(child, i, NULL) != NOPROC);
+	while(WaitChild(NOPROC, NULL) != NOPROC);
+
+	ASSERT(sh->turn == N*COUNT);
+	for(int i=0; i<N; i++) ASSERT(sh->data[i]==COUNT);
+	ASSERT(ShmDetach(sh)==0);
+
+	/* An anonymous region is inherited by children, and lives until they exit */
+	int* anon = ShmCreate(NULL, sizeof(int));
+	*anon = 42;
+	int reader(int argl, void* args) {
+		int* p = *(int**)args;
+		while(*(volatile int*)p == 42) 
+			FutexWait(p, 42, 1000);
+		ASSERT(*p == 43);
+		ASSERT(ShmDetach(p)==0);
+		ASSERT(ShmDetach(p)==-1);
+		return 0;
+	}
+	int writer(int argl, void* args) {
+		int* p = *(int**)args;
+		*p = 43;
+		FutexWake(p, 1);
+		return 0;
+	}
+	ASSERT(Exec(reader, sizeof(anon), &anon) != NOPROC);
+	ASSERT(ShmDetach(anon)==0);
+	ASSERT(Exec(writer, sizeof(anon), &anon) != NOPROC);	/* Inherits nothing */
+	while(WaitChild(NOPROC, NULL) != NOPROC);
 	return 0;
 }
 
-BOOT_TEST(test_pipe_multi_producer,
-	"Test blocking in the pipe by 10 producers and single consumer sending 10Mbytes of data."
+
+BOOT_TEST(test_futex,
+	"Test FutexWait and FutexWake: the value check, timeouts, and the wake-up count."
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-
-	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
-	if(pipe.read != 0) {
-		if(pipe.write==0) {
-			/* Get a null stream! */
-			Fid_t fid = OpenNull();
-			assert(fid!=NOFILE);
-			Dup2(0, fid);
-			pipe.write = fid;
-		}
-		Dup2(pipe.read, 0);
-		Close(pipe.read);
+	static volatile int word = 0;
+	ASSERT(FutexWait(&word, 1, 1000)==-1);
+	ASSERT(FutexWait(&word, 0, 10)==-1);		/* Times out */
+	ASSERT(FutexWake(&word, 1)==0);
+	ASSERT(FutexWait(NULL, 0, 10)==-1);
+
+	int waiter(int argl, void* args) {
+		return FutexWait(&word, 0, (timeout_t)-1);
 	}
-	if(pipe.write!=1)  {
-		Dup2(pipe.write, 1);
-		Close(pipe.write);
+	Tid_t tids[3];
+	for(int i=0; i<3; i++) tids[i] = CreateThread(waiter, 0, NULL);
+
+	/* Wake them one at a time; a wake may find no waiter yet */
+	int woken = 0, nap = 0;
+	while(woken < 3) {
+		int n = FutexWake(&word, 1);
+		ASSERT(n==0 || n==1);
+		woken += n;
+		if(n==0) FutexWait(&nap, 0, 1);		/* Sleep for a millisecond */
 	}
+	for(int i=0; i<3; i++) {
+		int exitval = -2;
+		ASSERT(ThreadJoin(tids[i], &exitval)==0);
+		ASSERT(exitval==0);
+	}
+	return 0;
+}
 
-	int N = 1000000;
-	for(int i=0;i<10;i++)
-		ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
-	N = 10*N;
-	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
 
-	Close(0);
-	Close(1);
+BOOT_TEST(test_mapfile,
+	"Test that a mapped file and its streams see the same data, and that the mapping\n"
+	"is shared by processes and outlives the file."
+	)
+{
+	Fid_t f = Open("mapped", OPEN_RDWR|OPEN_CREAT);
+	ASSERT(f!=NOFILE);
+	ASSERT(Write(f, "Hello world", 12)==12);
+
+	char* m = MapFile(f, 10000);
+	ASSERT(m != NULL);
+	ASSERT(strcmp(m, "Hello world")==0);
+
+	file_stat st;
+	ASSERT(Stat("mapped", &st)==0);
+	ASSERT(st.size==12 && st.pages==3);
+
+	/* Memory writes are seen by streams, and stream writes in memory */
+	memcpy(m, "HELLO", 5);
+	memcpy(m + 5000, "far", 4);
+	char buffer[16];
+	ASSERT(Seek(f, 0, SEEK_SET)==0);
+	ASSERT(Read(f, buffer, 16)==12);
+	ASSERT(strcmp(buffer, "HELLO world")==0);
+	ASSERT(Seek(f, 8000, SEEK_SET)==8000);
+	ASSERT(Write(f, "near", 5)==5);
+	ASSERT(strcmp(m + 8000, "near")==0);
+	ASSERT(Seek(f, 5000, SEEK_SET)==5000);
+	ASSERT(Read(f, buffer, 4)==4);
+	ASSERT(strcmp(buffer, "far")==0);
+
+	/* Mapping again shares the region */
+	ASSERT(MapFile(f, 8192)==m);
+	ASSERT(MapFile(f, 20000)==NULL);
+	ASSERT(ShmDetach(m)==0);
+
+	int child(int argl, void* args) {
+		Fid_t g = Open("mapped", OPEN_RDWR);
+		char* p = MapFile(g, 1);
+		ASSERT(p == *(char**)args);
+		p[0] = 'J';
+		return 0;
+	}
+	ASSERT(Exec(child, sizeof(m), &m) != NOPROC);
+	while(WaitChild(NOPROC, NULL) != NOPROC);
+	ASSERT(m[0]=='J');
+
+	/* Only memory files, open for reading and writing */
+	Fid_t r = Open("mapped", OPEN_RDONLY);
+	ASSERT(MapFile(r, 100)==NULL);
+	ASSERT(MapFile(f, 0)==NULL);
+	ASSERT(MapFile(NOFILE, 100)==NULL);
+	ASSERT(MapFile(MAX_FILEID, 100)==NULL);
+	ASSERT(MkDir("d")==0);
+	ASSERT(MapFile(Open("d", OPEN_RDONLY), 100)==NULL);
+
+	/* The mapping outlives the file */
+	ASSERT(Close(f)==0);
+	ASSERT(Close(r)==0);
+	ASSERT(Unlink("mapped")==0);
+	ASSERT(strcmp(m + 8000, "near")==0);
+	ASSERT(ShmDetach(m)==0);
+	return 0;
+}
 
-	for(int i=0;i<10;i++)
-		WaitChild(NOPROC,NULL);
-	WaitChild(NOPROC,NULL);
+
+BOOT_TEST(test_mapfile_truncate,
+	"Test that truncating a mapped file zeroes the mapping, which stays the storage\n"
+	"of the file."
+	)
+{
+	Fid_t f = Open("mapped", OPEN_RDWR|OPEN_CREAT);
+	ASSERT(Write(f, "Hello world", 12)==12);
+	char* m = MapFile(f, 8192);
+	ASSERT(m != NULL);
+
+	Fid_t g = Open("mapped", OPEN_RDWR|OPEN_TRUNC);
+	ASSERT(g!=NOFILE);
+	file_stat st;
+	ASSERT(Stat("mapped", &st)==0);
+	ASSERT(st.size==0 && st.pages==2);
+	for(int i=0; i<8192; i++)
+		if(m[i] != 0) { ASSERT_MSG(0, "byte %d of the mapping is not zero\n", i); break; }
+
+	/* Memory and streams still share the pages */
+	memcpy(m, "abc", 3);
+	ASSERT(Seek(g, 5000, SEEK_SET)==5000);
+	ASSERT(Write(g, "far", 4)==4);
+	ASSERT(strcmp(m + 5000, "far")==0);
+	char buffer[4];
+	ASSERT(Seek(g, 0, SEEK_SET)==0);
+	ASSERT(Read(g, buffer, 4)==4);
+	ASSERT(memcmp(buffer, "abc", 4)==0);
+
+	ASSERT(Close(f)==0);
+	ASSERT(Close(g)==0);
+	ASSERT(ShmDetach(m)==0);
 	return 0;
 }
 
 
-TEST_SUITE(pipe_tests,
-	"A suite of tests for pipes. We are focusing on correctness, not performance."
+TEST_SUITE(shm_tests,
+	"A suite of tests for shared memory."
 	)
 {
-	&test_pipe_open,
-	&test_pipe_fails_on_exhausted_fid,
-	&test_pipe_close_reader,
-	&test_pipe_close_writer,
-	&test_pipe_single_producer,
-	&test_pipe_multi_producer,
+	&test_shm_named,
+	&test_shm_between_processes,
+	&test_futex,
+	&test_mapfile,
+	&test_mapfile_truncate,
 	NULL
 };
 
@@ -2110,6 +4329,169 @@ BOOT_TEST(test_shudown_write,
 
 
 
+BOOT_TEST(test_packet_socket,
+	"Test that packet sockets exchange whole messages, and only connect to packet sockets."
+	)
+{
+	Fid_t lsock = PacketSocket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	/* A stream socket cannot connect to a packet listener */
+	Fid_t bad = Socket(NOPORT);
+	ASSERT(Connect(bad, 100, 100)==-1);
+
+	Fid_t cli = PacketSocket(NOPORT), srv;
+	ASSERT(cli!=NOFILE);
+	connect_sockets(cli, lsock, &srv, 100);
+
+	/* Each request and each reply is a single message, read with a single Read */
+	for(int i=0; i<1000; i++) {
+		char req[64], buffer[64];
+		int len = sprintf(req, "request %d", i);
+		ASSERT(Write(cli, req, len)==len);
+		ASSERT(Read(srv, buffer, sizeof(buffer))==len);
+		ASSERT(memcmp(buffer, req, len)==0);
+		ASSERT(Write(srv, "ok", 2)==2);
+		ASSERT(Read(cli, buffer, sizeof(buffer))==2);
+	}
+
+	ASSERT(ShutDown(cli, SHUTDOWN_WRITE)==0);
+	char c;
+	ASSERT(Read(srv, &c, 1)==0);
+
+	/* A packet socket cannot connect to a stream listener */
+	Fid_t slsock = Socket(101);
+	ASSERT(Listen(slsock)==0);
+	ASSERT(Connect(PacketSocket(NOPORT), 101, 100)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_datagram_socket,
+	"Test binding datagram sockets, and sending and receiving single messages."
+	)
+{
+	Fid_t rx = DatagramSocket(200);
+	ASSERT(rx!=NOFILE);
+	ASSERT(DatagramSocket(200)==NOFILE);
+	ASSERT(DatagramSocket(MAX_PORT+1)==NOFILE);
+	ASSERT(DatagramSocket(-1)==NOFILE);
+
+	/* Datagram ports are separate from listener ports */
+	Fid_t lsock = Socket(200);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(Listen(rx)==-1);
+
+	Fid_t tx = DatagramSocket(NOPORT), tx2 = DatagramSocket(201);
+	ASSERT(tx!=NOFILE && tx2!=NOFILE);
+
+	char buffer[MAX_DATAGRAM_SIZE+1];
+	ASSERT(SendTo(tx, "Hello", 6, 202)==-1);		/* Nobody there */
+	ASSERT(SendTo(tx, buffer, MAX_DATAGRAM_SIZE+1, 200)==-1);
+	ASSERT(SendTo(tx, buffer, 0, 200)==-1);
+	ASSERT(SendTo(lsock, "Hello", 6, 200)==-1);
+	ASSERT(Write(tx, "Hello", 6)==-1);
+
+	ASSERT(SendTo(tx, "Hello", 6, 200)==6);
+	ASSERT(SendTo(tx2, "world", 6, 200)==6);
+	ASSERT(SendTo(tx, "Hello world", 12, 200)==12);
+
+	port_t from = 1000;
+	ASSERT(RecvFrom(rx, buffer, sizeof(buffer), &from, 1000)==6);
+	ASSERT(strcmp(buffer, "Hello")==0 && from==NOPORT);
+	ASSERT(RecvFrom(rx, buffer, sizeof(buffer), &from, 1000)==6);
+	ASSERT(strcmp(buffer, "world")==0 && from==201);
+	ASSERT(RecvFrom(rx, buffer, 5, NULL, 1000)==5);	/* The rest is discarded */
+	ASSERT(memcmp(buffer, "Hello", 5)==0);
+
+	/* Nothing left */
+	ASSERT(RecvFrom(rx, buffer, sizeof(buffer), &from, 10)==-1);
+	ASSERT(RecvFrom(tx, buffer, sizeof(buffer), &from, 10)==-1);	/* Not bound */
+
+	ASSERT(SendTo(tx2, "again", 6, 200)==6);
+	ASSERT(Read(rx, buffer, sizeof(buffer))==6);
+	ASSERT(strcmp(buffer, "again")==0);
+
+	/* Closing releases the port */
+	ASSERT(Close(rx)==0);
+	ASSERT(SendTo(tx, "Hello", 6, 200)==-1);
+	ASSERT(DatagramSocket(200)!=NOFILE);
+	return 0;
+}
+
+
+BOOT_TEST(test_datagram_close_wakes_sender,
+	"Test that a sender blocked on a full port fails, when the receiver is closed."
+	)
+{
+	Fid_t rx = DatagramSocket(200);
+	Fid_t tx = DatagramSocket(NOPORT);
+
+	/* The port queue holds 64 messages; the sender blocks on the next one */
+	enum { QUEUE = 64 };
+	static volatile int sent;
+	sent = 0;
+	int sender(int argl, void* args) {
+		int rc;
+		while((rc = SendTo(tx, "x", 1, 200)) == 1) sent++;
+		return rc;
+	}
+	Tid_t t = CreateThread(sender, 0, NULL);
+
+	/* Nothing is received, so the queue fills up and stays full */
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&m);
+	while(sent < QUEUE) Cond_TimedWait(&m, &cv, 10);
+	Cond_TimedWait(&m, &cv, 50);
+	Mutex_Unlock(&m);
+	ASSERT(sent==QUEUE);
+
+	ASSERT(Close(rx)==0);
+	int rc = 0;
+	ASSERT(ThreadJoin(t, &rc)==0);
+	ASSERT(rc==-1);
+	ASSERT(sent==QUEUE);
+	return 0;
+}
+
+
+BOOT_TEST(test_datagram_many_to_one,
+	"Test many sender processes sending records to one collector, with the messages\n"
+	"of each sender arriving in order."
+	)
+{
+	enum { SENDERS = 16, RECORDS = 500 };
+	struct record { int sender; int seq; char payload[100]; };
+
+	int client(int argl, void* args) {
+		Fid_t sock = DatagramSocket(NOPORT);
+		ASSERT(sock!=NOFILE);
+		struct record r = { .sender = argl };
+		for(r.seq=0; r.seq<RECORDS; r.seq++)
+			ASSERT(SendTo(sock, &r, sizeof(r), 300)==sizeof(r));
+		return 0;
+	}
+
+	Fid_t rx = DatagramSocket(300);
+	ASSERT(rx!=NOFILE);
+	for(int i=0; i<SENDERS; i++)
+		ASSERT(Exec(client, i, NULL)!=NOPROC);
+
+	int next[SENDERS] = { 0 };
+	for(int k=0; k<SENDERS*RECORDS; k++) {
+		struct record r;
+		ASSERT(RecvFrom(rx, &r, sizeof(r), NULL, 5000)==sizeof(r));
+		ASSERT(r.sender>=0 && r.sender<SENDERS);
+		ASSERT(r.seq == next[r.sender]);
+		next[r.sender]++;
+	}
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	return 0;
+}
+
+
 TEST_SUITE(socket_tests,
 	"A suite of tests for sockets."
 	)
@@ -2145,6 +4527,12 @@ TEST_SUITE(socket_tests,
 	&test_shudown_read,
 	&test_shudown_write,
 
+	&test_packet_socket,
+
+	&test_datagram_socket,
+	&test_datagram_close_wakes_sender,
+	&test_datagram_many_to_one,
+
 	NULL
 };
 
@@ -2491,6 +4879,9 @@ TEST_SUITE(all_tests,
 	//&io_tests,
 	&thread_tests,
 	&pipe_tests,
+	&file_tests,
+	&lfs_tests,
+	&shm_tests,
 	&socket_tests,
 	NULL
 };
@@ -2508,6 +4899,192 @@ TEST_SUITE(all_tests,
  ****************************************************************************/
 
 
+/*********************************************
+ *
+ *
+ *
+ *  Performance benchmarks
+ *
+ *
+ *
+ *********************************************/
+
+BARE_TEST(bench_barrier,
+	"Compare the latency of BarrierSync and Barrier_Sync, for 2 to 32 cores, with\n"
+	"2 threads per core.",
+	.timeout = 120
+	)
+{
+	const int R = 200;
+
+	double result[2];
+	int barrier_task(int argl, void* args)
+	{
+		int N = argl;
+
+		barrier B = BARRIER_INIT;
+		Barrier bar;
+		Barrier_Init(&bar, N);
+
+		int use_tree = 0;
+		int sync_thread(int argl, void* args)
+		{
+			for(int r=0; r<R; r++) 
+				if(use_tree) Barrier_Sync(&bar); else BarrierSync(&B, N);
+			return 0;
+		}
+
+		for(use_tree=0; use_tree<2; use_tree++) {
+			Tid_t tids[N];
+			double t0 = wall_time();
+			for(int i=0; i<N; i++) tids[i] = CreateThread(sync_thread, 0, NULL);
+			for(int i=0; i<N; i++) ThreadJoin(tids[i], NULL);
+			result[use_tree] = (wall_time()-t0)/R;
+		}
+
+		Barrier_Destroy(&bar);
+		return 0;
+	}
+
+	for(int cores=2; cores<=32; cores *= 2) {
+		boot(cores, 0, barrier_task, 2*cores, NULL);
+		MSG("cores=%2d threads=%2d   BarrierSync: %8.1f usec/round   Barrier_Sync: %8.1f usec/round\n",
+			cores, 2*cores, result[0]*1E6, result[1]*1E6);
+	}
+}
+
+
+BOOT_TEST(bench_syscall_overhead,
+	"Measure the cost of a trivial system call in a tight loop. Each call\n"
+	"disables and enables interrupts a few times, which must be cheap."
+	)
+{
+	const int N = 200000;
+
+	double t0 = wall_time();
+	for(int i=0; i<N; i++)
+		ASSERT(GetPid()==1);
+	double t1 = wall_time();
+
+	double nsec = (t1-t0)*1E9/N;
+	/* This is a few hundred nsec when no host system call is made */
+	MSG("%.0f nsec per system call\n", nsec);
+	return 0;
+}
+
+
+BOOT_TEST(bench_serial_throughput,
+	"Measure the throughput of the console and the keyboard of terminal 0,\n"
+	"transferring 1 Mbyte each way in 16 kbyte blocks.",
+	.minimum_terminals = 1, .timeout = 30
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	char bytes[1025];
+	FUDGE(bytes);
+	bytes[1024]='\0';
+
+	char buffer[16384];
+	FUDGE(buffer);
+	const int total = 1<<20;
+
+	/* Write 1 Mbyte */
+	for(int i=0; i<1024; i++)
+		expect(0, bytes);
+	double t0 = wall_time();
+	for(int count=0; count < total; ) {
+		int remain = total-count;
+		int rc = Write(fterm, buffer, (remain<16384)? remain: 16384);
+		ASSERT(rc>0);
+		count += rc;
+	}
+	double t1 = wall_time();
+
+	/* Read 1 Mbyte */
+	for(int i=0; i<1024; i++)
+		sendme(0, bytes);
+	double t2 = wall_time();
+	for(int count=0; count < total; ) {
+		int remain = total-count;
+		int rc = Read(fterm, buffer, (remain<16384)? remain: 16384);
+		ASSERT(rc>0);
+		count += rc;
+	}
+	double t3 = wall_time();
+
+	MSG("console %.1f Mbyte/sec, keyboard %.1f Mbyte/sec\n", 1/(t1-t0), 1/(t3-t2));
+	return 0;
+}
+
+
+BOOT_TEST(bench_disk_queue_depth,
+	"Measure the throughput of random and of sequential 4 Kbyte transfers to a disk,\n"
+	"by 1, 4 and 16 threads, i.e., at various queue depths.",
+	.disks = 1, .timeout = 60
+	)
+{
+	enum { N = 4000, BLOCK = 4096/DISK_SECTOR_SIZE, SPAN = (16 << 20)/4096 };
+	Mutex mx = MUTEX_INIT;
+	int next, sequential, write;
+	int depth;
+
+	int worker(int argl, void* args) {
+		char block[BLOCK*DISK_SECTOR_SIZE];
+		unsigned int seed = argl;
+		memset(block, argl, sizeof(block));
+		for(int i=0; i<N/depth; i++) {
+			unsigned long b;
+			if(sequential) {
+				Mutex_Lock(&mx);
+				b = next++;
+				Mutex_Unlock(&mx);
+			} else
+				b = rand_r(&seed) % SPAN;
+			int rc = write ? WriteSectors(0, b*BLOCK, BLOCK, block) 
+				: ReadSectors(0, b*BLOCK, BLOCK, block);
+			ASSERT(rc==0);
+		}
+		return 0;
+	}
+
+	const char* name[] = { "random read", "random write", "sequential write" };
+	int depths[] = { 1, 4, 16 };
+	for(int d=0; d<3; d++) {
+		depth = depths[d];
+		double rate[3];
+		for(int p=0; p<3; p++) {
+			sequential = (p==2);
+			write = (p>0);
+			next = 0;
+			Tid_t tids[16];
+			double t0 = wall_time();
+			for(int t=0; t<depth; t++) tids[t] = CreateThread(worker, t, NULL);
+			for(int t=0; t<depth; t++) ThreadJoin(tids[t], NULL);
+			rate[p] = N / (wall_time()-t0);
+		}
+		MSG("depth %2d: %s %6.0f IOPS, %s %6.0f IOPS, %s %5.1f Mbyte/sec\n", depth,
+			name[0], rate[0], name[1], rate[1], name[2], rate[2]*4096/1E6);
+	}
+	return 0;
+}
+
+
+TEST_SUITE(perf_tests,
+	"Performance benchmarks. These report their measurements and are not part\n"
+	"of all_tests."
+	)
+{
+	&bench_barrier,
+	&bench_syscall_overhead,
+	&bench_serial_throughput,
+	&bench_disk_queue_depth,
+	NULL
+};
+
+
+
 BARE_TEST(dummy_user_test,
 	"A dummy test, feel free to edit it and copy it as needed."
 	)
@@ -2532,6 +5109,7 @@ int main(int argc, char** argv)
 {
 	register_test(&all_tests);
 	register_test(&user_tests);
+	register_test(&perf_tests);
 	return run_program(argc, argv, &all_tests);
 }
 